@@ -0,0 +1,148 @@
+/*
+ * BENCHMARK BASE64
+ *
+ * So sánh tốc độ mã hóa / giải mã base64 cho payload 1-50 MB (cỡ file gửi
+ * qua đường JSON kiểu cũ):
+ *   - legacy: bản cũ trong server.cpp (push_back từng ký tự, giải mã từng bit,
+ *             tạo vector<int>(256) mỗi lần gọi)
+ *   - scalar: base64.h, nhánh bảng tra, ghi vào buffer cấp sẵn
+ *   - avx2:   base64.h, nhánh AVX2 (bỏ qua nếu CPU không hỗ trợ)
+ *
+ * Chạy: ./base64_bench [số MB ...]   (mặc định 1 5 10 50)
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include "base64.h"
+
+using namespace std;
+
+// ===== BẢN CŨ (để so sánh) =====
+
+string legacy_encode(const string &in) {
+    const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string out;
+    out.reserve((in.size() + 2) / 3 * 4);
+    int val = 0, valb = -6;
+    for (unsigned char c : in) {
+        val = (val << 8) + c;
+        valb += 8;
+        while (valb >= 0) {
+            out.push_back(chars[(val >> valb) & 0x3F]);
+            valb -= 6;
+        }
+    }
+    if (valb > -6) out.push_back(chars[((val << 8) >> (valb + 8)) & 0x3F]);
+    while (out.size() % 4) out.push_back('=');
+    return out;
+}
+
+string legacy_decode(const string &in) {
+    string out;
+    vector<int> T(256, -1);
+    for (int i = 0; i < 64; i++) T["ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i]] = i;
+    int val = 0, valb = -8;
+    for (unsigned char c : in) {
+        if (T[c] == -1) break;
+        val = (val << 6) + T[c];
+        valb += 6;
+        if (valb >= 0) {
+            out.push_back(char((val >> valb) & 0xFF));
+            valb -= 8;
+        }
+    }
+    return out;
+}
+
+// ===== ĐO =====
+
+// Chạy fn nhiều lần (tối thiểu ~0.3s), trả về MB/s tính theo cỡ dữ liệu gốc
+template <typename Fn>
+double measure(size_t raw_bytes, Fn fn) {
+    using clock = chrono::steady_clock;
+    fn();   // Làm nóng cache / page fault của buffer
+    int rounds = 0;
+    auto start = clock::now();
+    double elapsed = 0;
+    do {
+        fn();
+        rounds++;
+        elapsed = chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < 0.3);
+    return raw_bytes * (double)rounds / elapsed / (1024.0 * 1024.0);
+}
+
+void print_row(const string& name, double encode_mbps, double decode_mbps, double base_encode, double base_decode) {
+    cout << "  " << left << setw(8) << name << right << fixed << setprecision(0)
+         << setw(10) << encode_mbps << " MB/s" << setprecision(1) << setw(7) << encode_mbps / base_encode << "x"
+         << setprecision(0) << setw(10) << decode_mbps << " MB/s" << setprecision(1) << setw(7) << decode_mbps / base_decode << "x"
+         << endl;
+}
+
+int main(int argc, char* argv[]) {
+    vector<size_t> sizes_mb;
+    for (int i = 1; i < argc; i++) sizes_mb.push_back(strtoul(argv[i], nullptr, 10));
+    if (sizes_mb.empty()) sizes_mb = {1, 5, 10, 50};
+
+    cout << "base64 benchmark (AVX2 " << (base64_avx2_available() ? "có" : "không có") << ")" << endl;
+
+    mt19937_64 rng(42);
+    bool all_ok = true;
+    for (size_t mb : sizes_mb) {
+        size_t n = mb * 1024 * 1024 + 7;    // Lệch bội số 3 để đi qua cả phần đuôi
+        string raw(n, '\0');
+        for (size_t i = 0; i < n; i++) raw[i] = (char)(rng() & 0xFF);
+
+        string encoded(base64_encoded_size(n), '\0');
+        string decoded(base64_decoded_max_size(encoded.size()), '\0');
+
+        // Kiểm tra kết quả giữa các nhánh trước khi đo
+        string reference = legacy_encode(raw);
+        base64_encode_scalar((const unsigned char*)raw.data(), n, &encoded[0]);
+        bool ok = encoded == reference;
+        size_t m = base64_decode_scalar(encoded.data(), encoded.size(), (unsigned char*)&decoded[0]);
+        ok = ok && m == n && decoded.compare(0, n, raw) == 0;
+#ifdef BASE64_HAVE_AVX2
+        if (base64_avx2_available()) {
+            base64_encode_avx2((const unsigned char*)raw.data(), n, &encoded[0]);
+            ok = ok && encoded == reference;
+            m = base64_decode_avx2(encoded.data(), encoded.size(), (unsigned char*)&decoded[0]);
+            ok = ok && m == n && decoded.compare(0, n, raw) == 0;
+        }
+#endif
+        cout << endl << mb << " MB" << (ok ? "" : "  ⚠ KẾT QUẢ SAI") << endl;
+        cout << "  " << left << setw(8) << "" << right << setw(16) << "encode" << setw(8) << ""
+             << setw(16) << "decode" << endl;
+        all_ok = all_ok && ok;
+
+        double legacy_enc = measure(n, [&] { string out = legacy_encode(raw); });
+        double legacy_dec = measure(n, [&] { string out = legacy_decode(reference); });
+        print_row("legacy", legacy_enc, legacy_dec, legacy_enc, legacy_dec);
+
+        double scalar_enc = measure(n, [&] {
+            base64_encode_scalar((const unsigned char*)raw.data(), n, &encoded[0]);
+        });
+        double scalar_dec = measure(n, [&] {
+            base64_decode_scalar(encoded.data(), encoded.size(), (unsigned char*)&decoded[0]);
+        });
+        print_row("scalar", scalar_enc, scalar_dec, legacy_enc, legacy_dec);
+
+#ifdef BASE64_HAVE_AVX2
+        if (base64_avx2_available()) {
+            double avx2_enc = measure(n, [&] {
+                base64_encode_avx2((const unsigned char*)raw.data(), n, &encoded[0]);
+            });
+            double avx2_dec = measure(n, [&] {
+                base64_decode_avx2(encoded.data(), encoded.size(), (unsigned char*)&decoded[0]);
+            });
+            print_row("avx2", avx2_enc, avx2_dec, legacy_enc, legacy_dec);
+        }
+#endif
+    }
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,458 @@
+/*
+ * MICROBENCHMARK CHO common/
+ *
+ * Đo các đoạn code nằm trên đường đi của mọi request:
+ *   - json_parse / json_build: JsonHelper với body thực tế của từng lệnh
+ *     (request client gửi, phản hồi / thông báo server dựng)
+ *   - history_page: dựng JSON một trang lịch sử chat (như handler 701/703)
+ *   - frame: mã hóa / giải mã WireHeader v2, tách frame khỏi luồng byte, v1
+ *   - base64: 4KB - 50MB (đường file_data kiểu cũ)
+ *   - crc32c / sha256 / deflate: kiểm tra chunk, hash nội dung, nén frame
+ *
+ * Kiểu Google Benchmark: mỗi benchmark tự tăng số lần lặp tới khi một lô
+ * chạy đủ lâu, đo nhiều lô và báo trung vị thời gian mỗi lần.
+ *
+ * Lưu / so sánh kết quả (CSV: name,ns_per_op,bytes_per_op):
+ *   ./common_bench --out results/before.csv
+ *   ... sửa common/ ...
+ *   ./common_bench --compare results/before.csv
+ * Tùy chọn khác: --filter <chuỗi con tên>, --min-time <giây mỗi benchmark>
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "protocol.h"
+#include "json_helper.h"
+#include "base64.h"
+#include "crc32c.h"
+#include "sha256.h"
+#include "compression.h"
+
+using namespace std;
+
+// ===== KHUNG ĐO =====
+
+struct Benchmark {
+    string name;
+    size_t bytes;                   // Số byte xử lý mỗi lần (0 = không tính MB/s)
+    function<void()> fn;
+};
+
+struct Result {
+    string name;
+    double ns_per_op;
+    size_t bytes;
+    uint64_t iterations;
+};
+
+vector<Benchmark> benchmarks;
+double min_time = 0.5;
+
+// Không cho compiler bỏ phép tính có kết quả không dùng
+template <typename T>
+inline void keep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+void add(const string& name, size_t bytes, function<void()> fn) {
+    benchmarks.push_back({ name, bytes, move(fn) });
+}
+
+Result run(const Benchmark& bench) {
+    using clock = chrono::steady_clock;
+    auto batch = [&](uint64_t n) {
+        auto start = clock::now();
+        for (uint64_t i = 0; i < n; i++) bench.fn();
+        return chrono::duration<double>(clock::now() - start).count();
+    };
+    // Tăng gấp đôi số lần lặp tới khi một lô chạy được ~1/10 thời gian đo
+    uint64_t n = 1;
+    double elapsed = batch(n);
+    while (elapsed < min_time / 10 && n < (1ull << 40)) {
+        n *= 2;
+        elapsed = batch(n);
+    }
+    vector<double> per_op;
+    double total = 0;
+    uint64_t iterations = 0;
+    while (per_op.size() < 5 || total < min_time) {
+        double t = batch(n);
+        per_op.push_back(t * 1e9 / n);
+        total += t;
+        iterations += n;
+    }
+    sort(per_op.begin(), per_op.end());
+    return { bench.name, per_op[per_op.size() / 2], bench.bytes, iterations };
+}
+
+// ===== DỮ LIỆU MẪU =====
+
+const string TOKEN = "5f2b9c0e8d7a4b1c3e6f9a2d4c8b7e1f";
+mt19937_64 rng(42);
+
+// special = true: có cả ký tự phải escape (tin nhắn trong database); body
+// request dựng bằng JsonHelper::build không escape nên không dùng các ký tự đó
+string random_text(size_t n, bool special = false) {
+    static const char* words[] = { "xin", "chào", "meeting", "lúc", "3h", "chiều", "nhé", "ok", "deploy", "báo cáo",
+                                   "đã", "gửi", "file", "rồi", "\"quote\"", "C:\\path" };
+    string text;
+    while (text.size() < n) {
+        if (!text.empty()) text += ' ';
+        text += words[rng() % (special ? 16 : 14)];
+    }
+    return text;
+}
+
+// Một trang lịch sử giống handle_chat_history_private
+string build_history_page(const vector<map<string, string>>& messages) {
+    string json = "{\"target_username\":\"bob\",";
+    json += "\"my_username\":\"alice\",";
+    json += "\"total_count\":" + to_string(12345) + ",";
+    json += "\"offset\":" + to_string(0) + ",";
+    json += "\"messages\":[";
+    for (size_t i = 0; i < messages.size(); i++) {
+        const map<string, string>& m = messages[i];
+        if (i > 0) json += ",";
+        json += "{\"message_id\":" + m.at("message_id") + ",";
+        json += "\"from_username\":\"" + m.at("from_username") + "\",";
+        json += "\"message\":\"" + JsonHelper::escapeJson(m.at("message_text")) + "\",";
+        json += "\"sent_at\":\"" + m.at("sent_at") + "\",";
+        json += "\"is_read\":\"" + m.at("is_read") + "\"}";
+    }
+    json += "]}";
+    return json;
+}
+
+vector<map<string, string>> history_rows(int count) {
+    vector<map<string, string>> rows;
+    for (int i = 0; i < count; i++) {
+        map<string, string> row;
+        row["message_id"] = to_string(100000 + i);
+        row["from_username"] = i % 2 ? "alice" : "bob";
+        row["message_text"] = random_text(20 + rng() % 120, true);
+        row["sent_at"] = "2025-01-15 10:" + to_string(10 + i % 50) + ":00";
+        row["is_read"] = i % 3 ? "1" : "0";
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+// Chuỗi frame v2 nối liền như trên socket
+string frame_stream(int frames, vector<string>& bodies) {
+    string stream;
+    for (int i = 0; i < frames; i++) {
+        const string& body = bodies[i % bodies.size()];
+        WireHeader header(C_REQ_MSG_PRIVATE, STATUS_OK, i + 1);
+        header.body_length = body.size();
+        unsigned char wire[WIRE_HEADER_SIZE];
+        encode_wire_header(header, wire);
+        stream.append((const char*)wire, WIRE_HEADER_SIZE);
+        stream += body;
+    }
+    return stream;
+}
+
+string size_label(size_t bytes) {
+    if (bytes >= 1024 * 1024) return to_string(bytes / (1024 * 1024)) + "MB";
+    return to_string(bytes / 1024) + "KB";
+}
+
+// ===== BENCHMARK =====
+
+void register_json() {
+    // Body request của từng lệnh, như client gửi
+    map<string, map<string, string>> requests;
+    requests["login"] = { { "username", "alice" }, { "pass_hash", "password" }, { "compress", "zlib" } };
+    requests["msg_private"] = { { "token", TOKEN }, { "target_username", "bob" }, { "message", random_text(80) } };
+    requests["msg_group"] = { { "token", TOKEN }, { "group_id", "42" }, { "message", random_text(80) } };
+    requests["history_private"] = { { "token", TOKEN }, { "target_username", "bob" }, { "offset", "0" }, { "limit", "20" } };
+    requests["search_messages"] = { { "token", TOKEN }, { "keyword", "deploy" }, { "chat_type", "group" }, { "target", "42" } };
+    requests["group_create"] = { { "token", TOKEN }, { "group_name", "Class 101" } };
+    requests["file_upload"] = { { "token", TOKEN }, { "group_id", "42" }, { "file_name", "report.pdf" },
+                                { "file_size", "1048576" }, { "file_hash", string(64, 'a') }, { "checksum", "crc32c" } };
+    requests["file_download"] = { { "token", TOKEN }, { "file_name", string(64, 'a') + "_report.pdf" },
+                                  { "stream", "1" }, { "offset", "65536" }, { "checksum", "crc32c" } };
+    requests["file_list"] = { { "token", TOKEN }, { "chat_type", "group" }, { "target", "42" },
+                              { "before_id", "120" }, { "limit", "50" } };
+
+    for (auto& entry : requests) {
+        string body = JsonHelper::build(entry.second);
+        add("json_parse/" + entry.first, body.size(), [body] {
+            map<string, string> parsed = JsonHelper::parse(body);
+            keep(parsed);
+        });
+        map<string, string> fields = entry.second;
+        add("json_build/" + entry.first, body.size(), [fields] {
+            string built = JsonHelper::build(fields);
+            keep(built);
+        });
+    }
+
+    // Phản hồi / thông báo server dựng
+    vector<string> friends;
+    for (int i = 0; i < 20; i++) friends.push_back("friend" + to_string(i));
+    map<string, string> login_resp = { { "token", TOKEN }, { "compress", "zlib" } };
+    string login_body = JsonHelper::build_with_array(login_resp, "friends_online", friends);
+    add("json_build/login_resp_20_friends", login_body.size(), [login_resp, friends] {
+        string built = JsonHelper::build_with_array(login_resp, "friends_online", friends);
+        keep(built);
+    });
+    add("json_parse/login_resp_20_friends", login_body.size(), [login_body] {
+        map<string, string> parsed = JsonHelper::parse(login_body);
+        vector<string> online = JsonHelper::parse_array(login_body, "friends_online");
+        keep(parsed);
+        keep(online);
+    });
+
+    map<string, string> notify = { { "from_username", "alice" }, { "group_id", "42" },
+                                   { "message", random_text(80) }, { "message_id", "123456" } };
+    string notify_body = JsonHelper::build(notify);
+    add("json_build/notify_msg_group", notify_body.size(), [notify] {
+        string built = JsonHelper::build(notify);
+        keep(built);
+    });
+    add("json_parse/notify_msg_group", notify_body.size(), [notify_body] {
+        map<string, string> parsed = JsonHelper::parse(notify_body);
+        keep(parsed);
+    });
+
+    string text = random_text(200, true);
+    add("json_escape/200B", text.size(), [text] {
+        string escaped = JsonHelper::escapeJson(text);
+        keep(escaped);
+    });
+}
+
+void register_history() {
+    for (int count : { 10, 50, 200 }) {
+        vector<map<string, string>> rows = history_rows(count);
+        size_t bytes = build_history_page(rows).size();
+        add("history_page/" + to_string(count), bytes, [rows] {
+            string page = build_history_page(rows);
+            keep(page);
+        });
+    }
+}
+
+void register_frames() {
+    WireHeader header(S_NOTIFY_MSG_GROUP, STATUS_OK, 77);
+    header.body_length = 180;
+    add("frame/encode_v2_header", WIRE_HEADER_SIZE, [header] {
+        unsigned char wire[WIRE_HEADER_SIZE];
+        encode_wire_header(header, wire);
+        keep(wire);
+    });
+    unsigned char encoded[WIRE_HEADER_SIZE];
+    encode_wire_header(header, encoded);
+    string wire((const char*)encoded, WIRE_HEADER_SIZE);
+    add("frame/decode_v2_header", WIRE_HEADER_SIZE, [wire] {
+        WireHeader decoded;
+        bool ok = decode_wire_header((const unsigned char*)wire.data(), decoded);
+        keep(ok);
+        keep(decoded);
+    });
+
+    // Tách 1000 frame (header + body JSON) khỏi một buffer nhận
+    vector<string> bodies;
+    for (int i = 0; i < 16; i++) {
+        map<string, string> body = { { "token", TOKEN }, { "target_username", "bob" },
+                                     { "message", random_text(20 + rng() % 200) } };
+        bodies.push_back(JsonHelper::build(body));
+    }
+    string stream = frame_stream(1000, bodies);
+    add("frame/split_1000_frames", stream.size(), [stream] {
+        size_t off = 0;
+        uint64_t total = 0;
+        while (stream.size() - off >= WIRE_HEADER_SIZE) {
+            WireHeader h;
+            if (!decode_wire_header((const unsigned char*)stream.data() + off, h)) break;
+            string body = stream.substr(off + WIRE_HEADER_SIZE, h.body_length);
+            total += body.size() + h.request_id;
+            off += WIRE_HEADER_SIZE + h.body_length;
+        }
+        keep(total);
+    });
+    add("frame/split_parse_1000_frames", stream.size(), [stream] {
+        size_t off = 0;
+        size_t fields = 0;
+        while (stream.size() - off >= WIRE_HEADER_SIZE) {
+            WireHeader h;
+            if (!decode_wire_header((const unsigned char*)stream.data() + off, h)) break;
+            map<string, string> body = JsonHelper::parse(stream.substr(off + WIRE_HEADER_SIZE, h.body_length));
+            fields += body.size();
+            off += WIRE_HEADER_SIZE + h.body_length;
+        }
+        keep(fields);
+    });
+
+    // Dựng phản hồi gộp: 32 frame con nối vào một buffer (như C_REQ_BATCH)
+    string reply = bodies[0];
+    add("frame/append_32_frames", (WIRE_HEADER_SIZE + reply.size()) * 32, [reply] {
+        string out;
+        for (uint32_t i = 0; i < 32; i++) {
+            WireHeader h(S_RESP_PRIVATE_MSG, STATUS_OK, i + 1);
+            h.body_length = reply.size();
+            unsigned char wire[WIRE_HEADER_SIZE];
+            encode_wire_header(h, wire);
+            out.append((const char*)wire, WIRE_HEADER_SIZE);
+            out += reply;
+        }
+        keep(out);
+    });
+
+    PacketHeader legacy(C_REQ_MSG_PRIVATE, STATUS_OK);
+    legacy.body_length = 180;
+    string legacy_wire((const char*)&legacy, sizeof(legacy));
+    add("frame/decode_v1_header", sizeof(PacketHeader), [legacy_wire] {
+        PacketHeader h;
+        memcpy(&h, legacy_wire.data(), sizeof(h));
+        keep(h);
+    });
+}
+
+void register_base64() {
+    for (size_t size : { 4096ul, 65536ul, 1048576ul, 10485760ul, 52428800ul }) {
+        string raw(size, '\0');
+        for (char& c : raw) c = (char)(rng() & 0xFF);
+        string label = size_label(size);
+        add("base64/encode/" + label, size, [raw] {
+            string encoded = base64_encode(raw);
+            keep(encoded);
+        });
+        string encoded = base64_encode(raw);
+        add("base64/decode/" + label, size, [encoded] {
+            string decoded = base64_decode(encoded);
+            keep(decoded);
+        });
+    }
+}
+
+void register_chunks() {
+    string chunk(FILE_CHUNK_SIZE, '\0');
+    for (char& c : chunk) c = (char)(rng() & 0xFF);
+    add("crc32c/32KB", chunk.size(), [chunk] {
+        uint32_t crc = crc32c(chunk.data(), chunk.size());
+        keep(crc);
+    });
+    add("sha256/32KB", chunk.size(), [chunk] {
+        Sha256 hasher;
+        hasher.update(chunk.data(), chunk.size());
+        string hex = hasher.final_hex();
+        keep(hex);
+    });
+
+    // Nén phản hồi lớn trên một luồng deflate đã ấm (như send_frame khi bật nén)
+    string page = build_history_page(history_rows(50));
+    auto deflater = make_shared<FrameDeflater>();
+    add("deflate/history_page_50", page.size(), [page, deflater] {
+        string packed;
+        bool ok = deflater->compress(page.data(), page.size(), packed);
+        keep(ok);
+        keep(packed);
+    });
+}
+
+// ===== KẾT QUẢ =====
+
+map<string, double> load_baseline(const string& path) {
+    map<string, double> baseline;
+    ifstream file(path);
+    string line;
+    while (getline(file, line)) {
+        if (line.empty() || line[0] == '#' || line.compare(0, 5, "name,") == 0) continue;
+        stringstream ss(line);
+        string name, ns;
+        if (getline(ss, name, ',') && getline(ss, ns, ',')) baseline[name] = atof(ns.c_str());
+    }
+    return baseline;
+}
+
+void print_result(const Result& result, const map<string, double>& baseline) {
+    cout << left << setw(40) << result.name << right << fixed << setprecision(1) << setw(14) << result.ns_per_op
+         << setw(14) << result.iterations;
+    if (result.bytes > 0) {
+        double mbps = result.bytes / result.ns_per_op * 1e9 / (1024.0 * 1024.0);
+        cout << setw(12) << setprecision(1) << mbps << " MB/s";
+    } else {
+        cout << setw(17) << "";
+    }
+    auto it = baseline.find(result.name);
+    if (it != baseline.end() && it->second > 0) {
+        double change = (result.ns_per_op - it->second) / it->second * 100;
+        cout << setw(10) << showpos << setprecision(1) << change << "%" << noshowpos;
+    }
+    cout << endl;
+}
+
+int main(int argc, char* argv[]) {
+    string filter, out_path, compare_path;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--filter") filter = argv[i + 1];
+        else if (arg == "--out") out_path = argv[i + 1];
+        else if (arg == "--compare") compare_path = argv[i + 1];
+        else if (arg == "--min-time") min_time = atof(argv[i + 1]);
+        else {
+            cerr << "Cách dùng: ./common_bench [--filter S] [--min-time GIÂY] [--out FILE.csv] [--compare FILE.csv]" << endl;
+            return 1;
+        }
+    }
+    if (argc % 2 == 0) {
+        cerr << "Thiếu giá trị cho " << argv[argc - 1] << endl;
+        return 1;
+    }
+
+    register_json();
+    register_history();
+    register_frames();
+    register_base64();
+    register_chunks();
+
+    map<string, double> baseline;
+    if (!compare_path.empty()) {
+        baseline = load_baseline(compare_path);
+        if (baseline.empty()) cerr << "⚠ Không đọc được kết quả cũ từ " << compare_path << endl;
+    }
+
+    cout << "common/ microbenchmark (base64 AVX2 " << (base64_avx2_available() ? "có" : "không có")
+         << ", crc32c SSE4.2 " << (crc32c_hw_available() ? "có" : "không có") << ")" << endl;
+    cout << left << setw(40) << "benchmark" << right << setw(14) << "ns/op" << setw(14) << "iterations"
+         << setw(17) << "throughput" << (baseline.empty() ? "" : "  so với cũ") << endl;
+
+    vector<Result> results;
+    for (const Benchmark& bench : benchmarks) {
+        if (!filter.empty() && bench.name.find(filter) == string::npos) continue;
+        results.push_back(run(bench));
+        print_result(results.back(), baseline);
+    }
+
+    if (!out_path.empty()) {
+        ofstream out(out_path);
+        if (!out) {
+            cerr << "Không ghi được " << out_path << endl;
+            return 1;
+        }
+        time_t now = time(nullptr);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        out << "# common_bench " << stamp << endl;
+        out << "name,ns_per_op,bytes_per_op" << endl;
+        for (const Result& result : results) {
+            out << result.name << "," << fixed << setprecision(2) << result.ns_per_op << "," << result.bytes << endl;
+        }
+        cout << "Đã lưu " << results.size() << " kết quả vào " << out_path << endl;
+    }
+    return 0;
+}
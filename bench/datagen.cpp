@@ -0,0 +1,638 @@
+/*
+ * SINH DỮ LIỆU TỔNG HỢP CHO database/schema.sql
+ *
+ * Tạo dữ liệu cỡ production để kiểm tra query plan / index của DBManager:
+ *   - users: user1..userN, mật khẩu chung (khớp mặc định của loadgen)
+ *   - friendships: bậc theo luật lũy thừa (mô hình Chung-Lu: mỗi user một
+ *     trọng số ~ rank^(-1/(gamma-1)), hai đầu cạnh chọn theo trọng số)
+ *   - groups / group_members: vài nhóm rất lớn (mặc định 10 nhóm 10k thành
+ *     viên), còn lại cỡ theo phân phối Pareto; user hoạt động nhiều vào
+ *     nhiều nhóm hơn
+ *   - private_messages / group_messages: thời điểm gửi theo xu hướng tăng
+ *     dần, chu kỳ ngày (cao điểm buổi tối) và tuần; tin nhắn đi theo đợt
+ *     trong các cuộc chat đang sôi nổi; người gửi 1-1 chủ yếu nhắn bạn bè
+ *   - attachments / file_blobs: một phần nhỏ tin nhắn là [FILE:...]
+ *
+ * Không ghi trực tiếp qua DBManager (từng INSERT một): mỗi bảng ra các file
+ * TSV (tách phần mỗi --chunk-rows dòng, id tăng dần theo khóa chính) và
+ * load.sql nạp bằng LOAD DATA LOCAL INFILE với foreign_key_checks /
+ * unique_checks tắt - đường bulk-load nhanh nhất của InnoDB.
+ *
+ * Chạy: ./datagen --out /data/chatgen [--users 1000000] [--private-messages 100000000] ...
+ *       mysql --local-infile=1 -u root -p chat_app < /data/chatgen/load.sql
+ * load.sql XÓA dữ liệu hiện có của các bảng trên - chỉ dùng cho database kiểm thử.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <string>
+#include <vector>
+#include <climits>
+#include <sys/stat.h>
+
+using namespace std;
+
+// ===== CẤU HÌNH =====
+
+struct Config {
+    string out = "datagen_out";
+    long long users = 1000000;
+    string user_prefix = "user";
+    string password = "password";
+    double avg_friends = 20;
+    double friend_gamma = 2.1;          // Số mũ phân phối bậc (P(k) ~ k^-gamma)
+    double max_friends = 5000;          // Chặn trên bậc kỳ vọng (như giới hạn bạn bè của mạng xã hội thật)
+    long long groups = 20000;
+    int large_groups = 10;
+    long long large_group_size = 10000;
+    long long private_messages = 20000000;
+    long long group_messages = 20000000;
+    int days = 365;
+    double file_ratio = 0.005;          // Tỉ lệ tin nhắn là file
+    long long chunk_rows = 5000000;
+    uint64_t seed = 1;
+};
+
+Config config;
+mt19937_64 rng;
+
+double uniform01() {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// ===== LẤY MẪU THEO TRỌNG SỐ (ALIAS, O(1) MỖI LẦN) =====
+
+class AliasTable {
+public:
+    void build(const vector<double>& weights) {
+        size_t n = weights.size();
+        prob.assign(n, 0);
+        alias.assign(n, 0);
+        double sum = 0;
+        for (double w : weights) sum += w;
+        vector<double> scaled(n);
+        vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            scaled[i] = weights[i] * n / sum;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            prob[s] = (float)scaled[s];
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        for (uint32_t i : large) prob[i] = 1;
+        for (uint32_t i : small) prob[i] = 1;
+    }
+
+    uint32_t sample() const {
+        uint32_t i = rng() % prob.size();
+        return uniform01() < prob[i] ? i : alias[i];
+    }
+
+    size_t size() const { return prob.size(); }
+
+private:
+    vector<float> prob;
+    vector<uint32_t> alias;
+};
+
+// ===== GHI TSV =====
+// Định dạng mặc định của LOAD DATA: cột cách bằng tab, dòng kết thúc bằng \n,
+// \N là NULL. Nội dung sinh ra không chứa tab / xuống dòng / dấu '\'.
+
+class TsvWriter {
+public:
+    TsvWriter(const string& table_name, const string& column_list) : table(table_name), columns(column_list) {}
+    ~TsvWriter() { close_part(); }
+
+    TsvWriter& col(const string& value) { sep(); buf += value; return *this; }
+    TsvWriter& col(const char* value) { sep(); buf += value; return *this; }
+    TsvWriter& col(long long value) {
+        sep();
+        char tmp[24];
+        int n = snprintf(tmp, sizeof(tmp), "%lld", value);
+        buf.append(tmp, n);
+        return *this;
+    }
+    TsvWriter& null() { sep(); buf += "\\N"; return *this; }
+    TsvWriter& time(time_t t) {
+        sep();
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        char tmp[24];
+        size_t n = strftime(tmp, sizeof(tmp), "%Y-%m-%d %H:%M:%S", &tm);
+        buf.append(tmp, n);
+        return *this;
+    }
+
+    void end_row() {
+        buf += '\n';
+        first_col = true;
+        rows++;
+        part_rows++;
+        if (buf.size() >= (1 << 20)) flush();
+        if (part_rows >= config.chunk_rows) close_part();
+    }
+
+    void close_part() {
+        if (!file) return;
+        flush();
+        fclose(file);
+        file = nullptr;
+        part_rows = 0;
+    }
+
+    long long row_count() const { return rows; }
+    const vector<string>& parts() const { return files; }
+    const string& name() const { return table; }
+    const string& column_list() const { return columns; }
+
+private:
+    string table;
+    string columns;
+    vector<string> files;
+    FILE* file = nullptr;
+    string buf;
+    bool first_col = true;
+    long long rows = 0;
+    long long part_rows = 0;
+
+    void sep() {
+        if (!file) open_part();
+        if (!first_col) buf += '\t';
+        first_col = false;
+    }
+
+    void open_part() {
+        char name[256];
+        snprintf(name, sizeof(name), "%s/%s.%03zu.tsv", config.out.c_str(), table.c_str(), files.size());
+        file = fopen(name, "w");
+        if (!file) {
+            cerr << "Không ghi được " << name << endl;
+            exit(1);
+        }
+        files.push_back(name);
+    }
+
+    void flush() {
+        if (file && !buf.empty() && fwrite(buf.data(), 1, buf.size(), file) != buf.size()) {
+            cerr << "Lỗi ghi file của bảng " << table << " (hết chỗ trống?)" << endl;
+            exit(1);
+        }
+        buf.clear();
+    }
+};
+
+// ===== NỘI DUNG TIN NHẮN =====
+
+const char* WORDS[] = { "xin", "chào", "mọi", "người", "hôm", "nay", "họp", "lúc", "mấy", "giờ", "ok", "nhé",
+                        "deadline", "project", "báo", "cáo", "gửi", "file", "rồi", "đã", "xong", "chưa", "mai",
+                        "đi", "ăn", "trưa", "không", "cảm", "ơn", "haha", "deploy", "server", "lỗi", "sửa",
+                        "review", "code", "meeting", "cuối", "tuần", "cafe", "tối", "được", "vâng", "hello" };
+const int WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+
+const char* FILE_TYPES[][2] = { { "pdf", "application/pdf" }, { "png", "image/png" }, { "jpg", "image/jpeg" },
+                                { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+                                { "zip", "application/zip" }, { "txt", "text/plain" } };
+
+// Độ dài theo phân phối log-normal (đa số tin ngắn, ít tin dài)
+string message_text() {
+    static lognormal_distribution<double> length(3.3, 0.8);
+    size_t target = min(1000.0, max(2.0, length(rng)));
+    string text;
+    while (text.size() < target) {
+        if (!text.empty()) text += ' ';
+        text += WORDS[rng() % WORD_COUNT];
+    }
+    return text;
+}
+
+string random_hex(size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    string hex(n, '0');
+    for (char& c : hex) c = digits[rng() & 15];
+    return hex;
+}
+
+// ===== PHÂN BỐ THỜI GIAN =====
+// Trọng số mỗi giờ = xu hướng tăng (0.5 -> 1.5 trên cả khoảng) x chu kỳ ngày
+// x chu kỳ tuần. Số tin mỗi giờ chia theo trọng số, trong giờ rải đều nên
+// message_id tăng dần cùng sent_at như dữ liệu thật.
+
+const double HOUR_WEIGHT[24] = { 0.35, 0.2, 0.1, 0.06, 0.05, 0.08, 0.2, 0.45, 0.7, 0.85, 0.9, 1.0,
+                                 1.1, 0.95, 0.85, 0.85, 0.9, 1.0, 1.1, 1.3, 1.5, 1.6, 1.3, 0.8 };
+
+class MessageClock {
+public:
+    MessageClock(time_t start_time, int span_days, long long total) : start(start_time), remaining(total) {
+        hours = span_days * 24;
+        weights.resize(hours);
+        double sum = 0;
+        for (int h = 0; h < hours; h++) {
+            time_t t = start + (time_t)h * 3600;
+            struct tm tm;
+            gmtime_r(&t, &tm);
+            double trend = 0.5 + (double)h / hours;
+            double weekly = (tm.tm_wday == 0 || tm.tm_wday == 6) ? 1.2 : 1.0;
+            weights[h] = trend * HOUR_WEIGHT[(tm.tm_hour + 7) % 24] * weekly;     // Giờ Việt Nam (UTC+7)
+            sum += weights[h];
+        }
+        scale = total / sum;
+    }
+
+    // Thời điểm của tin tiếp theo (không giảm)
+    time_t next() {
+        while (index >= count && hour < hours) start_hour();
+        time_t t = start + (time_t)(hour - 1) * 3600 + (time_t)(index * 3600.0 / count);
+        index++;
+        remaining--;
+        return t;
+    }
+
+private:
+    time_t start;
+    int hours;
+    int hour = 0;
+    vector<double> weights;
+    double scale;
+    double carry = 0;
+    long long count = 0;
+    long long index = 0;
+    long long remaining;
+
+    void start_hour() {
+        double exact = weights[hour] * scale + carry;
+        count = (long long)exact;
+        carry = exact - count;
+        hour++;
+        if (hour == hours) count = max(count, remaining);   // Phần lẻ còn lại dồn vào giờ cuối
+        index = 0;
+    }
+};
+
+// ===== SINH DỮ LIỆU =====
+
+struct Graph {
+    vector<uint32_t> offsets;           // CSR: bạn của user i là neighbors[offsets[i] .. offsets[i+1])
+    vector<uint32_t> neighbors;
+};
+
+time_t span_start;
+time_t span_end;
+AliasTable activity;                    // Trọng số hoạt động của user (cùng trọng số với bậc)
+
+// User id trong database = chỉ số + 1
+void generate_users(TsvWriter& users) {
+    vector<double> weights(config.users);
+    double exponent = 1.0 / (config.friend_gamma - 1);
+    for (long long i = 0; i < config.users; i++) weights[i] = pow((double)(i + 1), -exponent);
+    // Bậc kỳ vọng của user i = avg_friends * n * w_i / tổng w; cắt ở max_friends
+    // (cắt làm tổng giảm nên lặp vài lần cho hội tụ)
+    for (int round = 0; round < 5; round++) {
+        double sum = 0;
+        for (double w : weights) sum += w;
+        double cap = config.max_friends * sum / (config.avg_friends * config.users);
+        for (double& w : weights) w = min(w, cap);
+    }
+    shuffle(weights.begin(), weights.end(), rng);       // Độ nổi tiếng không gắn với thứ tự id
+    activity.build(weights);
+
+    for (long long i = 0; i < config.users; i++) {
+        time_t created = span_start - (time_t)(uniform01() * 180 * 86400);
+        time_t last_login = span_end - (time_t)(pow(uniform01(), 3) * config.days * 86400);
+        users.col(i + 1).col(config.user_prefix + to_string(i + 1)).col(config.password)
+             .time(created).time(last_login).col(0LL);
+        users.end_row();
+    }
+}
+
+Graph generate_friendships(TsvWriter& friendships) {
+    long long target = (long long)(config.users * config.avg_friends / 2);
+    vector<uint64_t> edges;
+    edges.reserve(target);
+    for (long long i = 0; i < target; i++) {
+        uint32_t a = activity.sample(), b = activity.sample();
+        if (a == b) continue;
+        if (a > b) swap(a, b);
+        edges.push_back((uint64_t)a << 32 | b);
+    }
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+    Graph graph;
+    graph.offsets.assign(config.users + 1, 0);
+    vector<bool> accepted(edges.size());
+    for (size_t e = 0; e < edges.size(); e++) {
+        uint32_t a = edges[e] >> 32, b = (uint32_t)edges[e];
+        double r = uniform01();
+        const char* status = r < 0.95 ? "accepted" : (r < 0.99 ? "pending" : "rejected");
+        accepted[e] = r < 0.95;
+        time_t created = span_start + (time_t)(uniform01() * config.days * 86400);
+        friendships.col((long long)a + 1).col((long long)b + 1).col(status)
+                   .col((long long)((rng() & 1) ? a : b) + 1).time(created).time(created);
+        friendships.end_row();
+        if (accepted[e]) {
+            graph.offsets[a + 1]++;
+            graph.offsets[b + 1]++;
+        }
+    }
+    for (long long i = 0; i < config.users; i++) graph.offsets[i + 1] += graph.offsets[i];
+    graph.neighbors.resize(graph.offsets[config.users]);
+    vector<uint32_t> fill(graph.offsets.begin(), graph.offsets.end() - 1);
+    for (size_t e = 0; e < edges.size(); e++) {
+        if (!accepted[e]) continue;
+        uint32_t a = edges[e] >> 32, b = (uint32_t)edges[e];
+        graph.neighbors[fill[a]++] = b;
+        graph.neighbors[fill[b]++] = a;
+    }
+    return graph;
+}
+
+// Cỡ nhóm: large_groups nhóm cỡ large_group_size, còn lại Pareto(3, 1.3) tối đa 1000
+vector<vector<uint32_t>> generate_groups(TsvWriter& groups, TsvWriter& members) {
+    vector<vector<uint32_t>> group_members(config.groups);
+    for (long long g = 0; g < config.groups; g++) {
+        long long size = g < config.large_groups
+            ? config.large_group_size
+            : (long long)min(1000.0, 3 * pow(1 - uniform01(), -1 / 1.3));
+        size = min(size, config.users);
+        vector<uint32_t>& list = group_members[g];
+        while ((long long)list.size() < size) {
+            while ((long long)list.size() < size) list.push_back(activity.sample());
+            uint32_t creator = list[0];
+            sort(list.begin() + 1, list.end());
+            list.erase(unique(list.begin() + 1, list.end()), list.end());
+            list.erase(remove(list.begin() + 1, list.end(), creator), list.end());
+            // User nổi tiếng bị trùng nhiều: với nhóm gần cỡ toàn bộ user thì bù bằng user ngẫu nhiên
+            if ((long long)list.size() < size && size > config.users / 2) {
+                for (long long u = 0; u < config.users && (long long)list.size() < size; u++) {
+                    if (!binary_search(list.begin() + 1, list.end(), (uint32_t)u) && u != creator) list.push_back(u);
+                }
+            }
+        }
+
+        time_t created = span_start + (time_t)(uniform01() * config.days * 86400 * 0.5);
+        string name = g < config.large_groups ? "Cộng đồng " + to_string(g + 1) : "Nhóm " + to_string(g + 1);
+        groups.col(g + 1).col(name).col((long long)list[0] + 1).time(created);
+        groups.end_row();
+        for (size_t m = 0; m < list.size(); m++) {
+            time_t joined = created + (time_t)(uniform01() * (span_end - created));
+            members.col(g + 1).col((long long)list[m] + 1).time(m == 0 ? created : joined)
+                   .col(m == 0 ? "admin" : "member");
+            members.end_row();
+        }
+    }
+    return group_members;
+}
+
+// Tin nhắn file: [FILE:<hash>_<tên>]<tên> kèm bản ghi attachments / file_blobs
+string file_message(TsvWriter& attachments, TsvWriter& blobs, const char* chat_type, long long message_id,
+                    long long group_id, uint32_t from, uint32_t to, time_t sent) {
+    const char* const* type = FILE_TYPES[rng() % 6];
+    string file_name = string(WORDS[rng() % WORD_COUNT]) + "_" + to_string(rng() % 1000) + "." + type[0];
+    string hash = random_hex(64);
+    string stored = hash + "_" + file_name;
+    long long size = (long long)min(5e8, exp(10 + 2.5 * normal_distribution<double>()(rng)));
+    attachments.col(chat_type).col(message_id);
+    if (group_id > 0) attachments.col(group_id).null().null();
+    else attachments.null().col((long long)min(from, to) + 1).col((long long)max(from, to) + 1);
+    attachments.col((long long)from + 1).col(file_name).col(stored).col(size).col(hash).col(type[1])
+               .col("uploads/blobs/" + hash.substr(0, 2) + "/" + hash.substr(2, 2) + "/" + hash).time(sent);
+    attachments.end_row();
+    blobs.col(hash).col(size).null().col(1LL).time(sent);
+    blobs.end_row();
+    return "[FILE:" + stored + "]" + file_name;
+}
+
+void generate_private_messages(TsvWriter& messages, TsvWriter& attachments, TsvWriter& blobs, const Graph& graph) {
+    MessageClock clock(span_start, config.days, config.private_messages);
+    // Các cuộc chat đang diễn ra: phần lớn tin tiếp nối một cuộc gần đây
+    vector<pair<uint32_t, uint32_t>> active(4096, { 0, 0 });
+    size_t active_count = 0;
+    for (long long i = 0; i < config.private_messages; i++) {
+        time_t sent = clock.next();
+        uint32_t from, to;
+        if (active_count > 0 && uniform01() < 0.7) {
+            pair<uint32_t, uint32_t>& chat = active[rng() % min(active_count, active.size())];
+            if (rng() & 1) swap(chat.first, chat.second);   // Bên kia trả lời
+            from = chat.first;
+            to = chat.second;
+        } else {
+            from = activity.sample();
+            uint32_t degree = graph.offsets[from + 1] - graph.offsets[from];
+            if (degree > 0 && uniform01() < 0.9) to = graph.neighbors[graph.offsets[from] + rng() % degree];
+            else do { to = activity.sample(); } while (to == from && config.users > 1);
+            active[active_count++ % active.size()] = { from, to };
+        }
+        long long message_id = i + 1;
+        string text = uniform01() < config.file_ratio
+            ? file_message(attachments, blobs, "private", message_id, 0, from, to, sent)
+            : message_text();
+        bool read = sent < span_end - 2 * 86400 || uniform01() < 0.3;
+        messages.col(message_id).col((long long)from + 1).col((long long)to + 1).col(text).time(sent).col(read ? 1LL : 0LL);
+        messages.end_row();
+        if ((i + 1) % 10000000 == 0) cout << "  private_messages: " << i + 1 << endl;
+    }
+}
+
+void generate_group_messages(TsvWriter& messages, TsvWriter& attachments, TsvWriter& blobs,
+                             const vector<vector<uint32_t>>& group_members) {
+    if (group_members.empty()) return;
+    // Nhóm lớn hoạt động nhiều hơn, nhưng không tỉ lệ thuận với số thành viên
+    vector<double> weights(group_members.size());
+    for (size_t g = 0; g < group_members.size(); g++) weights[g] = pow((double)group_members[g].size(), 0.7);
+    AliasTable group_activity;
+    group_activity.build(weights);
+
+    MessageClock clock(span_start, config.days, config.group_messages);
+    vector<uint32_t> active(1024, 0);
+    size_t active_count = 0;
+    for (long long i = 0; i < config.group_messages; i++) {
+        time_t sent = clock.next();
+        uint32_t g;
+        if (active_count > 0 && uniform01() < 0.7) {
+            g = active[rng() % min(active_count, active.size())];
+        } else {
+            g = group_activity.sample();
+            active[active_count++ % active.size()] = g;
+        }
+        const vector<uint32_t>& list = group_members[g];
+        uint32_t from = list[rng() % list.size()];
+        long long message_id = i + 1;
+        string text = uniform01() < config.file_ratio
+            ? file_message(attachments, blobs, "group", message_id, g + 1, from, from, sent)
+            : message_text();
+        messages.col(message_id).col((long long)g + 1).col((long long)from + 1).col(text).time(sent);
+        messages.end_row();
+        if ((i + 1) % 10000000 == 0) cout << "  group_messages: " << i + 1 << endl;
+    }
+}
+
+// ===== load.sql =====
+
+void write_load_script(const vector<TsvWriter*>& tables) {
+    string path = config.out + "/load.sql";
+    FILE* sql = fopen(path.c_str(), "w");
+    if (!sql) {
+        cerr << "Không ghi được " << path << endl;
+        exit(1);
+    }
+    char absolute[PATH_MAX];
+    if (!realpath(config.out.c_str(), absolute)) strncpy(absolute, config.out.c_str(), sizeof(absolute) - 1);
+
+    fprintf(sql, "-- Sinh bởi datagen (seed %llu). XÓA dữ liệu hiện có của các bảng bên dưới.\n",
+            (unsigned long long)config.seed);
+    fprintf(sql, "-- mysql --local-infile=1 -u root -p chat_app < load.sql\n\n");
+    fprintf(sql, "SET time_zone = '+00:00';\n");
+    fprintf(sql, "SET foreign_key_checks = 0;\n");
+    fprintf(sql, "SET unique_checks = 0;\n\n");
+    const char* truncate[] = { "attachments", "file_blobs", "sessions", "group_messages", "private_messages",
+                               "group_members", "`groups`", "friendships", "users" };
+    for (const char* table : truncate) fprintf(sql, "TRUNCATE TABLE %s;\n", table);
+    fprintf(sql, "\n");
+    for (const TsvWriter* table : tables) {
+        for (const string& part : table->parts()) {
+            string file = string(absolute) + part.substr(config.out.size());
+            fprintf(sql, "LOAD DATA LOCAL INFILE '%s' INTO TABLE %s CHARACTER SET utf8mb4 (%s);\n",
+                    file.c_str(), table->name() == "groups" ? "`groups`" : table->name().c_str(),
+                    table->column_list().c_str());
+        }
+    }
+    fprintf(sql, "\nSET unique_checks = 1;\n");
+    fprintf(sql, "SET foreign_key_checks = 1;\n\n");
+    fprintf(sql, "-- Cập nhật thống kê cho optimizer sau khi nạp\n");
+    fprintf(sql, "ANALYZE TABLE users, friendships, `groups`, group_members, private_messages, group_messages, "
+                 "attachments, file_blobs;\n");
+    fclose(sql);
+}
+
+// ===== MAIN =====
+
+void usage() {
+    cout << "Cách dùng: ./datagen [tùy chọn]\n"
+            "  --out DIR                 thư mục ghi TSV và load.sql (mặc định datagen_out)\n"
+            "  --users N                 số user (mặc định 1000000)\n"
+            "  --user-prefix P           tên user = P + số thứ tự (mặc định user)\n"
+            "  --password P              mật khẩu mọi user (mặc định password)\n"
+            "  --avg-friends F           số bạn trung bình (mặc định 20)\n"
+            "  --friend-gamma G          số mũ phân phối bậc, > 2 (mặc định 2.1)\n"
+            "  --max-friends N           chặn trên số bạn kỳ vọng mỗi user (mặc định 5000)\n"
+            "  --groups N                số nhóm (mặc định 20000)\n"
+            "  --large-groups N          số nhóm rất lớn trong đó (mặc định 10)\n"
+            "  --large-group-size N      cỡ nhóm rất lớn (mặc định 10000)\n"
+            "  --private-messages N      (mặc định 20000000)\n"
+            "  --group-messages N        (mặc định 20000000)\n"
+            "  --days D                  khoảng thời gian của tin nhắn, kết thúc lúc chạy (mặc định 365)\n"
+            "  --file-ratio R            tỉ lệ tin nhắn là file (mặc định 0.005)\n"
+            "  --chunk-rows N            số dòng mỗi file TSV (mặc định 5000000)\n"
+            "  --seed N                  (mặc định 1)\n";
+}
+
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--help" || arg == "-h" || i + 1 >= argc) return false;
+        const char* value = argv[++i];
+        if (arg == "--out") config.out = value;
+        else if (arg == "--users") config.users = atoll(value);
+        else if (arg == "--user-prefix") config.user_prefix = value;
+        else if (arg == "--password") config.password = value;
+        else if (arg == "--avg-friends") config.avg_friends = atof(value);
+        else if (arg == "--friend-gamma") config.friend_gamma = atof(value);
+        else if (arg == "--max-friends") config.max_friends = atof(value);
+        else if (arg == "--groups") config.groups = atoll(value);
+        else if (arg == "--large-groups") config.large_groups = atoi(value);
+        else if (arg == "--large-group-size") config.large_group_size = atoll(value);
+        else if (arg == "--private-messages") config.private_messages = atoll(value);
+        else if (arg == "--group-messages") config.group_messages = atoll(value);
+        else if (arg == "--days") config.days = atoi(value);
+        else if (arg == "--file-ratio") config.file_ratio = atof(value);
+        else if (arg == "--chunk-rows") config.chunk_rows = atoll(value);
+        else if (arg == "--seed") config.seed = strtoull(value, nullptr, 10);
+        else {
+            cerr << "Tùy chọn không rõ: " << arg << endl;
+            return false;
+        }
+    }
+    if (config.users < 2 || config.users > INT_MAX || config.friend_gamma <= 2 || config.max_friends < 1 ||
+        config.days < 1 || config.chunk_rows < 1 || config.groups < 0 || config.private_messages > INT_MAX ||
+        config.group_messages > INT_MAX) {
+        cerr << "Giá trị tùy chọn không hợp lệ (id trong schema là INT)" << endl;
+        return false;
+    }
+    config.large_groups = (int)min((long long)config.large_groups, config.groups);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        usage();
+        return 1;
+    }
+    mkdir(config.out.c_str(), 0755);
+    rng.seed(config.seed);
+    span_end = time(nullptr);
+    span_start = span_end - (time_t)config.days * 86400;
+    auto started = chrono::steady_clock::now();
+
+    TsvWriter users("users", "user_id, username, password_hash, created_at, last_login, is_online");
+    TsvWriter friendships("friendships", "user_id1, user_id2, status, requester_id, created_at, updated_at");
+    TsvWriter groups("groups", "group_id, group_name, creator_id, created_at");
+    TsvWriter members("group_members", "group_id, user_id, joined_at, role");
+    TsvWriter private_messages("private_messages", "message_id, from_user_id, to_user_id, message_text, sent_at, is_read");
+    TsvWriter group_messages("group_messages", "message_id, group_id, from_user_id, message_text, sent_at");
+    TsvWriter attachments("attachments", "chat_type, message_id, group_id, user_lo, user_hi, uploader_id, file_name, "
+                                         "stored_name, file_size, hash, mime_type, storage_path, created_at");
+    TsvWriter blobs("file_blobs", "hash, file_size, crc32c, ref_count, created_at");
+
+    cout << "Sinh users..." << endl;
+    generate_users(users);
+    cout << "Sinh friendships..." << endl;
+    Graph graph = generate_friendships(friendships);
+    cout << "Sinh groups..." << endl;
+    vector<vector<uint32_t>> group_members = generate_groups(groups, members);
+    cout << "Sinh private_messages..." << endl;
+    generate_private_messages(private_messages, attachments, blobs, graph);
+    cout << "Sinh group_messages..." << endl;
+    generate_group_messages(group_messages, attachments, blobs, group_members);
+
+    // Thứ tự nạp theo khóa ngoại (dù foreign_key_checks tắt, để bảng cha có trước)
+    vector<TsvWriter*> tables = { &users, &friendships, &groups, &members, &private_messages, &group_messages,
+                                  &blobs, &attachments };
+    for (TsvWriter* table : tables) table->close_part();
+    write_load_script(tables);
+
+    // Tóm tắt phân phối bậc để kiểm tra nhanh
+    vector<uint32_t> degrees(config.users);
+    for (long long i = 0; i < config.users; i++) degrees[i] = graph.offsets[i + 1] - graph.offsets[i];
+    sort(degrees.begin(), degrees.end());
+    size_t largest_group = 0;
+    for (const auto& list : group_members) largest_group = max(largest_group, list.size());
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << endl << "== Xong sau " << fixed << setprecision(1) << seconds << " s ==" << endl;
+    for (TsvWriter* table : tables) {
+        cout << "  " << left << setw(18) << table->name() << right << setw(14) << table->row_count() << " dòng, "
+             << table->parts().size() << " file" << endl;
+    }
+    cout << "  bạn bè mỗi user: p50 " << degrees[degrees.size() / 2] << ", p99 " << degrees[degrees.size() * 99 / 100]
+         << ", max " << degrees.back() << endl;
+    cout << "  nhóm lớn nhất: " << largest_group << " thành viên" << endl;
+    cout << "Nạp: mysql --local-infile=1 -u root -p chat_app < " << config.out << "/load.sql" << endl;
+    return 0;
+}
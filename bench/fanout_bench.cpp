@@ -0,0 +1,1047 @@
+/*
+ * BENCHMARK FAN-OUT TIN NHẮN NHÓM
+ *
+ * handle_msg_group lưu tin rồi với MỖI thành viên: một truy vấn getUsername
+ * và một lần gửi nếu thành viên đang online - chi phí O(số thành viên). Công
+ * cụ này đo lại được chi phí đó:
+ *   - (tùy chọn) tự chạy server (--server-bin) trên database local
+ *   - tạo nhóm N thành viên (user<start>..user<start+N-1>), S người gửi đầu
+ *     tiên, M người tiếp theo online nhận tin, phần còn lại offline
+ *   - người gửi gửi tin theo tốc độ R (open-loop, Poisson, như loadgen)
+ *   - báo độ trễ ack của người gửi (S_RESP_GROUP_MSG), độ trễ tới người nhận
+ *     đầu tiên / cuối cùng của mỗi tin, độ trễ mọi lần giao, và CPU server
+ *     (utime + stime từ /proc/<pid>/stat) trên mỗi tin / mỗi lần giao
+ *
+ * Thành viên được thêm bằng các client chặn lần lượt: đăng nhập, vào nhóm,
+ * C_REQ_GROUP_LIST (request_id 0 nên chạy sau lệnh vào nhóm) để xác nhận rồi
+ * ngắt. Lúc đó chỉ người gửi online nên số thông báo vào nhóm là O(N) thay
+ * vì O(N^2). Người nhận đăng nhập sau, qua vòng epoll giống loadgen.
+ *
+ * Chạy: ./fanout_bench --server-bin ../server/server --group-size 1000 --receivers 500 --rate 20
+ *       ./fanout_bench --port 8888 --server-pid <pid> ...   (server đang chạy sẵn)
+ *       (./fanout_bench --help để xem đủ tùy chọn)
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "json_helper.h"
+#include "latency_histogram.h"
+
+using namespace std;
+
+// ===== CẤU HÌNH =====
+
+struct Config {
+    string host = "127.0.0.1";
+    int port = 8888;
+    string server_bin;                  // Rỗng = dùng server đang chạy
+    string server_log = "fanout_server.log";
+    int server_pid = 0;                 // Đo CPU của server chạy sẵn
+    int group_size = 1000;
+    int receivers = -1;                 // -1 = mọi thành viên trừ người gửi
+    int senders = 1;
+    int group_id = 0;                   // Dùng lại nhóm có sẵn (vd. của lần chạy trước)
+    int user_start = 1;
+    string user_prefix = "user";
+    string password = "password";
+    bool register_users = false;
+    double rate = 10;                   // Tin nhắn mỗi giây (tổng mọi người gửi)
+    int duration = 30;
+    int message_bytes = 64;
+    int threads = 4;
+    int join_threads = 8;
+    double connect_rate = 500;
+    int drain = 10;                     // Giây tối đa chờ tin còn trên đường
+    string csv;                         // Ghi thêm một dòng kết quả
+    uint64_t seed = 1;
+};
+
+Config config;
+
+inline uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ===== SỐ LIỆU =====
+// Mỗi tin một slot theo số thứ tự; người nhận ở nhiều thread cùng cập nhật
+
+struct MessageSlot {
+    atomic<uint64_t> scheduled_ns{0};
+    atomic<uint64_t> ack_ns{0};
+    atomic<uint32_t> delivered{0};
+    atomic<uint64_t> first_ns{UINT64_MAX};
+    atomic<uint64_t> last_ns{0};
+};
+
+MessageSlot* message_slots = nullptr;
+size_t message_capacity = 0;
+atomic<uint64_t> next_seq(0);
+atomic<uint64_t> sent(0);
+atomic<uint64_t> acked(0);
+atomic<uint64_t> ack_errors(0);
+atomic<uint64_t> skipped(0);            // Hết slot hoặc không có người gửi sẵn sàng
+atomic<uint64_t> deliveries(0);
+atomic<uint64_t> disconnects(0);
+LatencyHistogram ack_latency;
+LatencyHistogram delivery_latency;      // Mọi lần giao
+
+// ===== KẾT NỐI =====
+
+enum ClientState { CLIENT_IDLE, CLIENT_CONNECTING, CLIENT_LOGGING_IN, CLIENT_READY, CLIENT_FAILED };
+
+struct Client {
+    int index;
+    string username;
+    bool sender = false;
+    string token;
+    int fd = -1;
+    atomic<int> state{CLIENT_IDLE};
+    string in;
+    string out;
+    size_t out_off = 0;
+    bool want_write = false;
+    uint32_t next_request_id = 1;
+    uint32_t login_request = 0;
+    uint32_t create_request = 0;
+    unordered_map<uint32_t, uint64_t> pending;      // request_id -> số thứ tự tin chờ ack
+    bool joining = false;
+    bool joined = false;
+    uint64_t send_due = 0;
+};
+
+struct Worker {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    vector<Client*> clients;
+    vector<Client*> to_connect;         // Theo thứ tự kết nối của pha hiện tại
+    mt19937_64 rng;
+    size_t next_connect = 0;
+    uint64_t connect_due = 0;
+    int setup_phase = -1;
+};
+
+vector<Client*> senders;
+vector<Client*> receivers;
+atomic<int> group_id(0);
+sockaddr_in server_addr;
+
+// ===== ĐIỀU PHỐI =====
+
+enum Phase { PHASE_SENDER_LOGIN, PHASE_GROUP_CREATE, PHASE_MEMBERS, PHASE_SENDER_JOIN, PHASE_RECEIVER_LOGIN,
+             PHASE_RUN, PHASE_DRAIN, PHASE_STOP };
+
+atomic<int> phase(PHASE_SENDER_LOGIN);
+atomic<int> logins_done(0);
+atomic<int> logins_ok(0);
+atomic<int> setup_workers(0);
+atomic<int> setup_sent(0);
+atomic<int> setup_done(0);
+
+// ===== GỬI =====
+
+void queue_frame(Client& c, int command, uint32_t request_id, const string& body) {
+    WireHeader header(command, STATUS_OK, request_id);
+    header.body_length = body.size();
+    unsigned char buf[WIRE_HEADER_SIZE];
+    encode_wire_header(header, buf);
+    c.out.append((const char*)buf, WIRE_HEADER_SIZE);
+    c.out += body;
+}
+
+uint32_t new_request_id(Client& c) {
+    uint32_t request_id = c.next_request_id++;
+    if (c.next_request_id == 0) c.next_request_id = 1;
+    return request_id;
+}
+
+void set_write_interest(Worker& w, Client& c, bool on) {
+    if (c.want_write == on) return;
+    c.want_write = on;
+    epoll_event ev;
+    ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+    ev.data.ptr = &c;
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+bool flush(Worker& w, Client& c) {
+    while (c.out_off < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n > 0) {
+            c.out_off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_write_interest(w, c, true);
+            return true;
+        }
+        return false;
+    }
+    c.out.clear();
+    c.out_off = 0;
+    set_write_interest(w, c, false);
+    return true;
+}
+
+void fail_client(Worker& w, Client& c) {
+    if (c.state == CLIENT_FAILED) return;
+    if (c.state == CLIENT_READY) disconnects++;
+    if (c.state == CLIENT_CONNECTING || c.state == CLIENT_LOGGING_IN) logins_done++;
+    ack_errors += c.pending.size();
+    c.pending.clear();
+    if (c.create_request || c.joining) setup_done++;
+    c.create_request = 0;
+    c.joining = false;
+    if (c.fd >= 0) {
+        epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.state = CLIENT_FAILED;
+}
+
+void submit(Worker& w, Client& c) {
+    if (c.state == CLIENT_CONNECTING) return;
+    if (!flush(w, c)) fail_client(w, c);
+}
+
+void start_connect(Worker& w, Client& c) {
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c.fd < 0 || (connect(c.fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS)) {
+        if (c.fd >= 0) close(c.fd);
+        c.fd = -1;
+        c.state = CLIENT_FAILED;
+        logins_done++;
+        return;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c.state = CLIENT_CONNECTING;
+    c.want_write = true;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = &c;
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+
+    map<string, string> body;
+    body["username"] = c.username;
+    body["pass_hash"] = config.password;
+    c.login_request = new_request_id(c);
+    queue_frame(c, C_REQ_LOGIN, c.login_request, JsonHelper::build(body));
+}
+
+// ===== GỬI TIN =====
+
+string make_message(uint64_t seq, uint64_t scheduled_ns) {
+    string message = "fo " + to_string(seq) + " " + to_string(scheduled_ns);
+    message.resize(max((size_t)config.message_bytes, message.size()), 'x');
+    return message;
+}
+
+void send_group_message(Worker& w, Client& c, uint64_t scheduled_ns) {
+    uint64_t seq = next_seq++;
+    if (seq >= message_capacity || c.state != CLIENT_READY) {
+        skipped++;
+        return;
+    }
+    message_slots[seq].scheduled_ns = scheduled_ns;
+    map<string, string> body;
+    body["token"] = c.token;
+    body["group_id"] = to_string(group_id.load());
+    body["message"] = make_message(seq, scheduled_ns);
+    uint32_t request_id = new_request_id(c);
+    c.pending[request_id] = seq;
+    queue_frame(c, C_REQ_MSG_GROUP, request_id, JsonHelper::build(body));
+    sent++;
+    submit(w, c);
+}
+
+// Mỗi người gửi có lịch Poisson riêng với tốc độ rate / senders
+void issue_due_messages(Worker& w, uint64_t now) {
+    double rate = config.rate / config.senders;
+    exponential_distribution<double> gap(rate);
+    for (Client* c : w.clients) {
+        if (!c->sender) continue;
+        if (c->send_due == 0) c->send_due = now + (uint64_t)(gap(w.rng) * 1e9);
+        while (c->send_due <= now) {
+            send_group_message(w, *c, c->send_due);
+            c->send_due += (uint64_t)(gap(w.rng) * 1e9) + 1;
+        }
+    }
+}
+
+// Pha chuẩn bị của người gửi: người gửi đầu tiên tạo nhóm, những người còn lại vào nhóm
+void run_setup(Worker& w, int current) {
+    if (w.setup_phase == current) return;
+    w.setup_phase = current;
+    for (Client* c : w.clients) {
+        if (!c->sender || c->state != CLIENT_READY) continue;
+        map<string, string> body;
+        body["token"] = c->token;
+        if (current == PHASE_GROUP_CREATE && c == senders[0]) {
+            body["group_name"] = "fanout-" + to_string(config.group_size) + "-" + to_string(time(nullptr));
+            c->create_request = new_request_id(*c);
+            queue_frame(*c, C_REQ_GROUP_CREATE, c->create_request, JsonHelper::build(body));
+        } else if (current == PHASE_SENDER_JOIN && !c->joined) {
+            // request_id 0: danh sách nhóm chạy sau lệnh vào nhóm, dùng để xác nhận
+            body["group_id"] = to_string(group_id.load());
+            queue_frame(*c, C_REQ_GROUP_JOIN, 0, JsonHelper::build(body));
+            map<string, string> list;
+            list["token"] = c->token;
+            queue_frame(*c, C_REQ_GROUP_LIST, 0, JsonHelper::build(list));
+            c->joining = true;
+        } else {
+            continue;
+        }
+        setup_sent++;
+        submit(w, *c);
+    }
+    setup_workers++;
+}
+
+// ===== NHẬN =====
+
+bool group_list_contains(const string& body, int id) {
+    return body.find("\"group_id\":\"" + to_string(id) + "\"") != string::npos;
+}
+
+// Tin của benchmark: "message":"fo <seq> <scheduled_ns>..." (không parse cả JSON:
+// với M người nhận mỗi tin được xử lý M lần)
+void record_delivery(const string& body, uint64_t now) {
+    size_t pos = body.find("\"message\":\"fo ");
+    if (pos == string::npos) return;
+    uint64_t seq = strtoull(body.c_str() + pos + 14, nullptr, 10);
+    if (seq >= message_capacity) return;
+    MessageSlot& slot = message_slots[seq];
+    uint64_t scheduled = slot.scheduled_ns.load();
+    if (scheduled == 0 || scheduled > now) return;
+    delivery_latency.record(now - scheduled);
+    deliveries++;
+    slot.delivered++;
+    uint64_t prev = slot.first_ns.load(memory_order_relaxed);
+    while (now < prev && !slot.first_ns.compare_exchange_weak(prev, now, memory_order_relaxed)) {}
+    prev = slot.last_ns.load(memory_order_relaxed);
+    while (now > prev && !slot.last_ns.compare_exchange_weak(prev, now, memory_order_relaxed)) {}
+}
+
+void handle_frame(Worker& w, Client& c, const WireHeader& header, const string& body) {
+    uint64_t now = now_ns();
+    switch (header.command) {
+        case S_NOTIFY_MSG_GROUP:
+            if (!c.sender) record_delivery(body, now);     // Người gửi cũng nhận lại tin, không tính
+            return;
+        case S_RESP_LOGIN:
+            if (c.state != CLIENT_LOGGING_IN || header.request_id != c.login_request) {
+                if (header.status != STATUS_OK) fail_client(w, c);    // Bị đăng nhập đè
+                return;
+            }
+            logins_done++;
+            if (header.status == STATUS_OK) {
+                c.token = JsonHelper::parse(body)["token"];
+                c.state = CLIENT_READY;
+                logins_ok++;
+            } else {
+                fail_client(w, c);
+            }
+            return;
+        case S_RESP_GROUP_CREATE:
+            if (header.request_id != c.create_request) return;
+            c.create_request = 0;
+            if (header.status == STATUS_OK || header.status == STATUS_CREATED) {
+                group_id = atoi(JsonHelper::parse(body)["group_id"].c_str());
+                c.joined = group_id > 0;
+            }
+            setup_done++;
+            return;
+        case S_RESP_GROUP_LIST:
+            if (!c.joining) return;
+            c.joining = false;
+            c.joined = group_list_contains(body, group_id);
+            setup_done++;
+            return;
+        case S_RESP_GROUP_MSG: {
+            auto it = c.pending.find(header.request_id);
+            if (it == c.pending.end()) return;
+            uint64_t seq = it->second;
+            c.pending.erase(it);
+            if (header.status != STATUS_OK) {
+                ack_errors++;
+                return;
+            }
+            message_slots[seq].ack_ns = now;
+            ack_latency.record(now - message_slots[seq].scheduled_ns);
+            acked++;
+            return;
+        }
+        default:
+            return;     // Thông báo vào nhóm, bạn bè online, ...
+    }
+}
+
+bool read_frames(Worker& w, Client& c) {
+    char buf[65536];
+    while (true) {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            c.in.append(buf, n);
+            continue;
+        }
+        if (n == 0) return false;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return false;
+    }
+    size_t off = 0;
+    while (c.in.size() - off >= WIRE_HEADER_SIZE) {
+        WireHeader header;
+        if (!decode_wire_header((const unsigned char*)c.in.data() + off, header)) return false;
+        if (c.in.size() - off - WIRE_HEADER_SIZE < header.body_length) break;
+        string body = c.in.substr(off + WIRE_HEADER_SIZE, header.body_length);
+        off += WIRE_HEADER_SIZE + header.body_length;
+        handle_frame(w, c, header, body);
+        if (c.state == CLIENT_FAILED) return true;
+    }
+    c.in.erase(0, off);
+    return true;
+}
+
+void handle_event(Worker& w, Client& c, uint32_t events) {
+    if (c.state == CLIENT_FAILED) return;
+    if (c.state == CLIENT_CONNECTING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            fail_client(w, c);
+            return;
+        }
+        c.state = CLIENT_LOGGING_IN;
+    }
+    if ((events & EPOLLOUT) && !flush(w, c)) {
+        fail_client(w, c);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !read_frames(w, c)) fail_client(w, c);
+}
+
+void* worker_main(void* arg) {
+    Worker& w = *(Worker*)arg;
+    epoll_event events[256];
+    uint64_t connect_gap = (uint64_t)(1e9 * config.threads / config.connect_rate);
+    int connecting_phase = -1;
+
+    while (true) {
+        int current = phase.load();
+        if (current == PHASE_STOP) break;
+        uint64_t now = now_ns();
+        if (current == PHASE_SENDER_LOGIN || current == PHASE_RECEIVER_LOGIN) {
+            if (connecting_phase != current) {
+                connecting_phase = current;
+                w.to_connect.clear();
+                for (Client* c : w.clients) {
+                    if (c->sender == (current == PHASE_SENDER_LOGIN)) w.to_connect.push_back(c);
+                }
+                w.next_connect = 0;
+                w.connect_due = now;
+            }
+            while (w.next_connect < w.to_connect.size() && w.connect_due <= now) {
+                start_connect(w, *w.to_connect[w.next_connect++]);
+                w.connect_due += connect_gap;
+            }
+        } else if (current == PHASE_GROUP_CREATE || current == PHASE_SENDER_JOIN) {
+            run_setup(w, current);
+        } else if (current == PHASE_RUN) {
+            issue_due_messages(w, now);
+        }
+
+        int n = epoll_wait(w.epoll_fd, events, 256, 1);
+        for (int i = 0; i < n; i++) handle_event(w, *(Client*)events[i].data.ptr, events[i].events);
+    }
+
+    for (Client* c : w.clients) {
+        if (c->fd >= 0) close(c->fd);
+    }
+    close(w.epoll_fd);
+    return nullptr;
+}
+
+// ===== THÊM THÀNH VIÊN (CLIENT CHẶN) =====
+
+bool write_all(int fd, const string& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+bool read_exact(int fd, char* buf, size_t size) {
+    size_t off = 0;
+    while (off < size) {
+        ssize_t n = recv(fd, buf + off, size - off, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        off += n;
+    }
+    return true;
+}
+
+// Đọc tới frame có lệnh command, bỏ qua các thông báo khác
+bool wait_frame(int fd, int command, WireHeader& header, string& body) {
+    while (true) {
+        unsigned char raw[WIRE_HEADER_SIZE];
+        if (!read_exact(fd, (char*)raw, WIRE_HEADER_SIZE) || !decode_wire_header(raw, header)) return false;
+        body.assign(header.body_length, '\0');
+        if (header.body_length > 0 && !read_exact(fd, &body[0], header.body_length)) return false;
+        if (header.command == command) return true;
+    }
+}
+
+string frame(int command, const map<string, string>& fields) {
+    string body = JsonHelper::build(fields);
+    WireHeader header(command, STATUS_OK, 0);
+    header.body_length = body.size();
+    unsigned char buf[WIRE_HEADER_SIZE];
+    encode_wire_header(header, buf);
+    return string((const char*)buf, WIRE_HEADER_SIZE) + body;
+}
+
+// Đăng nhập, vào nhóm (không đổi gì nếu đã là thành viên), xác nhận, ngắt
+bool add_member(const string& username) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    struct timeval timeout = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    bool ok = false;
+    WireHeader header;
+    string body;
+    map<string, string> fields;
+    fields["username"] = username;
+    fields["pass_hash"] = config.password;
+    if (connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) == 0) {
+        bool logged_in = true;
+        if (config.register_users) {
+            logged_in = write_all(fd, frame(C_REQ_REGISTER, fields)) && wait_frame(fd, S_RESP_REGISTER, header, body);
+        }
+        if (logged_in && write_all(fd, frame(C_REQ_LOGIN, fields)) && wait_frame(fd, S_RESP_LOGIN, header, body) &&
+            header.status == STATUS_OK) {
+            map<string, string> request;
+            request["token"] = JsonHelper::parse(body)["token"];
+            map<string, string> list = request;
+            request["group_id"] = to_string(group_id.load());
+            ok = write_all(fd, frame(C_REQ_GROUP_JOIN, request) + frame(C_REQ_GROUP_LIST, list)) &&
+                 wait_frame(fd, S_RESP_GROUP_LIST, header, body) && group_list_contains(body, group_id);
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+struct MemberJob {
+    vector<string> usernames;
+    atomic<int>* done;
+    atomic<int>* ok;
+};
+
+void* member_thread(void* arg) {
+    MemberJob& job = *(MemberJob*)arg;
+    for (const string& username : job.usernames) {
+        if (add_member(username)) (*job.ok)++;
+        (*job.done)++;
+    }
+    return nullptr;
+}
+
+// Thành viên không gửi: người nhận và người offline
+int add_members(int& total) {
+    int first = config.user_start + config.senders;
+    total = config.group_size - config.senders;
+    atomic<int> done(0), ok(0);
+    vector<MemberJob> jobs(config.join_threads);
+    for (int i = 0; i < total; i++) {
+        jobs[i % config.join_threads].usernames.push_back(config.user_prefix + to_string(first + i));
+    }
+    vector<pthread_t> threads(config.join_threads);
+    for (int i = 0; i < config.join_threads; i++) {
+        jobs[i].done = &done;
+        jobs[i].ok = &ok;
+        pthread_create(&threads[i], nullptr, member_thread, &jobs[i]);
+    }
+    int last_print = -1;
+    while (done < total) {
+        usleep(200000);
+        int now_done = done;
+        if (now_done / 1000 != last_print / 1000) {
+            last_print = now_done;
+            cout << "  thêm thành viên: " << now_done << "/" << total << endl;
+        }
+    }
+    for (pthread_t& thread : threads) pthread_join(thread, nullptr);
+    return ok;
+}
+
+// ===== SERVER =====
+
+pid_t server_child = 0;
+
+bool port_open() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bool open = connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) == 0;
+    close(fd);
+    return open;
+}
+
+// Chạy server trên port cấu hình (tắt cổng quản trị), log ra server_log
+bool start_server() {
+    server_child = fork();
+    if (server_child < 0) return false;
+    if (server_child == 0) {
+        int log_fd = open(config.server_log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd >= 0) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        string port = to_string(config.port);
+        execl(config.server_bin.c_str(), config.server_bin.c_str(), port.c_str(), "0", (char*)nullptr);
+        _exit(127);
+    }
+    config.server_pid = server_child;
+    for (int i = 0; i < 300; i++) {
+        int status;
+        if (waitpid(server_child, &status, WNOHANG) == server_child) {
+            cerr << "Server thoát khi khởi động, xem " << config.server_log << endl;
+            server_child = 0;
+            return false;
+        }
+        if (port_open()) return true;
+        usleep(100000);
+    }
+    cerr << "Server không mở cổng " << config.port << " sau 30 s" << endl;
+    return false;
+}
+
+void stop_server() {
+    if (server_child <= 0) return;
+    kill(server_child, SIGTERM);
+    for (int i = 0; i < 50; i++) {
+        if (waitpid(server_child, nullptr, WNOHANG) == server_child) return;
+        usleep(100000);
+    }
+    kill(server_child, SIGKILL);
+    waitpid(server_child, nullptr, 0);
+}
+
+// Thời gian CPU (user + system) của tiến trình, giây; < 0 nếu không đọc được
+double process_cpu_seconds(int pid) {
+    if (pid <= 0) return -1;
+    ifstream stat("/proc/" + to_string(pid) + "/stat");
+    string line;
+    if (!getline(stat, line)) return -1;
+    size_t end = line.rfind(')');           // Tên tiến trình có thể chứa dấu cách
+    if (end == string::npos) return -1;
+    istringstream fields(line.substr(end + 2));
+    string skip;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i < 14; i++) fields >> skip;    // Trường 3..13
+    fields >> utime >> stime;                        // Trường 14, 15
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+double self_cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// ===== BÁO CÁO =====
+
+double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+void print_row(const char* name, const LatencySnapshot& snapshot) {
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    cout << left << setw(16) << name << right << setw(10) << snapshot.count << fixed << setprecision(2);
+    for (double q : quantiles) cout << setw(10) << ms(snapshot.percentile_ns(q));
+    cout << setw(10) << ms(snapshot.max_ns) << endl;
+}
+
+struct Summary {
+    uint64_t complete = 0;              // Tới đủ mọi người nhận online
+    uint64_t partial = 0;
+    uint64_t none = 0;
+    LatencySnapshot ack, first, last, every;
+    double server_cpu = -1;
+    double harness_cpu = 0;
+    double run_seconds = 0;
+};
+
+void summarize(Summary& summary, int online_receivers) {
+    LatencyHistogram first, last;
+    uint64_t total = min((uint64_t)message_capacity, next_seq.load());
+    for (uint64_t seq = 0; seq < total; seq++) {
+        MessageSlot& slot = message_slots[seq];
+        uint64_t scheduled = slot.scheduled_ns;
+        if (scheduled == 0) continue;
+        uint32_t delivered = slot.delivered;
+        if (delivered == 0) {
+            summary.none++;
+            continue;
+        }
+        first.record(slot.first_ns - scheduled);
+        if ((int)delivered >= online_receivers) {
+            summary.complete++;
+            last.record(slot.last_ns - scheduled);
+        } else {
+            summary.partial++;
+        }
+    }
+    ack_latency.snapshot(summary.ack);
+    first.snapshot(summary.first);
+    last.snapshot(summary.last);
+    delivery_latency.snapshot(summary.every);
+}
+
+void print_report(const Summary& s, int members, int online_receivers) {
+    cout << endl << "== Fan-out: nhóm " << group_id << ", " << members << " thành viên, " << senders.size()
+         << " người gửi, " << online_receivers << " người nhận online, " << fixed << setprecision(1)
+         << config.rate << " tin/s trong " << s.run_seconds << " s ==" << endl;
+    cout << "Tin: gửi " << sent << ", ack " << acked << ", lỗi/mất ack " << ack_errors << ", bỏ qua " << skipped
+         << " | tới đủ người nhận " << s.complete << ", thiếu " << s.partial << ", không ai nhận " << s.none << endl;
+    cout << left << setw(16) << "latency" << right << setw(10) << "count" << setw(10) << "p50" << setw(10) << "p90"
+         << setw(10) << "p99" << setw(10) << "p99.9" << setw(10) << "max" << "  (ms)" << endl;
+    print_row("sender-ack", s.ack);                 // Tới S_RESP_GROUP_MSG
+    print_row("first-recipient", s.first);          // Người nhận đầu tiên có tin
+    print_row("last-recipient", s.last);            // Chỉ tin tới đủ người nhận online
+    print_row("every-delivery", s.every);
+    if (s.server_cpu >= 0 && acked > 0) {
+        cout << "CPU server: " << setprecision(2) << s.server_cpu << " s (" << setprecision(0)
+             << 100 * s.server_cpu / s.run_seconds << "% một core), " << setprecision(3)
+             << 1000 * s.server_cpu / acked << " ms/tin, " << setprecision(2)
+             << 1e6 * s.server_cpu / max<uint64_t>(1, deliveries) << " µs/lần giao" << endl;
+    } else if (s.server_cpu < 0) {
+        cout << "CPU server: không đo (dùng --server-bin hoặc --server-pid)" << endl;
+    }
+    cout << "CPU benchmark: " << setprecision(0) << 100 * s.harness_cpu / s.run_seconds
+         << "% một core (gần " << config.threads * 100 << "% thì số liệu bị giới hạn bởi benchmark)" << endl;
+}
+
+void append_csv(const Summary& s, int members, int online_receivers) {
+    struct stat st;
+    bool header = stat(config.csv.c_str(), &st) != 0 || st.st_size == 0;
+    ofstream out(config.csv, ios::app);
+    if (!out) {
+        cerr << "Không ghi được " << config.csv << endl;
+        return;
+    }
+    if (header) {
+        out << "time,group_size,receivers,senders,rate,duration,sent,acked,complete,"
+               "ack_p50_ms,ack_p99_ms,last_p50_ms,last_p99_ms,every_p99_ms,server_cpu_ms_per_msg" << endl;
+    }
+    out << time(nullptr) << "," << members << "," << online_receivers << "," << senders.size() << ","
+        << config.rate << "," << fixed << setprecision(1) << s.run_seconds << "," << sent << "," << acked << ","
+        << s.complete << "," << setprecision(3)
+        << ms(s.ack.percentile_ns(0.5)) << "," << ms(s.ack.percentile_ns(0.99)) << ","
+        << ms(s.last.percentile_ns(0.5)) << "," << ms(s.last.percentile_ns(0.99)) << ","
+        << ms(s.every.percentile_ns(0.99)) << ",";
+    if (s.server_cpu >= 0 && acked > 0) out << 1000 * s.server_cpu / acked;
+    out << endl;
+}
+
+// ===== MAIN =====
+
+void usage() {
+    cout << "Cách dùng: ./fanout_bench [tùy chọn]\n"
+            "  --server-bin PATH       tự chạy server (trên --port, cổng quản trị tắt), dừng khi xong\n"
+            "  --server-log FILE       stdout/stderr của server tự chạy (mặc định fanout_server.log)\n"
+            "  --server-pid PID        đo CPU của server đang chạy sẵn\n"
+            "  --host HOST             (mặc định 127.0.0.1)\n"
+            "  --port PORT             (mặc định 8888)\n"
+            "  --group-size N          số thành viên nhóm (mặc định 1000)\n"
+            "  --receivers M           số thành viên online nhận tin (mặc định N - số người gửi)\n"
+            "  --senders S             số người gửi (mặc định 1)\n"
+            "  --group-id G            dùng nhóm có sẵn thay vì tạo mới (thành viên thiếu được thêm vào)\n"
+            "  --rate R                tin nhắn mỗi giây, tổng mọi người gửi (mặc định 10)\n"
+            "  --duration S            giây gửi tin (mặc định 30)\n"
+            "  --message-bytes N       độ dài tin nhắn (mặc định 64)\n"
+            "  --user-start I          thành viên là user<I>..user<I+N-1> (mặc định 1)\n"
+            "  --user-prefix P         (mặc định user)\n"
+            "  --password P            (mặc định password)\n"
+            "  --register              đăng ký user trước khi thêm vào nhóm\n"
+            "  --threads N             worker thread epoll (mặc định 4)\n"
+            "  --join-threads N        thread thêm thành viên (mặc định 8)\n"
+            "  --connect-rate R        kết nối mới mỗi giây (mặc định 500)\n"
+            "  --drain S               giây tối đa chờ tin còn trên đường (mặc định 10)\n"
+            "  --csv FILE              ghi thêm một dòng kết quả (để so sánh giữa các lần sửa)\n"
+            "  --seed N                (mặc định 1)\n";
+}
+
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--help" || arg == "-h") return false;
+        if (arg == "--register") {
+            config.register_users = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cerr << "Thiếu giá trị cho " << arg << endl;
+            return false;
+        }
+        string value = argv[++i];
+        if (arg == "--server-bin") config.server_bin = value;
+        else if (arg == "--server-log") config.server_log = value;
+        else if (arg == "--server-pid") config.server_pid = atoi(value.c_str());
+        else if (arg == "--host") config.host = value;
+        else if (arg == "--port") config.port = atoi(value.c_str());
+        else if (arg == "--group-size") config.group_size = atoi(value.c_str());
+        else if (arg == "--receivers") config.receivers = atoi(value.c_str());
+        else if (arg == "--senders") config.senders = atoi(value.c_str());
+        else if (arg == "--group-id") config.group_id = atoi(value.c_str());
+        else if (arg == "--rate") config.rate = atof(value.c_str());
+        else if (arg == "--duration") config.duration = atoi(value.c_str());
+        else if (arg == "--message-bytes") config.message_bytes = atoi(value.c_str());
+        else if (arg == "--user-start") config.user_start = atoi(value.c_str());
+        else if (arg == "--user-prefix") config.user_prefix = value;
+        else if (arg == "--password") config.password = value;
+        else if (arg == "--threads") config.threads = atoi(value.c_str());
+        else if (arg == "--join-threads") config.join_threads = atoi(value.c_str());
+        else if (arg == "--connect-rate") config.connect_rate = atof(value.c_str());
+        else if (arg == "--drain") config.drain = atoi(value.c_str());
+        else if (arg == "--csv") config.csv = value;
+        else if (arg == "--seed") config.seed = strtoull(value.c_str(), nullptr, 10);
+        else {
+            cerr << "Tùy chọn không rõ: " << arg << endl;
+            return false;
+        }
+    }
+    if (config.receivers < 0) config.receivers = config.group_size - config.senders;
+    if (config.senders < 1 || config.group_size <= config.senders || config.receivers < 1 ||
+        config.receivers > config.group_size - config.senders || config.rate <= 0 || config.duration < 1 ||
+        config.threads < 1 || config.join_threads < 1 || config.connect_rate <= 0) {
+        cerr << "Giá trị tùy chọn không hợp lệ (cần 1 <= người nhận <= cỡ nhóm - người gửi)" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Chờ tới khi done() đúng hoặc không có tiến triển trong stall_seconds giây
+template <typename Done, typename Count>
+void wait_phase(const char* label, Done done, Count count, int stall_seconds) {
+    int last = -1;
+    uint64_t last_change = now_ns();
+    uint64_t last_print = 0;
+    while (!done()) {
+        usleep(50000);
+        int current = count();
+        uint64_t now = now_ns();
+        if (current != last) {
+            last = current;
+            last_change = now;
+        }
+        if (now - last_print >= 1000000000ull) {
+            last_print = now;
+            cout << "  " << label << ": " << current << endl;
+        }
+        if (now - last_change > (uint64_t)stall_seconds * 1000000000ull) {
+            cout << "  " << label << ": không tiến triển trong " << stall_seconds << " s, tiếp tục" << endl;
+            return;
+        }
+    }
+}
+
+void wait_setup(const char* label, int next_phase) {
+    setup_workers = 0;
+    setup_sent = 0;
+    setup_done = 0;
+    phase = next_phase;
+    wait_phase(label, [&] { return setup_workers >= config.threads && setup_done >= setup_sent; },
+               [&] { return setup_done.load(); }, 30);
+}
+
+int finish(vector<Worker*>& workers, int code) {
+    phase = PHASE_STOP;
+    for (Worker* w : workers) pthread_join(w->thread, nullptr);
+    stop_server();
+    return code;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        usage();
+        return 1;
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host.c_str(), &server_addr.sin_addr) != 1) {
+        cerr << "Địa chỉ không hợp lệ: " << config.host << endl;
+        return 1;
+    }
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)config.receivers + config.senders + 64) {
+        cerr << "⚠ Giới hạn file descriptor (" << limit.rlim_cur << ") nhỏ hơn số kết nối, tăng bằng ulimit -n" << endl;
+    }
+
+    if (!config.server_bin.empty()) {
+        if (port_open()) {
+            cerr << "Cổng " << config.port << " đang có server khác, chọn --port khác" << endl;
+            return 1;
+        }
+        cout << "Chạy server " << config.server_bin << " trên cổng " << config.port << endl;
+        if (!start_server()) {
+            stop_server();
+            return 1;
+        }
+    }
+
+    // Bảng tin: dư 50% cho dao động Poisson
+    message_capacity = (size_t)(config.rate * config.duration * 1.5) + 1000;
+    message_slots = new MessageSlot[message_capacity];
+
+    for (int i = 0; i < config.senders + config.receivers; i++) {
+        Client* c = new Client();
+        c->index = i;
+        c->username = config.user_prefix + to_string(config.user_start + i);
+        c->sender = i < config.senders;
+        (c->sender ? senders : receivers).push_back(c);
+    }
+    vector<Worker*> workers;
+    for (int i = 0; i < config.threads; i++) {
+        Worker* w = new Worker();
+        w->id = i;
+        w->epoll_fd = epoll_create1(0);
+        w->rng.seed(config.seed * 1000003 + i);
+        workers.push_back(w);
+    }
+    // Người gửi ở worker 0, người nhận ở các worker còn lại (nếu có): ack không
+    // phải xếp hàng sau hàng trăm thông báo của người nhận cùng thread
+    int receiver_workers = config.threads > 1 ? config.threads - 1 : 1;
+    for (Client* c : senders) workers[0]->clients.push_back(c);
+    for (Client* c : receivers) workers[config.threads - 1 - c->index % receiver_workers]->clients.push_back(c);
+    // Đăng ký người gửi trước khi worker đăng nhập họ
+    if (config.register_users) {
+        for (Client* c : senders) {
+            map<string, string> fields;
+            fields["username"] = c->username;
+            fields["pass_hash"] = config.password;
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            WireHeader header;
+            string body;
+            if (connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) == 0 &&
+                write_all(fd, frame(C_REQ_REGISTER, fields))) {
+                wait_frame(fd, S_RESP_REGISTER, header, body);
+            }
+            close(fd);
+        }
+    }
+    for (Worker* w : workers) pthread_create(&w->thread, nullptr, worker_main, w);
+
+    // Người gửi đăng nhập trước và online suốt quá trình chuẩn bị
+
+    int sender_count = senders.size();
+    wait_phase("người gửi đăng nhập", [&] { return logins_done >= sender_count; },
+               [&] { return logins_done.load(); }, 30);
+    if (senders[0]->state != CLIENT_READY) {
+        cerr << "Người gửi " << senders[0]->username << " không đăng nhập được" << endl;
+        return finish(workers, 1);
+    }
+
+    if (config.group_id > 0) {
+        group_id = config.group_id;
+    } else {
+        wait_setup("tạo nhóm", PHASE_GROUP_CREATE);
+        if (group_id <= 0) {
+            cerr << "Không tạo được nhóm" << endl;
+            return finish(workers, 1);
+        }
+    }
+    cout << "Nhóm " << group_id << endl;
+
+    phase = PHASE_MEMBERS;
+    int candidates = 0;
+    int members_ok = add_members(candidates);
+    cout << "Thành viên (ngoài người gửi): " << members_ok << "/" << candidates << endl;
+    wait_setup("người gửi vào nhóm", PHASE_SENDER_JOIN);
+    int members = members_ok;
+    for (Client* c : senders) members += c->joined ? 1 : 0;
+    if (!senders[0]->joined) {
+        cerr << "Người gửi không ở trong nhóm " << group_id << endl;
+        return finish(workers, 1);
+    }
+    usleep(500000);     // Server dọn xong các kết nối thêm thành viên trước khi người nhận đăng nhập
+
+    int total = config.senders + config.receivers;
+    phase = PHASE_RECEIVER_LOGIN;
+    wait_phase("người nhận đăng nhập", [&] { return logins_done >= total; }, [&] { return logins_done.load(); }, 30);
+    int online_receivers = 0;
+    for (Client* c : receivers) online_receivers += c->state == CLIENT_READY ? 1 : 0;
+    cout << "Người nhận online: " << online_receivers << "/" << config.receivers << endl;
+    usleep(500000);     // Thông báo bạn bè online lúc đăng nhập không tính vào CPU đo
+
+    // Gửi tin
+    cout << "Gửi " << config.rate << " tin/s trong " << config.duration << " s" << endl;
+    double server_cpu_start = process_cpu_seconds(config.server_pid);
+    double harness_cpu_start = self_cpu_seconds();
+    uint64_t run_start = now_ns();
+    phase = PHASE_RUN;
+    for (int second = 1; second <= config.duration; second++) {
+        uint64_t wake = run_start + (uint64_t)second * 1000000000ull;
+        uint64_t now = now_ns();
+        if (wake > now) usleep((wake - now) / 1000);
+        cout << "[" << setw(4) << second << "s] gửi " << sent << ", ack " << acked << ", giao " << deliveries << endl;
+    }
+    double run_seconds = (now_ns() - run_start) / 1e9;
+
+    // Chờ ack và tin còn trên đường (dừng sớm khi đã đủ)
+    phase = PHASE_DRAIN;
+    uint64_t expected = (uint64_t)online_receivers;
+    uint64_t drain_end = now_ns() + (uint64_t)config.drain * 1000000000ull;
+    while (now_ns() < drain_end && (acked + ack_errors < sent || deliveries < sent * expected)) usleep(50000);
+    double server_cpu_end = process_cpu_seconds(config.server_pid);
+    double harness_cpu_end = self_cpu_seconds();
+
+    Summary summary;
+    summary.run_seconds = run_seconds;
+    if (server_cpu_start >= 0 && server_cpu_end >= 0) summary.server_cpu = server_cpu_end - server_cpu_start;
+    summary.harness_cpu = harness_cpu_end - harness_cpu_start;
+    summarize(summary, online_receivers);
+    print_report(summary, members, online_receivers);
+    if (!config.csv.empty()) append_csv(summary, members, online_receivers);
+    return finish(workers, 0);
+}
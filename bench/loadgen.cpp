@@ -0,0 +1,929 @@
+/*
+ * LOAD GENERATOR CHO GIAO THỨC CHAT
+ *
+ * Đăng nhập hàng nghìn user tổng hợp (user1..userN cùng một mật khẩu, khớp
+ * dữ liệu do datagen tạo, hoặc danh sách "username password" trong file như
+ * database/users.txt), chia họ vào các nhóm rồi tạo tải theo tốc độ cấu hình
+ * cho từng loại: tin nhắn 1-1, tin nhắn nhóm, trang lịch sử, tìm kiếm, upload
+ * file theo chunk. Báo thông lượng, độ trễ phản hồi theo loại và độ trễ giao
+ * tin end-to-end (từ lúc gửi tới lúc người nhận có tin).
+ *
+ *   - Dùng header v2, request_id để ghép phản hồi với request.
+ *   - Mỗi worker thread chạy một vòng epoll trên phần user của mình (socket
+ *     non-blocking), vài thread là đủ cho hàng nghìn kết nối.
+ *   - Tải open-loop: request được lên lịch theo phân phối Poisson, độ trễ tính
+ *     từ thời điểm đã lên lịch chứ không phải lúc gửi thật, nên khi load
+ *     generator hoặc server nghẽn thì độ trễ không bị báo thấp đi.
+ *   - Tin nhắn mang thời điểm gửi ("lg <ns> ..."); người nhận nằm trong cùng
+ *     tiến trình nên dùng chung đồng hồ steady_clock để tính độ trễ giao tin.
+ *
+ * Chạy: ./loadgen [--users 1000] [--duration 60] [--mix private=200,group=20]
+ *       (./loadgen --help để xem đủ tùy chọn)
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "json_helper.h"
+#include "latency_histogram.h"
+
+using namespace std;
+
+// ===== CẤU HÌNH =====
+
+enum OpKind { OP_LOGIN, OP_PRIVATE, OP_GROUP, OP_HISTORY, OP_SEARCH, OP_FILE, OP_COUNT };
+// Request chuẩn bị (không tính vào bảng kết quả)
+#define SETUP_REGISTER      OP_COUNT
+#define SETUP_GROUP_CREATE  (OP_COUNT + 1)
+
+const char* OP_NAMES[OP_COUNT] = { "login", "private", "group", "history", "search", "file" };
+
+struct Config {
+    string host = "127.0.0.1";
+    int port = 8888;
+    int users = 1000;
+    int user_start = 1;
+    string user_prefix = "user";
+    string password = "password";
+    string users_file;
+    bool register_users = false;
+    int threads = 4;
+    int duration = 60;                  // Giây chạy tải (không tính đăng nhập / tạo nhóm)
+    double connect_rate = 500;          // Kết nối mới mỗi giây khi đăng nhập
+    int groups = 10;
+    double rate[OP_COUNT] = { 0, 200, 20, 20, 5, 1 };   // Request mỗi giây (tổng mọi thread)
+    int message_bytes = 64;
+    int history_limit = 20;
+    int file_kb = 64;
+    uint64_t seed = 1;
+    int drain = 3;                      // Giây chờ phản hồi còn thiếu sau khi ngừng gửi
+};
+
+Config config;
+
+const char* WORDS[] = { "hello", "meeting", "project", "deadline", "lunch", "review", "deploy", "weekend",
+                        "coffee", "report", "server", "release", "ticket", "design", "budget", "travel" };
+const int WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+
+inline uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ===== SỐ LIỆU =====
+
+struct OpStats {
+    atomic<uint64_t> sent{0};
+    atomic<uint64_t> ok{0};
+    atomic<uint64_t> errors{0};         // Phản hồi lỗi hoặc mất kết nối khi đang chờ
+    atomic<uint64_t> skipped{0};        // Tới lịch nhưng không có user phù hợp
+    LatencyHistogram latency;
+};
+
+struct DeliveryStats {
+    atomic<uint64_t> count{0};
+    LatencyHistogram latency;
+};
+
+OpStats op_stats[OP_COUNT];
+DeliveryStats delivery_private;
+DeliveryStats delivery_group;
+atomic<uint64_t> disconnects(0);
+
+// ===== USER / KẾT NỐI =====
+
+enum ClientState { CLIENT_IDLE, CLIENT_CONNECTING, CLIENT_LOGGING_IN, CLIENT_READY, CLIENT_FAILED };
+
+struct PendingOp {
+    int kind;
+    uint64_t scheduled_ns;
+    int stage;                          // Upload: 0 = chờ file_id, 1 = chờ kết quả sau END
+};
+
+struct Client {
+    int index;
+    string username;
+    string password;
+    string token;
+    int fd = -1;
+    atomic<int> state{CLIENT_IDLE};     // Thread khác đọc để chọn người nhận
+    string in;
+    string out;
+    size_t out_off = 0;
+    bool want_write = false;
+    uint32_t next_request_id = 1;
+    unordered_map<uint32_t, PendingOp> pending;
+    int group_slot = -1;                // Nhóm loadgen của user (-1 = không có)
+    bool group_creator = false;
+    bool joining = false;
+    bool joined = false;
+    bool uploading = false;
+    uint64_t uploads = 0;
+};
+
+struct Worker {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    vector<Client*> clients;
+    mt19937_64 rng;
+    size_t next_connect = 0;
+    uint64_t connect_due = 0;
+    uint64_t op_due[OP_COUNT];
+    int setup_phase = -1;               // Pha chuẩn bị gần nhất đã gửi request
+    string file_data;
+};
+
+vector<Client*> all_clients;
+atomic<int>* group_ids = nullptr;       // group_id trên server của từng nhóm loadgen (0 = chưa có)
+sockaddr_in server_addr;
+
+// ===== ĐIỀU PHỐI =====
+// Thread chính chuyển pha; worker thấy pha mới thì gửi request của pha đó
+// cho các user của mình và đếm vào setup_sent / setup_done.
+
+enum Phase { PHASE_LOGIN, PHASE_GROUP_CREATE, PHASE_GROUP_JOIN, PHASE_RUN, PHASE_DRAIN, PHASE_STOP };
+
+atomic<int> phase(PHASE_LOGIN);
+atomic<int> logins_done(0);
+atomic<int> logins_ok(0);
+atomic<int> setup_workers(0);           // Số worker đã gửi xong request của pha chuẩn bị hiện tại
+atomic<int> setup_sent(0);
+atomic<int> setup_done(0);
+
+// ===== GỬI =====
+
+void queue_frame(Client& c, int command, uint32_t request_id, const string& body) {
+    WireHeader header(command, STATUS_OK, request_id);
+    header.body_length = body.size();
+    unsigned char buf[WIRE_HEADER_SIZE];
+    encode_wire_header(header, buf);
+    c.out.append((const char*)buf, WIRE_HEADER_SIZE);
+    c.out += body;
+}
+
+uint32_t track(Client& c, int kind, uint64_t scheduled_ns, int stage = 0) {
+    uint32_t request_id = c.next_request_id++;
+    if (c.next_request_id == 0) c.next_request_id = 1;
+    c.pending[request_id] = { kind, scheduled_ns, stage };
+    return request_id;
+}
+
+void set_write_interest(Worker& w, Client& c, bool on) {
+    if (c.want_write == on) return;
+    c.want_write = on;
+    epoll_event ev;
+    ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+    ev.data.ptr = &c;
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+// Gửi phần còn trong buffer; socket đầy thì chờ EPOLLOUT
+bool flush(Worker& w, Client& c) {
+    while (c.out_off < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n > 0) {
+            c.out_off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_write_interest(w, c, true);
+            return true;
+        }
+        return false;
+    }
+    c.out.clear();
+    c.out_off = 0;
+    set_write_interest(w, c, false);
+    return true;
+}
+
+// Đóng kết nối, các request đang chờ tính là lỗi
+void fail_client(Worker& w, Client& c) {
+    if (c.state == CLIENT_FAILED) return;
+    if (c.state == CLIENT_READY) disconnects++;
+    for (auto& entry : c.pending) {
+        const PendingOp& op = entry.second;
+        if (op.kind == OP_LOGIN) logins_done++;
+        if (op.kind == SETUP_GROUP_CREATE) setup_done++;
+        if (op.kind < OP_COUNT) op_stats[op.kind].errors++;
+    }
+    c.pending.clear();
+    if (c.joining) {
+        c.joining = false;
+        setup_done++;
+    }
+    if (c.fd >= 0) {
+        epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.state = CLIENT_FAILED;
+}
+
+void submit(Worker& w, Client& c) {
+    if (c.state == CLIENT_CONNECTING) return;     // Gửi khi connect xong
+    if (!flush(w, c)) fail_client(w, c);
+}
+
+void start_connect(Worker& w, Client& c) {
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c.fd < 0) {
+        c.state = CLIENT_FAILED;
+        op_stats[OP_LOGIN].errors++;
+        logins_done++;
+        return;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c.fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        close(c.fd);
+        c.fd = -1;
+        c.state = CLIENT_FAILED;
+        op_stats[OP_LOGIN].errors++;
+        logins_done++;
+        return;
+    }
+    c.state = CLIENT_CONNECTING;
+    c.want_write = true;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = &c;
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+
+    map<string, string> body;
+    body["username"] = c.username;
+    body["pass_hash"] = c.password;
+    if (config.register_users) queue_frame(c, C_REQ_REGISTER, track(c, SETUP_REGISTER, 0), JsonHelper::build(body));
+    queue_frame(c, C_REQ_LOGIN, track(c, OP_LOGIN, now_ns()), JsonHelper::build(body));
+    op_stats[OP_LOGIN].sent++;
+}
+
+// ===== TẠO TẢI =====
+
+string make_message(Worker& w, uint64_t scheduled_ns) {
+    string message = "lg " + to_string(scheduled_ns);
+    while ((int)message.size() < config.message_bytes) {
+        message += ' ';
+        message += WORDS[w.rng() % WORD_COUNT];
+    }
+    return message;
+}
+
+// User của worker đủ điều kiện cho loại request (thử ngẫu nhiên vài lần)
+Client* pick_client(Worker& w, OpKind kind) {
+    if (w.clients.empty()) return nullptr;
+    for (int attempt = 0; attempt < 16; attempt++) {
+        Client* c = w.clients[w.rng() % w.clients.size()];
+        if (c->state != CLIENT_READY) continue;
+        if (kind == OP_GROUP && !c->joined) continue;
+        if (kind == OP_FILE && c->uploading) continue;
+        return c;
+    }
+    return nullptr;
+}
+
+// Người nhận: user khác đang online nếu tìm được
+Client* pick_peer(Worker& w, const Client& self) {
+    Client* peer = nullptr;
+    for (int attempt = 0; attempt < 8; attempt++) {
+        peer = all_clients[w.rng() % all_clients.size()];
+        if (peer != &self && peer->state == CLIENT_READY) return peer;
+    }
+    return peer;
+}
+
+void issue_op(Worker& w, OpKind kind, uint64_t scheduled_ns) {
+    Client* c = pick_client(w, kind);
+    if (!c) {
+        op_stats[kind].skipped++;
+        return;
+    }
+    map<string, string> body;
+    body["token"] = c->token;
+    bool use_group = c->joined && (w.rng() & 1);
+    int command = 0;
+    switch (kind) {
+        case OP_PRIVATE:
+            command = C_REQ_MSG_PRIVATE;
+            body["target_username"] = pick_peer(w, *c)->username;
+            body["message"] = make_message(w, scheduled_ns);
+            break;
+        case OP_GROUP:
+            command = C_REQ_MSG_GROUP;
+            body["group_id"] = to_string(group_ids[c->group_slot].load());
+            body["message"] = make_message(w, scheduled_ns);
+            break;
+        case OP_HISTORY:
+            if (use_group) {
+                command = C_REQ_CHAT_HISTORY_GROUP;
+                body["group_id"] = to_string(group_ids[c->group_slot].load());
+            } else {
+                command = C_REQ_CHAT_HISTORY_PRIVATE;
+                body["target_username"] = pick_peer(w, *c)->username;
+            }
+            body["offset"] = "0";
+            body["limit"] = to_string(config.history_limit);
+            break;
+        case OP_SEARCH:
+            command = C_REQ_SEARCH_MESSAGES;
+            body["keyword"] = WORDS[w.rng() % WORD_COUNT];
+            body["chat_type"] = use_group ? "group" : "private";
+            body["target"] = use_group ? to_string(group_ids[c->group_slot].load()) : pick_peer(w, *c)->username;
+            break;
+        case OP_FILE:
+            command = C_REQ_FILE_UPLOAD;
+            body["target_username"] = pick_peer(w, *c)->username;
+            body["file_name"] = "lg_" + to_string(c->index) + "_" + to_string(c->uploads) + ".bin";
+            body["file_size"] = to_string(w.file_data.size());
+            c->uploading = true;
+            break;
+        default:
+            return;
+    }
+    queue_frame(*c, command, track(*c, kind, scheduled_ns), JsonHelper::build(body));
+    op_stats[kind].sent++;
+    submit(w, *c);
+}
+
+// Server đã cấp file_id: gửi toàn bộ chunk rồi C_DATA_FILE_END
+void send_upload(Worker& w, Client& c, uint32_t file_id, uint64_t scheduled_ns) {
+    size_t size = w.file_data.size();
+    uint64_t tag = ((uint64_t)c.index << 32) | ++c.uploads;     // Nội dung mỗi lần upload khác nhau
+    for (size_t offset = 0; offset < size; offset += FILE_CHUNK_SIZE) {
+        size_t n = min((size_t)FILE_CHUNK_SIZE, size - offset);
+        string chunk(FILE_CHUNK_HEADER_SIZE + n, '\0');
+        unsigned char* p = (unsigned char*)&chunk[0];
+        wire_put_u32(p, file_id);
+        wire_put_u64(p + 4, offset);
+        memcpy(p + FILE_CHUNK_HEADER_SIZE, w.file_data.data() + offset, n);
+        if (offset == 0) memcpy(p + FILE_CHUNK_HEADER_SIZE, &tag, min(n, sizeof(tag)));
+        queue_frame(c, C_DATA_FILE_CHUNK, 0, chunk);
+    }
+    map<string, string> body;
+    body["token"] = c.token;
+    body["file_id"] = to_string(file_id);
+    queue_frame(c, C_DATA_FILE_END, track(c, OP_FILE, scheduled_ns, 1), JsonHelper::build(body));
+    submit(w, c);
+}
+
+void issue_due_ops(Worker& w, uint64_t now) {
+    for (int kind = OP_PRIVATE; kind < OP_COUNT; kind++) {
+        double rate = config.rate[kind] / config.threads;
+        if (rate <= 0) continue;
+        exponential_distribution<double> gap(rate);
+        while (w.op_due[kind] <= now) {
+            issue_op(w, (OpKind)kind, w.op_due[kind]);
+            w.op_due[kind] += (uint64_t)(gap(w.rng) * 1e9) + 1;
+        }
+    }
+}
+
+// Gửi request của pha chuẩn bị (tạo nhóm / vào nhóm) một lần cho mỗi pha
+void run_setup(Worker& w, int current) {
+    if (w.setup_phase == current) return;
+    w.setup_phase = current;
+    for (Client* c : w.clients) {
+        if (c->state != CLIENT_READY || c->group_slot < 0) continue;
+        map<string, string> body;
+        body["token"] = c->token;
+        if (current == PHASE_GROUP_CREATE && c->group_creator) {
+            body["group_name"] = "loadgen-" + to_string(config.seed) + "-" + to_string(time(nullptr)) + "-" +
+                                 to_string(c->group_slot);
+            queue_frame(*c, C_REQ_GROUP_CREATE, track(*c, SETUP_GROUP_CREATE, 0), JsonHelper::build(body));
+        } else if (current == PHASE_GROUP_JOIN && !c->group_creator && group_ids[c->group_slot] > 0) {
+            // Server không phản hồi C_REQ_GROUP_JOIN, user biết đã vào nhóm qua S_NOTIFY_GROUP_JOIN
+            body["group_id"] = to_string(group_ids[c->group_slot].load());
+            queue_frame(*c, C_REQ_GROUP_JOIN, 0, JsonHelper::build(body));
+            c->joining = true;
+        } else {
+            continue;
+        }
+        setup_sent++;
+        submit(w, *c);
+    }
+    setup_workers++;
+}
+
+// ===== NHẬN =====
+
+void record_delivery(DeliveryStats& stats, const string& body, uint64_t now) {
+    map<string, string> fields = JsonHelper::parse(body);
+    const string& message = fields["message"];
+    if (message.compare(0, 3, "lg ") != 0) return;      // Không phải tin của loadgen (vd. tin nhắn file)
+    uint64_t sent_ns = strtoull(message.c_str() + 3, nullptr, 10);
+    if (sent_ns == 0 || sent_ns > now) return;
+    stats.latency.record(now - sent_ns);
+    stats.count++;
+}
+
+void finish_op(int kind, const PendingOp& op, uint64_t now, bool ok) {
+    if (ok) {
+        op_stats[kind].ok++;
+        op_stats[kind].latency.record(now - op.scheduled_ns);
+    } else {
+        op_stats[kind].errors++;
+    }
+}
+
+void handle_frame(Worker& w, Client& c, const WireHeader& header, const string& body) {
+    uint64_t now = now_ns();
+    if (header.command == S_NOTIFY_MSG_PRIVATE) {
+        record_delivery(delivery_private, body, now);
+        return;
+    }
+    if (header.command == S_NOTIFY_MSG_GROUP) {
+        record_delivery(delivery_group, body, now);
+        return;
+    }
+    if (header.command == S_NOTIFY_GROUP_JOIN) {
+        if (c.joining && JsonHelper::parse(body)["username"] == c.username) {
+            c.joining = false;
+            c.joined = true;
+            setup_done++;
+        }
+        return;
+    }
+    if (header.request_id == 0) return;     // Thông báo khác
+
+    auto it = c.pending.find(header.request_id);
+    if (it == c.pending.end()) return;
+    PendingOp op = it->second;
+    c.pending.erase(it);
+    bool ok = header.status == STATUS_OK || header.status == STATUS_CREATED;
+
+    switch (op.kind) {
+        case SETUP_REGISTER:
+            return;     // 201 hoặc 409 (đã có) đều được, login phía sau sẽ báo lỗi nếu có
+        case SETUP_GROUP_CREATE:
+            if (ok) {
+                group_ids[c.group_slot] = atoi(JsonHelper::parse(body)["group_id"].c_str());
+                c.joined = group_ids[c.group_slot] > 0;     // Người tạo đã là thành viên
+            }
+            setup_done++;
+            return;
+        case OP_LOGIN:
+            finish_op(OP_LOGIN, op, now, ok);
+            logins_done++;
+            if (ok) {
+                c.token = JsonHelper::parse(body)["token"];
+                c.state = CLIENT_READY;
+                logins_ok++;
+            } else {
+                fail_client(w, c);
+            }
+            return;
+        case OP_FILE:
+            if (ok && op.stage == 0) {
+                map<string, string> resp = JsonHelper::parse(body);
+                if (resp.count("file_id") && !resp.count("deduplicated")) {
+                    send_upload(w, c, strtoul(resp["file_id"].c_str(), nullptr, 10), op.scheduled_ns);
+                    return;
+                }
+            }
+            c.uploading = false;
+            finish_op(OP_FILE, op, now, ok);
+            return;
+        default:
+            finish_op(op.kind, op, now, ok);
+            return;
+    }
+}
+
+// Đọc hết dữ liệu đang có và xử lý các frame đủ
+bool read_frames(Worker& w, Client& c) {
+    char buf[65536];
+    while (true) {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            c.in.append(buf, n);
+            continue;
+        }
+        if (n == 0) return false;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return false;
+    }
+    size_t off = 0;
+    while (c.in.size() - off >= WIRE_HEADER_SIZE) {
+        WireHeader header;
+        if (!decode_wire_header((const unsigned char*)c.in.data() + off, header)) return false;
+        if (c.in.size() - off - WIRE_HEADER_SIZE < header.body_length) break;
+        string body = c.in.substr(off + WIRE_HEADER_SIZE, header.body_length);
+        off += WIRE_HEADER_SIZE + header.body_length;
+        handle_frame(w, c, header, body);
+        if (c.state == CLIENT_FAILED) return true;
+    }
+    c.in.erase(0, off);
+    return true;
+}
+
+void handle_event(Worker& w, Client& c, uint32_t events) {
+    if (c.state == CLIENT_FAILED) return;
+    if (c.state == CLIENT_CONNECTING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            fail_client(w, c);
+            return;
+        }
+        c.state = CLIENT_LOGGING_IN;
+    }
+    if ((events & EPOLLOUT) && !flush(w, c)) {
+        fail_client(w, c);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !read_frames(w, c)) fail_client(w, c);
+}
+
+void* worker_main(void* arg) {
+    Worker& w = *(Worker*)arg;
+    epoll_event events[256];
+    bool running = false;
+    uint64_t connect_gap = (uint64_t)(1e9 * config.threads / config.connect_rate);
+
+    while (true) {
+        int current = phase.load();
+        if (current == PHASE_STOP) break;
+        uint64_t now = now_ns();
+        if (current == PHASE_LOGIN) {
+            if (w.connect_due == 0) w.connect_due = now;
+            while (w.next_connect < w.clients.size() && w.connect_due <= now) {
+                start_connect(w, *w.clients[w.next_connect++]);
+                w.connect_due += connect_gap;
+            }
+        } else if (current == PHASE_GROUP_CREATE || current == PHASE_GROUP_JOIN) {
+            run_setup(w, current);
+        } else if (current == PHASE_RUN) {
+            if (!running) {
+                running = true;
+                for (int kind = 0; kind < OP_COUNT; kind++) {
+                    double rate = config.rate[kind] / config.threads;
+                    w.op_due[kind] = rate > 0 ? now + (uint64_t)(exponential_distribution<double>(rate)(w.rng) * 1e9) : 0;
+                }
+            }
+            issue_due_ops(w, now);
+        }
+
+        int n = epoll_wait(w.epoll_fd, events, 256, 1);
+        for (int i = 0; i < n; i++) handle_event(w, *(Client*)events[i].data.ptr, events[i].events);
+    }
+
+    for (Client* c : w.clients) {
+        if (c->fd >= 0) close(c->fd);
+    }
+    close(w.epoll_fd);
+    return nullptr;
+}
+
+// ===== BÁO CÁO =====
+
+double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+// Số liệu trong khoảng giữa hai snapshot (max là max tích lũy)
+void snapshot_delta(const LatencySnapshot& current, const LatencySnapshot& previous, LatencySnapshot& out) {
+    out.count = current.count - previous.count;
+    out.sum_ns = current.sum_ns - previous.sum_ns;
+    out.max_ns = current.max_ns;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) out.buckets[i] = current.buckets[i] - previous.buckets[i];
+}
+
+struct Progress {
+    LatencySnapshot previous[OP_COUNT + 2];
+    LatencySnapshot current;
+    LatencySnapshot delta;
+    uint64_t last_ns = 0;
+};
+
+// Một dòng mỗi giây: request thành công / giây và p99 trong giây vừa qua
+void print_progress(Progress& progress, int elapsed) {
+    uint64_t now = now_ns();
+    double seconds = progress.last_ns ? (now - progress.last_ns) / 1e9 : 1;
+    progress.last_ns = now;
+
+    ostringstream line;
+    line << "[" << setw(4) << elapsed << "s]" << fixed << setprecision(1);
+    auto column = [&](const char* name, const LatencyHistogram& histogram, LatencySnapshot& previous, bool show) {
+        histogram.snapshot(progress.current);
+        snapshot_delta(progress.current, previous, progress.delta);
+        previous = progress.current;
+        if (!show) return;
+        line << "  " << name << " " << setprecision(0) << progress.delta.count / seconds << "/s p99 "
+             << setprecision(1) << ms(progress.delta.percentile_ns(0.99)) << "ms";
+    };
+    for (int kind = OP_PRIVATE; kind < OP_COUNT; kind++) {
+        column(OP_NAMES[kind], op_stats[kind].latency, progress.previous[kind], config.rate[kind] > 0);
+    }
+    column("deliv-private", delivery_private.latency, progress.previous[OP_COUNT], config.rate[OP_PRIVATE] > 0);
+    column("deliv-group", delivery_group.latency, progress.previous[OP_COUNT + 1], config.rate[OP_GROUP] > 0);
+    cout << line.str() << endl;
+}
+
+void print_latency_cells(const LatencySnapshot& snapshot) {
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (double q : quantiles) cout << setw(9) << ms(snapshot.percentile_ns(q));
+    cout << setw(9) << ms(snapshot.max_ns) << endl;
+}
+
+void print_report(double run_seconds) {
+    LatencySnapshot snapshot;
+    cout << endl << "== Kết quả: " << fixed << setprecision(1) << run_seconds << " s, "
+         << logins_ok << "/" << all_clients.size() << " user đăng nhập, " << disconnects << " mất kết nối ==" << endl;
+    cout << left << setw(16) << "request" << right << setw(10) << "sent" << setw(10) << "ok" << setw(8) << "error"
+         << setw(9) << "no-reply" << setw(8) << "skipped" << setw(9) << "ok/s"
+         << setw(9) << "p50" << setw(9) << "p90" << setw(9) << "p99" << setw(9) << "p99.9" << setw(9) << "max"
+         << "  (ms)" << endl;
+    for (int kind = 0; kind < OP_COUNT; kind++) {
+        OpStats& stats = op_stats[kind];
+        if (stats.sent == 0 && stats.skipped == 0) continue;
+        stats.latency.snapshot(snapshot);
+        uint64_t answered = stats.ok + stats.errors;
+        uint64_t no_reply = stats.sent > answered ? stats.sent - answered : 0;
+        // Đăng nhập không nằm trong thời gian chạy tải nên không tính tốc độ
+        double rate = kind == OP_LOGIN ? 0 : stats.ok / run_seconds;
+        cout << left << setw(16) << OP_NAMES[kind] << right << setw(10) << stats.sent << setw(10) << stats.ok
+             << setw(8) << stats.errors << setw(9) << no_reply << setw(8) << stats.skipped
+             << setw(9) << setprecision(1) << rate << setprecision(2);
+        print_latency_cells(snapshot);
+    }
+    DeliveryStats* deliveries[] = { &delivery_private, &delivery_group };
+    const char* names[] = { "deliver-private", "deliver-group" };
+    for (int i = 0; i < 2; i++) {
+        if (deliveries[i]->count == 0) continue;
+        deliveries[i]->latency.snapshot(snapshot);
+        cout << left << setw(16) << names[i] << right << setw(10) << "" << setw(10) << deliveries[i]->count
+             << setw(8) << "" << setw(9) << "" << setw(8) << "" << setw(9) << setprecision(1)
+             << deliveries[i]->count / run_seconds << setprecision(2);
+        print_latency_cells(snapshot);
+    }
+}
+
+// ===== MAIN =====
+
+void usage() {
+    cout << "Cách dùng: ./loadgen [tùy chọn]\n"
+            "  --host HOST             server (mặc định 127.0.0.1)\n"
+            "  --port PORT             (mặc định 8888)\n"
+            "  --users N               số user user<start>..user<start+N-1> (mặc định 1000)\n"
+            "  --user-start I          số thứ tự user đầu tiên (mặc định 1)\n"
+            "  --user-prefix P         tiền tố tên user (mặc định user)\n"
+            "  --password P            mật khẩu chung (mặc định password)\n"
+            "  --users-file FILE       lấy user từ file \"username password\" mỗi dòng (bỏ qua --users)\n"
+            "  --register              đăng ký user trước khi đăng nhập (user đã có thì bỏ qua)\n"
+            "  --threads N             worker thread (mặc định 4)\n"
+            "  --connect-rate R        kết nối mới mỗi giây lúc đăng nhập (mặc định 500)\n"
+            "  --groups N              số nhóm tạo cho loadgen, user chia đều vào các nhóm (mặc định 10, 0 = không)\n"
+            "  --mix K=R,...           request mỗi giây theo loại: private, group, history, search, file\n"
+            "                          (mặc định private=200,group=20,history=20,search=5,file=1)\n"
+            "  --duration S            giây chạy tải (mặc định 60)\n"
+            "  --message-bytes N       độ dài tin nhắn (mặc định 64)\n"
+            "  --history-limit N       số tin mỗi trang lịch sử (mặc định 20)\n"
+            "  --file-kb N             cỡ file upload (mặc định 64)\n"
+            "  --seed N                hạt giống ngẫu nhiên (mặc định 1)\n"
+            "  --drain S               giây chờ phản hồi còn thiếu sau khi ngừng gửi (mặc định 3)\n"
+            "Vào nhóm gửi thông báo cho mọi thành viên: N user trong một nhóm tốn O(N^2) thông báo lúc chuẩn bị.\n";
+}
+
+bool parse_mix(const string& mix) {
+    stringstream ss(mix);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos) return false;
+        string key = item.substr(0, eq);
+        int kind = -1;
+        for (int i = OP_PRIVATE; i < OP_COUNT; i++) {
+            if (key == OP_NAMES[i]) kind = i;
+        }
+        if (kind < 0) return false;
+        config.rate[kind] = atof(item.c_str() + eq + 1);
+    }
+    return true;
+}
+
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--help" || arg == "-h") return false;
+        if (arg == "--register") {
+            config.register_users = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cerr << "Thiếu giá trị cho " << arg << endl;
+            return false;
+        }
+        string value = argv[++i];
+        if (arg == "--host") config.host = value;
+        else if (arg == "--port") config.port = atoi(value.c_str());
+        else if (arg == "--users") config.users = atoi(value.c_str());
+        else if (arg == "--user-start") config.user_start = atoi(value.c_str());
+        else if (arg == "--user-prefix") config.user_prefix = value;
+        else if (arg == "--password") config.password = value;
+        else if (arg == "--users-file") config.users_file = value;
+        else if (arg == "--threads") config.threads = atoi(value.c_str());
+        else if (arg == "--connect-rate") config.connect_rate = atof(value.c_str());
+        else if (arg == "--groups") config.groups = atoi(value.c_str());
+        else if (arg == "--duration") config.duration = atoi(value.c_str());
+        else if (arg == "--message-bytes") config.message_bytes = atoi(value.c_str());
+        else if (arg == "--history-limit") config.history_limit = atoi(value.c_str());
+        else if (arg == "--file-kb") config.file_kb = atoi(value.c_str());
+        else if (arg == "--seed") config.seed = strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--drain") config.drain = atoi(value.c_str());
+        else if (arg == "--mix") {
+            if (!parse_mix(value)) {
+                cerr << "--mix không hợp lệ: " << value << endl;
+                return false;
+            }
+        } else {
+            cerr << "Tùy chọn không rõ: " << arg << endl;
+            return false;
+        }
+    }
+    if (config.threads < 1 || config.connect_rate <= 0 || config.file_kb < 1 || config.groups < 0) {
+        cerr << "Giá trị tùy chọn không hợp lệ" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool load_users() {
+    if (config.users_file.empty()) {
+        for (int i = 0; i < config.users; i++) {
+            Client* c = new Client();
+            c->username = config.user_prefix + to_string(config.user_start + i);
+            c->password = config.password;
+            all_clients.push_back(c);
+        }
+    } else {
+        ifstream file(config.users_file);
+        if (!file) {
+            cerr << "Không mở được " << config.users_file << endl;
+            return false;
+        }
+        string line;
+        while (getline(file, line)) {
+            stringstream ss(line);
+            Client* c = new Client();
+            if (!(ss >> c->username >> c->password) || c->username[0] == '#') {
+                delete c;
+                continue;
+            }
+            all_clients.push_back(c);
+        }
+    }
+    for (size_t i = 0; i < all_clients.size(); i++) all_clients[i]->index = i;
+    return !all_clients.empty();
+}
+
+// Chờ tới khi done() đúng hoặc không có tiến triển trong stall_seconds giây
+template <typename Done, typename Count>
+void wait_phase(const char* label, Done done, Count count, int stall_seconds) {
+    int last = -1;
+    uint64_t last_change = now_ns();
+    uint64_t last_print = 0;
+    while (!done()) {
+        usleep(100000);
+        int current = count();
+        uint64_t now = now_ns();
+        if (current != last) {
+            last = current;
+            last_change = now;
+        }
+        if (now - last_print >= 1000000000ull) {
+            last_print = now;
+            cout << "  " << label << ": " << current << endl;
+        }
+        if (now - last_change > (uint64_t)stall_seconds * 1000000000ull) {
+            cout << "  " << label << ": không tiến triển trong " << stall_seconds << " s, tiếp tục" << endl;
+            return;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        usage();
+        return 1;
+    }
+    if (!load_users()) {
+        cerr << "Không có user nào" << endl;
+        return 1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host.c_str(), &server_addr.sin_addr) != 1) {
+        cerr << "Địa chỉ không hợp lệ: " << config.host << endl;
+        return 1;
+    }
+
+    // Mỗi user một socket
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < all_clients.size() + 64) {
+        cerr << "⚠ Giới hạn file descriptor (" << limit.rlim_cur << ") nhỏ hơn số user, tăng bằng ulimit -n" << endl;
+    }
+
+    int groups = min(config.groups, (int)all_clients.size());
+    group_ids = new atomic<int>[groups > 0 ? groups : 1];
+    for (int g = 0; g < groups; g++) group_ids[g] = 0;
+    for (Client* c : all_clients) {
+        if (groups == 0) break;
+        c->group_slot = c->index % groups;
+        c->group_creator = c->index < groups;
+    }
+
+    vector<Worker*> workers;
+    mt19937_64 file_rng(config.seed);
+    for (int i = 0; i < config.threads; i++) {
+        Worker* w = new Worker();
+        w->id = i;
+        w->epoll_fd = epoll_create1(0);
+        w->rng.seed(config.seed * 1000003 + i);
+        w->file_data.resize((size_t)config.file_kb * 1024);
+        for (char& byte : w->file_data) byte = (char)(file_rng() & 0xFF);
+        workers.push_back(w);
+    }
+    for (Client* c : all_clients) workers[c->index % config.threads]->clients.push_back(c);
+
+    cout << "loadgen: " << all_clients.size() << " user, " << config.threads << " thread, " << groups << " nhóm, "
+         << config.host << ":" << config.port << endl;
+    for (Worker* w : workers) pthread_create(&w->thread, nullptr, worker_main, w);
+
+    // Đăng nhập
+    int total = all_clients.size();
+    wait_phase("đăng nhập xong", [&] { return logins_done >= total; }, [&] { return logins_done.load(); }, 30);
+    cout << "Đăng nhập: " << logins_ok << "/" << total << " thành công" << endl;
+    if (logins_ok == 0) {
+        phase = PHASE_STOP;
+        for (Worker* w : workers) pthread_join(w->thread, nullptr);
+        return 1;
+    }
+
+    // Tạo nhóm, các user còn lại vào nhóm
+    int setup_phases[] = { PHASE_GROUP_CREATE, PHASE_GROUP_JOIN };
+    const char* setup_labels[] = { "tạo nhóm", "vào nhóm" };
+    for (int i = 0; i < 2 && groups > 0; i++) {
+        setup_workers = 0;
+        setup_sent = 0;
+        setup_done = 0;
+        phase = setup_phases[i];
+        wait_phase(setup_labels[i],
+                   [&] { return setup_workers >= config.threads && setup_done >= setup_sent; },
+                   [&] { return setup_done.load(); }, 30);
+        cout << "Đã " << setup_labels[i] << ": " << setup_done << "/" << setup_sent << endl;
+    }
+
+    // Chạy tải
+    cout << "Chạy tải " << config.duration << " s" << endl;
+    Progress progress;
+    for (int kind = 0; kind < OP_COUNT; kind++) op_stats[kind].latency.snapshot(progress.previous[kind]);
+    delivery_private.latency.snapshot(progress.previous[OP_COUNT]);
+    delivery_group.latency.snapshot(progress.previous[OP_COUNT + 1]);
+    progress.last_ns = now_ns();
+    uint64_t run_start = progress.last_ns;
+    phase = PHASE_RUN;
+    for (int second = 1; second <= config.duration; second++) {
+        uint64_t wake = run_start + (uint64_t)second * 1000000000ull;
+        uint64_t now = now_ns();
+        if (wake > now) usleep((wake - now) / 1000);
+        print_progress(progress, second);
+    }
+    double run_seconds = (now_ns() - run_start) / 1e9;
+
+    // Ngừng gửi, chờ phản hồi / tin còn trên đường
+    phase = PHASE_DRAIN;
+    sleep(config.drain);
+    phase = PHASE_STOP;
+    for (Worker* w : workers) pthread_join(w->thread, nullptr);
+
+    print_report(run_seconds);
+    return 0;
+}
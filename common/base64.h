@@ -0,0 +1,240 @@
+/*
+ * BASE64 (RFC 4648, có padding '=')
+ *
+ * Dùng cho các đường truyền file kiểu cũ còn gửi nội dung file trong JSON
+ * ("file_data" của C_REQ_FILE_UPLOAD / S_RESP_FILE_OK). Mã hóa / giải mã
+ * thẳng vào buffer đã cấp phát sẵn (không push_back từng ký tự). CPU x86 có
+ * AVX2 xử lý 24 byte <-> 32 ký tự mỗi vòng, máy khác dùng bảng tra. Hai
+ * nhánh cho cùng kết quả.
+ *
+ * Giải mã dừng ở ký tự đầu tiên không thuộc bảng chữ base64 (padding '='
+ * hoặc ký tự lạ) và trả về số byte đã giải mã trước đó.
+ */
+
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BASE64_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define BASE64_ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+
+inline size_t base64_encoded_size(size_t len) {
+    return (len + 2) / 3 * 4;
+}
+
+// Cỡ tối đa của dữ liệu giải mã từ len ký tự (cấp phát buffer theo cỡ này)
+inline size_t base64_decoded_max_size(size_t len) {
+    return (len + 3) / 4 * 3;
+}
+
+// Ký tự -> giá trị 6 bit, 0xFF nếu không thuộc bảng chữ
+inline const unsigned char* base64_decode_table() {
+    struct Table {
+        unsigned char v[256];
+        Table() {
+            for (int i = 0; i < 256; i++) v[i] = 0xFF;
+            for (int i = 0; i < 64; i++) v[(unsigned char)BASE64_ALPHABET[i]] = (unsigned char)i;
+        }
+    };
+    static const Table table;
+    return table.v;
+}
+
+// ===== NHÁNH VÔ HƯỚNG =====
+
+inline size_t base64_encode_scalar(const unsigned char* in, size_t len, char* out) {
+    static const char chars[] = BASE64_ALPHABET;
+    char* start = out;
+    while (len >= 3) {
+        uint32_t v = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+        out[0] = chars[v >> 18];
+        out[1] = chars[(v >> 12) & 0x3F];
+        out[2] = chars[(v >> 6) & 0x3F];
+        out[3] = chars[v & 0x3F];
+        in += 3;
+        len -= 3;
+        out += 4;
+    }
+    if (len > 0) {
+        uint32_t v = (uint32_t)in[0] << 16;
+        if (len == 2) v |= (uint32_t)in[1] << 8;
+        out[0] = chars[v >> 18];
+        out[1] = chars[(v >> 12) & 0x3F];
+        out[2] = len == 2 ? chars[(v >> 6) & 0x3F] : '=';
+        out[3] = '=';
+        out += 4;
+    }
+    return out - start;
+}
+
+inline size_t base64_decode_scalar(const char* in, size_t len, unsigned char* out) {
+    const unsigned char* table = base64_decode_table();
+    const unsigned char* p = (const unsigned char*)in;
+    unsigned char* start = out;
+
+    // Nhóm 4 ký tự hợp lệ -> 3 byte
+    while (len >= 4) {
+        unsigned char a = table[p[0]], b = table[p[1]], c = table[p[2]], d = table[p[3]];
+        if ((a | b | c | d) & 0x80) break;
+        uint32_t v = ((uint32_t)a << 18) | ((uint32_t)b << 12) | ((uint32_t)c << 6) | d;
+        out[0] = (unsigned char)(v >> 16);
+        out[1] = (unsigned char)(v >> 8);
+        out[2] = (unsigned char)v;
+        p += 4;
+        len -= 4;
+        out += 3;
+    }
+
+    // Nhóm cuối (có padding / bị cắt / gặp ký tự lạ): giải mã từng ký tự
+    uint32_t val = 0;
+    int bits = 0;
+    while (len > 0 && table[*p] != 0xFF) {
+        val = (val << 6) | table[*p];
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            *out++ = (unsigned char)(val >> bits);
+        }
+        p++;
+        len--;
+    }
+    return out - start;
+}
+
+// ===== NHÁNH AVX2 =====
+// Thuật toán của Muła & Lemire ("Faster Base64 Encoding and Decoding Using
+// AVX2 Instructions"): tách 6 bit bằng nhân 16-bit, dịch sang ASCII bằng
+// bảng tra pshufb; khi giải mã, kiểm tra hợp lệ 32 ký tự một lần.
+
+#ifdef BASE64_HAVE_AVX2
+__attribute__((target("avx2")))
+inline size_t base64_encode_avx2(const unsigned char* in, size_t len, char* out) {
+    const __m256i shuffle = _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6, 4, 5);
+    const __m256i offsets = _mm256_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    char* start = out;
+
+    // Mỗi vòng dùng 24 byte nhưng đọc 28 byte (lane cao đọc in[12..27])
+    while (len >= 32) {
+        // Lane thấp: in[0..11] ở byte 4..15, lane cao: in[12..23] ở byte 0..11
+        __m128i lo = _mm_slli_si128(_mm_loadu_si128((const __m128i*)in), 4);
+        __m128i hi = _mm_loadu_si128((const __m128i*)(in + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+        // Mỗi 4 byte chứa 3 byte nguồn -> tách thành 4 giá trị 6 bit
+        v = _mm256_shuffle_epi8(v, shuffle);
+        __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0FC0FC00)),
+                                        _mm256_set1_epi32(0x04000040));
+        __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003F03F0)),
+                                        _mm256_set1_epi32(0x01000010));
+        v = _mm256_or_si256(t0, t1);
+
+        // 0..63 -> ASCII: cộng độ lệch theo khoảng (A-Z, a-z, 0-9, '+', '/')
+        __m256i index = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+        index = _mm256_sub_epi8(index, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+        v = _mm256_add_epi8(v, _mm256_shuffle_epi8(offsets, index));
+
+        _mm256_storeu_si256((__m256i*)out, v);
+        in += 24;
+        len -= 24;
+        out += 32;
+    }
+    return (out - start) + base64_encode_scalar(in, len, out);
+}
+
+__attribute__((target("avx2")))
+inline size_t base64_decode_avx2(const char* in, size_t len, unsigned char* out) {
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    unsigned char* start = out;
+
+    // Mỗi vòng ghi 32 byte (24 byte có nghĩa): còn >= 45 ký tự thì buffer
+    // cỡ base64_decoded_max_size chắc chắn còn đủ chỗ
+    while (len >= 45) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)in);
+
+        // Phân loại theo nibble cao / thấp: khác 0 -> có ký tự ngoài bảng chữ
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+        __m256i lo_nibbles = _mm256_and_si256(v, mask_2f);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) break;     // Phần còn lại để nhánh vô hướng xử lý
+
+        // ASCII -> 0..63
+        __m256i eq_2f = _mm256_cmpeq_epi8(v, mask_2f);
+        v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+        // Gộp 4 x 6 bit -> 3 byte, dồn 12 byte mỗi lane về đầu
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, pack);
+        v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+
+        _mm256_storeu_si256((__m256i*)out, v);
+        in += 32;
+        len -= 32;
+        out += 24;
+    }
+    return (out - start) + base64_decode_scalar(in, len, out);
+}
+
+inline bool base64_avx2_available() {
+    static const bool available = __builtin_cpu_supports("avx2");
+    return available;
+}
+#else
+inline bool base64_avx2_available() { return false; }
+#endif
+
+// ===== API =====
+
+// Ghi base64_encoded_size(len) ký tự vào out, trả về số ký tự đã ghi
+inline size_t base64_encode_to(const void* in, size_t len, char* out) {
+#ifdef BASE64_HAVE_AVX2
+    if (base64_avx2_available()) return base64_encode_avx2((const unsigned char*)in, len, out);
+#endif
+    return base64_encode_scalar((const unsigned char*)in, len, out);
+}
+
+// out cần ít nhất base64_decoded_max_size(len) byte, trả về số byte đã ghi
+inline size_t base64_decode_to(const char* in, size_t len, void* out) {
+#ifdef BASE64_HAVE_AVX2
+    if (base64_avx2_available()) return base64_decode_avx2(in, len, (unsigned char*)out);
+#endif
+    return base64_decode_scalar(in, len, (unsigned char*)out);
+}
+
+inline std::string base64_encode(const std::string& in) {
+    std::string out(base64_encoded_size(in.size()), '\0');
+    base64_encode_to(in.data(), in.size(), &out[0]);
+    return out;
+}
+
+inline std::string base64_decode(const std::string& in) {
+    std::string out(base64_decoded_max_size(in.size()), '\0');
+    out.resize(base64_decode_to(in.data(), in.size(), &out[0]));
+    return out;
+}
+
+#endif // BASE64_H
@@ -0,0 +1,132 @@
+/*
+ * NÉN FRAME (zlib / raw deflate)
+ *
+ * Body của frame v2 có thể được nén khi header có cờ WIRE_FLAG_COMPRESSED.
+ * Mỗi kết nối giữ một luồng deflate duy nhất cho chiều server -> client:
+ * các frame được nén nối tiếp với Z_SYNC_FLUSH nên frame sau dùng lại
+ * "từ điển" là các frame trước đó (cửa sổ 32KB) - JSON lặp khóa rất nhiều
+ * nên tỉ lệ nén cao hơn hẳn nén từng frame độc lập. Luồng được khởi tạo
+ * bằng một từ điển dựng sẵn gồm các khóa JSON hay gặp của protocol.
+ *
+ * Vì hai đầu dùng chung trạng thái luồng, các frame nén phải được giải nén
+ * đúng theo thứ tự đã nén (server nén trong lúc giữ khóa ghi của kết nối).
+ */
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <zlib.h>
+#include <string>
+#include <cstring>
+#include <cstddef>
+
+#define COMPRESS_ALGORITHM  "zlib"    // Giá trị "compress" trong body của C_REQ_LOGIN
+#define COMPRESS_MIN_SIZE   512       // Body nhỏ hơn thì gửi thẳng
+#define COMPRESS_LEVEL      6
+#define COMPRESS_WINDOW     15        // 32KB, raw deflate (không header zlib)
+
+// Từ điển khởi tạo - chuỗi hay gặp nhất đặt ở cuối (gần nhất với dữ liệu)
+static const char COMPRESS_DICTIONARY[] =
+    "\"error\":\"\"status\":\"file_data\":\"\",\"file_name\":\"\",\"file_size\":"
+    "\"members\":[{\"username\":\"\",\"role\":\"\"groups\":[{\"group_id\":\""
+    "\",\"group_name\":\"\",\"member_count\":\"\"users\":[{\"user_id\":\""
+    "\"friends\":[{\"username\":\"\",\"online\":false},{\"username\":\"\",\"online\":true}"
+    "{\"target_username\":\"\",\"my_username\":\"\",\"total_count\":\",\"offset\":"
+    "\"group_id\":\"\",\"messages\":[{\"message_id\":\",\"from_username\":\""
+    "\",\"message\":\"\",\"sent_at\":\"2025-\",\"is_read\":\"0\"},{\"message_id\":";
+
+// Nén liên tục các body gửi đi trên một kết nối
+class FrameDeflater {
+private:
+    z_stream strm;
+    bool ok;
+
+public:
+    FrameDeflater() {
+        memset(&strm, 0, sizeof(strm));
+        ok = deflateInit2(&strm, COMPRESS_LEVEL, Z_DEFLATED, -COMPRESS_WINDOW, 8,
+                          Z_DEFAULT_STRATEGY) == Z_OK;
+        if (ok) {
+            deflateSetDictionary(&strm, (const Bytef*)COMPRESS_DICTIONARY,
+                                 sizeof(COMPRESS_DICTIONARY) - 1);
+        }
+    }
+    ~FrameDeflater() {
+        if (ok) deflateEnd(&strm);
+    }
+    FrameDeflater(const FrameDeflater&) = delete;
+    FrameDeflater& operator=(const FrameDeflater&) = delete;
+
+    // Nén data thành một khối kết thúc bằng sync flush (giải nén được ngay)
+    bool compress(const char* data, size_t len, std::string& out) {
+        if (!ok) return false;
+        out.resize(deflateBound(&strm, len) + 16);
+        strm.next_in = (Bytef*)data;
+        strm.avail_in = len;
+        size_t produced = 0;
+        while (true) {
+            strm.next_out = (Bytef*)&out[produced];
+            strm.avail_out = out.size() - produced;
+            if (deflate(&strm, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+                ok = false;
+                return false;
+            }
+            produced = out.size() - strm.avail_out;
+            if (strm.avail_out != 0) break;
+            out.resize(out.size() * 2);
+        }
+        out.resize(produced);
+        return true;
+    }
+};
+
+// Giải nén các body nhận được, theo đúng thứ tự nhận
+class FrameInflater {
+private:
+    z_stream strm;
+    bool ok;
+
+public:
+    FrameInflater() {
+        memset(&strm, 0, sizeof(strm));
+        ok = inflateInit2(&strm, -COMPRESS_WINDOW) == Z_OK;
+        if (ok) {
+            ok = inflateSetDictionary(&strm, (const Bytef*)COMPRESS_DICTIONARY,
+                                      sizeof(COMPRESS_DICTIONARY) - 1) == Z_OK;
+        }
+    }
+    ~FrameInflater() {
+        inflateEnd(&strm);
+    }
+    FrameInflater(const FrameInflater&) = delete;
+    FrameInflater& operator=(const FrameInflater&) = delete;
+
+    // max_out chặn "bom nén"; trả về false nếu luồng hỏng (phải ngắt kết nối)
+    bool decompress(const char* data, size_t len, std::string& out, size_t max_out) {
+        if (!ok) return false;
+        out.resize(len * 4 + 256);
+        strm.next_in = (Bytef*)data;
+        strm.avail_in = len;
+        size_t produced = 0;
+        while (true) {
+            strm.next_out = (Bytef*)&out[produced];
+            strm.avail_out = out.size() - produced;
+            int ret = inflate(&strm, Z_SYNC_FLUSH);
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                ok = false;
+                return false;
+            }
+            produced = out.size() - strm.avail_out;
+            if (strm.avail_in == 0 && strm.avail_out != 0) break;
+            if (out.size() >= max_out) {
+                ok = false;
+                return false;
+            }
+            out.resize(out.size() * 2 > max_out ? max_out : out.size() * 2);
+        }
+        out.resize(produced);
+        return true;
+    }
+};
+
+#endif // COMPRESSION_H
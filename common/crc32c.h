@@ -0,0 +1,94 @@
+/*
+ * CRC32C (Castagnoli, đa thức 0x1EDC6F41)
+ *
+ * Kiểm tra toàn vẹn từng chunk khi truyền file: bên gửi kèm CRC32C của dữ
+ * liệu chunk, bên nhận tính lại và yêu cầu gửi lại riêng chunk bị hỏng.
+ * CPU x86 có SSE4.2 dùng lệnh crc32 (8 byte mỗi lệnh), máy khác dùng bảng
+ * tra 256 phần tử. Hai nhánh cho cùng kết quả.
+ *
+ * crc32c_update(0, a) rồi crc32c_update(crc, b) == crc32c của a nối b.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_HAVE_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+inline const uint32_t* crc32c_table() {
+    struct Table {
+        uint32_t v[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+                v[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    return table.v;
+}
+
+// Nhánh phần mềm (crc chưa đảo bit)
+inline uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len) {
+    const uint32_t* table = crc32c_table();
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// Nhánh SSE4.2: biên dịch riêng hàm này cho sse4.2, chỉ gọi khi CPU hỗ trợ
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        len -= 4;
+    }
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+inline bool crc32c_hw_available() {
+    static const bool available = __builtin_cpu_supports("sse4.2");
+    return available;
+}
+#else
+inline bool crc32c_hw_available() { return false; }
+#endif
+
+// Cộng dồn CRC32C của data vào crc (crc = 0 cho đoạn đầu tiên)
+inline uint32_t crc32c_update(uint32_t crc, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_hw_available()) return ~crc32c_hw(crc, p, len);
+#endif
+    return ~crc32c_sw(crc, p, len);
+}
+
+inline uint32_t crc32c(const void* data, size_t len) {
+    return crc32c_update(0, data, len);
+}
+
+#endif // CRC32C_H
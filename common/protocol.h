@@ -3,13 +3,24 @@
  * Nhóm 11 - Xây dựng ứng dụng Chat P2P
  * 
  * Kiến trúc: Client-Server
- * Cấu trúc gói tin: Header (20 bytes cố định) + Body (JSON string)
+ * Cấu trúc gói tin: Header + Body (JSON string)
  * 
- * Header Format:
- *   - command (4 bytes): ID lệnh
- *   - status (4 bytes): Mã trạng thái HTTP-like
- *   - timestamp (8 bytes): Thời gian gửi (Unix timestamp)
+ * Có 2 định dạng header, server nhận diện theo byte đầu tiên của kết nối:
+ * 
+ * v1 - PacketHeader (cũ, giữ để tương thích):
+ *   - command (int), status (int), timestamp (long), body_length (int)
+ *   - Byte order và padding theo máy biên dịch (24 bytes trên x86_64)
+ * 
+ * v2 - WireHeader (24 bytes cố định, little-endian):
+ *   - magic (1 byte): WIRE_MAGIC
+ *   - version (1 byte): WIRE_VERSION
+ *   - flags (2 bytes): WIRE_FLAG_*
+ *   - command (2 bytes): ID lệnh
+ *   - status (2 bytes): Mã trạng thái HTTP-like
+ *   - request_id (4 bytes): Do client đặt, server trả lại nguyên vẹn trong
+ *     phản hồi để client ghép cặp request/response (0 = không ghép cặp)
  *   - body_length (4 bytes): Độ dài phần Body
+ *   - timestamp (8 bytes): Thời gian gửi (Unix timestamp)
  * 
  * Body Format: JSON string
  */
@@ -19,6 +30,7 @@
 
 #include <cstring>
 #include <ctime>
+#include <cstdint>
 
 // ===== NHÓM XÁC THỰC (1xx) =====
 #define C_REQ_LOGIN         101   // Client yêu cầu đăng nhập
@@ -27,6 +39,8 @@
 #define S_RESP_REGISTER     104   // Server xác nhận đăng ký
 #define C_REQ_CHANGE_PASS   105   // Client yêu cầu đổi mật khẩu
 #define S_RESP_CHANGE_PASS  106   // Server phản hồi đổi mật khẩu
+#define C_REQ_ATTACH_CHANNEL  107 // Client mở kết nối phụ dành cho truyền file
+#define S_RESP_ATTACH_CHANNEL 108 // Server xác nhận kênh truyền file
 
 // ===== NHÓM TRẠNG THÁI (2xx) =====
 #define S_NOTIFY_FRIEND_ONLINE  201   // Server báo bạn bè online
@@ -94,11 +108,25 @@
 #define C_REQ_FILE_DOWNLOAD 606   // Client yêu cầu được tải file
 #define S_RESP_FILE_START   607   // Server đồng ý, báo Client chuẩn bị nhận file
 #define S_DATA_FILE_END     609   // Server báo đã gửi xong chunk cuối cùng
+#define C_REQ_FILE_RESEND   610   // Client xin gửi lại một chunk download bị sai CRC
+#define S_NOTIFY_FILE_NACK  611   // Server báo chunk upload sai CRC, client gửi lại từ offset
+#define C_REQ_FILE_LIST     612   // Client yêu cầu danh sách file trong một cuộc chat
+#define S_RESP_FILE_LIST    613   // Server trả về một trang danh sách file
 
 // ===== NHÓM GÓI TIN CÓ PHẦN BODY LÀ DỮ LIỆU NHỊ PHÂN (16xx) =====
 #define C_DATA_FILE_CHUNK   1603  // Client gửi một khối (chunk) của file
 #define S_DATA_FILE_CHUNK   1608  // Server gửi một khối (chunk) của file
 
+// ===== NHÓM LỆNH GỘP (10xx) =====
+// Body của C_REQ_BATCH là chuỗi các frame con (WireHeader v2 + body JSON) nối
+// liền nhau; server chạy lần lượt với chung một lần xác thực (user đã đăng
+// nhập trên kết nối) và trả về S_RESP_BATCH chứa chuỗi frame phản hồi con,
+// mỗi frame mang request_id của frame con tương ứng. Chỉ nhận truy vấn chỉ
+// đọc và C_REQ_MARK_MESSAGES_READ; lệnh khác bị trả STATUS_BAD_REQUEST.
+#define C_REQ_BATCH         1001  // Client gửi nhiều request trong một frame
+#define S_RESP_BATCH        1002  // Server trả về các phản hồi gộp
+#define MAX_BATCH_ITEMS     32    // Số request con tối đa trong một batch
+
 // ===== STATUS CODES (HTTP-like) =====
 #define STATUS_OK           200   // Thành công
 #define STATUS_CREATED      201   // Đã tạo thành công
@@ -109,7 +137,7 @@
 #define STATUS_CONFLICT     409   // Conflict (username/group đã tồn tại)
 #define STATUS_SERVER_ERROR 500   // Lỗi server
 
-// ===== PACKET HEADER (20 bytes cố định) =====
+// ===== PACKET HEADER v1 (layout phụ thuộc máy biên dịch) =====
 struct PacketHeader {
     int command;          // 4 bytes - ID lệnh
     int status;           // 4 bytes - Mã trạng thái
@@ -122,9 +150,94 @@ struct PacketHeader {
         : command(cmd), status(stat), timestamp(time(NULL)), body_length(0) {}
 };
 
+// ===== WIRE HEADER v2 (24 bytes cố định, little-endian) =====
+#define WIRE_MAGIC          0xC8  // Không trùng byte thấp của command id nào
+#define WIRE_VERSION        2
+#define WIRE_HEADER_SIZE    24
+
+// Cờ trong WireHeader.flags
+#define WIRE_FLAG_COMPRESSED 0x0001  // Body được nén (xem compression.h)
+
+struct WireHeader {
+    uint16_t flags;
+    uint16_t command;
+    uint16_t status;
+    uint32_t request_id;
+    uint32_t body_length;
+    int64_t timestamp;
+    
+    WireHeader() : flags(0), command(0), status(0), request_id(0), body_length(0), timestamp(0) {}
+    
+    WireHeader(int cmd, int stat = STATUS_OK, uint32_t req_id = 0)
+        : flags(0), command((uint16_t)cmd), status((uint16_t)stat), request_id(req_id),
+          body_length(0), timestamp(time(NULL)) {}
+};
+
+inline void wire_put_u16(unsigned char* p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+inline void wire_put_u32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+inline void wire_put_u64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+inline uint16_t wire_get_u16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+inline uint32_t wire_get_u32(const unsigned char* p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+inline uint64_t wire_get_u64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+// Ghi header vào out (đủ WIRE_HEADER_SIZE bytes)
+inline void encode_wire_header(const WireHeader& h, unsigned char* out) {
+    out[0] = WIRE_MAGIC;
+    out[1] = WIRE_VERSION;
+    wire_put_u16(out + 2, h.flags);
+    wire_put_u16(out + 4, h.command);
+    wire_put_u16(out + 6, h.status);
+    wire_put_u32(out + 8, h.request_id);
+    wire_put_u32(out + 12, h.body_length);
+    wire_put_u64(out + 16, (uint64_t)h.timestamp);
+}
+
+// Đọc header từ in, trả về false nếu sai magic/version
+inline bool decode_wire_header(const unsigned char* in, WireHeader& h) {
+    if (in[0] != WIRE_MAGIC || in[1] != WIRE_VERSION) return false;
+    h.flags = wire_get_u16(in + 2);
+    h.command = wire_get_u16(in + 4);
+    h.status = wire_get_u16(in + 6);
+    h.request_id = wire_get_u32(in + 8);
+    h.body_length = wire_get_u32(in + 12);
+    h.timestamp = (int64_t)wire_get_u64(in + 16);
+    return true;
+}
+
 // ===== CONSTANTS =====
 #define MAX_BODY_SIZE 65535   // 64KB max cho JSON body
-#define FILE_CHUNK_SIZE 4096  // 4KB per chunk cho file transfer
+#define MAX_LEGACY_FILE_SIZE (1024 * 1024)  // 1MB file gửi dạng base64 trong JSON (giới hạn của client cũ)
+#define MAX_FILE_BODY_SIZE ((MAX_LEGACY_FILE_SIZE + 2) / 3 * 4 + 16 * 1024)  // base64 + các trường JSON khác
+#define FILE_CHUNK_SIZE 32768  // 32KB dữ liệu mỗi chunk cho file transfer
+#define FILE_CHUNK_HEADER_SIZE 12  // u32 file_id + u64 offset (little-endian) đầu mỗi chunk
+#define FILE_CHUNK_CRC_SIZE 4      // u32 CRC32C sau offset khi transfer bật "checksum" (xem crc32c.h)
+#define FILE_CHECKSUM_CRC32C "crc32c"
+#define MAX_UPLOAD_SIZE (1024ULL * 1024 * 1024)  // 1GB cho upload theo chunk
+#define UPLOAD_RESUME_TTL 3600  // Giây giữ phiên upload dang dở sau khi rớt kết nối
+#define FILE_LIST_DEFAULT_LIMIT 50   // Số file mỗi trang C_REQ_FILE_LIST
+#define FILE_LIST_MAX_LIMIT 200
 
 // ===== JSON BODY EXAMPLES =====
 /*
@@ -151,6 +264,20 @@ S_RESP_REGISTER (104):
     "message": "Register OK"
 }
 
+C_REQ_ATTACH_CHANNEL (107):
+(gửi trên một kết nối TCP mới, header v2, sau khi đã đăng nhập ở kết nối chính)
+{
+    "token": "..."
+}
+
+S_RESP_ATTACH_CHANNEL (108):
+(200 OK) {
+    "channel": "bulk"
+}
+Kết nối này chỉ dùng cho 6xx/16xx (upload/download): không nhận thông báo,
+đóng kênh không làm user offline. File lớn truyền ở đây nên không chặn
+tin nhắn trên kết nối chính.
+
 S_NOTIFY_FRIEND_ONLINE (201):
 {
     "username": "u4"
@@ -250,22 +377,40 @@ S_NOTIFY_MSG_GROUP (508):
 C_REQ_FILE_UPLOAD (601):
 {
     "token": "...",
-    "group_id": "1",
-    "filename": "a.zip",
-    "filesize": 10240
+    "group_id": "1",              // hoặc "target_username": "u2"
+    "file_name": "a.zip",
+    "file_size": 10240,           // Không kèm "file_data" -> upload theo chunk
+    "file_hash": "9f86d0...",     // Tùy chọn: SHA-256 hex của nội dung
+    "checksum": "crc32c"          // Tùy chọn: mỗi chunk kèm CRC32C
+}
+User này đã từng gửi file cùng hash (và server còn giữ nội dung) -> trả ngay
+"File uploaded successfully" kèm "deduplicated": "1", không mở phiên (client
+không gửi chunk). Hash của người khác không đủ: vẫn phải gửi chunk. File được lưu
+theo nội dung, tên trong tin nhắn là "<sha256>_<tên gốc>".
+Tiếp tục upload sau khi rớt kết nối (đăng nhập lại cùng user):
+{
+    "token": "...",
+    "resume_file_id": 123,
+    "file_size": 10240
 }
 
 S_RESP_FILE_OK (602):
 (200 OK) {
     "file_id": 123,
-    "message": "Ready"
+    "chunk_size": 32768,
+    "offset": 65536,              // Chỉ khi resume: gửi tiếp chunk từ offset này
+    "checksum": "crc32c",         // Server chấp nhận CRC32C cho phiên này
+    "message": "Upload ready"
 }
+(404 NOT FOUND) phiên đã hết hạn / không tồn tại -> upload lại từ đầu
 
 C_DATA_FILE_END (604):
 {
     "token": "...",
     "file_id": 123
 }
+-> S_RESP_FILE_OK { "message": "File uploaded successfully", "file_name": "<sha256>_a.zip" }
+(400) "File hash mismatch" nếu nội dung nhận được khác "file_hash" đã khai báo
 
 S_NOTIFY_FILE_NEW (605):
 {
@@ -278,26 +423,87 @@ S_NOTIFY_FILE_NEW (605):
 C_REQ_FILE_DOWNLOAD (606):
 {
     "token": "...",
-    "file_id": 123
+    "file_name": "1700000000_a.zip",
+    "stream": "1",                // Chỉ client v2; thiếu -> một gói S_RESP_FILE_OK base64
+    "offset": 65536,              // Tùy chọn (chỉ với stream): tải tiếp từ byte này
+    "checksum": "crc32c"          // Tùy chọn (chỉ với stream): mỗi chunk kèm CRC32C
 }
 
 S_RESP_FILE_START (607):
 (200 OK) {
-    "filename": "a.zip",
-    "filesize": 10240
+    "file_id": 123,
+    "file_name": "1700000000_a.zip",
+    "file_size": 10240,
+    "chunk_size": 32768,
+    "offset": 0,                  // Byte đầu tiên sẽ được gửi
+    "checksum": "crc32c",         // Chỉ khi client yêu cầu: chunk có CRC32C
+    "file_crc32c": 3808858755     // CRC32C của cả file (nếu server biết)
 }
 
 S_DATA_FILE_END (609):
 {
     "file_id": 123,
+    "file_name": "1700000000_a.zip",
     "message": "Download complete"
 }
 
+C_REQ_FILE_RESEND (610):
+{
+    "token": "...",
+    "file_name": "1700000000_a.zip",
+    "file_id": 123,               // file_id trong S_RESP_FILE_START
+    "offset": 65536               // Chunk bị sai CRC
+}
+-> một S_DATA_FILE_CHUNK (kèm CRC32C) mang request_id của C_REQ_FILE_RESEND
+
+S_NOTIFY_FILE_NACK (611):
+{
+    "file_id": 123,
+    "offset": 65536               // Chunk sai CRC; server bỏ các chunk sau cho tới khi nhận lại chunk này
+}
+
+C_REQ_FILE_LIST (612):
+{
+    "token": "...",
+    "chat_type": "group",         // hoặc "private"
+    "target": "1",                // group_id hoặc username bên kia
+    "before_id": 120,             // Tùy chọn: trang tiếp theo (next_before_id của trang trước)
+    "limit": 50                   // Tùy chọn, tối đa FILE_LIST_MAX_LIMIT
+}
+
+S_RESP_FILE_LIST (613):
+(200 OK) {
+    "chat_type": "group",
+    "target": "1",
+    "files": [
+        {
+            "attachment_id": 119,
+            "message_id": 4521,
+            "from_username": "u1",
+            "file_name": "a.png",
+            "stored_name": "9f86d0..._a.png",   // Dùng làm "file_name" khi download
+            "file_size": 10240,
+            "hash": "9f86d0...",
+            "mime_type": "image/png",
+            "created_at": "2024-01-01 10:00:00"
+        }
+    ],
+    "next_before_id": 119         // "" khi đã hết
+}
+(403) không phải thành viên nhóm, (404) không có user / nhóm
+
+S_NOTIFY_MSG_PRIVATE / S_NOTIFY_MSG_GROUP / S_RESP_FILE_OK của tin nhắn file
+kèm "attachment_id".
+
 C_DATA_FILE_CHUNK (1603):
-[Dữ liệu nhị phân (vd: 4KB)]
+[u32 file_id][u64 offset][Dữ liệu nhị phân (tối đa FILE_CHUNK_SIZE)]
+[u32 file_id][u64 offset][u32 crc32c][Dữ liệu]   (phiên có "checksum": "crc32c")
+(gửi liên tục, offset tăng dần; server chỉ phản hồi S_RESP_FILE_OK khi lỗi)
 
 S_DATA_FILE_CHUNK (1608):
-[Dữ liệu nhị phân (vd: 4KB)]
+[u32 file_id][u64 offset][Dữ liệu nhị phân (tối đa FILE_CHUNK_SIZE)]
+[u32 file_id][u64 offset][u32 crc32c][Dữ liệu]   (download có "checksum": "crc32c")
+(cùng request_id với C_REQ_FILE_DOWNLOAD, theo thứ tự offset tăng dần)
 */
 
 #endif // PROTOCOL_H
@@ -7,11 +7,14 @@
 #include <sstream>
 #include <iomanip>
 #include <random>
+#include <algorithm>
+#include <cctype>
+#include <strings.h>
 
 DBManager::DBManager(const string& host, const string& user, 
                      const string& password, const string& database, int port)
     : conn(nullptr), host(host), user(user), password(password), 
-      database(database), port(port) {
+      database(database), port(port), pending(false), pending_op(nullptr) {
 }
 
 DBManager::~DBManager() {
@@ -28,14 +31,19 @@ bool DBManager::connect() {
     if (!mysql_real_connect(conn, host.c_str(), user.c_str(), 
                            password.c_str(), database.c_str(), 
                            port, nullptr, 0)) {
-        printError();
+        cerr << "❌ MySQL connect failed: " << mysql_error(conn) << endl;
         return false;
     }
     
     // Set UTF-8 encoding
     mysql_set_character_set(conn, "utf8mb4");
     
-    cout << "✓ Connected to MySQL database: " << database << endl;
+    // Server mở cả pool kết nối lúc khởi động - chỉ in một lần
+    static bool announced = false;
+    if (!announced) {
+        cout << "✓ Connected to MySQL database: " << database << endl;
+        announced = true;
+    }
     return true;
 }
 
@@ -51,11 +59,115 @@ bool DBManager::isConnected() {
 }
 
 void DBManager::printError() {
+    if (query_observer) return;     // finishQuery đã gửi lỗi kèm tên hàm cho observer
     if (conn) {
         cerr << "❌ MySQL Error: " << mysql_error(conn) << endl;
     }
 }
 
+// ===== QUERY PROFILING =====
+
+QueryObserver DBManager::query_observer = nullptr;
+uint64_t DBManager::slow_query_ns = 0;
+bool DBManager::explain_slow_queries = false;
+
+void DBManager::setQueryObserver(QueryObserver observer, uint64_t slow_ns, bool explain) {
+    query_observer = observer;
+    slow_query_ns = slow_ns;
+    explain_slow_queries = explain;
+}
+
+int DBManager::runQuery(const string& query, const char* op) {
+    if (pending) finishQuery(true, 0);     // SELECT trước đó không lấy kết quả
+    if (!query_observer) return mysql_query(conn, query.c_str());
+    
+    pending_start = chrono::steady_clock::now();
+    int err = mysql_query(conn, query.c_str());
+    pending = true;
+    pending_op = op;
+    pending_sql = query;
+    if (err) {
+        finishQuery(false, 0);
+    } else if (mysql_field_count(conn) == 0) {
+        finishQuery(true, mysql_affected_rows(conn));   // Không có tập kết quả
+    }
+    return err;
+}
+
+MYSQL_RES* DBManager::storeResult() {
+    MYSQL_RES* result = mysql_store_result(conn);
+    if (pending) finishQuery(result != nullptr, result ? mysql_num_rows(result) : 0);
+    return result;
+}
+
+void DBManager::finishQuery(bool ok, uint64_t rows) {
+    pending = false;
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - pending_start).count();
+    bool slow = slow_query_ns > 0 && ns >= slow_query_ns;
+    string explain;
+    if (slow && ok && explain_slow_queries && strncasecmp(pending_sql.c_str(), "SELECT", 6) == 0) {
+        explain = explainQuery(pending_sql);
+    }
+    QueryEvent event = { pending_op, pending_sql, ns, rows, ok, slow, explain,
+                         ok ? 0 : mysql_errno(conn), ok ? "" : mysql_error(conn) };
+    query_observer(event);
+}
+
+// Mỗi dòng của EXPLAIN thành "cột=giá trị ...", các dòng cách nhau bởi " | "
+string DBManager::explainQuery(const string& query) {
+    string explain_query = "EXPLAIN " + query;
+    if (mysql_query(conn, explain_query.c_str())) return "";
+    MYSQL_RES* result = mysql_store_result(conn);
+    if (!result) return "";
+    
+    unsigned int num_fields = mysql_num_fields(result);
+    MYSQL_FIELD* fields = mysql_fetch_fields(result);
+    string plan;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(result))) {
+        if (!plan.empty()) plan += " | ";
+        for (unsigned int i = 0; i < num_fields; i++) {
+            if (!row[i]) continue;     // Bỏ cột NULL cho gọn
+            if (plan.size() && plan.back() != ' ') plan += " ";
+            plan += string(fields[i].name) + "=" + row[i];
+        }
+    }
+    mysql_free_result(result);
+    return plan;
+}
+
+string DBManager::queryShape(const string& sql) {
+    string shape;
+    shape.reserve(sql.size());
+    size_t i = 0;
+    while (i < sql.size()) {
+        char c = sql[i];
+        if (c == '\'' || c == '"') {
+            // Chuỗi hằng (có thể chứa \x hoặc '' thoát)
+            i++;
+            while (i < sql.size()) {
+                if (sql[i] == '\\') i += 2;
+                else if (sql[i] == c && i + 1 < sql.size() && sql[i + 1] == c) i += 2;
+                else if (sql[i] == c) { i++; break; }
+                else i++;
+            }
+            shape += '?';
+        } else if (isdigit((unsigned char)c) && (shape.empty() || !(isalnum((unsigned char)shape.back()) || shape.back() == '_'))) {
+            // Số đứng riêng (không phải một phần tên cột như user_id1)
+            while (i < sql.size() && (isalnum((unsigned char)sql[i]) || sql[i] == '.')) i++;
+            shape += '?';
+        } else if (isspace((unsigned char)c)) {
+            while (i < sql.size() && isspace((unsigned char)sql[i])) i++;
+            if (!shape.empty() && shape.back() != ' ') shape += ' ';
+        } else {
+            shape += c;
+            i++;
+        }
+    }
+    if (!shape.empty() && shape.back() == ' ') shape.pop_back();
+    return shape;
+}
+
 string DBManager::escapeString(const string& str) {
     if (!conn) return str;
     
@@ -73,7 +185,7 @@ bool DBManager::createUser(const string& username, const string& password_hash)
                    escapeString(username) + "', '" + 
                    escapeString(password_hash) + "')";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -85,12 +197,12 @@ bool DBManager::verifyUser(const string& username, const string& password_hash)
                    escapeString(username) + "' AND password_hash='" +
                    escapeString(password_hash) + "'";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     bool exists = (mysql_num_rows(result) > 0);
     mysql_free_result(result);
     return exists;
@@ -100,12 +212,12 @@ int DBManager::getUserId(const string& username) {
     string query = "SELECT user_id FROM users WHERE username='" +
                    escapeString(username) + "'";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return -1;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     if (mysql_num_rows(result) == 0) {
         mysql_free_result(result);
         return -1;
@@ -120,12 +232,12 @@ int DBManager::getUserId(const string& username) {
 string DBManager::getUsername(int user_id) {
     string query = "SELECT username FROM users WHERE user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return "";
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     if (mysql_num_rows(result) == 0) {
         mysql_free_result(result);
         return "";
@@ -141,7 +253,7 @@ bool DBManager::setUserOnline(int user_id, bool is_online) {
     string query = "UPDATE users SET is_online=" + string(is_online ? "1" : "0") +
                    " WHERE user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -151,12 +263,12 @@ bool DBManager::setUserOnline(int user_id, bool is_online) {
 bool DBManager::isUserOnline(int user_id) {
     string query = "SELECT is_online FROM users WHERE user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
     
-    MYSQL_RES *result = mysql_store_result(conn);
+    MYSQL_RES *result = storeResult();
     if (!result) return false;
     
     MYSQL_ROW row = mysql_fetch_row(result);
@@ -167,7 +279,7 @@ bool DBManager::isUserOnline(int user_id) {
 
 void DBManager::resetAllUsersOffline() {
     string query = "UPDATE users SET is_online=0";
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
     }
 }
@@ -175,7 +287,7 @@ void DBManager::resetAllUsersOffline() {
 bool DBManager::updateLastLogin(int user_id) {
     string query = "UPDATE users SET last_login=NOW() WHERE user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -187,12 +299,12 @@ bool DBManager::changePassword(int user_id, const string& old_password, const st
     string verify_query = "SELECT user_id FROM users WHERE user_id=" + to_string(user_id) +
                          " AND password_hash='" + escapeString(old_password) + "'";
     
-    if (mysql_query(conn, verify_query.c_str())) {
+    if (runQuery(verify_query)) {
         printError();
         return false;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     if (mysql_num_rows(result) == 0) {
         mysql_free_result(result);
         return false;  // Old password is incorrect
@@ -203,7 +315,7 @@ bool DBManager::changePassword(int user_id, const string& old_password, const st
     string update_query = "UPDATE users SET password_hash='" + escapeString(new_password) +
                          "' WHERE user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, update_query.c_str())) {
+    if (runQuery(update_query)) {
         printError();
         return false;
     }
@@ -226,13 +338,13 @@ string DBManager::createSession(int user_id) {
     
     // Delete old sessions for this user
     string del_query = "DELETE FROM sessions WHERE user_id=" + to_string(user_id);
-    mysql_query(conn, del_query.c_str());
+    runQuery(del_query);
     
     // Create new session (expires in 24 hours)
     string query = "INSERT INTO sessions (user_id, token, expires_at) VALUES (" +
                    to_string(user_id) + ", '" + token + "', DATE_ADD(NOW(), INTERVAL 24 HOUR))";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return "";
     }
@@ -244,12 +356,12 @@ bool DBManager::verifyToken(const string& token, int& user_id) {
     string query = "SELECT user_id FROM sessions WHERE token='" +
                    escapeString(token) + "' AND expires_at > NOW()";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     if (mysql_num_rows(result) == 0) {
         mysql_free_result(result);
         return false;
@@ -264,7 +376,7 @@ bool DBManager::verifyToken(const string& token, int& user_id) {
 bool DBManager::deleteSession(const string& token) {
     string query = "DELETE FROM sessions WHERE token='" + escapeString(token) + "'";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -272,7 +384,7 @@ bool DBManager::deleteSession(const string& token) {
 }
 
 void DBManager::cleanExpiredSessions() {
-    mysql_query(conn, "DELETE FROM sessions WHERE expires_at < NOW()");
+    runQuery("DELETE FROM sessions WHERE expires_at < NOW()");
 }
 
 // ===== FRIENDSHIP OPERATIONS =====
@@ -286,7 +398,7 @@ bool DBManager::sendFriendRequest(int requester_id, int target_user_id) {
                    to_string(user_id1) + ", " + to_string(user_id2) + ", " +
                    to_string(requester_id) + ", 'pending')";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -300,7 +412,7 @@ bool DBManager::acceptFriendRequest(int user_id1, int user_id2) {
     string query = "UPDATE friendships SET status='accepted' WHERE user_id1=" +
                    to_string(uid1) + " AND user_id2=" + to_string(uid2);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -314,7 +426,7 @@ bool DBManager::rejectFriendRequest(int user_id1, int user_id2) {
     string query = "DELETE FROM friendships WHERE user_id1=" +
                    to_string(uid1) + " AND user_id2=" + to_string(uid2);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -332,12 +444,12 @@ vector<string> DBManager::getFriends(int user_id) {
                    "WHERE f.user_id2 = " + to_string(user_id) + " AND f.status = 'accepted'";
     
     vector<string> friends;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return friends;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         friends.push_back(row[0]);
@@ -357,12 +469,12 @@ vector<string> DBManager::getOnlineFriends(int user_id) {
                    "AND (CASE WHEN f.user_id1=" + to_string(user_id) + " THEN u2.is_online ELSE u1.is_online END)=1";
     
     vector<string> friends;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return friends;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         friends.push_back(row[0]);
@@ -379,12 +491,12 @@ vector<string> DBManager::getPendingFriendRequests(int user_id) {
                    "AND f.status='pending'";
     
     vector<string> requests;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return requests;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         requests.push_back(row[0]);
@@ -400,12 +512,12 @@ bool DBManager::areFriends(int user_id1, int user_id2) {
     string query = "SELECT 1 FROM friendships WHERE user_id1=" + to_string(uid1) +
                    " AND user_id2=" + to_string(uid2) + " AND status='accepted'";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     bool friends = (mysql_num_rows(result) > 0);
     mysql_free_result(result);
     return friends;
@@ -417,7 +529,7 @@ int DBManager::createGroup(const string& group_name, int creator_id) {
     string query = "INSERT INTO `groups` (group_name, creator_id) VALUES ('" +
                    escapeString(group_name) + "', " + to_string(creator_id) + ")";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return -1;
     }
@@ -434,7 +546,7 @@ bool DBManager::addGroupMember(int group_id, int user_id, const string& role) {
     string query = "INSERT INTO group_members (group_id, user_id, role) VALUES (" +
                    to_string(group_id) + ", " + to_string(user_id) + ", '" + role + "')";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -445,7 +557,7 @@ bool DBManager::removeGroupMember(int group_id, int user_id) {
     string query = "DELETE FROM group_members WHERE group_id=" + to_string(group_id) +
                    " AND user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -455,15 +567,15 @@ bool DBManager::removeGroupMember(int group_id, int user_id) {
 bool DBManager::deleteGroup(int group_id) {
     // Xóa tất cả members trước (nếu còn)
     string query1 = "DELETE FROM group_members WHERE group_id=" + to_string(group_id);
-    mysql_query(conn, query1.c_str());
+    runQuery(query1);
     
     // Xóa tin nhắn trong nhóm
     string query2 = "DELETE FROM group_messages WHERE group_id=" + to_string(group_id);
-    mysql_query(conn, query2.c_str());
+    runQuery(query2);
     
     // Xóa nhóm
     string query3 = "DELETE FROM `groups` WHERE group_id=" + to_string(group_id);
-    if (mysql_query(conn, query3.c_str())) {
+    if (runQuery(query3)) {
         printError();
         return false;
     }
@@ -474,12 +586,12 @@ bool DBManager::isGroupMember(int group_id, int user_id) {
     string query = "SELECT 1 FROM group_members WHERE group_id=" + to_string(group_id) +
                    " AND user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     bool is_member = (mysql_num_rows(result) > 0);
     mysql_free_result(result);
     return is_member;
@@ -489,12 +601,12 @@ vector<int> DBManager::getGroupMembers(int group_id) {
     string query = "SELECT user_id FROM group_members WHERE group_id=" + to_string(group_id);
     
     vector<int> members;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return members;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         members.push_back(atoi(row[0]));
@@ -509,12 +621,12 @@ vector<map<string, string>> DBManager::getUserGroups(int user_id) {
                    "WHERE gm.user_id=" + to_string(user_id);
     
     vector<map<string, string>> groups;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return groups;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         map<string, string> group;
@@ -529,12 +641,12 @@ vector<map<string, string>> DBManager::getUserGroups(int user_id) {
 string DBManager::getGroupName(int group_id) {
     string query = "SELECT group_name FROM `groups` WHERE group_id=" + to_string(group_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return "";
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     if (mysql_num_rows(result) == 0) {
         mysql_free_result(result);
         return "";
@@ -553,7 +665,7 @@ int DBManager::savePrivateMessage(int from_user_id, int to_user_id, const string
                    to_string(from_user_id) + ", " + to_string(to_user_id) + ", '" +
                    escapeString(message) + "')";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return -1;
     }
@@ -565,7 +677,7 @@ int DBManager::saveGroupMessage(int group_id, int from_user_id, const string& me
                    to_string(group_id) + ", " + to_string(from_user_id) + ", '" +
                    escapeString(message) + "')";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return -1;
     }
@@ -581,12 +693,12 @@ vector<map<string, string>> DBManager::getPrivateMessages(int user_id1, int user
                    "ORDER BY m.sent_at DESC LIMIT " + to_string(limit) + " OFFSET " + to_string(offset);
     
     vector<map<string, string>> messages;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return messages;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         map<string, string> msg;
@@ -606,12 +718,12 @@ int DBManager::getPrivateMessageCount(int user_id1, int user_id2) {
                    "WHERE (from_user_id=" + to_string(user_id1) + " AND to_user_id=" + to_string(user_id2) + ") "
                    "OR (from_user_id=" + to_string(user_id2) + " AND to_user_id=" + to_string(user_id1) + ")";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return 0;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row = mysql_fetch_row(result);
     int count = row ? atoi(row[0]) : 0;
     mysql_free_result(result);
@@ -626,12 +738,12 @@ vector<map<string, string>> DBManager::getGroupMessages(int group_id, int limit,
                    "ORDER BY m.sent_at DESC LIMIT " + to_string(limit) + " OFFSET " + to_string(offset);
     
     vector<map<string, string>> messages;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return messages;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         map<string, string> msg;
@@ -648,12 +760,12 @@ vector<map<string, string>> DBManager::getGroupMessages(int group_id, int limit,
 int DBManager::getGroupMessageCount(int group_id) {
     string query = "SELECT COUNT(*) FROM group_messages WHERE group_id=" + to_string(group_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return 0;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row = mysql_fetch_row(result);
     int count = row ? atoi(row[0]) : 0;
     mysql_free_result(result);
@@ -663,7 +775,7 @@ int DBManager::getGroupMessageCount(int group_id) {
 bool DBManager::markMessageAsRead(int message_id) {
     string query = "UPDATE private_messages SET is_read=1 WHERE message_id=" + to_string(message_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -676,7 +788,7 @@ bool DBManager::markAllMessagesAsRead(int from_user_id, int to_user_id) {
                    to_string(from_user_id) + " AND to_user_id=" + to_string(to_user_id) + 
                    " AND is_read=0";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -688,12 +800,12 @@ vector<int> DBManager::getUnreadMessageSenders(int user_id) {
     string query = "SELECT DISTINCT from_user_id FROM private_messages WHERE to_user_id=" + 
                    to_string(user_id) + " AND is_read=0";
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return senders;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         senders.push_back(atoi(row[0]));
@@ -710,12 +822,12 @@ vector<map<string, string>> DBManager::getAllGroups() {
                    "FROM `groups` g ORDER BY group_name";
     
     vector<map<string, string>> groups;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return groups;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         map<string, string> group;
@@ -733,12 +845,12 @@ vector<map<string, string>> DBManager::getAllUsers() {
     string query = "SELECT user_id, username, is_online FROM users ORDER BY username";
     
     vector<map<string, string>> users;
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return users;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         map<string, string> user;
@@ -758,7 +870,7 @@ bool DBManager::deletePrivateMessage(int message_id, int user_id) {
     string query = "DELETE FROM private_messages WHERE message_id=" + to_string(message_id) + 
                    " AND from_user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -770,7 +882,7 @@ bool DBManager::deleteGroupMessage(int message_id, int user_id) {
     string query = "DELETE FROM group_messages WHERE message_id=" + to_string(message_id) + 
                    " AND from_user_id=" + to_string(user_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return false;
     }
@@ -780,12 +892,12 @@ bool DBManager::deleteGroupMessage(int message_id, int user_id) {
 int DBManager::getPrivateMessageSender(int message_id) {
     string query = "SELECT from_user_id FROM private_messages WHERE message_id=" + to_string(message_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return -1;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row = mysql_fetch_row(result);
     int sender_id = row ? atoi(row[0]) : -1;
     mysql_free_result(result);
@@ -795,12 +907,12 @@ int DBManager::getPrivateMessageSender(int message_id) {
 int DBManager::getGroupMessageSender(int message_id) {
     string query = "SELECT from_user_id FROM group_messages WHERE message_id=" + to_string(message_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return -1;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row = mysql_fetch_row(result);
     int sender_id = row ? atoi(row[0]) : -1;
     mysql_free_result(result);
@@ -810,12 +922,12 @@ int DBManager::getGroupMessageSender(int message_id) {
 int DBManager::getPrivateMessageReceiver(int message_id) {
     string query = "SELECT to_user_id FROM private_messages WHERE message_id=" + to_string(message_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return -1;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row = mysql_fetch_row(result);
     int receiver_id = row ? atoi(row[0]) : -1;
     mysql_free_result(result);
@@ -825,18 +937,225 @@ int DBManager::getPrivateMessageReceiver(int message_id) {
 int DBManager::getGroupIdFromMessage(int message_id) {
     string query = "SELECT group_id FROM group_messages WHERE message_id=" + to_string(message_id);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return -1;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row = mysql_fetch_row(result);
     int group_id = row ? atoi(row[0]) : -1;
     mysql_free_result(result);
     return group_id;
 }
 
+string DBManager::getPrivateMessageText(int message_id) {
+    string query = "SELECT message_text FROM private_messages WHERE message_id=" + to_string(message_id);
+    
+    if (runQuery(query)) {
+        printError();
+        return "";
+    }
+    
+    MYSQL_RES* result = storeResult();
+    MYSQL_ROW row = mysql_fetch_row(result);
+    string text = (row && row[0]) ? row[0] : "";
+    mysql_free_result(result);
+    return text;
+}
+
+string DBManager::getGroupMessageText(int message_id) {
+    string query = "SELECT message_text FROM group_messages WHERE message_id=" + to_string(message_id);
+    
+    if (runQuery(query)) {
+        printError();
+        return "";
+    }
+    
+    MYSQL_RES* result = storeResult();
+    MYSQL_ROW row = mysql_fetch_row(result);
+    string text = (row && row[0]) ? row[0] : "";
+    mysql_free_result(result);
+    return text;
+}
+
+vector<string> DBManager::getGroupFileMessages(int group_id) {
+    string query = "SELECT message_text FROM group_messages WHERE group_id=" + to_string(group_id) +
+                   " AND message_text LIKE '[FILE:%'";
+    
+    vector<string> texts;
+    if (runQuery(query)) {
+        printError();
+        return texts;
+    }
+    
+    MYSQL_RES* result = storeResult();
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(result))) {
+        if (row[0]) texts.push_back(row[0]);
+    }
+    mysql_free_result(result);
+    return texts;
+}
+
+bool DBManager::addFileBlobRef(const string& hash, long long file_size, long long crc32c) {
+    string crc = crc32c >= 0 ? to_string(crc32c) : "NULL";
+    string query = "INSERT INTO file_blobs (hash, file_size, crc32c, ref_count) VALUES ('" +
+                   escapeString(hash) + "', " + to_string(file_size) + ", " + crc + ", 1) "
+                   "ON DUPLICATE KEY UPDATE ref_count=ref_count+1, crc32c=COALESCE(crc32c, VALUES(crc32c))";
+    
+    if (runQuery(query)) {
+        printError();
+        return false;
+    }
+    return true;
+}
+
+long long DBManager::getFileBlobCrc32c(const string& hash) {
+    string query = "SELECT crc32c FROM file_blobs WHERE hash='" + escapeString(hash) + "'";
+    
+    if (runQuery(query)) {
+        printError();
+        return -1;
+    }
+    
+    MYSQL_RES* result = storeResult();
+    MYSQL_ROW row = mysql_fetch_row(result);
+    long long crc32c = (row && row[0]) ? atoll(row[0]) : -1;
+    mysql_free_result(result);
+    return crc32c;
+}
+
+int DBManager::saveAttachment(const string& chat_type, int message_id, int group_id, int from_user_id, int to_user_id,
+                              const string& file_name, const string& stored_name, long long file_size,
+                              const string& hash, const string& mime_type, const string& storage_path) {
+    bool group = chat_type == "group";
+    // Chat 1-1 lưu cặp (user nhỏ, user lớn) để hai chiều dùng chung index
+    string conversation = group
+        ? to_string(group_id) + ", NULL, NULL"
+        : "NULL, " + to_string(min(from_user_id, to_user_id)) + ", " + to_string(max(from_user_id, to_user_id));
+    string query = "INSERT INTO attachments (chat_type, message_id, group_id, user_lo, user_hi, uploader_id, "
+                   "file_name, stored_name, file_size, hash, mime_type, storage_path) VALUES ('" +
+                   string(group ? "group" : "private") + "', " + to_string(message_id) + ", " + conversation + ", " +
+                   to_string(from_user_id) + ", '" + escapeString(file_name) + "', '" + escapeString(stored_name) + "', " +
+                   to_string(file_size) + ", " + (hash.empty() ? string("NULL") : "'" + escapeString(hash) + "'") + ", '" +
+                   escapeString(mime_type) + "', '" + escapeString(storage_path) + "')";
+    
+    if (runQuery(query)) {
+        printError();
+        return -1;
+    }
+    return (int)mysql_insert_id(conn);
+}
+
+bool DBManager::deleteMessageAttachments(const string& chat_type, int message_id) {
+    string query = "DELETE FROM attachments WHERE chat_type='" + string(chat_type == "group" ? "group" : "private") +
+                   "' AND message_id=" + to_string(message_id);
+    
+    if (runQuery(query)) {
+        printError();
+        return false;
+    }
+    return true;
+}
+
+#define ATTACHMENT_COLUMNS "a.attachment_id, a.message_id, u.username, a.file_name, a.stored_name, " \
+                           "a.file_size, a.hash, a.mime_type, a.created_at "
+
+// Đọc các dòng attachment (cột theo thứ tự ATTACHMENT_COLUMNS)
+vector<map<string, string>> DBManager::fetchAttachments(const string& query, const char* op) {
+    vector<map<string, string>> files;
+    if (runQuery(query, op)) {
+        printError();
+        return files;
+    }
+    
+    MYSQL_RES* result = storeResult();
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(result))) {
+        map<string, string> file;
+        file["attachment_id"] = row[0];
+        file["message_id"] = row[1];
+        file["from_username"] = row[2];
+        file["file_name"] = row[3];
+        file["stored_name"] = row[4];
+        file["file_size"] = row[5];
+        file["hash"] = row[6] ? row[6] : "";
+        file["mime_type"] = row[7];
+        file["created_at"] = row[8];
+        files.push_back(file);
+    }
+    mysql_free_result(result);
+    return files;
+}
+
+vector<map<string, string>> DBManager::getGroupAttachments(int group_id, int before_id, int limit) {
+    // Dùng index (group_id, attachment_id): phân trang theo khóa, không OFFSET
+    string query = "SELECT " ATTACHMENT_COLUMNS
+                   "FROM attachments a JOIN users u ON a.uploader_id=u.user_id "
+                   "WHERE a.group_id=" + to_string(group_id) +
+                   (before_id > 0 ? " AND a.attachment_id<" + to_string(before_id) : string()) +
+                   " ORDER BY a.attachment_id DESC LIMIT " + to_string(limit);
+    return fetchAttachments(query);
+}
+
+vector<map<string, string>> DBManager::getPrivateAttachments(int user_id1, int user_id2, int before_id, int limit) {
+    // Dùng index (user_lo, user_hi, attachment_id)
+    string query = "SELECT " ATTACHMENT_COLUMNS
+                   "FROM attachments a JOIN users u ON a.uploader_id=u.user_id "
+                   "WHERE a.user_lo=" + to_string(min(user_id1, user_id2)) +
+                   " AND a.user_hi=" + to_string(max(user_id1, user_id2)) +
+                   (before_id > 0 ? " AND a.attachment_id<" + to_string(before_id) : string()) +
+                   " ORDER BY a.attachment_id DESC LIMIT " + to_string(limit);
+    return fetchAttachments(query);
+}
+
+int DBManager::releaseFileBlobRef(const string& hash) {
+    string escaped_hash = escapeString(hash);
+    string query = "UPDATE file_blobs SET ref_count=ref_count-1 WHERE hash='" + escaped_hash +
+                   "' AND ref_count>0";
+    
+    if (runQuery(query)) {
+        printError();
+        return -1;
+    }
+    
+    query = "SELECT ref_count FROM file_blobs WHERE hash='" + escaped_hash + "'";
+    if (runQuery(query)) {
+        printError();
+        return -1;
+    }
+    
+    MYSQL_RES* result = storeResult();
+    MYSQL_ROW row = mysql_fetch_row(result);
+    int ref_count = row ? atoi(row[0]) : 0;
+    mysql_free_result(result);
+    
+    // Không còn tin nhắn nào tham chiếu -> xóa bản ghi, server xóa file blob
+    if (ref_count == 0) {
+        query = "DELETE FROM file_blobs WHERE hash='" + escaped_hash + "'";
+        if (runQuery(query)) {
+            printError();
+        }
+    }
+    return ref_count;
+}
+
+bool DBManager::hasUploadedBlob(int user_id, const string& hash) {
+    string query = "SELECT 1 FROM attachments WHERE uploader_id=" + to_string(user_id) +
+                   " AND hash='" + escapeString(hash) + "' LIMIT 1";
+    
+    if (runQuery(query)) {
+        printError();
+        return false;
+    }
+    
+    MYSQL_RES* result = storeResult();
+    bool uploaded = (mysql_num_rows(result) > 0);
+    mysql_free_result(result);
+    return uploaded;
+}
+
 vector<map<string, string>> DBManager::searchPrivateMessages(int user_id1, int user_id2, const string& keyword, int limit) {
     vector<map<string, string>> messages;
     string escaped_keyword = escapeString(keyword);
@@ -849,12 +1168,12 @@ vector<map<string, string>> DBManager::searchPrivateMessages(int user_id1, int u
                    "AND pm.message_text LIKE '%" + escaped_keyword + "%' "
                    "ORDER BY pm.sent_at DESC LIMIT " + to_string(limit);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return messages;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         map<string, string> msg;
@@ -880,12 +1199,12 @@ vector<map<string, string>> DBManager::searchGroupMessages(int group_id, const s
                    "AND gm.message_text LIKE '%" + escaped_keyword + "%' "
                    "ORDER BY gm.sent_at DESC LIMIT " + to_string(limit);
     
-    if (mysql_query(conn, query.c_str())) {
+    if (runQuery(query)) {
         printError();
         return messages;
     }
     
-    MYSQL_RES* result = mysql_store_result(conn);
+    MYSQL_RES* result = storeResult();
     MYSQL_ROW row;
     while ((row = mysql_fetch_row(result))) {
         map<string, string> msg;
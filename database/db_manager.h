@@ -10,10 +10,27 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
 
 using namespace std;
 
+// Số liệu một câu lệnh SQL, gửi cho QueryObserver khi câu lệnh chạy xong
+struct QueryEvent {
+    const char* op;             // Hàm DBManager đã chạy câu lệnh (getUserId, ...)
+    const string& sql;
+    uint64_t duration_ns;       // Với SELECT gồm cả lấy kết quả (mysql_store_result)
+    uint64_t rows;              // Số dòng trả về / bị ảnh hưởng
+    bool ok;
+    bool slow;                  // Chạy lâu hơn ngưỡng đặt trong setQueryObserver
+    const string& explain;      // Kết quả EXPLAIN của câu SELECT chậm ("" nếu không lấy)
+    unsigned int error_code;    // mysql_errno khi lỗi (0 nếu ok)
+    const char* error;          // mysql_error khi lỗi ("" nếu ok)
+};
+
+typedef void (*QueryObserver)(const QueryEvent& event);
+
 class DBManager {
 private:
     MYSQL* conn;
@@ -23,6 +40,25 @@ private:
     string database;
     int port;
     
+    // Câu SELECT đang chờ mysql_store_result để đo xong
+    bool pending;
+    const char* pending_op;
+    string pending_sql;
+    chrono::steady_clock::time_point pending_start;
+    
+    static QueryObserver query_observer;
+    static uint64_t slow_query_ns;
+    static bool explain_slow_queries;
+    
+    // Mọi câu lệnh đi qua runQuery / storeResult (cùng kết quả như mysql_query /
+    // mysql_store_result) để được đo theo tên hàm gọi
+    int runQuery(const string& query, const char* op = __builtin_FUNCTION());
+    MYSQL_RES* storeResult();
+    void finishQuery(bool ok, uint64_t rows);
+    string explainQuery(const string& query);
+    
+    vector<map<string, string>> fetchAttachments(const string& query, const char* op = __builtin_FUNCTION());
+    
 public:
     DBManager(const string& host = "localhost", 
               const string& user = "root",
@@ -93,14 +129,38 @@ public:
     int getGroupMessageSender(int message_id);               // Lấy ID người gửi tin nhắn group
     int getPrivateMessageReceiver(int message_id);           // Lấy ID người nhận tin nhắn private
     int getGroupIdFromMessage(int message_id);               // Lấy group_id từ message_id
+    string getPrivateMessageText(int message_id);            // Nội dung tin nhắn private ("" nếu không có)
+    string getGroupMessageText(int message_id);              // Nội dung tin nhắn group ("" nếu không có)
+    vector<string> getGroupFileMessages(int group_id);       // Nội dung các tin [FILE:...] của nhóm
+    
+    // File blob operations - file upload lưu một lần theo SHA-256, đếm số tin nhắn tham chiếu
+    bool addFileBlobRef(const string& hash, long long file_size, long long crc32c = -1);  // Tạo blob hoặc tăng ref_count (crc32c -1 = chưa biết)
+    long long getFileBlobCrc32c(const string& hash);                // CRC32C cả file, -1 nếu chưa biết
+    
+    // Attachment operations - mỗi tin nhắn [FILE:...] có một bản ghi trong attachments
+    // chat_type "group": group_id, to_user_id bỏ qua; "private": group_id bỏ qua
+    int saveAttachment(const string& chat_type, int message_id, int group_id, int from_user_id, int to_user_id,
+                       const string& file_name, const string& stored_name, long long file_size,
+                       const string& hash, const string& mime_type, const string& storage_path);  // attachment_id, -1 nếu lỗi
+    bool deleteMessageAttachments(const string& chat_type, int message_id);
+    // File trong cuộc chat, mới nhất trước; before_id > 0 -> chỉ lấy attachment_id < before_id
+    vector<map<string, string>> getGroupAttachments(int group_id, int before_id, int limit);
+    vector<map<string, string>> getPrivateAttachments(int user_id1, int user_id2, int before_id, int limit);
+    int releaseFileBlobRef(const string& hash);                     // Giảm ref_count, trả về số ref còn lại (-1 nếu lỗi)
+    bool hasUploadedBlob(int user_id, const string& hash);          // User từng gửi file có nội dung này
     
     // Search message operations
     vector<map<string, string>> searchPrivateMessages(int user_id1, int user_id2, const string& keyword, int limit = 100);
     vector<map<string, string>> searchGroupMessages(int group_id, const string& keyword, int limit = 100);
     
+    // Query profiling - đặt trước khi mở kết nối; slow_ns = 0 tắt đánh dấu câu chậm,
+    // explain = chạy EXPLAIN cho câu SELECT chậm
+    static void setQueryObserver(QueryObserver observer, uint64_t slow_ns, bool explain);
+    static string queryShape(const string& sql);    // Thay giá trị hằng bằng '?' (không lộ dữ liệu khi ghi log)
+    
     // Utility
     string escapeString(const string& str);
-    void printError();
+    void printError();      // Lỗi đã báo qua QueryObserver thì không in lại
 };
 
 #endif // DB_MANAGER_H
@@ -122,6 +122,89 @@ CREATE TABLE IF NOT EXISTS sessions (
     INDEX idx_user (user_id)
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
 
+-- =============================================
+-- TABLE: file_blobs
+-- File upload lưu một lần theo nội dung (uploads/blobs/<hash>),
+-- ref_count = số tin nhắn [FILE:...] đang tham chiếu
+-- =============================================
+CREATE TABLE IF NOT EXISTS file_blobs (
+    hash CHAR(64) PRIMARY KEY,      -- SHA-256 dạng hex
+    file_size BIGINT NOT NULL,
+    crc32c INT UNSIGNED NULL,       -- CRC32C cả file (NULL với blob tạo trước khi có CRC)
+    ref_count INT NOT NULL DEFAULT 0,
+    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+
+-- =============================================
+-- TABLE: attachments
+-- Mỗi tin nhắn [FILE:...] có một bản ghi: liệt kê file của một cuộc chat
+-- theo index, không phải quét nội dung tin nhắn.
+-- Chat nhóm dùng group_id, chat 1-1 dùng cặp (user_lo, user_hi) = (id nhỏ, id lớn)
+-- =============================================
+CREATE TABLE IF NOT EXISTS attachments (
+    attachment_id INT AUTO_INCREMENT PRIMARY KEY,
+    chat_type ENUM('private', 'group') NOT NULL,
+    message_id INT NOT NULL,        -- private_messages / group_messages theo chat_type
+    group_id INT NULL,
+    user_lo INT NULL,
+    user_hi INT NULL,
+    uploader_id INT NOT NULL,
+    file_name VARCHAR(255) NOT NULL,            -- Tên gốc
+    stored_name VARCHAR(330) NOT NULL,          -- Tên trong [FILE:...], dùng để download
+    file_size BIGINT NOT NULL DEFAULT 0,
+    hash CHAR(64) NULL,                         -- SHA-256 (NULL với file kiểu cũ)
+    mime_type VARCHAR(100) NOT NULL DEFAULT 'application/octet-stream',
+    storage_path VARCHAR(512) NOT NULL,         -- Đường dẫn trên server
+    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+    FOREIGN KEY (group_id) REFERENCES `groups`(group_id) ON DELETE CASCADE,
+    FOREIGN KEY (uploader_id) REFERENCES users(user_id) ON DELETE CASCADE,
+    INDEX idx_group_files (group_id, attachment_id),
+    INDEX idx_private_files (user_lo, user_hi, attachment_id),
+    INDEX idx_message (chat_type, message_id),
+    INDEX idx_uploader_hash (uploader_id, hash)  -- Bỏ qua truyền khi user gửi lại file của chính mình
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+
+-- Tạo bản ghi cho các tin nhắn [FILE:<tên lưu>]<tên gốc> có từ trước
+-- (chạy lại nhiều lần không tạo trùng)
+INSERT INTO attachments (chat_type, message_id, group_id, uploader_id, file_name, stored_name,
+                         file_size, hash, storage_path)
+SELECT 'group', m.message_id, m.group_id, m.from_user_id,
+       SUBSTRING(m.message_text, LOCATE(']', m.message_text) + 1),
+       SUBSTRING(m.message_text, 7, LOCATE(']', m.message_text) - 7),
+       COALESCE(b.file_size, 0), b.hash,
+       IF(b.hash IS NULL,
+          CONCAT('uploads/', SUBSTRING(m.message_text, 7, LOCATE(']', m.message_text) - 7)),
+          CONCAT('uploads/blobs/', b.hash))
+FROM group_messages m
+LEFT JOIN file_blobs b ON SUBSTRING(m.message_text, 71, 1) = '_' AND b.hash = SUBSTRING(m.message_text, 7, 64)
+WHERE m.message_text LIKE '[FILE:%]%'
+  AND NOT EXISTS (SELECT 1 FROM attachments a WHERE a.chat_type = 'group' AND a.message_id = m.message_id);
+
+INSERT INTO attachments (chat_type, message_id, user_lo, user_hi, uploader_id, file_name, stored_name,
+                         file_size, hash, storage_path)
+SELECT 'private', m.message_id, LEAST(m.from_user_id, m.to_user_id), GREATEST(m.from_user_id, m.to_user_id),
+       m.from_user_id,
+       SUBSTRING(m.message_text, LOCATE(']', m.message_text) + 1),
+       SUBSTRING(m.message_text, 7, LOCATE(']', m.message_text) - 7),
+       COALESCE(b.file_size, 0), b.hash,
+       IF(b.hash IS NULL,
+          CONCAT('uploads/', SUBSTRING(m.message_text, 7, LOCATE(']', m.message_text) - 7)),
+          CONCAT('uploads/blobs/', b.hash))
+FROM private_messages m
+LEFT JOIN file_blobs b ON SUBSTRING(m.message_text, 71, 1) = '_' AND b.hash = SUBSTRING(m.message_text, 7, 64)
+WHERE m.message_text LIKE '[FILE:%]%'
+  AND NOT EXISTS (SELECT 1 FROM attachments a WHERE a.chat_type = 'private' AND a.message_id = m.message_id);
+
+-- storage_path theo layout shard: uploads/blobs/ab/cd/<hash> và
+-- uploads/files/ab/cd/<tên lưu> (ab, cd = 4 ký tự đầu của SHA-256 tên lưu).
+-- Server tự dời file trên đĩa khi khởi động; ở đây chỉ sửa các bản ghi cũ.
+UPDATE attachments
+SET storage_path = IF(hash IS NULL,
+    CONCAT('uploads/files/', LEFT(SHA2(stored_name, 256), 2), '/', SUBSTRING(SHA2(stored_name, 256), 3, 2), '/', stored_name),
+    CONCAT('uploads/blobs/', LEFT(hash, 2), '/', SUBSTRING(hash, 3, 2), '/', hash))
+WHERE storage_path NOT LIKE 'uploads/blobs/__/__/%'
+  AND storage_path NOT LIKE 'uploads/files/__/__/%';
+
 -- =============================================
 -- INSERT SAMPLE DATA
 -- Tạo một vài users mẫu
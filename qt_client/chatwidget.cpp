@@ -236,7 +236,7 @@ ChatWidget::ChatWidget(NetworkClient *client, const QString &username, QWidget *
     connect(m_client, &NetworkClient::privateChatHistoryReceived, this, &ChatWidget::onPrivateChatHistoryReceived);
     connect(m_client, &NetworkClient::groupChatHistoryReceived, this, &ChatWidget::onGroupChatHistoryReceived);
     connect(m_client, &NetworkClient::messagesReadNotification, this, &ChatWidget::onMessagesReadNotification);
-    connect(m_client, &NetworkClient::fileDownloadReceived, this, &ChatWidget::onFileDownloadReceived);
+    connect(m_client, &NetworkClient::fileDownloadFinished, this, &ChatWidget::onFileDownloadFinished);
     connect(m_client, &NetworkClient::deleteMessageResponse, this, &ChatWidget::onDeleteMessageResponse);
     connect(m_client, &NetworkClient::messageDeleted, this, &ChatWidget::onMessageDeleted);
     connect(m_client, &NetworkClient::privateMessageSent, this, &ChatWidget::onPrivateMessageSent);
@@ -247,9 +247,11 @@ ChatWidget::ChatWidget(NetworkClient *client, const QString &username, QWidget *
     m_currentOffset = 0;
     m_totalMessageCount = 0;
     
-    // Initial data load
+    // Initial data load (một round trip)
+    m_client->beginBatch();
     m_client->sendFriendList();
     m_client->sendGroupList();
+    m_client->endBatch();
 }
 
 QString ChatWidget::formatFileSize(qint64 bytes)
@@ -874,10 +876,12 @@ void ChatWidget::onFriendSelected(QListWidgetItem *item)
         m_seenStatusLabel->setVisible(false);
     }
     
+    m_client->beginBatch();
     m_client->sendChatHistoryPrivate(username, 0, 10);
     
     // Mark messages from this user as read
     m_client->sendMarkMessagesRead(username);
+    m_client->endBatch();
 }
 
 void ChatWidget::onGroupSelected(QListWidgetItem *item)
@@ -909,11 +913,13 @@ void ChatWidget::onGroupSelected(QListWidgetItem *item)
         m_currentOffset = 0;
         m_totalMessageCount = 0;
         m_loadMoreBtn->setVisible(false);
+        m_currentGroupMembers.clear();
+        m_client->beginBatch();
         m_client->sendChatHistoryGroup(m_currentTarget, 0, 10);
         
         // Request group members để cập nhật m_currentGroupMembers cho tính năng invite
-        m_currentGroupMembers.clear();
         m_client->sendGroupMembers(m_currentTarget);
+        m_client->endBatch();
     }
 }
 
@@ -1018,25 +1024,18 @@ void ChatWidget::onAttachFile()
     QFileInfo fileInfo(filePath);
     qint64 fileSize = fileInfo.size();
     
-    // Limit file size to 1MB (base64 encoded will be ~1.33MB)
-    if (fileSize > 1024 * 1024) {
-        QMessageBox::warning(this, "Lỗi", "File quá lớn! Giới hạn 1MB");
+    if ((quint64)fileSize > MAX_UPLOAD_SIZE) {
+        QMessageBox::warning(this, "Lỗi", "File quá lớn! Giới hạn 1GB");
         return;
     }
     
-    // Read file content
-    QFile file(filePath);
-    if (!file.open(QIODevice::ReadOnly)) {
+    if (!fileInfo.isReadable()) {
         QMessageBox::warning(this, "Lỗi", "Không thể đọc file");
         return;
     }
     
-    QByteArray fileData = file.readAll();
-    file.close();
-    
-    // Send file upload request
-    m_client->sendFileUpload(m_currentTarget, m_isChatWithGroup, 
-                             fileInfo.fileName(), fileSize, fileData);
+    // Send file upload request (file được stream theo chunk từ đĩa)
+    m_client->sendFileUpload(m_currentTarget, m_isChatWithGroup, filePath);
     
     // Show uploading message
     QString displayMsg = QString("📎 Đang gửi file: %1 (%2)...")
@@ -1047,22 +1046,8 @@ void ChatWidget::onAttachFile()
 
 void ChatWidget::downloadFile(const QString &fileName)
 {
-    m_downloadPath = QFileDialog::getExistingDirectory(this, "Chọn thư mục để lưu file");
-    if (m_downloadPath.isEmpty()) return;
-    
-    // Request file from server
-    m_client->sendFileDownload(fileName);
-    
-    QMessageBox::information(this, "Download", 
-        QString("Đang tải file %1...\nFile sẽ được lưu vào: %2").arg(fileName, m_downloadPath));
-}
-
-void ChatWidget::onFileDownloadReceived(const QString &fileName, const QByteArray &fileData, qint64 fileSize)
-{
-    if (m_downloadPath.isEmpty()) {
-        qDebug() << "Download path not set";
-        return;
-    }
+    QString downloadDir = QFileDialog::getExistingDirectory(this, "Chọn thư mục để lưu file");
+    if (downloadDir.isEmpty()) return;
     
     // Extract original filename from server filename (remove timestamp prefix)
     QString originalName = fileName;
@@ -1071,27 +1056,23 @@ void ChatWidget::onFileDownloadReceived(const QString &fileName, const QByteArra
         originalName = fileName.mid(underscorePos + 1);
     }
     
-    QString fullPath = m_downloadPath + "/" + originalName;
+    // Request file from server - dữ liệu được ghi dần xuống đĩa khi nhận
+    m_client->sendFileDownload(fileName, downloadDir + "/" + originalName);
     
-    QFile file(fullPath);
-    if (!file.open(QIODevice::WriteOnly)) {
-        QMessageBox::warning(this, "Lỗi", "Không thể lưu file: " + fullPath);
-        return;
-    }
-    
-    qint64 written = file.write(fileData);
-    file.close();
-    
-    if (written == fileSize) {
+    QMessageBox::information(this, "Download", 
+        QString("Đang tải file %1...\nFile sẽ được lưu vào: %2").arg(fileName, downloadDir));
+}
+
+void ChatWidget::onFileDownloadFinished(const QString &fileName, const QString &savePath, bool success)
+{
+    if (success) {
         QMessageBox::information(this, "Thành công", 
-            QString("Đã tải file thành công!\nLưu tại: %1").arg(fullPath));
-        qDebug() << "File saved successfully:" << fullPath;
+            QString("Đã tải file thành công!\nLưu tại: %1").arg(savePath));
+        qDebug() << "File saved successfully:" << savePath;
     } else {
-        QMessageBox::warning(this, "Lỗi", "Lưu file không hoàn chỉnh");
-        qDebug() << "File save incomplete:" << written << "of" << fileSize;
+        QMessageBox::warning(this, "Lỗi", "Không thể tải file: " + fileName);
+        qDebug() << "File download failed:" << fileName;
     }
-    
-    m_downloadPath.clear(); // Reset for next download
 }
 
 void ChatWidget::onAllGroupsReceived(const QList<QPair<QString, QString>> &groups)
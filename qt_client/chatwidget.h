@@ -109,7 +109,7 @@ private slots:
     
     // Read status slot
     void onMessagesReadNotification(const QString &readerUsername);
-    void onFileDownloadReceived(const QString &fileName, const QByteArray &fileData, qint64 fileSize);
+    void onFileDownloadFinished(const QString &fileName, const QString &savePath, bool success);
     
     // Delete message slots
     void onDeleteMessageRequested(int messageId);
@@ -176,9 +176,6 @@ private:
     // Track last message for "seen" status per user
     QMap<QString, bool> m_messageSeenStatus;  // target -> whether they've seen our last message
     
-    // File download path
-    QString m_downloadPath;
-    
     // Track last sent message bubble (for updating message_id)
     MessageBubble *m_lastSentBubble;
     
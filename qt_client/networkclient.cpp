@@ -1,5 +1,6 @@
 #include "networkclient.h"
 #include "chatwidget.h"
+#include "crc32c.h"
 #include <QDataStream>
 #include <QDebug>
 #include <QDialog>
@@ -7,25 +8,60 @@
 #include <QHBoxLayout>
 #include <QListWidget>
 #include <QPushButton>
+#include <QFileInfo>
+#include <QCryptographicHash>
+#include <QTimer>
 
-NetworkClient::NetworkClient(QObject *parent) : QObject(parent)
+// Chỉ đọc thêm chunk từ đĩa khi buffer ghi của socket xuống dưới ngưỡng này
+#define UPLOAD_WRITE_WATERMARK (1024 * 1024)
+// Số byte băm SHA-256 mỗi vòng event loop trước khi upload
+#define UPLOAD_HASH_BLOCK (1024 * 1024)
+// Số chunk sai CRC tối đa xin gửi lại cho một lượt tải trước khi bỏ cuộc
+#define DOWNLOAD_MAX_RESENDS 16
+
+NetworkClient::NetworkClient(QObject *parent) : QObject(parent), m_nextRequestId(1),
+      m_inflater(new FrameInflater()), m_batching(false), m_uploadHash(QCryptographicHash::Sha256),
+      m_loggedIn(false)
 {
     m_socket = new QTcpSocket(this);
+    m_port = 0;
     
     connect(m_socket, &QTcpSocket::connected, this, &NetworkClient::onConnected);
     connect(m_socket, &QTcpSocket::disconnected, this, &NetworkClient::onDisconnected);
     connect(m_socket, &QTcpSocket::readyRead, this, &NetworkClient::onReadyRead);
     connect(m_socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::errorOccurred),
             this, &NetworkClient::onError);
+    
+    m_bulkSocket = new QTcpSocket(this);
+    m_bulkState = BulkClosed;
+    
+    connect(m_bulkSocket, &QTcpSocket::connected, this, &NetworkClient::onBulkConnected);
+    connect(m_bulkSocket, &QTcpSocket::readyRead, this, &NetworkClient::onBulkReadyRead);
+    connect(m_bulkSocket, &QTcpSocket::bytesWritten, this, &NetworkClient::onBytesWritten);
+    connect(m_bulkSocket, &QTcpSocket::stateChanged, this, &NetworkClient::onBulkStateChanged);
+    
+    m_hashTimer = new QTimer(this);
+    m_hashTimer->setSingleShot(true);
+    connect(m_hashTimer, &QTimer::timeout, this, &NetworkClient::hashUploads);
 }
 
 NetworkClient::~NetworkClient()
 {
     disconnectFromServer();
+    clearUploads();
+    for (Download *download : m_downloads) {
+        download->file->close();
+        download->file->remove();
+        delete download->file;
+        delete download;
+    }
+    delete m_inflater;
 }
 
 bool NetworkClient::connectToServer(const QString &host, int port)
 {
+    m_host = host;
+    m_port = port;
     m_socket->connectToHost(host, port);
     return m_socket->waitForConnected(5000);
 }
@@ -44,14 +80,97 @@ bool NetworkClient::isConnected() const
 
 void NetworkClient::onConnected()
 {
+    // Kết nối mới -> luồng nén mới ở server
+    delete m_inflater;
+    m_inflater = new FrameInflater();
     emit connected();
 }
 
 void NetworkClient::onDisconnected()
 {
+    m_buffer.clear();
+    m_pendingRequests.clear();
+    m_loggedIn = false;
+    
+    // Kênh truyền file dùng phiên của kết nối chính -> đóng theo; các transfer
+    // dang dở được giữ lại và tiếp tục sau khi đăng nhập lại
+    m_bulkSocket->abort();
     emit disconnected();
 }
 
+// ===== KÊNH TRUYỀN FILE =====
+
+bool NetworkClient::isBulkCommand(int command)
+{
+    return command == C_REQ_ATTACH_CHANNEL || command == C_REQ_FILE_UPLOAD ||
+           command == C_DATA_FILE_CHUNK || command == C_DATA_FILE_END ||
+           command == C_REQ_FILE_DOWNLOAD || command == C_REQ_FILE_RESEND;
+}
+
+// Mở kênh truyền file nếu chưa có (chỉ khi đã đăng nhập và có transfer chờ)
+void NetworkClient::ensureBulkChannel()
+{
+    if (m_bulkState != BulkClosed || !m_loggedIn) return;
+    if (m_uploads.isEmpty() && m_downloads.isEmpty()) return;
+    if (m_bulkSocket->state() != QAbstractSocket::UnconnectedState) return;  // Đang đóng, sẽ mở lại sau
+    
+    m_bulkState = BulkConnecting;
+    m_bulkSocket->connectToHost(m_host, m_port);
+}
+
+void NetworkClient::onBulkConnected()
+{
+    QMap<QString, QString> body;
+    body["token"] = m_token;
+    sendPacket(C_REQ_ATTACH_CHANNEL, body);
+}
+
+void NetworkClient::onBulkReadyRead()
+{
+    m_bulkBuffer.append(m_bulkSocket->readAll());
+    processFrames(m_bulkSocket, m_bulkBuffer, nullptr);  // Server không nén kênh này
+}
+
+void NetworkClient::onBulkStateChanged(QAbstractSocket::SocketState state)
+{
+    if (state != QAbstractSocket::UnconnectedState) return;
+    
+    bool wasOpen = m_bulkState != BulkClosed;
+    m_bulkBuffer.clear();
+    m_bulkState = BulkClosed;
+    suspendTransfers();
+    
+    // Kênh rớt khi còn transfer -> thử mở lại (kết nối chính vẫn đăng nhập)
+    if (wasOpen && m_loggedIn && (!m_uploads.isEmpty() || !m_downloads.isEmpty())) {
+        qDebug() << "Bulk channel lost, reconnecting:" << m_bulkSocket->errorString();
+        QTimer::singleShot(1000, this, &NetworkClient::ensureBulkChannel);
+    } else if (!wasOpen) {
+        // Kênh vừa đóng chủ động trong lúc có transfer mới xếp hàng
+        ensureBulkChannel();
+    }
+}
+
+// Hết upload/download -> đóng kênh truyền file
+void NetworkClient::closeBulkIfIdle()
+{
+    if (!m_uploads.isEmpty() || !m_downloads.isEmpty() || m_bulkState == BulkClosed) return;
+    m_bulkState = BulkClosed;
+    m_bulkSocket->disconnectFromHost();
+}
+
+// Các request đang chờ trên kênh cũ sẽ không có phản hồi -> gửi lại khi kênh mới sẵn sàng
+void NetworkClient::suspendTransfers()
+{
+    for (Upload *upload : m_uploads) {
+        upload->requestId = 0;
+        upload->resuming = false;
+    }
+    for (Download *download : m_downloads) {
+        download->requestId = 0;
+        download->fileId = 0;
+    }
+}
+
 void NetworkClient::onError(QAbstractSocket::SocketError error)
 {
     Q_UNUSED(error);
@@ -114,44 +233,188 @@ QMap<QString, QString> NetworkClient::parseJson(const QString &json)
     return result;
 }
 
-void NetworkClient::sendPacket(int command, const QMap<QString, QString> &body)
+// Đọc mảng object phẳng "key":[{...},{...}] (chuỗi có thể chứa , } ] và ký tự escape).
+// Trả về vị trí ngay sau ']' hoặc -1 nếu không có mảng.
+int NetworkClient::parseJsonObjectArray(const QString &json, const QString &key,
+                                        QList<QMap<QString, QString>> &objects)
+{
+    int pos = json.indexOf("\"" + key + "\":[");
+    if (pos == -1) return -1;
+    pos += key.length() + 4;
+    
+    QMap<QString, QString> object;
+    QString field, value;
+    QString *target = &field;
+    bool inString = false, inObject = false;
+    for (; pos < json.length(); pos++) {
+        QChar c = json[pos];
+        if (inString) {
+            if (c == '\\' && pos + 1 < json.length()) {
+                QChar next = json[++pos];
+                if (next == 'n') target->append('\n');
+                else if (next == 't') target->append('\t');
+                else if (next == 'r') target->append('\r');
+                else if (next == 'u' && pos + 4 < json.length()) {
+                    target->append(QChar(json.mid(pos + 1, 4).toUShort(nullptr, 16)));
+                    pos += 4;
+                } else target->append(next);
+            } else if (c == '"') {
+                inString = false;
+            } else {
+                target->append(c);
+            }
+            continue;
+        }
+        if (c == '"') {
+            inString = true;
+        } else if (c == '{') {
+            object.clear();
+            inObject = true;
+        } else if (c == ':') {
+            target = &value;
+        } else if (c == ',' || c == '}') {
+            if (inObject && !field.isEmpty()) object[field] = value;
+            field.clear();
+            value.clear();
+            target = &field;
+            if (c == '}') {
+                objects.append(object);
+                inObject = false;
+            }
+        } else if (c == ']' && !inObject) {
+            return pos + 1;
+        } else if (inObject && !c.isSpace()) {
+            target->append(c);      // Số / true / false
+        }
+    }
+    return -1;
+}
+
+quint32 NetworkClient::sendPacket(int command, const QMap<QString, QString> &body)
 {
-    QString jsonStr = buildJson(body);
-    QByteArray jsonBytes = jsonStr.toUtf8();
+    QMap<QString, QString> payload = body;
+    if (m_batching && !isBulkCommand(command)) {
+        payload.remove("token");  // Batch dùng phiên của kết nối, không cần token từng lệnh
+    }
+    return sendRaw(command, buildJson(payload).toUtf8());
+}
+
+quint32 NetworkClient::sendRaw(int command, const QByteArray &payload)
+{
+    quint32 requestId = m_nextRequestId++;
+    if (m_nextRequestId == 0) m_nextRequestId = 1;
     
-    PacketHeader header;
-    header.command = command;
-    header.status = STATUS_OK;
-    header.timestamp = time(nullptr);
-    header.body_length = jsonBytes.size();
+    WireHeader header(command, STATUS_OK, requestId);
+    header.body_length = payload.size();
+    
+    unsigned char wire[WIRE_HEADER_SIZE];
+    encode_wire_header(header, wire);
+    
+    // Server có thể trả lời không theo thứ tự gửi -> ghép phản hồi bằng request_id
+    m_pendingRequests.insert(requestId, command);
+    
+    // Lệnh truyền file đi trên kênh riêng và không bao giờ nằm trong batch
+    if (isBulkCommand(command)) {
+        m_bulkSocket->write(reinterpret_cast<char*>(wire), WIRE_HEADER_SIZE);
+        m_bulkSocket->write(payload);
+        return requestId;
+    }
     
-    m_socket->write(reinterpret_cast<char*>(&header), sizeof(PacketHeader));
-    m_socket->write(jsonBytes);
+    if (m_batching) {
+        m_batchBuffer.append(reinterpret_cast<char*>(wire), WIRE_HEADER_SIZE);
+        m_batchBuffer.append(payload);
+        return requestId;
+    }
+    
+    m_socket->write(reinterpret_cast<char*>(wire), WIRE_HEADER_SIZE);
+    m_socket->write(payload);
     m_socket->flush();
+    return requestId;
+}
+
+// Ghi thẳng một frame ra socket (không theo dõi phản hồi, không gom batch)
+void NetworkClient::writeFrame(int command, const QByteArray &payload, quint32 requestId)
+{
+    WireHeader header(command, STATUS_OK, requestId);
+    header.body_length = payload.size();
+    
+    unsigned char wire[WIRE_HEADER_SIZE];
+    encode_wire_header(header, wire);
+    
+    QTcpSocket *socket = isBulkCommand(command) ? m_bulkSocket : m_socket;
+    socket->write(reinterpret_cast<char*>(wire), WIRE_HEADER_SIZE);
+    socket->write(payload);
+}
+
+void NetworkClient::beginBatch()
+{
+    m_batching = true;
+    m_batchBuffer.clear();
+}
+
+void NetworkClient::endBatch()
+{
+    m_batching = false;
+    if (m_batchBuffer.isEmpty()) return;
+    
+    QByteArray items = m_batchBuffer;
+    m_batchBuffer.clear();
+    sendRaw(C_REQ_BATCH, items);
 }
 
 void NetworkClient::onReadyRead()
 {
     m_buffer.append(m_socket->readAll());
-    
-    while (m_buffer.size() >= (int)sizeof(PacketHeader)) {
-        PacketHeader header;
-        memcpy(&header, m_buffer.data(), sizeof(PacketHeader));
+    processFrames(m_socket, m_buffer, m_inflater);
+}
+
+// Tách các frame hoàn chỉnh trong buffer của một kết nối và xử lý lần lượt;
+// false nếu luồng hỏng (kết nối đã bị hủy)
+bool NetworkClient::processFrames(QTcpSocket *socket, QByteArray &buffer, FrameInflater *inflater)
+{
+    while (buffer.size() >= WIRE_HEADER_SIZE) {
+        WireHeader header;
+        if (!decode_wire_header(reinterpret_cast<const unsigned char*>(buffer.constData()), header)) {
+            qDebug() << "Invalid frame header from server, dropping connection";
+            buffer.clear();
+            socket->abort();
+            return false;
+        }
         
-        int totalSize = sizeof(PacketHeader) + header.body_length;
-        if (m_buffer.size() < totalSize) {
+        qint64 totalSize = WIRE_HEADER_SIZE + (qint64)header.body_length;
+        if (buffer.size() < totalSize) {
             break; // Wait for more data
         }
         
-        QByteArray body = m_buffer.mid(sizeof(PacketHeader), header.body_length);
-        m_buffer.remove(0, totalSize);
+        QByteArray body = buffer.mid(WIRE_HEADER_SIZE, header.body_length);
+        buffer.remove(0, totalSize);
+        
+        if (header.flags & WIRE_FLAG_COMPRESSED) {
+            std::string plain;
+            if (!inflater || !inflater->decompress(body.constData(), body.size(), plain, 64 * 1024 * 1024)) {
+                qDebug() << "Invalid compressed frame from server, dropping connection";
+                buffer.clear();
+                socket->abort();
+                return false;
+            }
+            body = QByteArray(plain.data(), (int)plain.size());
+        }
         
-        processPacket(header, body);
+        // request_id = 0 là thông báo chủ động từ server, không gắn với request nào
+        int requestCommand = header.request_id ? m_pendingRequests.take(header.request_id) : 0;
+        processPacket(header, body, requestCommand);
     }
+    return true;
 }
 
-void NetworkClient::processPacket(const PacketHeader &header, const QByteArray &body)
+void NetworkClient::processPacket(const WireHeader &header, const QByteArray &body, int requestCommand)
 {
+    // Chunk nhị phân: ghi thẳng xuống file, không parse JSON
+    if (header.command == S_DATA_FILE_CHUNK) {
+        handleDownloadChunk(body);
+        return;
+    }
+    
     QString jsonStr = QString::fromUtf8(body);
     QMap<QString, QString> data = parseJson(jsonStr);
     
@@ -159,12 +422,31 @@ void NetworkClient::processPacket(const PacketHeader &header, const QByteArray &
         case S_RESP_LOGIN:
             if (header.status == STATUS_OK) {
                 m_token = data.value("token");
+                // Phiên upload trên server gắn với user: đổi user thì bỏ transfer cũ
+                if (m_loginUsername != m_username) {
+                    discardTransfers();
+                }
+                m_username = m_loginUsername;
+                m_loggedIn = true;
+                ensureBulkChannel();
                 emit loginResponse(true, "Đăng nhập thành công", m_token);
             } else {
                 emit loginResponse(false, data.value("message", "Đăng nhập thất bại"), "");
             }
             break;
             
+        case S_RESP_ATTACH_CHANNEL:
+            if (header.status == STATUS_OK && m_bulkState == BulkConnecting) {
+                m_bulkState = BulkReady;
+                resumeTransfers();
+            } else if (header.status != STATUS_OK) {
+                qDebug() << "Bulk channel rejected:" << data.value("message");
+                m_bulkState = BulkClosed;
+                m_bulkSocket->abort();
+                discardTransfers();
+            }
+            break;
+            
         case S_RESP_REGISTER:
             emit registerResponse(header.status == STATUS_OK || header.status == STATUS_CREATED,
                                   data.value("message"));
@@ -181,27 +463,166 @@ void NetworkClient::processPacket(const PacketHeader &header, const QByteArray &
             break;
             
         case S_RESP_FILE_OK:
-            if (header.status == STATUS_OK) {
-                QString message = data.value("message");
-                if (message.contains("download")) {
-                    // File download response
-                    QString fileName = data.value("file_name");
-                    QString fileDataBase64 = data.value("file_data");
-                    qint64 fileSize = data.value("file_size", "0").toLongLong();
-                    
-                    if (!fileDataBase64.isEmpty()) {
-                        QByteArray fileData = QByteArray::fromBase64(fileDataBase64.toLatin1());
-                        emit fileDownloadReceived(fileName, fileData, fileSize);
-                        qDebug() << "File download received:" << fileName << "Size:" << fileSize;
+            if (requestCommand == C_REQ_FILE_UPLOAD || requestCommand == C_DATA_FILE_END ||
+                data.contains("file_id")) {
+                // Phiên upload theo chunk: server cấp file_id / offset resume,
+                // xác nhận C_DATA_FILE_END, hoặc báo lỗi giữa chừng
+                Upload *upload = nullptr;
+                for (Upload *candidate : m_uploads) {
+                    bool match = ((requestCommand == C_REQ_FILE_UPLOAD || requestCommand == C_DATA_FILE_END) &&
+                                  candidate->requestId == header.request_id) ||
+                                 (candidate->fileId != 0 && QString::number(candidate->fileId) == data.value("file_id"));
+                    if (match) {
+                        upload = candidate;
+                        break;
                     }
-                } else {
+                }
+                if (upload && header.status == STATUS_OK && data.value("deduplicated") == "1") {
+                    // Server đã có nội dung này - tin nhắn đã được gửi, bỏ qua truyền dữ liệu
+                    qDebug() << "File uploaded (deduplicated):" << data.value("file_name");
+                    removeUpload(upload);
+                    pumpUploads();
+                    break;
+                }
+                if (upload && header.status == STATUS_OK && requestCommand == C_REQ_FILE_UPLOAD) {
+                    upload->fileId = data.value("file_id").toUInt();
+                    upload->checksum = data.value("checksum") == FILE_CHECKSUM_CRC32C;
+                    upload->chunkSize = data.value("chunk_size", QString::number(FILE_CHUNK_SIZE)).toInt();
+                    if (upload->chunkSize <= 0 || upload->chunkSize > FILE_CHUNK_SIZE) upload->chunkSize = FILE_CHUNK_SIZE;
+                    if (upload->resuming) {
+                        // Gửi tiếp từ offset server đã ghi
+                        qint64 offset = data.value("offset", "0").toLongLong();
+                        upload->resuming = false;
+                        upload->endSent = false;
+                        if (offset < 0 || offset > upload->size || !upload->file->seek(offset)) {
+                            qDebug() << "File upload failed:" << upload->fileName << "bad resume offset" << offset;
+                            removeUpload(upload);
+                            pumpUploads();
+                            break;
+                        }
+                        upload->sent = offset;
+                        qDebug() << "File upload resumed:" << upload->fileName << "at" << offset;
+                    }
+                    pumpUploads();
+                    break;
+                }
+                if (upload && header.status == STATUS_OK) {
                     qDebug() << "File uploaded successfully:" << data.value("file_name");
+                    removeUpload(upload);
+                    pumpUploads();
+                    break;
+                }
+                if (upload && upload->resuming && header.status == STATUS_NOT_FOUND) {
+                    upload->resuming = false;
+                    if (upload->endSent) {
+                        // Server đã xử lý C_DATA_FILE_END trước khi rớt kết nối
+                        qDebug() << "File upload already completed:" << upload->fileName;
+                        removeUpload(upload);
+                    } else {
+                        // Phiên đã hết hạn trên server -> upload lại từ đầu
+                        qDebug() << "File upload restarted:" << upload->fileName;
+                        upload->fileId = 0;
+                        upload->sent = 0;
+                        upload->file->seek(0);
+                        requestUpload(upload);
+                    }
+                    break;
                 }
+                if (upload && header.status != STATUS_OK) {
+                    qDebug() << "File upload failed:" << upload->fileName << data.value("message");
+                    removeUpload(upload);
+                    pumpUploads();
+                    break;
+                }
+                if (header.status == STATUS_OK) break;
+            }
+            if (header.status == STATUS_OK) {
+                qDebug() << "File uploaded successfully:" << data.value("file_name");
             } else {
                 qDebug() << "File operation failed:" << data.value("message");
+                if (requestCommand == C_REQ_FILE_DOWNLOAD) {
+                    Download *download = findDownload(header.request_id, 0);
+                    if (download) finishDownload(download, false);
+                } else if (requestCommand == C_REQ_FILE_RESEND) {
+                    for (Download *download : m_downloads) {
+                        if (download->resendIds.contains(header.request_id)) {
+                            finishDownload(download, false);
+                            break;
+                        }
+                    }
+                }
+            }
+            break;
+            
+        case S_RESP_FILE_START: {
+            Download *download = findDownload(header.request_id, 0);
+            if (!download) break;
+            if (data.value("offset", "0").toLongLong() != download->received) {
+                qDebug() << "Download failed:" << download->fileName << "unexpected start offset";
+                finishDownload(download, false);
+                break;
+            }
+            download->fileId = data.value("file_id").toUInt();
+            download->size = data.value("file_size", "0").toLongLong();
+            download->checksum = data.value("checksum") == FILE_CHECKSUM_CRC32C;
+            download->fileCrc = data.value("file_crc32c", "-1").toLongLong();
+            qDebug() << "File download started:" << download->fileName << "Size:" << download->size;
+            break;
+        }
+        
+        case S_DATA_FILE_END: {
+            Download *download = findDownload(0, data.value("file_id").toUInt());
+            if (!download) break;
+            download->ended = true;
+            // Còn chunk sai CRC đang chờ gửi lại -> kết thúc khi nhận đủ
+            if (download->missing.isEmpty()) {
+                finishDownload(download, download->received == download->size && verifyDownload(download));
             }
             break;
+        }
+        
+        case S_NOTIFY_FILE_NACK: {
+            // Server nhận chunk upload sai CRC: gửi lại từ offset đó (server bỏ
+            // các chunk sau nó, kể cả C_DATA_FILE_END nếu đã gửi)
+            qint64 offset = data.value("offset", "-1").toLongLong();
+            for (Upload *upload : m_uploads) {
+                if (upload->fileId == 0 || QString::number(upload->fileId) != data.value("file_id")) continue;
+                if (upload->resuming) break;    // Offset resume sẽ thay thế NACK này
+                if (offset < 0 || offset > upload->sent || !upload->file->seek(offset)) {
+                    qDebug() << "File upload failed:" << upload->fileName << "bad resend offset" << offset;
+                    removeUpload(upload);
+                } else {
+                    qDebug() << "File upload chunk corrupted, resending:" << upload->fileName << "at" << offset;
+                    upload->sent = offset;
+                    upload->endSent = false;
+                }
+                pumpUploads();
+                break;
+            }
+            break;
+        }
             
+        case S_RESP_BATCH: {
+            if (header.status != STATUS_OK) {
+                qDebug() << "Batch rejected:" << data.value("message");
+                break;
+            }
+            // Body là chuỗi frame phản hồi con, xử lý như từng gói riêng lẻ
+            int pos = 0;
+            while (body.size() - pos >= WIRE_HEADER_SIZE) {
+                WireHeader sub;
+                if (!decode_wire_header(reinterpret_cast<const unsigned char*>(body.constData()) + pos, sub) ||
+                    body.size() - pos - WIRE_HEADER_SIZE < (qint64)sub.body_length) {
+                    qDebug() << "Malformed batch response";
+                    break;
+                }
+                QByteArray subBody = body.mid(pos + WIRE_HEADER_SIZE, sub.body_length);
+                pos += WIRE_HEADER_SIZE + sub.body_length;
+                processPacket(sub, subBody, m_pendingRequests.take(sub.request_id));
+            }
+            break;
+        }
+        
         case S_RESP_DELETE_MESSAGE: {
             bool success = (header.status == STATUS_OK);
             int messageId = data.value("message_id", "-1").toInt();
@@ -217,6 +638,21 @@ void NetworkClient::processPacket(const PacketHeader &header, const QByteArray &
             break;
         }
         
+        case S_RESP_FILE_LIST: {
+            if (header.status != STATUS_OK) {
+                qDebug() << "File list failed:" << data.value("message");
+                break;
+            }
+            QList<QMap<QString, QString>> files;
+            int end = parseJsonObjectArray(jsonStr, "files", files);
+            // chat_type / target đứng trước mảng, next_before_id đứng sau
+            QMap<QString, QString> head = parseJson(jsonStr.left(jsonStr.indexOf("\"files\":[")));
+            QMap<QString, QString> tail = end != -1 ? parseJson(jsonStr.mid(end)) : QMap<QString, QString>();
+            emit fileListReceived(head.value("chat_type"), head.value("target"), files,
+                                  tail.value("next_before_id").toInt());
+            break;
+        }
+        
         case S_RESP_SEARCH_MESSAGES: {
             qDebug() << "[Search] Received response: " << jsonStr.left(200);
             QList<QMap<QString, QString>> results;
@@ -636,6 +1072,8 @@ void NetworkClient::sendLogin(const QString &username, const QString &password)
     QMap<QString, QString> body;
     body["username"] = username;
     body["pass_hash"] = password;  // Server expects "pass_hash"
+    body["compress"] = COMPRESS_ALGORITHM;  // Xin server nén các phản hồi lớn
+    m_loginUsername = username;
     sendPacket(C_REQ_LOGIN, body);
 }
 
@@ -787,25 +1225,23 @@ void NetworkClient::sendMarkMessagesRead(const QString &senderUsername)
     sendPacket(C_REQ_MARK_MESSAGES_READ, body);
 }
 
-void NetworkClient::sendFileUpload(const QString &target, bool isGroup, 
-                                    const QString &fileName, qint64 fileSize, 
-                                    const QByteArray &fileData)
+void NetworkClient::sendFileUpload(const QString &target, bool isGroup, const QString &filePath)
 {
-    // Check if file is too large for JSON packet
-    if (fileData.size() > 500 * 1024) { // 500KB limit for safety
-        qDebug() << "File too large for packet:" << fileData.size() << "bytes";
+    QFile *file = new QFile(filePath);
+    if (!file->open(QIODevice::ReadOnly)) {
+        qDebug() << "Cannot open file for upload:" << filePath;
+        delete file;
         return;
     }
     
-    // Encode file data as base64
-    QString fileDataBase64 = QString::fromLatin1(fileData.toBase64());
-    qDebug() << "File upload:" << fileName << fileSize << "bytes, base64 size:" << fileDataBase64.length();
+    QString fileName = QFileInfo(filePath).fileName();
+    qDebug() << "File upload:" << fileName << file->size() << "bytes (chunked)";
     
+    // Body xin mở phiên upload; "file_hash" được thêm khi băm xong (hashUploads)
     QMap<QString, QString> body;
-    body["token"] = m_token;
     body["file_name"] = fileName;
-    body["file_size"] = QString::number(fileSize);
-    body["file_data"] = fileDataBase64;
+    body["file_size"] = QString::number(file->size());
+    body["checksum"] = FILE_CHECKSUM_CRC32C;
     
     if (isGroup) {
         body["group_id"] = target;
@@ -813,15 +1249,326 @@ void NetworkClient::sendFileUpload(const QString &target, bool isGroup,
         body["target_username"] = target;
     }
     
-    sendPacket(C_REQ_FILE_UPLOAD, body);
+    Upload *upload = new Upload;
+    upload->file = file;
+    upload->fileName = fileName;
+    upload->request = body;
+    upload->fileId = 0;
+    upload->size = file->size();
+    upload->sent = 0;
+    upload->chunkSize = FILE_CHUNK_SIZE;
+    upload->resuming = false;
+    upload->endSent = false;
+    upload->checksum = false;
+    m_hashingUploads.append(upload);
+    m_hashTimer->start(0);
 }
 
-void NetworkClient::sendFileDownload(const QString &fileName)
+// Băm nội dung trước khi xin upload (server đã có file thì không cần gửi lại
+// dữ liệu), mỗi lần một khối UPLOAD_HASH_BLOCK để file lớn không làm đứng
+// giao diện; băm xong file nào thì file đó vào hàng đợi upload
+void NetworkClient::hashUploads()
+{
+    if (m_hashingUploads.isEmpty()) return;
+    Upload *upload = m_hashingUploads.first();
+    
+    QByteArray block = upload->file->read(UPLOAD_HASH_BLOCK);
+    m_uploadHash.addData(block);
+    if (!block.isEmpty() && upload->file->pos() < upload->size) {
+        m_hashTimer->start(0);
+        return;
+    }
+    
+    m_hashingUploads.removeFirst();
+    if (upload->file->pos() != upload->size || !upload->file->seek(0)) {
+        qDebug() << "Cannot read file for upload:" << upload->fileName;
+        upload->file->close();
+        delete upload->file;
+        delete upload;
+    } else {
+        upload->request["file_hash"] = QString::fromLatin1(m_uploadHash.result().toHex());
+        m_uploads.append(upload);
+        if (m_bulkState == BulkReady) {
+            requestUpload(upload);
+        } else {
+            ensureBulkChannel();
+        }
+    }
+    m_uploadHash.reset();
+    if (!m_hashingUploads.isEmpty()) m_hashTimer->start(0);
+}
+
+// Gửi C_REQ_FILE_UPLOAD: mở phiên mới, hoặc xin offset của phiên đã có file_id
+void NetworkClient::requestUpload(Upload *upload)
 {
     QMap<QString, QString> body;
+    if (upload->fileId != 0) {
+        body["resume_file_id"] = QString::number(upload->fileId);
+        body["file_size"] = QString::number(upload->size);
+        upload->resuming = true;
+    } else {
+        body = upload->request;
+    }
     body["token"] = m_token;
-    body["file_name"] = fileName;
-    sendPacket(C_REQ_FILE_DOWNLOAD, body);
+    upload->requestId = sendPacket(C_REQ_FILE_UPLOAD, body);
+}
+
+void NetworkClient::removeUpload(Upload *upload)
+{
+    m_uploads.removeOne(upload);
+    upload->file->close();
+    delete upload->file;
+    delete upload;
+    closeBulkIfIdle();
+}
+
+void NetworkClient::onBytesWritten(qint64 bytes)
+{
+    Q_UNUSED(bytes);
+    pumpUploads();
+}
+
+// Đọc chunk từ đĩa và ghi ra socket cho tới khi buffer ghi đạt ngưỡng,
+// nên bộ nhớ dùng cho upload chỉ cỡ UPLOAD_WRITE_WATERMARK dù file lớn
+void NetworkClient::pumpUploads()
+{
+    if (m_bulkState != BulkReady) return;
+    
+    while (m_bulkSocket->bytesToWrite() < UPLOAD_WRITE_WATERMARK) {
+        // File đầu hàng đợi chưa gửi END (các file đã gửi END chỉ chờ xác nhận)
+        Upload *upload = nullptr;
+        for (Upload *candidate : m_uploads) {
+            if (!candidate->endSent) {
+                upload = candidate;
+                break;
+            }
+        }
+        if (!upload || upload->fileId == 0 || upload->resuming) break;
+        
+        if (upload->sent < upload->size) {
+            int headSize = FILE_CHUNK_HEADER_SIZE + (upload->checksum ? FILE_CHUNK_CRC_SIZE : 0);
+            QByteArray chunk(headSize, '\0');
+            unsigned char *head = reinterpret_cast<unsigned char*>(chunk.data());
+            wire_put_u32(head, upload->fileId);
+            wire_put_u64(head + 4, (quint64)upload->sent);
+            
+            QByteArray data = upload->file->read(qMin<qint64>(upload->chunkSize, upload->size - upload->sent));
+            if (data.isEmpty()) {
+                qDebug() << "File read failed during upload:" << upload->fileName;
+                upload->size = upload->sent;  // Báo END sớm, server sẽ từ chối phiên thiếu dữ liệu
+                continue;
+            }
+            if (upload->checksum) {
+                wire_put_u32(head + FILE_CHUNK_HEADER_SIZE, crc32c(data.constData(), data.size()));
+            }
+            chunk.append(data);
+            writeFrame(C_DATA_FILE_CHUNK, chunk, 0);
+            upload->sent += data.size();
+            continue;
+        }
+        
+        QMap<QString, QString> body;
+        body["token"] = m_token;
+        body["file_id"] = QString::number(upload->fileId);
+        upload->requestId = sendPacket(C_DATA_FILE_END, body);
+        upload->endSent = true;
+    }
+}
+
+void NetworkClient::clearUploads()
+{
+    for (Upload *upload : m_uploads + m_hashingUploads) {
+        upload->file->close();
+        delete upload->file;
+        delete upload;
+    }
+    m_uploads.clear();
+    m_hashingUploads.clear();
+    m_uploadHash.reset();
+}
+
+// Kênh truyền file vừa sẵn sàng: mở / resume các upload và tải (tiếp) các download
+void NetworkClient::resumeTransfers()
+{
+    for (Upload *upload : m_uploads) {
+        requestUpload(upload);
+    }
+    for (Download *download : m_downloads) {
+        if (download->received > 0) {
+            qDebug() << "File download resumed:" << download->fileName << "at" << download->received;
+        }
+        requestDownload(download);
+    }
+}
+
+void NetworkClient::discardTransfers()
+{
+    clearUploads();
+    while (!m_downloads.isEmpty()) {
+        finishDownload(m_downloads.first(), false);
+    }
+    closeBulkIfIdle();
+}
+
+void NetworkClient::sendFileDownload(const QString &fileName, const QString &savePath)
+{
+    QFile *file = new QFile(savePath + ".part");
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qDebug() << "Cannot open file for download:" << file->fileName();
+        delete file;
+        emit fileDownloadFinished(fileName, savePath, false);
+        return;
+    }
+    
+    Download *download = new Download;
+    download->file = file;
+    download->fileName = fileName;
+    download->savePath = savePath;
+    download->size = 0;
+    download->received = 0;
+    download->checksum = false;
+    download->fileCrc = -1;
+    download->resends = 0;
+    download->ended = false;
+    m_downloads.append(download);
+    if (m_bulkState == BulkReady) {
+        requestDownload(download);
+    } else {
+        ensureBulkChannel();
+    }
+}
+
+// Xin stream file từ byte download->received (0 nếu tải mới)
+void NetworkClient::requestDownload(Download *download)
+{
+    // Chunk sai CRC chưa kịp gửi lại (rớt kết nối) -> tải lại từ chunk hỏng đầu tiên
+    for (qint64 offset : download->missing) {
+        download->received = qMin(download->received, offset);
+    }
+    download->missing.clear();
+    download->resendIds.clear();
+    download->ended = false;
+    
+    QMap<QString, QString> body;
+    body["token"] = m_token;
+    body["file_name"] = download->fileName;
+    body["stream"] = "1";
+    body["checksum"] = FILE_CHECKSUM_CRC32C;
+    if (download->received > 0) {
+        body["offset"] = QString::number(download->received);
+    }
+    download->fileId = 0;
+    download->requestId = sendPacket(C_REQ_FILE_DOWNLOAD, body);
+}
+
+// Xin server gửi lại riêng chunk tại offset (sai CRC), luồng chính vẫn chạy tiếp
+void NetworkClient::requestChunkResend(Download *download, qint64 offset)
+{
+    QMap<QString, QString> body;
+    body["token"] = m_token;
+    body["file_name"] = download->fileName;
+    body["file_id"] = QString::number(download->fileId);
+    body["offset"] = QString::number(offset);
+    download->resendIds.append(sendPacket(C_REQ_FILE_RESEND, body));
+}
+
+NetworkClient::Download *NetworkClient::findDownload(quint32 requestId, quint32 fileId)
+{
+    for (Download *download : m_downloads) {
+        if (fileId != 0 ? download->fileId == fileId : download->requestId == requestId) {
+            return download;
+        }
+    }
+    return nullptr;
+}
+
+// S_DATA_FILE_CHUNK: [u32 file_id][u64 offset]([u32 crc32c])[dữ liệu]
+// Chunk sai CRC được bỏ qua và xin gửi lại riêng, các chunk sau vẫn ghi tiếp
+// vào đúng vị trí; chunk gửi lại lấp vào chỗ trống.
+void NetworkClient::handleDownloadChunk(const QByteArray &body)
+{
+    if (body.size() < FILE_CHUNK_HEADER_SIZE) return;
+    const unsigned char *head = reinterpret_cast<const unsigned char*>(body.constData());
+    Download *download = findDownload(0, wire_get_u32(head));
+    if (!download) return;
+    
+    int headSize = FILE_CHUNK_HEADER_SIZE + (download->checksum ? FILE_CHUNK_CRC_SIZE : 0);
+    qint64 offset = (qint64)wire_get_u64(head + 4);
+    qint64 len = body.size() - headSize;
+    bool resent = download->missing.contains(offset);
+    if (len < 0 || (offset != download->received && !resent) || offset + len > download->size) {
+        qDebug() << "Download failed:" << download->fileName << "at offset" << offset;
+        finishDownload(download, false);
+        return;
+    }
+    
+    const char *data = body.constData() + headSize;
+    if (download->checksum && crc32c(data, len) != wire_get_u32(head + FILE_CHUNK_HEADER_SIZE)) {
+        if (++download->resends > DOWNLOAD_MAX_RESENDS) {
+            qDebug() << "Download failed:" << download->fileName << "too many corrupted chunks";
+            finishDownload(download, false);
+            return;
+        }
+        qDebug() << "Download chunk corrupted, requesting resend:" << download->fileName << "at" << offset;
+        if (!resent) {
+            download->missing.append(offset);
+            download->received += len;
+        }
+        requestChunkResend(download, offset);
+        return;
+    }
+    
+    if (!download->file->seek(offset) || download->file->write(data, len) != len) {
+        qDebug() << "Download failed:" << download->fileName << "at offset" << offset;
+        finishDownload(download, false);
+        return;
+    }
+    if (!resent) {
+        download->received += len;
+        return;
+    }
+    download->missing.removeOne(offset);
+    if (download->ended && download->missing.isEmpty()) {
+        finishDownload(download, download->received == download->size && verifyDownload(download));
+    }
+}
+
+// So CRC32C cả file đã ghi với giá trị server báo trong S_RESP_FILE_START
+bool NetworkClient::verifyDownload(Download *download)
+{
+    if (download->fileCrc < 0) return true;
+    if (!download->file->flush()) return false;
+    
+    QFile file(download->file->fileName());
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    quint32 crc = 0;
+    QByteArray block;
+    while (!(block = file.read(1024 * 1024)).isEmpty()) {
+        crc = crc32c_update(crc, block.constData(), block.size());
+    }
+    if (crc != (quint32)download->fileCrc) {
+        qDebug() << "Download failed:" << download->fileName << "file CRC32C mismatch";
+        return false;
+    }
+    return true;
+}
+
+void NetworkClient::finishDownload(Download *download, bool success)
+{
+    download->file->close();
+    if (success) {
+        QFile::remove(download->savePath);
+        success = download->file->rename(download->savePath);
+    }
+    if (!success) {
+        download->file->remove();
+    }
+    emit fileDownloadFinished(download->fileName, download->savePath, success);
+    
+    m_downloads.removeOne(download);
+    delete download->file;
+    delete download;
+    closeBulkIfIdle();
 }
 
 void NetworkClient::sendDeleteMessage(int messageId, const QString &chatType)
@@ -842,6 +1589,17 @@ void NetworkClient::sendGroupInvite(const QString &groupId, const QString &usern
     sendPacket(C_REQ_GROUP_INVITE, body);
 }
 
+void NetworkClient::sendFileList(const QString &chatType, const QString &target, int beforeId, int limit)
+{
+    QMap<QString, QString> body;
+    body["token"] = m_token;
+    body["chat_type"] = chatType;  // "private" hoặc "group"
+    body["target"] = target;
+    if (beforeId > 0) body["before_id"] = QString::number(beforeId);
+    body["limit"] = QString::number(limit);
+    sendPacket(C_REQ_FILE_LIST, body);
+}
+
 void NetworkClient::sendSearchMessages(const QString &keyword, const QString &chatType, const QString &target)
 {
     QMap<QString, QString> body;
@@ -5,11 +5,16 @@
 #include <QTcpSocket>
 #include <QByteArray>
 #include <QMap>
+#include <QHash>
 #include <QString>
 #include <QStringList>
 #include <QList>
 #include <QPair>
+#include <QFile>
+#include <QCryptographicHash>
+#include <QTimer>
 #include "protocol.h"
+#include "compression.h"
 
 class NetworkClient : public QObject
 {
@@ -43,12 +48,18 @@ public:
     void sendChatHistoryPrivate(const QString &targetUsername, int offset = 0, int limit = 10);
     void sendChatHistoryGroup(const QString &groupId, int offset = 0, int limit = 10);
     void sendMarkMessagesRead(const QString &senderUsername);
-    void sendFileUpload(const QString &target, bool isGroup, const QString &fileName, 
-                        qint64 fileSize, const QByteArray &fileData);
-    void sendFileDownload(const QString &fileName);
+    void sendFileUpload(const QString &target, bool isGroup, const QString &filePath);  // Stream theo chunk
+    void sendFileDownload(const QString &fileName, const QString &savePath);  // Stream thẳng xuống savePath
     void sendDeleteMessage(int messageId, const QString &chatType);  // "private" hoặc "group"
     void sendGroupInvite(const QString &groupId, const QString &username);  // Mời bạn bè vào nhóm
     void sendSearchMessages(const QString &keyword, const QString &chatType, const QString &target);  // Tìm kiếm tin nhắn
+    // Một trang file trong cuộc chat (mới nhất trước); beforeId = nextBeforeId của trang trước
+    void sendFileList(const QString &chatType, const QString &target, int beforeId = 0, int limit = FILE_LIST_DEFAULT_LIMIT);
+    
+    // Gom các lệnh gửi giữa beginBatch() và endBatch() thành một C_REQ_BATCH
+    // (một round trip, server xác thực một lần bằng phiên của kết nối)
+    void beginBatch();
+    void endBatch();
     
     void setToken(const QString &token) { m_token = token; }
     QString getToken() const { return m_token; }
@@ -98,7 +109,11 @@ signals:
     void messagesReadNotification(const QString &readerUsername);
     
     // File operations
-    void fileDownloadReceived(const QString &fileName, const QByteArray &fileData, qint64 fileSize);
+    void fileDownloadFinished(const QString &fileName, const QString &savePath, bool success);
+    // Mỗi file: attachment_id, message_id, from_username, file_name, stored_name (dùng để tải),
+    // file_size, hash, mime_type, created_at; nextBeforeId = 0 khi hết
+    void fileListReceived(const QString &chatType, const QString &target,
+                          const QList<QMap<QString, QString>> &files, int nextBeforeId);
     
     // Delete message
     void deleteMessageResponse(bool success, const QString &message, int messageId);
@@ -112,16 +127,99 @@ private slots:
     void onConnected();
     void onDisconnected();
     void onError(QAbstractSocket::SocketError error);
+    void onBytesWritten(qint64 bytes);
+    void onBulkConnected();
+    void onBulkReadyRead();
+    void onBulkStateChanged(QAbstractSocket::SocketState state);
+    void ensureBulkChannel();
+    void hashUploads();
 
 private:
-    void sendPacket(int command, const QMap<QString, QString> &body);
-    void processPacket(const PacketHeader &header, const QByteArray &body);
+    quint32 sendPacket(int command, const QMap<QString, QString> &body);
+    quint32 sendRaw(int command, const QByteArray &payload);
+    void writeFrame(int command, const QByteArray &payload, quint32 requestId);
+    static bool isBulkCommand(int command);
+    bool processFrames(QTcpSocket *socket, QByteArray &buffer, FrameInflater *inflater);
+    void closeBulkIfIdle();
+    void suspendTransfers();
+    void pumpUploads();
+    void clearUploads();
+    void resumeTransfers();
+    void discardTransfers();
+    
+    // Một file đang upload theo chunk (đọc dần từ đĩa, không nạp cả file)
+    struct Upload {
+        QFile *file;
+        QString fileName;
+        QMap<QString, QString> request;  // Body C_REQ_FILE_UPLOAD ban đầu (không có token)
+        quint32 requestId;      // request_id của C_REQ_FILE_UPLOAD / C_DATA_FILE_END đang chờ
+        quint32 fileId;         // 0 = chưa được server cấp
+        qint64 size;
+        qint64 sent;
+        int chunkSize;
+        bool resuming;          // Đang chờ offset của "resume_file_id"
+        bool endSent;           // Đã gửi C_DATA_FILE_END, chờ xác nhận
+        bool checksum;          // Server nhận chunk kèm CRC32C
+    };
+    void requestUpload(Upload *upload);
+    void removeUpload(Upload *upload);
+    
+    // Một file đang tải về, ghi dần vào savePath + ".part"
+    struct Download {
+        QFile *file;
+        QString fileName;       // Tên file trên server
+        QString savePath;
+        quint32 requestId;      // request_id của C_REQ_FILE_DOWNLOAD
+        quint32 fileId;         // 0 = chưa nhận S_RESP_FILE_START
+        qint64 size;
+        qint64 received;        // Byte kế tiếp trong luồng (chunk sai CRC nằm trong missing)
+        bool checksum;          // Chunk kèm CRC32C
+        qint64 fileCrc;         // CRC32C cả file server báo, -1 nếu không có
+        QList<qint64> missing;  // Offset các chunk sai CRC đang chờ gửi lại
+        QList<quint32> resendIds;  // request_id các C_REQ_FILE_RESEND đang chờ
+        int resends;
+        bool ended;             // Đã nhận S_DATA_FILE_END
+    };
+    void requestDownload(Download *download);
+    void requestChunkResend(Download *download, qint64 offset);
+    Download *findDownload(quint32 requestId, quint32 fileId);
+    void handleDownloadChunk(const QByteArray &body);
+    bool verifyDownload(Download *download);
+    void finishDownload(Download *download, bool success);
+    
+    void processPacket(const WireHeader &header, const QByteArray &body, int requestCommand);
     QString buildJson(const QMap<QString, QString> &data);
     QMap<QString, QString> parseJson(const QString &json);
+    int parseJsonObjectArray(const QString &json, const QString &key, QList<QMap<QString, QString>> &objects);
     
     QTcpSocket *m_socket;
     QString m_token;
     QByteArray m_buffer;
+    QString m_host;
+    int m_port;
+    
+    // Kênh truyền file: kết nối TCP thứ hai, mở khi có upload/download và
+    // đóng khi hết, để file lớn không chặn tin nhắn trên kết nối chính
+    enum BulkState { BulkClosed, BulkConnecting, BulkReady };
+    QTcpSocket *m_bulkSocket;
+    QByteArray m_bulkBuffer;
+    BulkState m_bulkState;
+    quint32 m_nextRequestId;    // request_id cho frame tiếp theo (bỏ qua 0)
+    QHash<quint32, int> m_pendingRequests;  // request_id -> command đã gửi, chờ phản hồi
+    FrameInflater *m_inflater;  // Luồng giải nén server -> client, tạo mới mỗi kết nối
+    bool m_batching;
+    QByteArray m_batchBuffer;   // Các frame con đang chờ endBatch()
+    QList<Upload*> m_uploads;   // Hàng đợi upload, gửi lần lượt từng file
+    QList<Upload*> m_hashingUploads;    // Đang băm SHA-256, chưa xin phiên upload
+    QCryptographicHash m_uploadHash;    // Trạng thái băm của m_hashingUploads.first()
+    QTimer *m_hashTimer;
+    QList<Download*> m_downloads;
+    // Kênh truyền file rớt giữa chừng: giữ các transfer lại, kênh mới (sau khi
+    // đăng nhập lại đúng user) upload tiếp từ offset server đã ghi và tải tiếp
+    // từ byte đã nhận
+    QString m_loginUsername;    // User của C_REQ_LOGIN đang chờ phản hồi
+    QString m_username;         // User đã đăng nhập (chủ của các transfer)
+    bool m_loggedIn;
 };
 
 #endif // NETWORKCLIENT_H
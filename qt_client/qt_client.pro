@@ -20,9 +20,12 @@ HEADERS += \
     chatwidget.h \
     networkclient.h \
     ../common/protocol.h \
-    ../common/json_helper.h
+    ../common/json_helper.h \
+    ../common/compression.h \
+    ../common/crc32c.h
 
 INCLUDEPATH += ../common
+LIBS += -lz
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
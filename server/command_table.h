@@ -0,0 +1,123 @@
+/*
+ * BẢNG ĐIỀU PHỐI LỆNH (COMMAND DISPATCH TABLE)
+ *
+ * Mỗi lệnh client gửi lên được mô tả bằng một CommandInfo: handler xử lý,
+ * cách xác thực, kiểu body, kích thước body tối đa, lớp ưu tiên và lệnh dùng
+ * để phản hồi lỗi. handle_client chỉ tra bảng theo command id rồi chạy một
+ * pipeline chung (đọc body -> kiểm tra kích thước -> xác thực -> handler ->
+ * thống kê), nên các handler không phải tự verifyToken nữa.
+ *
+ * Bảng chỉ mục command id -> slot được sinh lúc biên dịch (constexpr), slot
+ * cũng chính là vị trí thống kê của lệnh trong command_stats (bộ đếm và
+ * histogram độ trễ theo từng giai đoạn, xem latency_histogram.h).
+ */
+
+#ifndef COMMAND_TABLE_H
+#define COMMAND_TABLE_H
+
+#include <map>
+#include <string>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "latency_histogram.h"
+
+using namespace std;
+
+// Command id lớn nhất có thể xuất hiện trong header (16xx là gói nhị phân)
+#define MAX_COMMAND_ID 2048
+
+// Cách xác thực trước khi gọi handler
+enum AuthMode {
+    AUTH_NONE,      // Không cần đăng nhập (login, register)
+    AUTH_TOKEN,     // Body JSON phải có "token" hợp lệ
+    AUTH_SESSION    // Dùng user đã đăng nhập trên chính kết nối này (lệnh batch)
+};
+
+// Kiểu body mà lệnh chấp nhận
+enum BodyType {
+    BODY_NONE,      // Không có body
+    BODY_JSON,      // JSON phẳng, parse bằng JsonHelper
+    BODY_BINARY     // Dữ liệu nhị phân, handler tự đọc raw_body
+};
+
+// Lớp ưu tiên của lệnh
+enum PriorityClass {
+    PRIO_AUTH,          // Đăng nhập / đăng ký
+    PRIO_INTERACTIVE,   // Tin nhắn, thao tác bạn bè/nhóm - cần độ trễ thấp
+    PRIO_QUERY,         // Truy vấn chỉ đọc (danh sách, lịch sử, tìm kiếm)
+    PRIO_BULK           // Truyền file
+};
+
+// Ngữ cảnh của một request, do pipeline chuẩn bị cho handler
+struct RequestContext {
+    int client_socket;
+    int user_id;                        // -1 nếu lệnh là AUTH_NONE
+    int command;
+    uint32_t request_id;                // request_id trong WireHeader (0 với client v1)
+    const string& raw_body;
+    const map<string, string>& body;
+    string* batch_out;                  // Khác null khi chạy trong batch: phản hồi được gom vào đây
+};
+
+typedef void (*CommandHandler)(RequestContext& ctx);
+
+struct CommandInfo {
+    int command;
+    const char* name;
+    CommandHandler handler;
+    AuthMode auth;
+    BodyType body_type;
+    int max_body;               // Kích thước body tối đa (bytes)
+    PriorityClass priority;
+    int resp_command;           // Lệnh phản hồi khi bị từ chối (0 = im lặng)
+};
+
+// Thống kê theo lệnh, cập nhật không cần khóa
+struct CommandStats {
+    atomic<uint64_t> calls;
+    atomic<uint64_t> auth_failures;
+    atomic<uint64_t> rejected;          // Body sai kiểu / quá lớn
+    LatencyHistogram handler;           // Thời gian chạy handler (gồm db + send bên dưới)
+    LatencyHistogram queue;             // Chờ trong hàng đợi worker pool (chỉ request được offload)
+    LatencyHistogram db;                // Chờ + giữ kết nối database trong handler
+    LatencyHistogram send;              // Chờ khóa ghi + gửi phản hồi / thông báo / chunk
+};
+
+// Bảng chỉ mục command id -> slot trong bảng lệnh (-1 = không có)
+struct CommandIndex {
+    short slot[MAX_COMMAND_ID];
+};
+
+template <size_t N>
+constexpr CommandIndex build_command_index(const CommandInfo (&table)[N]) {
+    CommandIndex index{};
+    for (int i = 0; i < MAX_COMMAND_ID; i++) index.slot[i] = -1;
+    for (size_t i = 0; i < N; i++) index.slot[table[i].command] = (short)i;
+    return index;
+}
+
+// Kiểm tra lúc biên dịch: id nằm trong khoảng và không trùng lặp
+template <size_t N>
+constexpr bool command_table_valid(const CommandInfo (&table)[N]) {
+    for (size_t i = 0; i < N; i++) {
+        if (table[i].command <= 0 || table[i].command >= MAX_COMMAND_ID) return false;
+        if (table[i].handler == nullptr) return false;
+        for (size_t j = i + 1; j < N; j++) {
+            if (table[i].command == table[j].command) return false;
+        }
+    }
+    return true;
+}
+
+inline const char* priority_name(PriorityClass p) {
+    switch (p) {
+        case PRIO_AUTH: return "auth";
+        case PRIO_INTERACTIVE: return "interactive";
+        case PRIO_QUERY: return "query";
+        case PRIO_BULK: return "bulk";
+    }
+    return "?";
+}
+
+#endif // COMMAND_TABLE_H
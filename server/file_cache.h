@@ -0,0 +1,216 @@
+/*
+ * CACHE FILE NÓNG (LRU TRONG BỘ NHỚ)
+ *
+ * File vừa gửi vào nhóm lớn thường bị hàng chục thành viên tải cùng lúc.
+ * FileCache giữ nội dung các file nhỏ vừa được tải gần đây trong RAM (tổng
+ * tối đa max_bytes, mỗi file tối đa max_entry), các lượt tải đồng thời dùng
+ * chung một buffer qua shared_ptr - entry bị đẩy khỏi LRU vẫn sống tới khi
+ * lượt tải cuối cùng dùng xong.
+ *
+ * Khi nhiều thread cùng miss một file, chỉ thread đầu tiên đọc đĩa, các
+ * thread còn lại chờ entry đó (không đọc trùng). Entry được kiểm tra lại
+ * bằng cỡ + mtime nên file bị ghi đè không bị phục vụ bản cũ. File lớn hơn
+ * max_entry không vào cache: chúng được gửi bằng sendfile từ page cache.
+ */
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "../common/base64.h"
+
+using namespace std;
+
+struct CachedFile {
+    string path;
+    uint64_t size;
+    time_t mtime;
+    string data;                // Toàn bộ nội dung file
+    bool ready;                 // false trong lúc thread nạp đang đọc đĩa
+    bool failed;
+
+    // Base64 của data, tạo khi có lượt tải kiểu cũ đầu tiên (client v1 / batch),
+    // xem FileCache::base64
+    pthread_mutex_t base64_mutex;
+    string base64;
+    bool has_base64;
+    size_t base64_charged;      // Phần base64 đã tính vào FileCache::bytes (đổi khi giữ mutex cache)
+
+    CachedFile() : size(0), mtime(0), ready(false), failed(false), has_base64(false), base64_charged(0) {
+        pthread_mutex_init(&base64_mutex, nullptr);
+    }
+    ~CachedFile() {
+        pthread_mutex_destroy(&base64_mutex);
+    }
+};
+
+class FileCache {
+private:
+    typedef list<shared_ptr<CachedFile>> LruList;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t loaded_cond;         // Báo cho các thread chờ entry đang nạp
+    LruList lru;                        // Đầu danh sách = dùng gần nhất
+    unordered_map<string, LruList::iterator> index;
+    size_t bytes;
+    size_t max_bytes;
+    size_t max_entry;
+
+    // Gọi khi đang giữ mutex
+    void remove_locked(LruList::iterator it) {
+        bytes -= (*it)->size + (*it)->base64_charged;
+        index.erase((*it)->path);
+        lru.erase(it);
+    }
+
+    void evict_locked() {
+        auto it = lru.end();
+        while (bytes > max_bytes && it != lru.begin()) {
+            auto victim = prev(it);
+            if (!(*victim)->ready) {        // Đang nạp - bỏ qua, thread nạp còn giữ nó
+                it = victim;
+                continue;
+            }
+            remove_locked(victim);
+            evictions++;
+        }
+    }
+
+    static bool read_all(int fd, string& out, uint64_t size) {
+        out.resize(size);
+        uint64_t done = 0;
+        while (done < size) {
+            ssize_t n = pread(fd, &out[done], size - done, done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+
+public:
+    // Thống kê (xem print_command_stats)
+    atomic<uint64_t> hits;
+    atomic<uint64_t> misses;
+    atomic<uint64_t> bypassed;          // File quá lớn để cache
+    atomic<uint64_t> evictions;
+    atomic<uint64_t> bytes_saved;       // Số byte phục vụ từ RAM thay vì đọc đĩa
+
+    FileCache(size_t max_bytes, size_t max_entry)
+        : bytes(0), max_bytes(max_bytes), max_entry(max_entry),
+          hits(0), misses(0), bypassed(0), evictions(0), bytes_saved(0) {
+        pthread_mutex_init(&mutex, nullptr);
+        pthread_cond_init(&loaded_cond, nullptr);
+    }
+    ~FileCache() {
+        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&loaded_cond);
+    }
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+
+    // Lấy nội dung file (fd đã mở, st là fstat của fd): từ cache nếu có,
+    // ngược lại đọc fd và đưa vào cache. nullptr nếu file quá lớn hoặc đọc lỗi
+    // - khi đó caller tự đọc/gửi thẳng từ fd.
+    shared_ptr<CachedFile> acquire(const string& path, int fd, const struct stat& st) {
+        if ((uint64_t)st.st_size > max_entry || max_bytes == 0) {
+            bypassed++;
+            return nullptr;
+        }
+
+        pthread_mutex_lock(&mutex);
+        auto found = index.find(path);
+        if (found != index.end()) {
+            shared_ptr<CachedFile> entry = *found->second;
+            if (entry->size == (uint64_t)st.st_size && entry->mtime == st.st_mtime) {
+                lru.splice(lru.begin(), lru, found->second);
+                while (!entry->ready) pthread_cond_wait(&loaded_cond, &mutex);
+                pthread_mutex_unlock(&mutex);
+                if (entry->failed) return nullptr;
+                hits++;
+                bytes_saved += entry->size;
+                return entry;
+            }
+            if (entry->ready) remove_locked(found->second);     // File đã đổi nội dung
+        }
+
+        auto entry = make_shared<CachedFile>();
+        entry->path = path;
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+        bool indexed = !index.count(path);      // Bản cũ đang nạp dở thì không thay chỗ
+        if (indexed) {
+            lru.push_front(entry);
+            index[path] = lru.begin();
+            bytes += entry->size;
+        }
+        misses++;
+        pthread_mutex_unlock(&mutex);
+
+        // Đọc đĩa ngoài khóa; các thread cùng file chờ trên loaded_cond
+        bool ok = read_all(fd, entry->data, entry->size);
+
+        pthread_mutex_lock(&mutex);
+        entry->ready = true;
+        entry->failed = !ok;
+        if (indexed) {
+            auto it = index.find(path);
+            if (!ok && it != index.end() && *it->second == entry) remove_locked(it->second);
+            evict_locked();
+        }
+        pthread_cond_broadcast(&loaded_cond);
+        pthread_mutex_unlock(&mutex);
+
+        return ok ? entry : nullptr;
+    }
+
+    // Base64 của entry do acquire trả về, mã hóa một lần rồi dùng chung. Khi
+    // entry còn trong cache, base64 được tính vào bytes (có thể đẩy entry khác
+    // ra). Chuỗi không đổi sau khi tạo - caller đọc qua tham chiếu khi còn giữ entry
+    const string& base64(const shared_ptr<CachedFile>& entry) {
+        pthread_mutex_lock(&entry->base64_mutex);
+        bool created = !entry->has_base64;
+        if (created) {
+            entry->base64 = base64_encode(entry->data);
+            entry->has_base64 = true;
+        }
+        pthread_mutex_unlock(&entry->base64_mutex);
+
+        if (created) {
+            pthread_mutex_lock(&mutex);
+            auto it = index.find(entry->path);
+            if (it != index.end() && *it->second == entry) {
+                entry->base64_charged = entry->base64.size();
+                bytes += entry->base64_charged;
+                evict_locked();
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+        return entry->base64;
+    }
+
+    // File bị xóa khỏi đĩa -> bỏ khỏi cache
+    void invalidate(const string& path) {
+        pthread_mutex_lock(&mutex);
+        auto it = index.find(path);
+        if (it != index.end() && (*it->second)->ready) remove_locked(it->second);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void usage(size_t& entries, size_t& used) {
+        pthread_mutex_lock(&mutex);
+        entries = lru.size();
+        used = bytes;
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+#endif // FILE_CACHE_H
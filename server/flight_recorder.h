@@ -0,0 +1,321 @@
+/*
+ * FLIGHT RECORDER
+ *
+ * Mỗi thread có một ring cố định FLIGHT_RING_EVENTS sự kiện gần nhất, ghi
+ * đè sự kiện cũ: gói vào / ra (lệnh, kích thước, socket), lần chờ khóa, câu
+ * lệnh SQL (thao tác, thời gian, số dòng), handler chậm. Không có I/O, không
+ * khóa: ghi một sự kiện là vài phép gán vào bộ nhớ của chính thread.
+ *
+ * flight_dump() gom ring của mọi thread (kể cả thread đã kết thúc mà ring
+ * chưa được dùng lại), xếp theo thời gian và ghi ra file flight-<thời gian>.log
+ * trong thư mục chạy server. Được gọi khi nhận SIGUSR2 hoặc tự động bởi
+ * watchdog khi một handler (trừ lệnh truyền file PRIO_BULK) chạy quá
+ * FLIGHT_STALL_MS (đổi bằng biến môi trường FLIGHT_STALL_MS, 0 = tắt).
+ *
+ * Mỗi ô của ring có số thứ tự kiểu seqlock: thread dump đọc song song với
+ * thread đang ghi và bỏ ô đang bị ghi dở.
+ */
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <ctime>
+#include <cstdio>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define FLIGHT_RING_EVENTS 256                  // Lũy thừa của 2
+#define FLIGHT_SLOW_HANDLER_NS (100 * 1000000ull)
+#define FLIGHT_STALL_MS_DEFAULT 5000
+#define FLIGHT_WATCHDOG_INTERVAL_US 500000
+#define FLIGHT_AUTO_DUMP_COOLDOWN_S 60         // Tối đa một lần dump tự động mỗi khoảng này
+
+enum FlightEventType {
+    FLIGHT_PACKET_IN,       // command, value = byte body, socket
+    FLIGHT_PACKET_OUT,      // command, value = byte body, socket
+    FLIGHT_LOCK_WAIT,       // label = tên khóa, detail = call site, value = ns chờ
+    FLIGHT_DB_QUERY,        // label = thao tác, value = ns, extra = số dòng
+    FLIGHT_SLOW_HANDLER     // label = tên lệnh, command, value = ns
+};
+
+struct FlightEvent {
+    uint64_t time_ns;       // CLOCK_MONOTONIC
+    const char* label;      // Chuỗi tĩnh hoặc nullptr
+    const char* detail;
+    uint64_t value;
+    uint64_t extra;
+    int32_t command;
+    int32_t socket;
+    int32_t type;
+};
+
+struct FlightSlot {
+    atomic<uint32_t> seq;   // Lẻ = đang ghi
+    FlightEvent event;
+};
+
+struct FlightRing {
+    FlightSlot slots[FLIGHT_RING_EVENTS];
+    atomic<uint64_t> head;              // Tổng số sự kiện đã ghi
+    atomic<uint64_t> busy_since;        // Handler đang chạy từ lúc này (0 = rảnh)
+    atomic<int> busy_command;
+    atomic<int> tid;
+    atomic<bool> owned;
+    FlightRing* next;
+
+    FlightRing() : head(0), busy_since(0), busy_command(0), tid(0), owned(true), next(nullptr) {
+        for (FlightSlot& slot : slots) slot.seq.store(0, memory_order_relaxed);
+    }
+
+    void push(const FlightEvent& event) {
+        uint64_t h = head.load(memory_order_relaxed);
+        FlightSlot& slot = slots[h & (FLIGHT_RING_EVENTS - 1)];
+        uint32_t seq = slot.seq.load(memory_order_relaxed);
+        slot.seq.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        slot.event = event;
+        slot.seq.store(seq + 2, memory_order_release);
+        head.store(h + 1, memory_order_release);
+    }
+
+    // Bản sao các sự kiện còn trong ring (bỏ ô đang ghi dở)
+    void snapshot(vector<FlightEvent>& out) const {
+        uint64_t h = head.load(memory_order_acquire);
+        uint64_t start = h > FLIGHT_RING_EVENTS ? h - FLIGHT_RING_EVENTS : 0;
+        for (uint64_t i = start; i < h; i++) {
+            const FlightSlot& slot = slots[i & (FLIGHT_RING_EVENTS - 1)];
+            uint32_t before = slot.seq.load(memory_order_acquire);
+            FlightEvent event = slot.event;
+            atomic_thread_fence(memory_order_acquire);
+            if (before % 2 == 0 && slot.seq.load(memory_order_relaxed) == before) out.push_back(event);
+        }
+    }
+};
+
+inline atomic<FlightRing*> flight_rings(nullptr);
+inline atomic<uint64_t> flight_stall_ns(FLIGHT_STALL_MS_DEFAULT * 1000000ull);   // 0 = không tự dump
+
+inline uint64_t flight_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Ring của thread hiện tại: dùng lại ring của thread đã kết thúc nếu có
+inline FlightRing* flight_ring_acquire() {
+    FlightRing* ring = nullptr;
+    for (FlightRing* r = flight_rings.load(memory_order_acquire); r && !ring; r = r->next) {
+        bool expected = false;
+        if (!r->owned.load(memory_order_relaxed) &&
+            r->owned.compare_exchange_strong(expected, true, memory_order_acquire)) {
+            ring = r;
+        }
+    }
+    if (!ring) {
+        ring = new FlightRing();
+        FlightRing* first = flight_rings.load(memory_order_relaxed);
+        do {
+            ring->next = first;
+        } while (!flight_rings.compare_exchange_weak(first, ring, memory_order_release, memory_order_relaxed));
+    }
+    ring->tid.store((int)syscall(SYS_gettid), memory_order_relaxed);
+    return ring;
+}
+
+struct FlightRingHolder {
+    FlightRing* ring = nullptr;
+    ~FlightRingHolder() {
+        if (ring) {
+            ring->busy_since.store(0, memory_order_relaxed);
+            ring->owned.store(false, memory_order_release);
+        }
+    }
+};
+
+inline FlightRing* flight_thread_ring() {
+    thread_local FlightRingHolder holder;
+    if (!holder.ring) holder.ring = flight_ring_acquire();
+    return holder.ring;
+}
+
+inline void flight_record(FlightEventType type, const char* label, const char* detail, uint64_t value,
+                          uint64_t extra, int command, int socket) {
+    FlightEvent event = { flight_now_ns(), label, detail, value, extra, command, socket, type };
+    flight_thread_ring()->push(event);
+}
+
+inline void flight_packet_in(int command, size_t bytes, int socket) {
+    flight_record(FLIGHT_PACKET_IN, nullptr, nullptr, bytes, 0, command, socket);
+}
+
+inline void flight_packet_out(int command, size_t bytes, int socket) {
+    flight_record(FLIGHT_PACKET_OUT, nullptr, nullptr, bytes, 0, command, socket);
+}
+
+inline void flight_lock_wait(const char* lock, const char* site, uint64_t wait_ns) {
+    flight_record(FLIGHT_LOCK_WAIT, lock, site, wait_ns, 0, 0, -1);
+}
+
+inline void flight_db_query(const char* op, uint64_t duration_ns, uint64_t rows) {
+    flight_record(FLIGHT_DB_QUERY, op, nullptr, duration_ns, rows, 0, -1);
+}
+
+inline void flight_slow_handler(const char* name, int command, uint64_t duration_ns) {
+    flight_record(FLIGHT_SLOW_HANDLER, name, nullptr, duration_ns, 0, command, -1);
+}
+
+// Đánh dấu thread đang chạy handler (watchdog dựa vào đây để phát hiện treo);
+// lồng nhau (batch) thì chỉ lớp ngoài cùng có hiệu lực. watch = false cho lệnh
+// chạy lâu là bình thường (truyền file) - không tính là treo
+class FlightBusy {
+public:
+    explicit FlightBusy(int command, bool watch = true)
+        : ring(flight_thread_ring()), outer(watch && ring->busy_since.load(memory_order_relaxed) == 0) {
+        if (!outer) return;
+        ring->busy_command.store(command, memory_order_relaxed);
+        ring->busy_since.store(flight_now_ns(), memory_order_relaxed);
+    }
+    ~FlightBusy() {
+        if (outer) ring->busy_since.store(0, memory_order_relaxed);
+    }
+    FlightBusy(const FlightBusy&) = delete;
+    FlightBusy& operator=(const FlightBusy&) = delete;
+
+private:
+    FlightRing* ring;
+    bool outer;
+};
+
+// Handler dài nhưng vẫn đang tiến triển (từng lệnh con của batch): tính lại
+// mốc treo từ bây giờ
+inline void flight_progress() {
+    FlightRing* ring = flight_thread_ring();
+    if (ring->busy_since.load(memory_order_relaxed) != 0) ring->busy_since.store(flight_now_ns(), memory_order_relaxed);
+}
+
+// ===== DUMP =====
+
+inline const char* flight_type_name(int type) {
+    switch (type) {
+        case FLIGHT_PACKET_IN: return "in";
+        case FLIGHT_PACKET_OUT: return "out";
+        case FLIGHT_LOCK_WAIT: return "lock_wait";
+        case FLIGHT_DB_QUERY: return "db";
+        default: return "slow_handler";
+    }
+}
+
+// Ghi mọi ring ra file, trả về tên file ("" nếu không mở được)
+inline string flight_dump(const string& reason) {
+    static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&dump_mutex);
+
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    int64_t offset_ns = ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000 + (real.tv_nsec - mono.tv_nsec);
+    uint64_t now = (uint64_t)mono.tv_sec * 1000000000ull + mono.tv_nsec;
+
+    char stamp[32], path[64];
+    struct tm tm;
+    localtime_r(&real.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(path, sizeof(path), "flight-%s-%03ld.log", stamp, real.tv_nsec / 1000000);
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        pthread_mutex_unlock(&dump_mutex);
+        return "";
+    }
+
+    fprintf(file, "# flight recorder dump: %s\n", reason.c_str());
+    vector<pair<FlightEvent, int>> events;      // (sự kiện, tid)
+    vector<FlightEvent> ring_events;
+    for (FlightRing* ring = flight_rings.load(memory_order_acquire); ring; ring = ring->next) {
+        int tid = ring->tid.load(memory_order_relaxed);
+        uint64_t since = ring->busy_since.load(memory_order_relaxed);
+        if (since && since < now) {
+            fprintf(file, "# busy: tid %d command %d for %.1f ms\n", tid,
+                    ring->busy_command.load(memory_order_relaxed), (now - since) / 1e6);
+        }
+        ring_events.clear();
+        ring->snapshot(ring_events);
+        for (const FlightEvent& event : ring_events) events.push_back({ event, tid });
+    }
+    stable_sort(events.begin(), events.end(), [](const pair<FlightEvent, int>& a, const pair<FlightEvent, int>& b) {
+        return a.first.time_ns < b.first.time_ns;
+    });
+
+    for (const auto& entry : events) {
+        const FlightEvent& event = entry.first;
+        int64_t wall_ns = (int64_t)event.time_ns + offset_ns;
+        time_t sec = wall_ns / 1000000000;
+        localtime_r(&sec, &tm);
+        char when[32];
+        strftime(when, sizeof(when), "%H:%M:%S", &tm);
+        fprintf(file, "%s.%06lld tid=%d %s", when, (long long)(wall_ns % 1000000000) / 1000, entry.second,
+                flight_type_name(event.type));
+        switch (event.type) {
+            case FLIGHT_PACKET_IN:
+            case FLIGHT_PACKET_OUT:
+                fprintf(file, " command=%d bytes=%llu socket=%d\n", event.command,
+                        (unsigned long long)event.value, event.socket);
+                break;
+            case FLIGHT_LOCK_WAIT:
+                fprintf(file, " lock=%s site=%s wait_us=%.1f\n", event.label,
+                        event.detail ? event.detail : "?", event.value / 1e3);
+                break;
+            case FLIGHT_DB_QUERY:
+                fprintf(file, " op=%s ms=%.3f rows=%llu\n", event.label, event.value / 1e6,
+                        (unsigned long long)event.extra);
+                break;
+            default:
+                fprintf(file, " command=%d name=%s ms=%.3f\n", event.command, event.label, event.value / 1e6);
+        }
+    }
+    fclose(file);
+    pthread_mutex_unlock(&dump_mutex);
+    return path;
+}
+
+// Gọi sau mỗi lần watchdog tự dump (để ghi log)
+inline void (*flight_on_auto_dump)(const string& path, const string& reason) = nullptr;
+
+// Thread nền: dump một lần khi có handler chạy quá flight_stall_ns
+inline void* flight_watchdog_thread(void*) {
+    uint64_t last_dump = 0;
+    while (true) {
+        usleep(FLIGHT_WATCHDOG_INTERVAL_US);
+        uint64_t stall = flight_stall_ns.load(memory_order_relaxed);
+        uint64_t now = flight_now_ns();
+        if (stall == 0 || (last_dump && now - last_dump < FLIGHT_AUTO_DUMP_COOLDOWN_S * 1000000000ull)) continue;
+
+        for (FlightRing* ring = flight_rings.load(memory_order_acquire); ring; ring = ring->next) {
+            uint64_t since = ring->busy_since.load(memory_order_relaxed);
+            if (since == 0 || since > now || now - since < stall) continue;
+            string reason = "stall: tid " + to_string(ring->tid.load(memory_order_relaxed)) + " command " +
+                            to_string(ring->busy_command.load(memory_order_relaxed)) + " busy " +
+                            to_string((now - since) / 1000000) + " ms";
+            string path = flight_dump(reason);
+            if (flight_on_auto_dump) flight_on_auto_dump(path, reason);
+            last_dump = now;
+            break;
+        }
+    }
+    return nullptr;
+}
+
+inline void flight_start_watchdog(void (*on_dump)(const string& path, const string& reason)) {
+    flight_on_auto_dump = on_dump;
+    pthread_t thread;
+    pthread_create(&thread, nullptr, flight_watchdog_thread, nullptr);
+    pthread_detach(thread);
+}
+
+#endif // FLIGHT_RECORDER_H
@@ -0,0 +1,121 @@
+/*
+ * HISTOGRAM ĐỘ TRỄ (KIỂU HDR, LOG-TUYẾN TÍNH)
+ *
+ * Giá trị tính bằng ns. Mỗi khoảng [2^k, 2^(k+1)) được chia thành
+ * 2^LATENCY_SUB_BITS bucket bằng nhau, nên sai số tương đối của một
+ * percentile không quá 1/2^LATENCY_SUB_BITS (12.5%) ở mọi thang đo, từ vài
+ * µs tới vài phút, với số bucket cố định.
+ *
+ * Ghi không cần khóa: mỗi histogram có LATENCY_SHARDS bản, mỗi thread ghi
+ * vào bản của mình (chọn lần lượt khi thread ghi lần đầu) bằng atomic
+ * relaxed, các bản nằm trên cache line riêng nên thread không tranh nhau.
+ * Server chạy một thread mỗi kết nối nên không cấp riêng cho từng thread.
+ * snapshot() cộng các bản lại để tính percentile.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+#define LATENCY_SUB_BITS 3          // 8 bucket mỗi lũy thừa 2
+#define LATENCY_MAX_BITS 40         // Giá trị lớn nhất phân biệt được ~2^40 ns (~18 phút)
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define LATENCY_SHARDS 8
+
+inline int latency_bucket(uint64_t ns) {
+    if (ns < (1u << LATENCY_SUB_BITS)) return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= LATENCY_MAX_BITS) return LATENCY_BUCKETS - 1;
+    int sub = (int)(ns >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+    return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+// Giá trị lớn nhất thuộc bucket (percentile báo theo cận trên)
+inline uint64_t latency_bucket_upper(int index) {
+    if (index < (1 << LATENCY_SUB_BITS)) return index;
+    int msb = (index >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    uint64_t sub = index & ((1 << LATENCY_SUB_BITS) - 1);
+    uint64_t width = 1ull << (msb - LATENCY_SUB_BITS);
+    return (1ull << msb) + sub * width + width - 1;
+}
+
+// Thread đang chạy ghi vào bản nào
+inline int latency_shard() {
+    static atomic<int> next_shard(0);
+    thread_local int shard = next_shard++ % LATENCY_SHARDS;
+    return shard;
+}
+
+struct LatencySnapshot {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+
+    uint64_t mean_ns() const { return count ? sum_ns / count : 0; }
+
+    // q trong [0, 1], ví dụ 0.99 -> p99
+    uint64_t percentile_ns(double q) const {
+        if (count == 0) return 0;
+        uint64_t rank = (uint64_t)(q * count);
+        if (rank >= count) rank = count - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen > rank) {
+                uint64_t upper = latency_bucket_upper(i);
+                return upper < max_ns ? upper : max_ns;
+            }
+        }
+        return max_ns;
+    }
+};
+
+class LatencyHistogram {
+public:
+    LatencyHistogram() {
+        for (Shard& shard : shards) {
+            for (auto& bucket : shard.buckets) bucket.store(0, memory_order_relaxed);
+            shard.count.store(0, memory_order_relaxed);
+            shard.sum_ns.store(0, memory_order_relaxed);
+            shard.max_ns.store(0, memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t ns) {
+        Shard& shard = shards[latency_shard()];
+        shard.buckets[latency_bucket(ns)].fetch_add(1, memory_order_relaxed);
+        shard.count.fetch_add(1, memory_order_relaxed);
+        shard.sum_ns.fetch_add(ns, memory_order_relaxed);
+        uint64_t prev_max = shard.max_ns.load(memory_order_relaxed);
+        while (ns > prev_max && !shard.max_ns.compare_exchange_weak(prev_max, ns, memory_order_relaxed)) {}
+    }
+
+    // Cộng các bản lại (không chặn thread đang ghi, kết quả có thể lệch vài mẫu)
+    void snapshot(LatencySnapshot& out) const {
+        out.count = out.sum_ns = out.max_ns = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) out.buckets[i] = 0;
+        for (const Shard& shard : shards) {
+            for (int i = 0; i < LATENCY_BUCKETS; i++) out.buckets[i] += shard.buckets[i].load(memory_order_relaxed);
+            out.count += shard.count.load(memory_order_relaxed);
+            out.sum_ns += shard.sum_ns.load(memory_order_relaxed);
+            uint64_t max_ns = shard.max_ns.load(memory_order_relaxed);
+            if (max_ns > out.max_ns) out.max_ns = max_ns;
+        }
+    }
+
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> buckets[LATENCY_BUCKETS];
+        atomic<uint64_t> count;
+        atomic<uint64_t> sum_ns;
+        atomic<uint64_t> max_ns;
+    };
+    Shard shards[LATENCY_SHARDS];
+};
+
+#endif // LATENCY_HISTOGRAM_H
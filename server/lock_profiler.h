@@ -0,0 +1,202 @@
+/*
+ * ĐO TRANH CHẤP KHÓA
+ *
+ * ProfiledMutex bọc pthread_mutex_t và ghi vào LockProfile của nó:
+ *   - wait: thời gian chờ để lấy được khóa (0 khi lấy được ngay)
+ *   - hold: thời gian giữ khóa, từ lúc lấy được tới lúc mở
+ *   - theo call site: hàm đã gọi lock() (lấy bằng __builtin_FUNCTION nên
+ *     chỗ gọi không phải truyền gì), số lần lấy / phải chờ, tổng thời gian
+ *     chờ và giữ, histogram thời gian giữ theo lũy thừa 2.
+ * Các khóa cùng loại (ví dụ write_mutex của mọi Connection) dùng chung một
+ * LockProfile để cộng dồn. Mọi LockProfile tự đăng ký vào một danh sách,
+ * print_lock_stats() / cổng quản trị đọc danh sách này.
+ *
+ * Lấy khóa thử bằng trylock trước, nên khi không có tranh chấp chỉ tốn
+ * thêm hai lần đọc đồng hồ. Histogram có thể ghi không cần khóa (xem
+ * latency_histogram.h); số liệu theo call site dùng atomic relaxed. Lần
+ * phải chờ được ghi thêm vào flight recorder (flight_recorder.h).
+ */
+
+#ifndef LOCK_PROFILER_H
+#define LOCK_PROFILER_H
+
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <cstdint>
+#include "latency_histogram.h"
+#include "flight_recorder.h"
+
+using namespace std;
+
+#define LOCK_SITES 32           // Số call site phân biệt mỗi khóa; vượt quá thì gộp vào "(other)"
+#define LOCK_SITE_BUCKETS 41    // Bucket i: thời gian giữ trong [2^(i-1), 2^i) ns
+
+inline uint64_t lock_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct LockSiteStats {
+    atomic<const char*> site;
+    atomic<uint64_t> acquires;
+    atomic<uint64_t> contended;
+    atomic<uint64_t> wait_ns;
+    atomic<uint64_t> hold_ns;
+    atomic<uint64_t> max_hold_ns;
+    atomic<uint64_t> hold_buckets[LOCK_SITE_BUCKETS];
+
+    // Cận trên thời gian giữ ở percentile q (theo lũy thừa 2)
+    uint64_t hold_percentile_ns(double q) const {
+        uint64_t count = acquires.load(memory_order_relaxed);
+        if (count == 0) return 0;
+        uint64_t rank = (uint64_t)(q * count);
+        uint64_t seen = 0;
+        for (int i = 0; i < LOCK_SITE_BUCKETS; i++) {
+            seen += hold_buckets[i].load(memory_order_relaxed);
+            if (seen > rank) {
+                uint64_t upper = i == 0 ? 0 : (1ull << i) - 1;
+                uint64_t max_ns = max_hold_ns.load(memory_order_relaxed);
+                return upper < max_ns ? upper : max_ns;
+            }
+        }
+        return max_hold_ns.load(memory_order_relaxed);
+    }
+};
+
+class LockProfile {
+public:
+    const char* name;
+    LatencyHistogram wait;
+    LatencyHistogram hold;
+    atomic<uint64_t> contended;     // Số lần trylock thất bại, phải chờ
+
+    explicit LockProfile(const char* lock_name) : name(lock_name), contended(0), next(nullptr) {
+        for (LockSiteStats& stats : sites) {
+            stats.site.store(nullptr, memory_order_relaxed);
+            stats.acquires.store(0, memory_order_relaxed);
+            stats.contended.store(0, memory_order_relaxed);
+            stats.wait_ns.store(0, memory_order_relaxed);
+            stats.hold_ns.store(0, memory_order_relaxed);
+            stats.max_hold_ns.store(0, memory_order_relaxed);
+            for (auto& bucket : stats.hold_buckets) bucket.store(0, memory_order_relaxed);
+        }
+        // Đăng ký (chỉ thêm vào đầu, không bao giờ gỡ)
+        next = registry().load(memory_order_relaxed);
+        while (!registry().compare_exchange_weak(next, this, memory_order_release, memory_order_relaxed)) {}
+    }
+
+    void record_wait(const char* site, uint64_t ns) {
+        LockSiteStats& stats = site_stats(site);
+        stats.acquires.fetch_add(1, memory_order_relaxed);
+        wait.record(ns);
+        if (ns > 0) {
+            contended.fetch_add(1, memory_order_relaxed);
+            stats.contended.fetch_add(1, memory_order_relaxed);
+            stats.wait_ns.fetch_add(ns, memory_order_relaxed);
+        }
+    }
+
+    void record_hold(const char* site, uint64_t ns) {
+        LockSiteStats& stats = site_stats(site);
+        hold.record(ns);
+        stats.hold_ns.fetch_add(ns, memory_order_relaxed);
+        int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+        if (bucket >= LOCK_SITE_BUCKETS) bucket = LOCK_SITE_BUCKETS - 1;
+        stats.hold_buckets[bucket].fetch_add(1, memory_order_relaxed);
+        uint64_t prev_max = stats.max_hold_ns.load(memory_order_relaxed);
+        while (ns > prev_max && !stats.max_hold_ns.compare_exchange_weak(prev_max, ns, memory_order_relaxed)) {}
+    }
+
+    // Các call site đã ghi nhận (slot còn trống có site == nullptr)
+    const LockSiteStats* site_table() const { return sites; }
+
+    static LockProfile* first() { return registry().load(memory_order_acquire); }
+    LockProfile* following() const { return next; }
+
+private:
+    LockSiteStats sites[LOCK_SITES];
+    LockProfile* next;
+
+    static atomic<LockProfile*>& registry() {
+        static atomic<LockProfile*> head(nullptr);
+        return head;
+    }
+
+    // Slot của site: dò tuyến tính theo địa chỉ chuỗi tên hàm, chiếm slot trống
+    // bằng CAS; bảng đầy thì dùng slot cuối làm "(other)"
+    LockSiteStats& site_stats(const char* site) {
+        size_t start = ((uintptr_t)site >> 4) % (LOCK_SITES - 1);
+        for (size_t i = 0; i < LOCK_SITES - 1; i++) {
+            LockSiteStats& stats = sites[(start + i) % (LOCK_SITES - 1)];
+            const char* current = stats.site.load(memory_order_acquire);
+            if (current == site) return stats;
+            if (current == nullptr) {
+                if (stats.site.compare_exchange_strong(current, site, memory_order_acq_rel)) return stats;
+                if (current == site) return stats;
+            }
+        }
+        LockSiteStats& other = sites[LOCK_SITES - 1];
+        const char* none = nullptr;
+        other.site.compare_exchange_strong(none, "(other)", memory_order_acq_rel);
+        return other;
+    }
+};
+
+class ProfiledMutex {
+public:
+    // Khóa có số liệu riêng, tên hiện trong bảng thống kê
+    explicit ProfiledMutex(const char* name) : profile(*new LockProfile(name)) { init(); }
+    // Khóa dùng chung số liệu với các khóa cùng loại
+    explicit ProfiledMutex(LockProfile& shared) : profile(shared) { init(); }
+    ~ProfiledMutex() { pthread_mutex_destroy(&mutex); }
+
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+    void lock(const char* site = __builtin_FUNCTION()) {
+        uint64_t waited = 0;
+        if (pthread_mutex_trylock(&mutex) != 0) {
+            uint64_t start = lock_now_ns();
+            pthread_mutex_lock(&mutex);
+            locked_at = lock_now_ns();
+            waited = locked_at - start;
+            if (waited == 0) waited = 1;    // Vẫn tính là có tranh chấp
+            flight_lock_wait(profile.name, site, waited);
+        } else {
+            locked_at = lock_now_ns();
+        }
+        holder = site;
+        profile.record_wait(site, waited);
+    }
+
+    void unlock() {
+        profile.record_hold(holder, lock_now_ns() - locked_at);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // pthread_cond_wait trên khóa này: thời gian nằm chờ điều kiện không
+    // tính là giữ khóa, lần giữ sau khi thức dậy ghi cho cùng call site
+    void wait(pthread_cond_t& cond) {
+        const char* site = holder;
+        profile.record_hold(site, lock_now_ns() - locked_at);
+        pthread_cond_wait(&cond, &mutex);
+        locked_at = lock_now_ns();
+        holder = site;
+    }
+
+private:
+    pthread_mutex_t mutex;
+    LockProfile& profile;
+    const char* holder;         // Call site đang giữ (chỉ đổi khi đang giữ khóa)
+    uint64_t locked_at;
+
+    void init() {
+        pthread_mutex_init(&mutex, nullptr);
+        holder = nullptr;
+        locked_at = 0;
+    }
+};
+
+#endif // LOCK_PROFILER_H
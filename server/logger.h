@@ -0,0 +1,372 @@
+/*
+ * LOG BẤT ĐỒNG BỘ
+ *
+ * Thay cho "cout << ... << endl" trên đường xử lý request: endl flush
+ * stdout mỗi dòng và mọi thread tranh nhau khóa của cout. Ở đây thread gọi
+ * log chỉ định dạng dòng vào buffer của mình rồi chép vào ring buffer riêng
+ * của thread (một producer - một consumer, không khóa); thread ghi log chạy
+ * nền gom bản ghi từ mọi ring, xếp theo thời gian và ghi ra stdout thành
+ * từng khối.
+ *
+ *   LOG_INFO("Private message", "from", from_username, "to", target_username);
+ *   -> 2026-10-19 10:00:00.123 ✓ Private message from=alice to=bob
+ *
+ * - Mức log: DEBUG / INFO / WARN / ERROR, mức tối thiểu lấy từ biến môi
+ *   trường LOG_LEVEL (mặc định info); dòng dưới mức bị bỏ trước khi định dạng.
+ * - Giới hạn tốc độ: mỗi chỗ gọi log ghi tối đa LOG_SITE_MAX_PER_SEC dòng mỗi
+ *   giây, phần vượt bị bỏ và được báo bằng trường suppressed=N ở dòng kế tiếp.
+ * - Ring đầy (thread ghi log không theo kịp) -> dòng bị bỏ, không bao giờ
+ *   chặn thread đang xử lý request; số dòng bị bỏ được báo định kỳ.
+ *
+ * Server chạy một thread mỗi kết nối nên ring được cấp khi thread log lần
+ * đầu và được thread khác dùng lại sau khi thread cũ kết thúc.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+#define LOG_RING_SIZE (16 * 1024)       // Byte mỗi ring (lũy thừa của 2)
+#define LOG_LINE_MAX 1024               // Dòng dài hơn bị cắt
+#define LOG_SITE_MAX_PER_SEC 200
+#define LOG_IDLE_SLEEP_US 2000          // Thread ghi log nghỉ khi không có gì để ghi
+
+enum LogLevel {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+inline atomic<int> log_min_level(LOG_LEVEL_INFO);
+inline atomic<uint64_t> log_dropped(0);         // Ring đầy
+inline atomic<uint64_t> log_suppressed(0);      // Vượt giới hạn tốc độ
+
+inline const char* log_level_mark(int level) {
+    switch (level) {
+        case LOG_LEVEL_DEBUG: return "·";
+        case LOG_LEVEL_INFO: return "✓";
+        case LOG_LEVEL_WARN: return "⚠";
+        default: return "❌";
+    }
+}
+
+// ===== RING BUFFER =====
+// Bản ghi: [u32 độ dài text][u32 level][i64 thời gian ns][text], có thể vắt
+// qua cuối buffer. head chỉ do thread sở hữu tăng, tail chỉ do consumer tăng.
+
+struct LogRecordHeader {
+    uint32_t length;
+    uint32_t level;
+    int64_t time_ns;
+};
+
+struct LogRing {
+    char buf[LOG_RING_SIZE];
+    atomic<uint64_t> head;
+    atomic<uint64_t> tail;
+    atomic<bool> owned;         // Đang có thread dùng
+    LogRing* next;              // Danh sách mọi ring (chỉ thêm, không xóa)
+
+    LogRing() : head(0), tail(0), owned(true), next(nullptr) {}
+
+    void copy_in(uint64_t pos, const void* data, size_t len) {
+        size_t at = pos & (LOG_RING_SIZE - 1);
+        size_t first = min(len, (size_t)LOG_RING_SIZE - at);
+        memcpy(buf + at, data, first);
+        memcpy(buf, (const char*)data + first, len - first);
+    }
+
+    void copy_out(uint64_t pos, void* data, size_t len) const {
+        size_t at = pos & (LOG_RING_SIZE - 1);
+        size_t first = min(len, (size_t)LOG_RING_SIZE - at);
+        memcpy(data, buf + at, first);
+        memcpy((char*)data + first, buf, len - first);
+    }
+
+    // Producer: false nếu không đủ chỗ
+    bool push(int level, int64_t time_ns, const char* text, size_t len) {
+        size_t need = sizeof(LogRecordHeader) + len;
+        uint64_t h = head.load(memory_order_relaxed);
+        if (LOG_RING_SIZE - (h - tail.load(memory_order_acquire)) < need) return false;
+        LogRecordHeader header = { (uint32_t)len, (uint32_t)level, time_ns };
+        copy_in(h, &header, sizeof(header));
+        copy_in(h + sizeof(header), text, len);
+        head.store(h + need, memory_order_release);
+        return true;
+    }
+};
+
+inline atomic<LogRing*> log_rings(nullptr);
+
+// Ring của thread hiện tại: dùng lại ring của thread đã kết thúc nếu có
+inline LogRing* log_ring_acquire() {
+    for (LogRing* ring = log_rings.load(memory_order_acquire); ring; ring = ring->next) {
+        bool expected = false;
+        if (!ring->owned.load(memory_order_relaxed) &&
+            ring->owned.compare_exchange_strong(expected, true, memory_order_acquire)) {
+            return ring;
+        }
+    }
+    LogRing* ring = new LogRing();
+    LogRing* first = log_rings.load(memory_order_relaxed);
+    do {
+        ring->next = first;
+    } while (!log_rings.compare_exchange_weak(first, ring, memory_order_release, memory_order_relaxed));
+    return ring;
+}
+
+// Trả ring lại khi thread kết thúc (phần chưa ghi vẫn được consumer đọc tiếp)
+struct LogRingHolder {
+    LogRing* ring = nullptr;
+    ~LogRingHolder() {
+        if (ring) ring->owned.store(false, memory_order_release);
+    }
+};
+
+inline LogRing* log_thread_ring() {
+    thread_local LogRingHolder holder;
+    if (!holder.ring) holder.ring = log_ring_acquire();
+    return holder.ring;
+}
+
+// ===== ĐỊNH DẠNG =====
+
+struct LogLine {
+    char text[LOG_LINE_MAX];
+    size_t len = 0;
+
+    void append(const char* s, size_t n) {
+        n = min(n, LOG_LINE_MAX - len);
+        memcpy(text + len, s, n);
+        len += n;
+    }
+    void append(const char* s) { append(s, strlen(s)); }
+};
+
+// Giá trị có khoảng trắng / dấu '"' / xuống dòng được đặt trong ngoặc kép
+inline void log_append_string(LogLine& line, const char* s, size_t n) {
+    bool quote = n == 0;
+    for (size_t i = 0; i < n && !quote; i++) {
+        quote = s[i] == ' ' || s[i] == '"' || s[i] == '\n' || s[i] == '=';
+    }
+    if (!quote) {
+        line.append(s, n);
+        return;
+    }
+    line.append("\"", 1);
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '"') line.append("\\\"", 2);
+        else if (s[i] == '\n') line.append("\\n", 2);
+        else line.append(s + i, 1);
+    }
+    line.append("\"", 1);
+}
+
+inline void log_append_value(LogLine& line, const string& value) {
+    log_append_string(line, value.data(), value.size());
+}
+
+inline void log_append_value(LogLine& line, const char* value) {
+    log_append_string(line, value, strlen(value));
+}
+
+inline void log_append_value(LogLine& line, bool value) {
+    line.append(value ? "true" : "false");
+}
+
+template <typename T>
+typename enable_if<is_integral<T>::value>::type log_append_value(LogLine& line, T value) {
+    char buf[24];
+    int n = is_signed<T>::value ? snprintf(buf, sizeof(buf), "%lld", (long long)value)
+                                : snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+    line.append(buf, n);
+}
+
+inline void log_append_value(LogLine& line, double value) {
+    char buf[32];
+    line.append(buf, snprintf(buf, sizeof(buf), "%.3f", value));
+}
+
+inline void log_append_fields(LogLine&) {}
+
+template <typename V, typename... Rest>
+void log_append_fields(LogLine& line, const char* key, const V& value, const Rest&... rest) {
+    line.append(" ", 1);
+    line.append(key);
+    line.append("=", 1);
+    log_append_value(line, value);
+    log_append_fields(line, rest...);
+}
+
+// ===== GIỚI HẠN TỐC ĐỘ =====
+// Mỗi chỗ gọi LOG_* có một LogSite tĩnh, đếm số dòng trong giây hiện tại
+
+struct LogSite {
+    atomic<int64_t> second;
+    atomic<uint32_t> count;
+    atomic<uint64_t> suppressed;
+    LogSite() : second(0), count(0), suppressed(0) {}
+};
+
+inline bool log_site_allow(LogSite& site, int64_t now_sec, uint64_t& suppressed) {
+    int64_t current = site.second.load(memory_order_relaxed);
+    if (current != now_sec && site.second.compare_exchange_strong(current, now_sec, memory_order_relaxed)) {
+        site.count.store(0, memory_order_relaxed);
+    }
+    if (site.count.fetch_add(1, memory_order_relaxed) >= LOG_SITE_MAX_PER_SEC) {
+        site.suppressed.fetch_add(1, memory_order_relaxed);
+        log_suppressed.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    suppressed = site.suppressed.exchange(0, memory_order_relaxed);
+    return true;
+}
+
+template <typename... Fields>
+void log_write(LogSite& site, int level, const char* message, const Fields&... fields) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t suppressed = 0;
+    if (!log_site_allow(site, ts.tv_sec, suppressed)) return;
+
+    thread_local LogLine line;
+    line.len = 0;
+    line.append(message);
+    log_append_fields(line, fields...);
+    if (suppressed > 0) log_append_fields(line, "suppressed", suppressed);
+
+    int64_t time_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (!log_thread_ring()->push(level, time_ns, line.text, line.len)) {
+        log_dropped.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) >= log_min_level.load(memory_order_relaxed)) { \
+            static LogSite log_site_; \
+            log_write(log_site_, (level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// ===== THREAD GHI LOG =====
+
+struct LogEntry {
+    int64_t time_ns;
+    int level;
+    string text;
+};
+
+inline pthread_mutex_t log_consumer_mutex = PTHREAD_MUTEX_INITIALIZER;     // Chỉ một consumer đọc ring
+
+inline void log_write_all(const string& out) {
+    const char* p = out.data();
+    size_t left = out.size();
+    while (left > 0) {
+        ssize_t n = write(STDOUT_FILENO, p, left);
+        if (n <= 0) return;
+        p += n;
+        left -= n;
+    }
+}
+
+// Ghi mọi bản ghi đang chờ ra stdout; trả về số dòng đã ghi
+inline size_t log_flush() {
+    static vector<LogEntry> entries;
+    static string out;
+    static uint64_t reported_dropped = 0;
+    static int64_t cached_second = -1;
+    static char cached_prefix[32];
+
+    pthread_mutex_lock(&log_consumer_mutex);
+    entries.clear();
+    for (LogRing* ring = log_rings.load(memory_order_acquire); ring; ring = ring->next) {
+        uint64_t tail = ring->tail.load(memory_order_relaxed);
+        uint64_t head = ring->head.load(memory_order_acquire);
+        while (tail < head) {
+            LogRecordHeader header;
+            ring->copy_out(tail, &header, sizeof(header));
+            LogEntry entry;
+            entry.time_ns = header.time_ns;
+            entry.level = header.level;
+            entry.text.resize(header.length);
+            ring->copy_out(tail + sizeof(header), &entry.text[0], header.length);
+            entries.push_back(move(entry));
+            tail += sizeof(header) + header.length;
+        }
+        ring->tail.store(tail, memory_order_release);
+    }
+    stable_sort(entries.begin(), entries.end(),
+                [](const LogEntry& a, const LogEntry& b) { return a.time_ns < b.time_ns; });
+
+    out.clear();
+    for (const LogEntry& entry : entries) {
+        int64_t second = entry.time_ns / 1000000000;
+        if (second != cached_second) {
+            time_t t = (time_t)second;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            strftime(cached_prefix, sizeof(cached_prefix), "%Y-%m-%d %H:%M:%S", &tm);
+            cached_second = second;
+        }
+        char millis[8];
+        snprintf(millis, sizeof(millis), ".%03d ", (int)(entry.time_ns / 1000000 % 1000));
+        out += cached_prefix;
+        out += millis;
+        out += log_level_mark(entry.level);
+        out += ' ';
+        out += entry.text;
+        out += '\n';
+    }
+    uint64_t dropped = log_dropped.load(memory_order_relaxed);
+    if (dropped != reported_dropped) {
+        out += "⚠ log: dropped " + to_string(dropped - reported_dropped) + " lines (ring buffer full)\n";
+        reported_dropped = dropped;
+    }
+    log_write_all(out);
+    size_t written = entries.size();
+    pthread_mutex_unlock(&log_consumer_mutex);
+    return written;
+}
+
+inline void* log_writer_thread(void*) {
+    while (true) {
+        if (log_flush() == 0) usleep(LOG_IDLE_SLEEP_US);
+    }
+    return nullptr;
+}
+
+// Đọc LOG_LEVEL (debug / info / warn / error) và chạy thread ghi log
+inline void log_start() {
+    const char* env = getenv("LOG_LEVEL");
+    if (env) {
+        string level = env;
+        if (level == "debug") log_min_level = LOG_LEVEL_DEBUG;
+        else if (level == "warn") log_min_level = LOG_LEVEL_WARN;
+        else if (level == "error") log_min_level = LOG_LEVEL_ERROR;
+    }
+    pthread_t thread;
+    pthread_create(&thread, nullptr, log_writer_thread, nullptr);
+    pthread_detach(thread);
+}
+
+#endif // LOGGER_H
@@ -0,0 +1,71 @@
+/*
+ * SỐ LIỆU TRUY VẤN DATABASE
+ *
+ * DBManager báo mỗi câu lệnh SQL qua QueryObserver (xem db_manager.h);
+ * QueryStatsTable cộng dồn theo thao tác (tên hàm DBManager): số câu lệnh,
+ * số dòng, số lỗi, số câu chậm và histogram độ trễ.
+ *
+ * Mỗi thao tác có một slot, cấp lần đầu bằng CAS nên ghi không cần khóa;
+ * số thao tác là cố định (các hàm của DBManager), vượt quá QUERY_OPS thì
+ * gộp vào slot cuối "(other)".
+ */
+
+#ifndef QUERY_STATS_H
+#define QUERY_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include "latency_histogram.h"
+
+using namespace std;
+
+#define QUERY_OPS 64
+
+struct QueryStats {
+    const char* op;
+    atomic<uint64_t> queries;
+    atomic<uint64_t> rows;
+    atomic<uint64_t> errors;
+    atomic<uint64_t> slow;
+    LatencyHistogram latency;
+
+    explicit QueryStats(const char* name) : op(name), queries(0), rows(0), errors(0), slow(0) {}
+};
+
+class QueryStatsTable {
+public:
+    QueryStatsTable() {
+        for (auto& slot : slots) slot.store(nullptr, memory_order_relaxed);
+    }
+
+    QueryStats& get(const char* op) {
+        size_t start = ((uintptr_t)op >> 4) % (QUERY_OPS - 1);
+        for (size_t i = 0; i < QUERY_OPS - 1; i++) {
+            atomic<QueryStats*>& slot = slots[(start + i) % (QUERY_OPS - 1)];
+            QueryStats* stats = slot.load(memory_order_acquire);
+            if (stats == nullptr) {
+                QueryStats* created = new QueryStats(op);
+                if (slot.compare_exchange_strong(stats, created, memory_order_acq_rel)) return *created;
+                delete created;     // Thread khác vừa chiếm slot, xem nó là thao tác nào
+            }
+            if (stats->op == op || strcmp(stats->op, op) == 0) return *stats;
+        }
+        atomic<QueryStats*>& other = slots[QUERY_OPS - 1];
+        QueryStats* stats = other.load(memory_order_acquire);
+        if (stats == nullptr) {
+            QueryStats* created = new QueryStats("(other)");
+            if (other.compare_exchange_strong(stats, created, memory_order_acq_rel)) return *created;
+            delete created;
+        }
+        return *stats;
+    }
+
+    // Slot i (nullptr nếu chưa dùng), i trong [0, QUERY_OPS)
+    const QueryStats* at(size_t i) const { return slots[i].load(memory_order_acquire); }
+
+private:
+    atomic<QueryStats*> slots[QUERY_OPS];
+};
+
+#endif // QUERY_STATS_H
@@ -3,7 +3,16 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <cerrno>
+#include <cstring>
+#include <cctype>
+#include <memory>
 #include <map>
 #include <string>
 #include <vector>
@@ -11,14 +20,62 @@
 #include <ctime>
 #include <sstream>
 #include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <csignal>
+#include <deque>
+#include <algorithm>
 #include "../common/protocol.h"
 #include "../common/json_helper.h"
+#include "../common/compression.h"
+#include "../common/sha256.h"
+#include "../common/crc32c.h"
+#include "../common/base64.h"
 #include "../database/db_manager.h"
+#include "command_table.h"
+#include "file_cache.h"
+#include "dir_syncer.h"
+#include "logger.h"
+#include "lock_profiler.h"
+#include "query_stats.h"
+#include "tracer.h"
+#include "flight_recorder.h"
 
 using namespace std;
 
-// ===== GLOBAL DATABASE =====
-DBManager* db = nullptr;
+// ===== DATABASE CONNECTION POOL =====
+// Mỗi thread mượn một kết nối MySQL riêng trong lúc thao tác database
+// (db_acquire/db_release), nên worker pool chạy được nhiều truy vấn song song
+#define DB_POOL_SIZE 8
+
+vector<DBManager*> db_pool;                 // Các kết nối đang rảnh
+thread_local DBManager* db = nullptr;       // Kết nối mà thread hiện tại đang giữ
+thread_local int db_depth = 0;              // Số lần db_acquire lồng nhau (batch giữ kết nối cho các lệnh con)
+
+// ===== PHASE TIMERS =====
+// Thời gian thread hiện tại đã dùng cho database / gửi dữ liệu; run_handler
+// lấy hiệu trước-sau handler để ghi histogram db / send của lệnh
+// Lệnh con của batch chạy trong lúc batch đã giữ kết nối (db_depth 2): mỗi
+// đoạn lồng được cộng vào db_time_ns ngay khi nhả, lần nhả ngoài cùng chỉ
+// cộng phần còn lại - lệnh con có thời gian db của mình, batch vẫn tính đúng
+// toàn bộ thời gian giữ kết nối, không đếm trùng.
+thread_local uint64_t db_time_ns = 0;
+thread_local uint64_t send_time_ns = 0;
+thread_local chrono::steady_clock::time_point db_acquired_at;
+thread_local chrono::steady_clock::time_point db_nested_at;    // Lúc bắt đầu đoạn lồng ở db_depth 2
+thread_local uint64_t db_nested_ns = 0;                        // Các đoạn lồng đã cộng từ lần lấy ngoài cùng
+
+inline uint64_t ns_since(chrono::steady_clock::time_point start) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// Cộng thời gian từ lúc tạo tới lúc ra khỏi scope vào total
+struct PhaseTimer {
+    uint64_t& total;
+    chrono::steady_clock::time_point start;
+    PhaseTimer(uint64_t& t) : total(t), start(chrono::steady_clock::now()) {}
+    ~PhaseTimer() { total += ns_since(start); }
+};
 
 // ===== IN-MEMORY CACHE FOR ONLINE USERS =====
 map<int, int> socket_to_userid;        // socket -> user_id
@@ -26,98 +83,305 @@ map<int, string> socket_to_username;   // socket -> username
 map<string, int> username_to_socket;   // username -> socket
 map<int, string> socket_to_token;      // socket -> token
 
+// ===== CONNECTIONS =====
+// Trạng thái theo từng kết nối: định dạng header đã thỏa thuận và khóa ghi
+// để các frame gửi từ nhiều thread không chen lẫn vào nhau
+LockProfile write_lock_profile("conn.write_mutex");         // Chung cho mọi Connection
+LockProfile inflight_lock_profile("conn.inflight_mutex");
+
+struct Connection {
+    int socket;
+    atomic<int> version;            // 0 = chưa biết, 1 = PacketHeader, 2 = WireHeader
+    ProfiledMutex write_mutex;
+    
+    // Số request của kết nối đang nằm trên worker pool; socket chỉ được
+    // close khi về 0 để phản hồi muộn không rơi vào socket đã cấp lại
+    int inflight;
+    ProfiledMutex inflight_mutex;
+    pthread_cond_t idle_cond;
+    
+    // Luồng nén server -> client, bật khi client yêu cầu lúc đăng nhập;
+    // chỉ dùng khi đang giữ write_mutex để thứ tự nén khớp thứ tự gửi
+    unique_ptr<FrameDeflater> deflater;
+    
+    // Kênh truyền file phụ (C_REQ_ATTACH_CHANNEL): không nằm trong
+    // username_to_socket, đóng kênh không làm user offline
+    atomic<bool> bulk;
+    
+    Connection(int sock) : socket(sock), version(0), write_mutex(write_lock_profile),
+                           inflight(0), inflight_mutex(inflight_lock_profile), bulk(false) {
+        pthread_cond_init(&idle_cond, NULL);
+    }
+    ~Connection() {
+        pthread_cond_destroy(&idle_cond);
+    }
+};
+
+map<int, shared_ptr<Connection>> connections;   // socket -> connection
+
 // ===== MUTEXES =====
-pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Các khóa dùng chung đều là ProfiledMutex (lock_profiler.h): thời gian chờ /
+// giữ khóa theo call site được in khi nhận SIGUSR1 và có trong cổng quản trị
+ProfiledMutex db_pool_mutex("db_pool_mutex");
+pthread_cond_t db_pool_cond = PTHREAD_COND_INITIALIZER;
+ProfiledMutex clients_mutex("clients_mutex");
+ProfiledMutex conn_mutex("conn_mutex");
+
+// Kết nối database cũng được đo như một khóa: wait là thời gian chờ pool,
+// hold là thời gian handler giữ kết nối
+LockProfile db_connection_profile("db_connection");
+thread_local const char* db_site = nullptr;
+thread_local uint64_t db_wait_ns = 0;
 
 // ===== HELPER FUNCTIONS =====
 
-void send_packet(int client_socket, int command, int status, const string& json_body) {
-    PacketHeader header(command, status);
-    header.body_length = json_body.length();
+// Mượn một kết nối database cho thread hiện tại (chờ nếu pool đã hết)
+void db_acquire(const char* site = __builtin_FUNCTION()) {
+    if (db_depth++ > 0) {
+        if (db_depth == 2) db_nested_at = chrono::steady_clock::now();
+        return;
+    }
+    db_acquired_at = chrono::steady_clock::now();   // Tính cả thời gian chờ pool
+    db_nested_ns = 0;
+    db_pool_mutex.lock();
+    bool waited = db_pool.empty();
+    while (db_pool.empty()) {
+        db_pool_mutex.wait(db_pool_cond);
+    }
+    db = db_pool.back();
+    db_pool.pop_back();
+    db_pool_mutex.unlock();
+    db_site = site;
+    db_wait_ns = waited ? max<uint64_t>(ns_since(db_acquired_at), 1) : 0;
+    db_connection_profile.record_wait(site, db_wait_ns);
+    if (waited) {
+        trace_complete("db_pool_wait", "db", trace_ns(db_acquired_at), db_wait_ns);
+        flight_lock_wait("db_connection", site, db_wait_ns);
+    }
+}
+
+// Trả kết nối về pool
+void db_release() {
+    if (--db_depth > 0) {
+        if (db_depth == 1) {
+            uint64_t nested = ns_since(db_nested_at);
+            db_time_ns += nested;
+            db_nested_ns += nested;
+        }
+        return;
+    }
+    uint64_t held = ns_since(db_acquired_at);
+    db_time_ns += held > db_nested_ns ? held - db_nested_ns : 0;
+    db_connection_profile.record_hold(db_site, held > db_wait_ns ? held - db_wait_ns : 0);
+    db_pool_mutex.lock();
+    db_pool.push_back(db);
+    db = nullptr;
+    pthread_cond_signal(&db_pool_cond);
+    db_pool_mutex.unlock();
+}
+
+shared_ptr<Connection> find_connection(int client_socket) {
+    conn_mutex.lock();
+    auto it = connections.find(client_socket);
+    shared_ptr<Connection> conn = (it != connections.end()) ? it->second : nullptr;
+    conn_mutex.unlock();
+    return conn;
+}
+
+// Gửi hết iov (sendmsg có thể ghi từng phần)
+bool send_iov_all(int sock, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+// Thống kê nén (xem print_command_stats)
+atomic<uint64_t> compressed_frames(0);
+atomic<uint64_t> compress_bytes_in(0);
+atomic<uint64_t> compress_bytes_out(0);
+
+// Gửi một frame theo định dạng header mà kết nối đích đang dùng
+void send_frame(int client_socket, int command, int status, uint32_t request_id,
+                const string& body) {
+    PhaseTimer timer(send_time_ns);
+    TraceSpan span("send", "net");
+    span.arg("bytes", body.length());
+    shared_ptr<Connection> conn = find_connection(client_socket);
+    
+    unsigned char wire[WIRE_HEADER_SIZE];
+    PacketHeader legacy(command, status);
+    struct iovec iov[2];
+    const string* payload = &body;
+    string packed;
+    
+    if (conn) conn->write_mutex.lock();
+    
+    if (conn && conn->version == 2) {
+        WireHeader header(command, status, request_id);
+        if (conn->deflater && body.length() >= COMPRESS_MIN_SIZE) {
+            if (!conn->deflater->compress(body.data(), body.length(), packed)) {
+                // Luồng nén hỏng thì client không thể giải nén tiếp -> ngắt
+                LOG_WARN("Compression failed", "socket", client_socket);
+                shutdown(client_socket, SHUT_RDWR);
+                conn->write_mutex.unlock();
+                return;
+            }
+            header.flags |= WIRE_FLAG_COMPRESSED;
+            payload = &packed;
+            compressed_frames++;
+            compress_bytes_in += body.length();
+            compress_bytes_out += packed.length();
+        }
+        header.body_length = payload->length();
+        encode_wire_header(header, wire);
+        iov[0].iov_base = wire;
+        iov[0].iov_len = WIRE_HEADER_SIZE;
+    } else {
+        legacy.body_length = body.length();
+        iov[0].iov_base = &legacy;
+        iov[0].iov_len = sizeof(PacketHeader);
+    }
+    iov[1].iov_base = (void*)payload->data();
+    iov[1].iov_len = payload->length();
     
-    send(client_socket, &header, sizeof(PacketHeader), 0);
-    if (header.body_length > 0) {
-        send(client_socket, json_body.c_str(), json_body.length(), 0);
+    send_iov_all(client_socket, iov, payload->empty() ? 1 : 2);
+    if (conn) conn->write_mutex.unlock();
+    flight_packet_out(command, payload->length(), client_socket);
+}
+
+// Bật nén cho kết nối nếu client yêu cầu (chỉ với header v2 có cờ)
+bool enable_compression(int client_socket, const string& algorithm) {
+    if (algorithm != COMPRESS_ALGORITHM) return false;
+    shared_ptr<Connection> conn = find_connection(client_socket);
+    if (!conn || conn->version != 2) return false;
+    
+    conn->write_mutex.lock();
+    if (!conn->deflater) conn->deflater.reset(new FrameDeflater());
+    conn->write_mutex.unlock();
+    return true;
+}
+
+// Gửi gói không gắn với request nào (thông báo cho user khác, ...)
+void send_packet(int client_socket, int command, int status, const string& json_body) {
+    send_frame(client_socket, command, status, 0, json_body);
+}
+
+// Nối một frame v2 vào buffer (dùng để gom phản hồi của batch)
+void append_wire_frame(string& out, int command, int status, uint32_t request_id,
+                       const string& body) {
+    WireHeader header(command, status, request_id);
+    header.body_length = body.length();
+    unsigned char wire[WIRE_HEADER_SIZE];
+    encode_wire_header(header, wire);
+    out.append((const char*)wire, WIRE_HEADER_SIZE);
+    out += body;
+}
+
+// Phản hồi cho request đang xử lý - mang theo request_id của client
+void send_response(RequestContext& ctx, int command, int status, const string& json_body) {
+    if (ctx.batch_out) {
+        append_wire_frame(*ctx.batch_out, command, status, ctx.request_id, json_body);
+        return;
     }
+    send_frame(ctx.client_socket, command, status, ctx.request_id, json_body);
 }
 
 // ===== REQUEST HANDLERS =====
 
-void handle_register(int client_socket, const map<string, string>& body) {
+void handle_register(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string username = body.count("username") ? body.at("username") : "";
     string pass_hash = body.count("pass_hash") ? body.at("pass_hash") : "";
     
     if (username.empty() || pass_hash.empty()) {
         map<string, string> resp;
         resp["error"] = "Missing username or pass_hash";
-        send_packet(client_socket, S_RESP_REGISTER, STATUS_BAD_REQUEST, 
+        send_response(ctx, S_RESP_REGISTER, STATUS_BAD_REQUEST, 
                    JsonHelper::build(resp));
         return;
     }
     
-    pthread_mutex_lock(&db_mutex);
+    db_acquire();
     
     // Check if username exists
     if (db->getUserId(username) != -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "Username already exists";
-        send_packet(client_socket, S_RESP_REGISTER, STATUS_CONFLICT, 
+        send_response(ctx, S_RESP_REGISTER, STATUS_CONFLICT, 
                    JsonHelper::build(resp));
         return;
     }
     
     // Create user
     if (!db->createUser(username, pass_hash)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "Failed to create user";
-        send_packet(client_socket, S_RESP_REGISTER, STATUS_SERVER_ERROR, 
+        send_response(ctx, S_RESP_REGISTER, STATUS_SERVER_ERROR, 
                    JsonHelper::build(resp));
         return;
     }
     
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     map<string, string> resp;
     resp["message"] = "Register OK";
-    send_packet(client_socket, S_RESP_REGISTER, STATUS_CREATED, 
+    send_response(ctx, S_RESP_REGISTER, STATUS_CREATED, 
                JsonHelper::build(resp));
     
-    cout << "✓ User registered: " << username << endl;
+    LOG_INFO("User registered", "username", username);
 }
 
-void handle_login(int client_socket, const map<string, string>& body) {
+void handle_login(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string username = body.count("username") ? body.at("username") : "";
     string pass_hash = body.count("pass_hash") ? body.at("pass_hash") : "";
     
     if (username.empty() || pass_hash.empty()) {
         map<string, string> resp;
         resp["error"] = "Missing username or pass_hash";
-        send_packet(client_socket, S_RESP_LOGIN, STATUS_BAD_REQUEST, 
+        send_response(ctx, S_RESP_LOGIN, STATUS_BAD_REQUEST, 
                    JsonHelper::build(resp));
         return;
     }
     
-    pthread_mutex_lock(&db_mutex);
+    db_acquire();
     
     // Verify credentials
     if (!db->verifyUser(username, pass_hash)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "Invalid username or password";
-        send_packet(client_socket, S_RESP_LOGIN, STATUS_UNAUTHORIZED, 
+        send_response(ctx, S_RESP_LOGIN, STATUS_UNAUTHORIZED, 
                    JsonHelper::build(resp));
         return;
     }
     
     int user_id = db->getUserId(username);
     if (user_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "User not found";
-        send_packet(client_socket, S_RESP_LOGIN, STATUS_NOT_FOUND, 
+        send_response(ctx, S_RESP_LOGIN, STATUS_NOT_FOUND, 
                    JsonHelper::build(resp));
         return;
     }
@@ -125,10 +389,10 @@ void handle_login(int client_socket, const map<string, string>& body) {
     // Create session token
     string token = db->createSession(user_id);
     if (token.empty()) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "Failed to create session";
-        send_packet(client_socket, S_RESP_LOGIN, STATUS_SERVER_ERROR, 
+        send_response(ctx, S_RESP_LOGIN, STATUS_SERVER_ERROR, 
                    JsonHelper::build(resp));
         return;
     }
@@ -140,16 +404,16 @@ void handle_login(int client_socket, const map<string, string>& body) {
     // Get online friends
     vector<string> friends_online = db->getOnlineFriends(user_id);
     
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Update in-memory cache
-    pthread_mutex_lock(&clients_mutex);
+    clients_mutex.lock();
     
     // Check if user already logged in somewhere else
     if (username_to_socket.count(username)) {
         int old_socket = username_to_socket[username];
-        if (old_socket != client_socket) {
-            cout << "⚠️  User " << username << " already logged in on another device. Forcing logout..." << endl;
+        if (old_socket != ctx.client_socket) {
+            LOG_WARN("User already logged in on another device, forcing logout", "username", username);
             
             // Send force logout notification to old client
             map<string, string> logout_msg;
@@ -162,134 +426,156 @@ void handle_login(int client_socket, const map<string, string>& body) {
             socket_to_username.erase(old_socket);
             socket_to_token.erase(old_socket);
             
-            // Close old socket
-            close(old_socket);
+            // Ngắt kết nối cũ - thread của socket đó sẽ tự dọn dẹp và close()
+            shutdown(old_socket, SHUT_RDWR);
         }
     }
     
-    socket_to_userid[client_socket] = user_id;
-    socket_to_username[client_socket] = username;
-    username_to_socket[username] = client_socket;
-    socket_to_token[client_socket] = token;
-    pthread_mutex_unlock(&clients_mutex);
+    socket_to_userid[ctx.client_socket] = user_id;
+    socket_to_username[ctx.client_socket] = username;
+    username_to_socket[username] = ctx.client_socket;
+    socket_to_token[ctx.client_socket] = token;
+    clients_mutex.unlock();
     
     // Send response
     map<string, string> resp;
     resp["token"] = token;
+    if (body.count("compress") && enable_compression(ctx.client_socket, body.at("compress"))) {
+        resp["compress"] = COMPRESS_ALGORITHM;
+    }
     string json_resp = JsonHelper::build_with_array(resp, "friends_online", friends_online);
-    send_packet(client_socket, S_RESP_LOGIN, STATUS_OK, json_resp);
+    send_response(ctx, S_RESP_LOGIN, STATUS_OK, json_resp);
     
-    cout << "✓ User logged in: " << username << " (ID: " << user_id << ")" << endl;
+    LOG_INFO("User logged in", "username", username, "user_id", user_id);
     
     // Notify online friends
-    pthread_mutex_lock(&db_mutex);
+    db_acquire();
     vector<string> all_friends = db->getFriends(user_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     for (const string& friend_name : all_friends) {
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         if (username_to_socket.count(friend_name)) {
             int friend_socket = username_to_socket[friend_name];
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
             
             map<string, string> notify;
             notify["username"] = username;
             send_packet(friend_socket, S_NOTIFY_FRIEND_ONLINE, STATUS_OK, 
                        JsonHelper::build(notify));
         } else {
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
         }
     }
 }
 
+// C_REQ_ATTACH_CHANNEL: biến kết nối hiện tại thành kênh truyền file của user
+// (token đã được pipeline xác thực). Kênh có thread riêng nên upload/download
+// lớn không chặn tin nhắn, thông báo trên kết nối chat.
+void handle_attach_channel(RequestContext& ctx) {
+    shared_ptr<Connection> conn = find_connection(ctx.client_socket);
+    
+    clients_mutex.lock();
+    bool is_chat = socket_to_username.count(ctx.client_socket) > 0;
+    if (conn && !is_chat && conn->version == 2) {
+        // Chỉ cache user_id/token: lệnh AUTH_SESSION (chunk) dùng được,
+        // còn thông báo vẫn chỉ gửi tới kết nối chat
+        socket_to_userid[ctx.client_socket] = ctx.user_id;
+        socket_to_token[ctx.client_socket] = ctx.body.at("token");
+    }
+    clients_mutex.unlock();
+    
+    if (!conn || is_chat || conn->version != 2) {
+        map<string, string> resp;
+        resp["message"] = "Channel cannot be attached";
+        send_response(ctx, S_RESP_ATTACH_CHANNEL, STATUS_BAD_REQUEST, JsonHelper::build(resp));
+        return;
+    }
+    conn->bulk = true;
+    
+    map<string, string> resp;
+    resp["channel"] = "bulk";
+    send_response(ctx, S_RESP_ATTACH_CHANNEL, STATUS_OK, JsonHelper::build(resp));
+    
+    LOG_INFO("Bulk channel attached", "socket", ctx.client_socket, "user_id", ctx.user_id);
+}
+
 // ===== PASSWORD CHANGE HANDLER =====
 
-void handle_change_password(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_change_password(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string old_password = body.count("old_password") ? body.at("old_password") : "";
     string new_password = body.count("new_password") ? body.at("new_password") : "";
     
     if (old_password.empty() || new_password.empty()) {
         map<string, string> resp;
         resp["message"] = "Missing old or new password";
-        send_packet(client_socket, S_RESP_CHANGE_PASS, STATUS_BAD_REQUEST, 
+        send_response(ctx, S_RESP_CHANGE_PASS, STATUS_BAD_REQUEST, 
                    JsonHelper::build(resp));
         return;
     }
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["message"] = "Invalid token";
-        send_packet(client_socket, S_RESP_CHANGE_PASS, STATUS_UNAUTHORIZED, 
-                   JsonHelper::build(resp));
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     bool success = db->changePassword(user_id, old_password, new_password);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     map<string, string> resp;
     if (success) {
         resp["message"] = "Password changed successfully";
-        send_packet(client_socket, S_RESP_CHANGE_PASS, STATUS_OK, 
+        send_response(ctx, S_RESP_CHANGE_PASS, STATUS_OK, 
                    JsonHelper::build(resp));
-        cout << "✓ Password changed for user_id: " << user_id << endl;
+        LOG_INFO("Password changed", "user_id", user_id);
     } else {
         resp["message"] = "Old password is incorrect";
-        send_packet(client_socket, S_RESP_CHANGE_PASS, STATUS_UNAUTHORIZED, 
+        send_response(ctx, S_RESP_CHANGE_PASS, STATUS_UNAUTHORIZED, 
                    JsonHelper::build(resp));
     }
 }
 
 // ===== FRIEND HANDLERS =====
 
-void handle_friend_add(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_friend_add(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string target_username = body.count("target_username") ? body.at("target_username") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int target_id = db->getUserId(target_username);
     if (target_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "User not found";
         resp["message"] = "Người dùng '" + target_username + "' không tồn tại";
-        send_packet(client_socket, S_RESP_FRIEND_ADD, STATUS_NOT_FOUND, 
+        send_response(ctx, S_RESP_FRIEND_ADD, STATUS_NOT_FOUND, 
                    JsonHelper::build(resp));
-        cout << "⚠ Friend request failed: User '" << target_username << "' not found" << endl;
+        LOG_WARN("Friend request failed: user not found", "target", target_username);
         return;
     }
     
     // Không thể tự kết bạn với chính mình
     if (target_id == user_id) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "Invalid request";
         resp["message"] = "Không thể kết bạn với chính mình";
-        send_packet(client_socket, S_RESP_FRIEND_ADD, STATUS_BAD_REQUEST, 
+        send_response(ctx, S_RESP_FRIEND_ADD, STATUS_BAD_REQUEST, 
                    JsonHelper::build(resp));
-        cout << "⚠ Friend request failed: Cannot add yourself" << endl;
+        LOG_WARN("Friend request failed: cannot add yourself", "user_id", user_id);
         return;
     }
     
     // Kiểm tra đã là bạn chưa
     if (db->areFriends(user_id, target_id)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "Already friends";
         resp["message"] = "Bạn đã là bạn bè với " + target_username;
-        send_packet(client_socket, S_RESP_FRIEND_ADD, STATUS_CONFLICT, 
+        send_response(ctx, S_RESP_FRIEND_ADD, STATUS_CONFLICT, 
                    JsonHelper::build(resp));
-        cout << "⚠ Friend request failed: Already friends" << endl;
+        LOG_WARN("Friend request failed: already friends", "user_id", user_id, "target", target_username);
         return;
     }
     
@@ -297,46 +583,42 @@ void handle_friend_add(int client_socket, const map<string, string>& body) {
     
     // Gửi lời mời kết bạn
     db->sendFriendRequest(user_id, target_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Thông báo cho target nếu online
-    pthread_mutex_lock(&clients_mutex);
+    clients_mutex.lock();
     if (username_to_socket.count(target_username)) {
         int target_socket = username_to_socket[target_username];
-        pthread_mutex_unlock(&clients_mutex);
+        clients_mutex.unlock();
         
         map<string, string> notify;
         notify["from_username"] = from_username;
         send_packet(target_socket, S_NOTIFY_FRIEND_REQ, STATUS_OK, 
                    JsonHelper::build(notify));
     } else {
-        pthread_mutex_unlock(&clients_mutex);
+        clients_mutex.unlock();
     }
     
     // Gửi response thành công về cho người gửi lời mời
     map<string, string> resp;
     resp["message"] = "Đã gửi lời mời kết bạn đến " + target_username;
-    send_packet(client_socket, S_RESP_FRIEND_ADD, STATUS_OK, 
+    send_response(ctx, S_RESP_FRIEND_ADD, STATUS_OK, 
                JsonHelper::build(resp));
     
-    cout << "✓ Friend request: " << from_username << " -> " << target_username << endl;
+    LOG_INFO("Friend request", "from", from_username, "to", target_username);
 }
 
-void handle_friend_response(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_friend_response(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string from_username = body.count("from_username") ? body.at("from_username") : "";
     string action = body.count("action") ? body.at("action") : "";  // "accept" or "reject"
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int from_id = db->getUserId(from_username);
     if (from_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
@@ -344,42 +626,36 @@ void handle_friend_response(int client_socket, const map<string, string>& body)
     
     if (action == "accept") {
         db->acceptFriendRequest(from_id, user_id);
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         
         // Thông báo cho người gửi lời mời nếu online
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         if (username_to_socket.count(from_username)) {
             int from_socket = username_to_socket[from_username];
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
             
             map<string, string> notify;
             notify["username"] = my_username;
             send_packet(from_socket, S_NOTIFY_FRIEND_ACCEPT, STATUS_OK, 
                        JsonHelper::build(notify));
         } else {
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
         }
         
-        cout << "✓ Friend request accepted: " << from_username << " <-> " << my_username << endl;
+        LOG_INFO("Friend request accepted", "from", from_username, "by", my_username);
     } else {
         db->rejectFriendRequest(from_id, user_id);
-        pthread_mutex_unlock(&db_mutex);
-        cout << "✓ Friend request rejected: " << from_username << " -> " << my_username << endl;
+        db_release();
+        LOG_INFO("Friend request rejected", "from", from_username, "by", my_username);
     }
 }
 
-void handle_friend_list(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
-    
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+void handle_friend_list(RequestContext& ctx) {
+    int user_id = ctx.user_id;
+    db_acquire();
     
     vector<string> friends = db->getFriends(user_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build JSON response với trạng thái online
     string json_resp = "{\"friends\":[";
@@ -387,29 +663,23 @@ void handle_friend_list(int client_socket, const map<string, string>& body) {
         if (i > 0) json_resp += ",";
         
         // Kiểm tra online status
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         bool is_online = username_to_socket.count(friends[i]) > 0;
-        pthread_mutex_unlock(&clients_mutex);
+        clients_mutex.unlock();
         
         json_resp += "{\"username\":\"" + friends[i] + "\",\"online\":" + (is_online ? "true" : "false") + "}";
     }
     json_resp += "]}";
     
-    send_packet(client_socket, S_RESP_FRIEND_LIST, STATUS_OK, json_resp);
+    send_response(ctx, S_RESP_FRIEND_LIST, STATUS_OK, json_resp);
 }
 
-void handle_pending_requests(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
-    
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+void handle_pending_requests(RequestContext& ctx) {
+    int user_id = ctx.user_id;
+    db_acquire();
     
     vector<string> pending = db->getPendingFriendRequests(user_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build JSON response
     string json_resp = "{\"pending\":[";
@@ -419,69 +689,54 @@ void handle_pending_requests(int client_socket, const map<string, string>& body)
     }
     json_resp += "]}";
     
-    send_packet(client_socket, S_RESP_PENDING_REQUESTS, STATUS_OK, json_resp);
+    send_response(ctx, S_RESP_PENDING_REQUESTS, STATUS_OK, json_resp);
 }
 
-void handle_unfriend(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_unfriend(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string friend_username = body.count("friend_username") ? body.at("friend_username") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["message"] = "Token không hợp lệ";
-        send_packet(client_socket, S_RESP_UNFRIEND, STATUS_UNAUTHORIZED, JsonHelper::build(resp));
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int friend_id = db->getUserId(friend_username);
     if (friend_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["message"] = "Không tìm thấy user";
-        send_packet(client_socket, S_RESP_UNFRIEND, STATUS_NOT_FOUND, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_UNFRIEND, STATUS_NOT_FOUND, JsonHelper::build(resp));
         return;
     }
     
     // Sử dụng rejectFriendRequest để xóa friendship (cùng logic)
     bool success = db->rejectFriendRequest(user_id, friend_id);
     string my_username = db->getUsername(user_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     if (success) {
         map<string, string> resp;
         resp["message"] = "Đã hủy kết bạn với " + friend_username;
-        send_packet(client_socket, S_RESP_UNFRIEND, STATUS_OK, JsonHelper::build(resp));
-        cout << "✓ Unfriended: " << my_username << " <-> " << friend_username << endl;
+        send_response(ctx, S_RESP_UNFRIEND, STATUS_OK, JsonHelper::build(resp));
+        LOG_INFO("Unfriended", "user", my_username, "friend", friend_username);
     } else {
         map<string, string> resp;
         resp["message"] = "Không thể hủy kết bạn";
-        send_packet(client_socket, S_RESP_UNFRIEND, STATUS_SERVER_ERROR, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_UNFRIEND, STATUS_SERVER_ERROR, JsonHelper::build(resp));
     }
 }
 
-void handle_group_create(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_group_create(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string group_name = body.count("group_name") ? body.at("group_name") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["error"] = "Unauthorized";
-        send_packet(client_socket, S_RESP_GROUP_CREATE, STATUS_UNAUTHORIZED, 
-                   JsonHelper::build(resp));
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     if (group_name.empty()) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "Missing group_name";
-        send_packet(client_socket, S_RESP_GROUP_CREATE, STATUS_BAD_REQUEST, 
+        send_response(ctx, S_RESP_GROUP_CREATE, STATUS_BAD_REQUEST, 
                    JsonHelper::build(resp));
         return;
     }
@@ -489,52 +744,48 @@ void handle_group_create(int client_socket, const map<string, string>& body) {
     // Create group
     int group_id = db->createGroup(group_name, user_id);
     if (group_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["error"] = "Failed to create group";
-        send_packet(client_socket, S_RESP_GROUP_CREATE, STATUS_SERVER_ERROR, 
+        send_response(ctx, S_RESP_GROUP_CREATE, STATUS_SERVER_ERROR, 
                    JsonHelper::build(resp));
         return;
     }
     
     string username = db->getUsername(user_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     map<string, string> resp;
     resp["group_id"] = to_string(group_id);
     resp["group_name"] = group_name;
-    send_packet(client_socket, S_RESP_GROUP_CREATE, STATUS_CREATED, 
+    send_response(ctx, S_RESP_GROUP_CREATE, STATUS_CREATED, 
                JsonHelper::build(resp));
     
-    cout << "✓ Group created: " << group_name << " by " << username << endl;
+    LOG_INFO("Group created", "group", group_name, "by", username);
 }
 
-void handle_group_join(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_group_join(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string group_id_str = body.count("group_id") ? body.at("group_id") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int group_id = atoi(group_id_str.c_str());
     if (group_id <= 0) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
     // Check if already member
     if (db->isGroupMember(group_id, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
     // Add to group
     if (!db->addGroupMember(group_id, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
@@ -543,18 +794,18 @@ void handle_group_join(int client_socket, const map<string, string>& body) {
     
     // Get all group members
     vector<int> member_ids = db->getGroupMembers(group_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Notify all members
     for (int member_id : member_ids) {
-        pthread_mutex_lock(&db_mutex);
+        db_acquire();
         string member_name = db->getUsername(member_id);
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         if (username_to_socket.count(member_name)) {
             int member_socket = username_to_socket[member_name];
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
             
             map<string, string> notify;
             notify["username"] = username;
@@ -562,30 +813,20 @@ void handle_group_join(int client_socket, const map<string, string>& body) {
             send_packet(member_socket, S_NOTIFY_GROUP_JOIN, STATUS_OK, 
                        JsonHelper::build(notify));
         } else {
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
         }
     }
     
-    cout << "✓ User " << username << " joined group " << group_name << endl;
+    LOG_INFO("User joined group", "username", username, "group", group_name);
 }
 
-void handle_group_list(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
-    
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["error"] = "Unauthorized";
-        send_packet(client_socket, S_RESP_GROUP_LIST, STATUS_UNAUTHORIZED, 
-                   JsonHelper::build(resp));
-        return;
-    }
+void handle_group_list(RequestContext& ctx) {
+    int user_id = ctx.user_id;
+    db_acquire();
     
     // Get user's groups
     vector<map<string, string>> groups = db->getUserGroups(user_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build response JSON với danh sách nhóm
     string json_resp = "{\"groups\":[";
@@ -596,28 +837,18 @@ void handle_group_list(int client_socket, const map<string, string>& body) {
     }
     json_resp += "]}";
     
-    send_packet(client_socket, S_RESP_GROUP_LIST, STATUS_OK, json_resp);
+    send_response(ctx, S_RESP_GROUP_LIST, STATUS_OK, json_resp);
     
-    cout << "✓ Sent group list to user_id " << user_id << " (" << groups.size() << " groups)" << endl;
+    LOG_INFO("Sent group list", "user_id", user_id, "groups", groups.size());
 }
 
-void handle_all_groups(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
-    
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["error"] = "Unauthorized";
-        send_packet(client_socket, S_RESP_ALL_GROUPS, STATUS_UNAUTHORIZED, 
-                   JsonHelper::build(resp));
-        return;
-    }
+void handle_all_groups(RequestContext& ctx) {
+    int user_id = ctx.user_id;
+    db_acquire();
     
     // Get all groups in system
     vector<map<string, string>> all_groups = db->getAllGroups();
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build response JSON
     string json_resp = "{\"groups\":[";
@@ -629,29 +860,19 @@ void handle_all_groups(int client_socket, const map<string, string>& body) {
     }
     json_resp += "]}";
     
-    send_packet(client_socket, S_RESP_ALL_GROUPS, STATUS_OK, json_resp);
+    send_response(ctx, S_RESP_ALL_GROUPS, STATUS_OK, json_resp);
     
-    cout << "✓ Sent all groups list to user_id " << user_id << " (" << all_groups.size() << " groups)" << endl;
+    LOG_INFO("Sent all groups list", "user_id", user_id, "groups", all_groups.size());
 }
 
 /*
-void handle_all_users(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
-    
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["error"] = "Unauthorized";
-        send_packet(client_socket, S_RESP_ALL_USERS, STATUS_UNAUTHORIZED, 
-                   JsonHelper::build(resp));
-        return;
-    }
+void handle_all_users(RequestContext& ctx) {
+    int user_id = ctx.user_id;
+    db_acquire();
     
     // Get all users in system
     vector<map<string, string>> all_users = db->getAllUsers();
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build response JSON
     string json_resp = "{\"users\":[";
@@ -663,32 +884,30 @@ void handle_all_users(int client_socket, const map<string, string>& body) {
     }
     json_resp += "]}";
     
-    send_packet(client_socket, S_RESP_ALL_USERS, STATUS_OK, json_resp);
+    send_response(ctx, S_RESP_ALL_USERS, STATUS_OK, json_resp);
     
-    cout << "✓ Sent all users list to user_id " << user_id << " (" << all_users.size() << " users)" << endl;
+    LOG_INFO("Sent all users list", "user_id", user_id, "users", all_users.size());
 }
 */
 
-void handle_group_leave(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void release_message_blob(const string& message_text);     // Kho upload, xem bên dưới
+
+void handle_group_leave(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string group_id_str = body.count("group_id") ? body.at("group_id") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int group_id = atoi(group_id_str.c_str());
     if (group_id <= 0) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
     // Check if user is member
     if (!db->isGroupMember(group_id, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
@@ -701,28 +920,31 @@ void handle_group_leave(int client_socket, const map<string, string>& body) {
     // Remove user from group
     db->removeGroupMember(group_id, user_id);
     
-    // Nếu là thành viên cuối cùng → xóa luôn nhóm
+    // Nếu là thành viên cuối cùng → xóa luôn nhóm, bớt tham chiếu blob của các tin [FILE:...]
     if (member_ids.size() == 1) {
-        db->deleteGroup(group_id);
-        pthread_mutex_unlock(&db_mutex);
-        cout << "✓ User " << username << " left and group " << group_name << " was deleted (no members left)" << endl;
+        vector<string> file_messages = db->getGroupFileMessages(group_id);
+        if (db->deleteGroup(group_id)) {
+            for (const string& text : file_messages) release_message_blob(text);
+        }
+        db_release();
+        LOG_INFO("User left group, group deleted (no members left)", "username", username, "group", group_name);
         return;
     }
     
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Notify all remaining members
     for (int member_id : member_ids) {
         if (member_id == user_id) continue;  // Skip the leaving user
         
-        pthread_mutex_lock(&db_mutex);
+        db_acquire();
         string member_name = db->getUsername(member_id);
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         if (username_to_socket.count(member_name)) {
             int member_socket = username_to_socket[member_name];
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
             
             map<string, string> notify;
             notify["username"] = username;
@@ -730,62 +952,55 @@ void handle_group_leave(int client_socket, const map<string, string>& body) {
             send_packet(member_socket, S_NOTIFY_GROUP_LEAVE, STATUS_OK, 
                        JsonHelper::build(notify));
         } else {
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
         }
     }
     
-    cout << "✓ User " << username << " left group " << group_name << endl;
+    LOG_INFO("User left group", "username", username, "group", group_name);
 }
 
-void handle_group_invite(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_group_invite(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string group_id_str = body.count("group_id") ? body.at("group_id") : "";
     string invite_username = body.count("username") ? body.at("username") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["message"] = "Invalid token";
-        send_packet(client_socket, S_RESP_GROUP_INVITE, STATUS_UNAUTHORIZED, JsonHelper::build(resp));
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int group_id = atoi(group_id_str.c_str());
     if (group_id <= 0 || invite_username.empty()) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["message"] = "Missing group_id or username";
-        send_packet(client_socket, S_RESP_GROUP_INVITE, STATUS_BAD_REQUEST, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_GROUP_INVITE, STATUS_BAD_REQUEST, JsonHelper::build(resp));
         return;
     }
     
     // Kiểm tra người mời có trong nhóm không
     if (!db->isGroupMember(group_id, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["message"] = "Bạn không phải thành viên nhóm này";
-        send_packet(client_socket, S_RESP_GROUP_INVITE, STATUS_FORBIDDEN, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_GROUP_INVITE, STATUS_FORBIDDEN, JsonHelper::build(resp));
         return;
     }
     
     // Lấy user_id của người được mời
     int invite_user_id = db->getUserId(invite_username);
     if (invite_user_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["message"] = "Người dùng không tồn tại";
-        send_packet(client_socket, S_RESP_GROUP_INVITE, STATUS_NOT_FOUND, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_GROUP_INVITE, STATUS_NOT_FOUND, JsonHelper::build(resp));
         return;
     }
     
     // Kiểm tra người được mời đã ở trong nhóm chưa
     if (db->isGroupMember(group_id, invite_user_id)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         map<string, string> resp;
         resp["message"] = "Người dùng đã là thành viên nhóm";
-        send_packet(client_socket, S_RESP_GROUP_INVITE, STATUS_CONFLICT, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_GROUP_INVITE, STATUS_CONFLICT, JsonHelper::build(resp));
         return;
     }
     
@@ -797,12 +1012,12 @@ void handle_group_invite(int client_socket, const map<string, string>& body) {
     
     // Lấy danh sách thành viên (bao gồm người mới)
     vector<int> member_ids = db->getGroupMembers(group_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     if (!added) {
         map<string, string> resp;
         resp["message"] = "Không thể thêm thành viên";
-        send_packet(client_socket, S_RESP_GROUP_INVITE, STATUS_SERVER_ERROR, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_GROUP_INVITE, STATUS_SERVER_ERROR, JsonHelper::build(resp));
         return;
     }
     
@@ -811,18 +1026,18 @@ void handle_group_invite(int client_socket, const map<string, string>& body) {
     resp["message"] = "Đã thêm " + invite_username + " vào nhóm";
     resp["group_id"] = group_id_str;
     resp["username"] = invite_username;
-    send_packet(client_socket, S_RESP_GROUP_INVITE, STATUS_OK, JsonHelper::build(resp));
+    send_response(ctx, S_RESP_GROUP_INVITE, STATUS_OK, JsonHelper::build(resp));
     
     // Thông báo cho tất cả thành viên (bao gồm người mới được thêm)
     for (int member_id : member_ids) {
-        pthread_mutex_lock(&db_mutex);
+        db_acquire();
         string member_name = db->getUsername(member_id);
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         if (username_to_socket.count(member_name)) {
             int member_socket = username_to_socket[member_name];
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
             
             map<string, string> notify;
             notify["username"] = invite_username;
@@ -831,38 +1046,32 @@ void handle_group_invite(int client_socket, const map<string, string>& body) {
             notify["inviter"] = inviter_username;
             send_packet(member_socket, S_NOTIFY_GROUP_JOIN, STATUS_OK, JsonHelper::build(notify));
         } else {
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
         }
     }
     
-    cout << "✓ User " << inviter_username << " invited " << invite_username << " to group " << group_name << endl;
+    LOG_INFO("Group invite", "from", inviter_username, "invited", invite_username, "group", group_name);
 }
 
-void handle_group_members(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_group_members(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string group_id_str = body.count("group_id") ? body.at("group_id") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        send_packet(client_socket, S_RESP_GROUP_MEMBERS, STATUS_UNAUTHORIZED, 
-                   "{\"error\":\"Invalid token\"}");
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int group_id = atoi(group_id_str.c_str());
     if (group_id <= 0) {
-        pthread_mutex_unlock(&db_mutex);
-        send_packet(client_socket, S_RESP_GROUP_MEMBERS, STATUS_BAD_REQUEST,
+        db_release();
+        send_response(ctx, S_RESP_GROUP_MEMBERS, STATUS_BAD_REQUEST,
                    "{\"error\":\"Invalid group_id\"}");
         return;
     }
     
     // Check if user is member
     if (!db->isGroupMember(group_id, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        send_packet(client_socket, S_RESP_GROUP_MEMBERS, STATUS_FORBIDDEN,
+        db_release();
+        send_response(ctx, S_RESP_GROUP_MEMBERS, STATUS_FORBIDDEN,
                    "{\"error\":\"Not a member\"}");
         return;
     }
@@ -882,42 +1091,38 @@ void handle_group_members(int client_socket, const map<string, string>& body) {
     }
     members_json += "]";
     
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build JSON manually to avoid escaping the members array
     string response_json = "{\"group_id\":\"" + group_id_str + 
                            "\",\"group_name\":\"" + group_name + 
                            "\",\"members\":" + members_json + "}";
     
-    send_packet(client_socket, S_RESP_GROUP_MEMBERS, STATUS_OK, response_json);
+    send_response(ctx, S_RESP_GROUP_MEMBERS, STATUS_OK, response_json);
     
-    cout << "✓ Sent member list for group " << group_name << " (" << member_ids.size() << " members)" << endl;
+    LOG_INFO("Sent member list", "group", group_name, "members", member_ids.size());
 }
 
-void handle_msg_private(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_msg_private(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string target_username = body.count("target_username") ? body.at("target_username") : "";
     string message = body.count("message") ? body.at("message") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     string from_username = db->getUsername(user_id);
     int target_user_id = db->getUserId(target_username);
     
     if (target_user_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
     // Save message to database and get message_id
     int message_id = db->savePrivateMessage(user_id, target_user_id, message);
     
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     if (message_id < 0) {
         return;  // Save failed
@@ -928,14 +1133,14 @@ void handle_msg_private(int client_socket, const map<string, string>& body) {
         map<string, string> confirm;
         confirm["message_id"] = to_string(message_id);
         confirm["target_username"] = target_username;
-        send_packet(client_socket, S_RESP_PRIVATE_MSG, STATUS_OK, JsonHelper::build(confirm));
+        send_response(ctx, S_RESP_PRIVATE_MSG, STATUS_OK, JsonHelper::build(confirm));
     }
     
     // Send to target if online
-    pthread_mutex_lock(&clients_mutex);
+    clients_mutex.lock();
     if (username_to_socket.count(target_username)) {
         int target_socket = username_to_socket[target_username];
-        pthread_mutex_unlock(&clients_mutex);
+        clients_mutex.unlock();
         
         map<string, string> notify;
         notify["from_username"] = from_username;
@@ -944,34 +1149,30 @@ void handle_msg_private(int client_socket, const map<string, string>& body) {
         send_packet(target_socket, S_NOTIFY_MSG_PRIVATE, STATUS_OK, 
                    JsonHelper::build(notify));
         
-        cout << "✓ Private message: " << from_username << " -> " << target_username << endl;
+        LOG_INFO("Private message", "from", from_username, "to", target_username);
     } else {
-        pthread_mutex_unlock(&clients_mutex);
-        cout << "ℹ️  Message saved (user offline): " << from_username << " -> " << target_username << endl;
+        clients_mutex.unlock();
+        LOG_INFO("Private message saved (user offline)", "from", from_username, "to", target_username);
     }
 }
 
-void handle_msg_group(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_msg_group(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string group_id_str = body.count("group_id") ? body.at("group_id") : "";
     string message = body.count("message") ? body.at("message") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int group_id = atoi(group_id_str.c_str());
     if (group_id <= 0) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
     // Check if user is member
     if (!db->isGroupMember(group_id, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
@@ -983,7 +1184,7 @@ void handle_msg_group(int client_socket, const map<string, string>& body) {
     
     // Get all members
     vector<int> member_ids = db->getGroupMembers(group_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     if (message_id < 0) {
         return;  // Save failed
@@ -994,23 +1195,25 @@ void handle_msg_group(int client_socket, const map<string, string>& body) {
         map<string, string> confirm;
         confirm["message_id"] = to_string(message_id);
         confirm["group_id"] = group_id_str;
-        send_packet(client_socket, S_RESP_GROUP_MSG, STATUS_OK, JsonHelper::build(confirm));
+        send_response(ctx, S_RESP_GROUP_MSG, STATUS_OK, JsonHelper::build(confirm));
     }
     
-    cout << "📤 Broadcasting to " << member_ids.size() << " members" << endl;
+    LOG_DEBUG("Broadcasting group message", "group", group_name, "members", member_ids.size());
     
     // Broadcast to online members
+    TraceSpan fanout("fanout", "fanout");
+    fanout.arg("members", member_ids.size());
     for (int member_id : member_ids) {
-        pthread_mutex_lock(&db_mutex);
+        db_acquire();
         string member_name = db->getUsername(member_id);
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         if (username_to_socket.count(member_name)) {
             int member_socket = username_to_socket[member_name];
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
             
-            cout << "  → Sending to " << member_name << " (socket " << member_socket << ")" << endl;
+            LOG_DEBUG("Group message to member", "member", member_name, "socket", member_socket);
             
             map<string, string> notify;
             notify["from_username"] = from_username;
@@ -1020,32 +1223,28 @@ void handle_msg_group(int client_socket, const map<string, string>& body) {
             send_packet(member_socket, S_NOTIFY_MSG_GROUP, STATUS_OK, 
                        JsonHelper::build(notify));
         } else {
-            cout << "  ✗ " << member_name << " not in online cache" << endl;
-            pthread_mutex_unlock(&clients_mutex);
+            LOG_DEBUG("Group member offline", "member", member_name);
+            clients_mutex.unlock();
         }
     }
     
-    cout << "✓ Group message: " << from_username << " -> " << group_name << endl;
+    LOG_INFO("Group message", "from", from_username, "group", group_name, "members", member_ids.size());
 }
 
 // ===== CHAT HISTORY HANDLERS =====
 
-void handle_chat_history_private(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_chat_history_private(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string target_username = body.count("target_username") ? body.at("target_username") : "";
     int offset = body.count("offset") ? atoi(body.at("offset").c_str()) : 0;
     int limit = body.count("limit") ? atoi(body.at("limit").c_str()) : 10;
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int target_user_id = db->getUserId(target_username);
     if (target_user_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
@@ -1054,7 +1253,7 @@ void handle_chat_history_private(int client_socket, const map<string, string>& b
     // Get messages and total count
     vector<map<string, string>> messages = db->getPrivateMessages(user_id, target_user_id, limit, offset);
     int total_count = db->getPrivateMessageCount(user_id, target_user_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build response JSON with is_read status
     string json = "{\"target_username\":\"" + target_username + "\",";
@@ -1073,32 +1272,28 @@ void handle_chat_history_private(int client_socket, const map<string, string>& b
     }
     json += "]}";
     
-    send_packet(client_socket, S_RESP_CHAT_HISTORY_PRIVATE, STATUS_OK, json);
-    cout << "✓ Sent private chat history: " << messages.size() << " messages (offset=" << offset << ")" << endl;
+    send_response(ctx, S_RESP_CHAT_HISTORY_PRIVATE, STATUS_OK, json);
+    LOG_INFO("Sent private chat history", "messages", messages.size(), "offset", offset);
 }
 
-void handle_chat_history_group(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_chat_history_group(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string group_id_str = body.count("group_id") ? body.at("group_id") : "";
     int offset = body.count("offset") ? atoi(body.at("offset").c_str()) : 0;
     int limit = body.count("limit") ? atoi(body.at("limit").c_str()) : 10;
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int group_id = atoi(group_id_str.c_str());
     if (group_id <= 0) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
     // Check if user is member
     if (!db->isGroupMember(group_id, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
@@ -1107,7 +1302,7 @@ void handle_chat_history_group(int client_socket, const map<string, string>& bod
     // Get messages and total count
     vector<map<string, string>> messages = db->getGroupMessages(group_id, limit, offset);
     int total_count = db->getGroupMessageCount(group_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build response JSON
     string json = "{\"group_id\":\"" + group_id_str + "\",";
@@ -1125,124 +1320,416 @@ void handle_chat_history_group(int client_socket, const map<string, string>& bod
     }
     json += "]}";
     
-    send_packet(client_socket, S_RESP_CHAT_HISTORY_GROUP, STATUS_OK, json);
-    cout << "✓ Sent group chat history: " << messages.size() << " messages (offset=" << offset << ")" << endl;
+    send_response(ctx, S_RESP_CHAT_HISTORY_GROUP, STATUS_OK, json);
+    LOG_INFO("Sent group chat history", "messages", messages.size(), "offset", offset);
 }
 
-void handle_mark_messages_read(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_mark_messages_read(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string sender_username = body.count("from_username") ? body.at("from_username") : "";
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        return;
-    }
+    int user_id = ctx.user_id;
+    db_acquire();
     
     int sender_id = db->getUserId(sender_username);
     if (sender_id == -1) {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         return;
     }
     
     // Mark all messages from sender to current user as read
     bool updated = db->markAllMessagesAsRead(sender_id, user_id);
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     if (updated) {
         // Notify sender that their messages have been read
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         if (username_to_socket.count(sender_username)) {
             int sender_socket = username_to_socket[sender_username];
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
             
             string my_username = "";
-            pthread_mutex_lock(&db_mutex);
+            db_acquire();
             my_username = db->getUsername(user_id);
-            pthread_mutex_unlock(&db_mutex);
+            db_release();
             
             map<string, string> notify;
             notify["reader_username"] = my_username;
             send_packet(sender_socket, S_NOTIFY_MESSAGES_READ, STATUS_OK, 
                        JsonHelper::build(notify));
             
-            cout << "✓ Notified " << sender_username << " that messages were read by " << my_username << endl;
+            LOG_INFO("Read receipt", "sender", sender_username, "reader", my_username);
         } else {
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
         }
     }
 }
 
-// Base64 decode helper
-string base64_decode(const string &in) {
-    string out;
-    vector<int> T(256, -1);
-    for (int i = 0; i < 64; i++) T["ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i]] = i;
-    int val = 0, valb = -8;
-    for (unsigned char c : in) {
-        if (T[c] == -1) break;
-        val = (val << 6) + T[c];
-        valb += 6;
-        if (valb >= 0) {
-            out.push_back(char((val >> valb) & 0xFF));
-            valb -= 8;
+// ===== FILE STORE =====
+// File upload được lưu một lần theo nội dung: uploads/blobs/ab/cd/<sha256>
+// (ab, cd = 4 ký tự đầu của hash) - mỗi thư mục chỉ chứa một phần nhỏ số
+// file nên tra cứu / tạo file không chậm dần khi kho lên tới hàng triệu file.
+// Tin nhắn tham chiếu file bằng "[FILE:<sha256>_<tên gốc>]", bảng file_blobs
+// đếm số tin nhắn đang trỏ tới mỗi blob; blob bị xóa khi tin nhắn cuối cùng
+// bị xóa. File cũ dạng "<time>_<tên>" nằm ở uploads/files/ab/cd/<tên lưu>
+// (ab, cd lấy từ SHA-256 của tên lưu). File đang upload nằm trong
+// uploads/tmp/ với tên do mkstemp tạo (không trùng dù cùng tên, cùng giây).
+//
+// Kho cũ để mọi file phẳng trong uploads/ và uploads/blobs/: lúc khởi động
+// upload_migration_thread dời dần chúng sang layout mới, trong lúc đó các
+// hàm tìm file thử vị trí mới trước rồi tới vị trí cũ.
+//
+// Thứ tự khóa: db_acquire() trước, blob_mutex sau (tránh giữ blob_mutex
+// trong lúc chờ kết nối DB từ pool).
+
+#define UPLOAD_DIR "uploads"
+#define UPLOAD_BLOB_DIR "uploads/blobs"
+#define UPLOAD_FILE_DIR "uploads/files"     // File kiểu cũ "<time>_<tên>"
+#define UPLOAD_TMP_DIR "uploads/tmp"        // File .part / file tạm, xóa hết khi khởi động
+
+// Đẩy dần dữ liệu upload xuống đĩa mỗi khi ghi thêm chừng này byte, để
+// fdatasync lúc C_DATA_FILE_END không phải ghi cả file một lúc
+#define UPLOAD_WRITEBACK_BYTES (4 * 1024 * 1024)
+
+// Luồng dời file sang layout shard nghỉ một chút sau mỗi lô (không chiếm hết IO)
+#define UPLOAD_MIGRATE_BATCH 256
+#define UPLOAD_MIGRATE_PAUSE_US 10000
+
+// Cache nội dung các file vừa được tải (xem file_cache.h)
+#define FILE_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define FILE_CACHE_MAX_ENTRY (8 * 1024 * 1024)
+
+ProfiledMutex blob_mutex("blob_mutex");                     // Kiểm tra tồn tại + ref_count của blob
+FileCache file_cache(FILE_CACHE_MAX_BYTES, FILE_CACHE_MAX_ENTRY);
+DirSyncer dir_syncer;                                       // fsync thư mục sau khi rename vào kho
+atomic<bool> upload_migration_done(false);                  // Không còn file ở layout phẳng cũ
+
+// "<root>/ab/cd" với ab, cd là 4 ký tự hex đầu của key
+string shard_dir(const char* root, const string& key_hex) {
+    return string(root) + "/" + key_hex.substr(0, 2) + "/" + key_hex.substr(2, 2);
+}
+
+string dir_of(const string& path) {
+    return path.substr(0, path.rfind('/'));
+}
+
+// Tạo "<root>/ab/cd" nếu chưa có (nhiều thread cùng tạo cũng không sao).
+// Thư mục vừa có thêm thư mục con được đưa vào dirty (cần fsync)
+bool make_shard_dir(const string& dir, vector<string>& dirty) {
+    string parent = dir_of(dir);
+    if (mkdir(parent.c_str(), 0755) == 0) dirty.push_back(dir_of(parent));
+    else if (errno != EEXIST) return false;
+    if (mkdir(dir.c_str(), 0755) == 0) dirty.push_back(parent);
+    else if (errno != EEXIST) return false;
+    return true;
+}
+
+string blob_path(const string& hash) {
+    return shard_dir(UPLOAD_BLOB_DIR, hash) + "/" + hash;
+}
+
+string legacy_file_path(const string& savedFileName) {
+    Sha256 hasher;
+    hasher.update(savedFileName.data(), savedFileName.size());
+    return shard_dir(UPLOAD_FILE_DIR, hasher.final_hex()) + "/" + savedFileName;
+}
+
+// Đường dẫn hiện tại của file: vị trí theo shard, hoặc vị trí phẳng cũ nếu
+// luồng dời file chưa tới file đó
+string locate_upload(const string& sharded, const string& flat) {
+    if (upload_migration_done.load()) return sharded;
+    struct stat st;
+    if (stat(sharded.c_str(), &st) == 0) return sharded;
+    if (stat(flat.c_str(), &st) == 0) return flat;
+    return sharded;     // Không có ở đâu, hoặc vừa được dời đi giữa hai lần stat
+}
+
+string locate_blob(const string& hash) {
+    return locate_upload(blob_path(hash), string(UPLOAD_BLOB_DIR) + "/" + hash);
+}
+
+// Tên lưu "<sha256>_<tên gốc>" -> hash; false với tên kiểu cũ
+bool parse_blob_name(const string& savedFileName, string& hash) {
+    if (savedFileName.size() <= SHA256_HEX_SIZE || savedFileName[SHA256_HEX_SIZE] != '_') return false;
+    hash = savedFileName.substr(0, SHA256_HEX_SIZE);
+    return is_sha256_hex(hash);
+}
+
+// Tên lưu có an toàn để ghép vào đường dẫn không (chặn "../" và đường dẫn
+// tuyệt đối trong yêu cầu download)
+bool valid_saved_name(const string& savedFileName) {
+    return !savedFileName.empty() && savedFileName[0] != '.' &&
+           savedFileName.find('/') == string::npos && savedFileName.find('\\') == string::npos;
+}
+
+// Vị trí của file trong layout shard (lưu vào attachments.storage_path),
+// "" nếu tên không hợp lệ
+string upload_storage_path(const string& savedFileName) {
+    string hash;
+    if (parse_blob_name(savedFileName, hash)) return blob_path(hash);
+    if (!valid_saved_name(savedFileName)) return "";
+    return legacy_file_path(savedFileName);
+}
+
+// Đường dẫn trên đĩa của file trong tin nhắn, "" nếu tên không hợp lệ
+string resolve_upload_path(const string& savedFileName) {
+    string hash;
+    if (parse_blob_name(savedFileName, hash)) return locate_blob(hash);
+    if (!valid_saved_name(savedFileName)) return "";
+    return locate_upload(legacy_file_path(savedFileName), string(UPLOAD_DIR) + "/" + savedFileName);
+}
+
+// Mở file đã lưu để đọc. Luồng dời file có thể vừa chuyển file đi giữa lúc
+// tìm đường dẫn và lúc mở -> tìm lại một lần (filePath được cập nhật)
+int open_upload(const string& savedFileName, string& filePath) {
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0 && errno == ENOENT && !upload_migration_done.load()) {
+        filePath = resolve_upload_path(savedFileName);
+        fd = open(filePath.c_str(), O_RDONLY);
+    }
+    return fd;
+}
+
+// File tạm mới trong UPLOAD_TMP_DIR (mkstemp: tên không bao giờ trùng)
+int create_upload_temp(const string& prefix, string& path) {
+    string pattern = string(UPLOAD_TMP_DIR) + "/" + prefix + "_XXXXXX";
+    vector<char> buf(pattern.begin(), pattern.end());
+    buf.push_back('\0');
+    int fd = mkstemp(buf.data());
+    if (fd < 0) return -1;
+    fchmod(fd, 0644);
+    path = buf.data();
+    return fd;
+}
+
+bool write_file_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Thêm một tham chiếu tới blob đã có trên đĩa; false nếu chưa có (hoặc khác cỡ)
+bool ref_existing_blob(const string& hash, uint64_t file_size) {
+    db_acquire();
+    blob_mutex.lock();
+    struct stat st;
+    bool exists = stat(locate_blob(hash).c_str(), &st) == 0 && (uint64_t)st.st_size == file_size;
+    bool ok = exists && db->addFileBlobRef(hash, file_size);
+    blob_mutex.unlock();
+    db_release();
+    return ok;
+}
+
+// Đưa file tạm đã ghi xong (và đã fdatasync) vào kho: nội dung đã có thì bỏ
+// file tạm, chưa có thì đổi tên thành blob rồi chờ fsync thư mục shard, nên
+// khi hàm trả về true thì file đã bền vững trên đĩa. Luôn tiêu thụ tmp_path.
+// crc32c là CRC32C cả file, lưu cùng blob để client kiểm tra khi tải về.
+bool commit_blob(const string& tmp_path, const string& hash, uint64_t file_size, uint32_t crc32c) {
+    string path = blob_path(hash);
+    db_acquire();
+    blob_mutex.lock();
+    struct stat st;
+    bool ok;
+    vector<string> dirty;
+    if (stat(locate_blob(hash).c_str(), &st) == 0) {
+        unlink(tmp_path.c_str());
+        ok = true;
+    } else {
+        ok = make_shard_dir(dir_of(path), dirty) && rename(tmp_path.c_str(), path.c_str()) == 0;
+        if (ok) dirty.push_back(dir_of(path));
+        else unlink(tmp_path.c_str());
+    }
+    ok = ok && db->addFileBlobRef(hash, file_size, crc32c);
+    blob_mutex.unlock();
+    db_release();
+    
+    for (const string& dir : dirty) ok = dir_syncer.sync(dir) && ok;
+    return ok;
+}
+
+// CRC32C cả file của blob, -1 nếu chưa biết (blob cũ / file kiểu cũ)
+long long blob_crc32c(const string& savedFileName) {
+    string hash;
+    if (!parse_blob_name(savedFileName, hash)) return -1;
+    db_acquire();
+    long long crc = db->getFileBlobCrc32c(hash);
+    db_release();
+    return crc;
+}
+
+// Kiểu MIME theo đuôi file (lưu trong attachments để client dựng thư viện ảnh / media)
+string guess_mime_type(const string& fileName) {
+    static const map<string, string> types = {
+        {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"png", "image/png"}, {"gif", "image/gif"},
+        {"webp", "image/webp"}, {"bmp", "image/bmp"}, {"svg", "image/svg+xml"},
+        {"mp4", "video/mp4"}, {"webm", "video/webm"}, {"mkv", "video/x-matroska"}, {"mov", "video/quicktime"},
+        {"mp3", "audio/mpeg"}, {"wav", "audio/wav"}, {"ogg", "audio/ogg"}, {"m4a", "audio/mp4"},
+        {"pdf", "application/pdf"}, {"zip", "application/zip"}, {"txt", "text/plain"},
+        {"doc", "application/msword"},
+        {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+        {"xls", "application/vnd.ms-excel"},
+        {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+        {"ppt", "application/vnd.ms-powerpoint"},
+        {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    };
+    size_t dot = fileName.rfind('.');
+    if (dot == string::npos) return "application/octet-stream";
+    string ext = fileName.substr(dot + 1);
+    for (char& c : ext) c = tolower((unsigned char)c);
+    auto it = types.find(ext);
+    return it != types.end() ? it->second : "application/octet-stream";
+}
+
+// Bớt một tham chiếu tới blob, xóa blob khi hết
+void release_blob_ref(const string& hash) {
+    db_acquire();
+    blob_mutex.lock();
+    int remaining = db->releaseFileBlobRef(hash);
+    if (remaining == 0) {
+        string path = locate_blob(hash);
+        unlink(path.c_str());
+        file_cache.invalidate(path);
+        LOG_INFO("Removed unreferenced file blob", "hash", hash);
+    }
+    blob_mutex.unlock();
+    db_release();
+}
+
+// Tin nhắn [FILE:...] vừa bị xóa: bớt tham chiếu tới blob của nó
+void release_message_blob(const string& message_text) {
+    if (message_text.compare(0, 6, "[FILE:") != 0) return;
+    size_t end = message_text.find(']');
+    if (end == string::npos) return;
+    string hash;
+    if (parse_blob_name(message_text.substr(6, end - 6), hash)) release_blob_ref(hash);
+}
+
+// Dời các file trong thư mục flat_dir (layout phẳng cũ) sang layout shard;
+// blobs = true với uploads/blobs/<sha256>, false với file kiểu cũ trong uploads/.
+// rename là nguyên tử nên mất điện giữa chừng không sao: file nằm ở một
+// trong hai vị trí và cả hai đều được locate_upload kiểm tra.
+// failed đếm các file không dời được (vẫn phục vụ từ vị trí cũ).
+uint64_t migrate_flat_dir(const char* flat_dir, bool blobs, uint64_t& failed) {
+    DIR* dir = opendir(flat_dir);
+    if (!dir) return 0;
+    uint64_t moved = 0;
+    vector<string> dirty;       // fsync không cần thiết ở đây (xem trên)
+    while (struct dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        string from = string(flat_dir) + "/" + name;
+        struct stat st;
+        if (lstat(from.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;   // Bỏ qua blobs/, files/, tmp/, ab/...
+        if (blobs && !is_sha256_hex(name)) continue;
+        if (!blobs && !valid_saved_name(name)) continue;
+        
+        string to = blobs ? blob_path(name) : legacy_file_path(name);
+        // Blob: giữ blob_mutex để commit_blob / release_message_blob không
+        // thấy blob ở trạng thái nửa vời
+        if (blobs) blob_mutex.lock();
+        if (!make_shard_dir(dir_of(to), dirty)) {
+            failed++;
+        } else if (stat(to.c_str(), &st) == 0) {
+            if (blobs) unlink(from.c_str());        // Blob cùng hash = cùng nội dung
+            else failed++;
+        } else if (rename(from.c_str(), to.c_str()) == 0) {
+            moved++;
+        } else {
+            failed++;
         }
+        if (blobs) blob_mutex.unlock();
+        
+        if (moved > 0 && moved % UPLOAD_MIGRATE_BATCH == 0) usleep(UPLOAD_MIGRATE_PAUSE_US);
+    }
+    closedir(dir);
+    return moved;
+}
+
+void* upload_migration_thread(void*) {
+    auto start = chrono::steady_clock::now();
+    uint64_t failed = 0;
+    uint64_t blobs = migrate_flat_dir(UPLOAD_BLOB_DIR, true, failed);
+    uint64_t files = migrate_flat_dir(UPLOAD_DIR, false, failed);
+    if (failed > 0) {
+        // Giữ đường tìm file ở vị trí cũ, lần khởi động sau thử dời lại
+        LOG_WARN("Upload store migration: files left in the flat layout", "files", failed);
+    } else {
+        upload_migration_done = true;
+    }
+    if (blobs + files > 0) {
+        auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        LOG_INFO("Upload store migrated to sharded layout", "blobs", blobs, "legacy_files", files, "ms", (int64_t)ms);
     }
-    return out;
+    return NULL;
+}
+
+// File tạm của các phiên upload trước khi server khởi động lại (phiên upload
+// chỉ sống trong bộ nhớ nên không thể resume nữa)
+void clean_upload_temp() {
+    DIR* dir = opendir(UPLOAD_TMP_DIR);
+    if (!dir) return;
+    int removed = 0;
+    while (struct dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        if (unlink((string(UPLOAD_TMP_DIR) + "/" + name).c_str()) == 0) removed++;
+    }
+    closedir(dir);
+    if (removed > 0) LOG_INFO("Removed stale upload temp files", "files", removed);
 }
 
 // ===== DELETE MESSAGE =====
-void handle_delete_message(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_delete_message(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string message_id_str = body.count("message_id") ? body.at("message_id") : "";
     string chat_type = body.count("chat_type") ? body.at("chat_type") : "";  // "private" hoặc "group"
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["message"] = "Invalid token";
-        send_packet(client_socket, S_RESP_DELETE_MESSAGE, STATUS_UNAUTHORIZED, JsonHelper::build(resp));
-        return;
-    }
-    pthread_mutex_unlock(&db_mutex);
+    int user_id = ctx.user_id;
     
     if (message_id_str.empty() || chat_type.empty()) {
         map<string, string> resp;
         resp["message"] = "Missing message_id or chat_type";
-        send_packet(client_socket, S_RESP_DELETE_MESSAGE, STATUS_BAD_REQUEST, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_DELETE_MESSAGE, STATUS_BAD_REQUEST, JsonHelper::build(resp));
         return;
     }
     
     int message_id = stoi(message_id_str);
     bool deleted = false;
     
-    pthread_mutex_lock(&db_mutex);
+    db_acquire();
     
     if (chat_type == "private") {
         // Lấy thông tin người nhận trước khi xóa
         int receiver_id = db->getPrivateMessageReceiver(message_id);
         string receiver_username = db->getUsername(receiver_id);
+        string message_text = db->getPrivateMessageText(message_id);
         
         // Xóa tin nhắn (chỉ người gửi mới xóa được)
         deleted = db->deletePrivateMessage(message_id, user_id);
-        pthread_mutex_unlock(&db_mutex);
+        if (deleted) db->deleteMessageAttachments("private", message_id);
+        db_release();
+        
+        if (deleted) release_message_blob(message_text);
         
         if (deleted && receiver_id != -1) {
             // Thông báo cho người nhận (nếu online)
-            pthread_mutex_lock(&clients_mutex);
+            clients_mutex.lock();
             if (username_to_socket.count(receiver_username)) {
                 int receiver_socket = username_to_socket[receiver_username];
-                pthread_mutex_unlock(&clients_mutex);
+                clients_mutex.unlock();
                 
                 map<string, string> notify;
                 notify["message_id"] = message_id_str;
                 notify["chat_type"] = "private";
                 send_packet(receiver_socket, S_NOTIFY_MESSAGE_DELETED, STATUS_OK, JsonHelper::build(notify));
             } else {
-                pthread_mutex_unlock(&clients_mutex);
+                clients_mutex.unlock();
             }
         }
     } else if (chat_type == "group") {
@@ -1253,22 +1740,27 @@ void handle_delete_message(int client_socket, const map<string, string>& body) {
             member_ids = db->getGroupMembers(group_id);
         }
         
+        string message_text = db->getGroupMessageText(message_id);
+        
         // Xóa tin nhắn
         deleted = db->deleteGroupMessage(message_id, user_id);
-        pthread_mutex_unlock(&db_mutex);
+        if (deleted) db->deleteMessageAttachments("group", message_id);
+        db_release();
+        
+        if (deleted) release_message_blob(message_text);
         
         if (deleted && group_id != -1) {
             // Thông báo cho tất cả thành viên nhóm (trừ người xóa)
-            pthread_mutex_lock(&db_mutex);
+            db_acquire();
             for (int member_id : member_ids) {
                 if (member_id == user_id) continue;
                 string member_username = db->getUsername(member_id);
-                pthread_mutex_unlock(&db_mutex);
+                db_release();
                 
-                pthread_mutex_lock(&clients_mutex);
+                clients_mutex.lock();
                 if (username_to_socket.count(member_username)) {
                     int member_socket = username_to_socket[member_username];
-                    pthread_mutex_unlock(&clients_mutex);
+                    clients_mutex.unlock();
                     
                     map<string, string> notify;
                     notify["message_id"] = message_id_str;
@@ -1276,14 +1768,14 @@ void handle_delete_message(int client_socket, const map<string, string>& body) {
                     notify["group_id"] = to_string(group_id);
                     send_packet(member_socket, S_NOTIFY_MESSAGE_DELETED, STATUS_OK, JsonHelper::build(notify));
                 } else {
-                    pthread_mutex_unlock(&clients_mutex);
+                    clients_mutex.unlock();
                 }
-                pthread_mutex_lock(&db_mutex);
+                db_acquire();
             }
-            pthread_mutex_unlock(&db_mutex);
+            db_release();
         }
     } else {
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
     }
     
     // Phản hồi cho client
@@ -1291,42 +1783,33 @@ void handle_delete_message(int client_socket, const map<string, string>& body) {
     if (deleted) {
         resp["message"] = "Message deleted";
         resp["message_id"] = message_id_str;
-        send_packet(client_socket, S_RESP_DELETE_MESSAGE, STATUS_OK, JsonHelper::build(resp));
-        cout << "✓ User " << user_id << " deleted message " << message_id << endl;
+        send_response(ctx, S_RESP_DELETE_MESSAGE, STATUS_OK, JsonHelper::build(resp));
+        LOG_INFO("Message deleted", "user_id", user_id, "message_id", message_id);
     } else {
         resp["message"] = "Failed to delete message (not found or not owner)";
-        send_packet(client_socket, S_RESP_DELETE_MESSAGE, STATUS_FORBIDDEN, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_DELETE_MESSAGE, STATUS_FORBIDDEN, JsonHelper::build(resp));
     }
 }
 
 // ===== SEARCH MESSAGES =====
-void handle_search_messages(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
+void handle_search_messages(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
     string keyword = body.count("keyword") ? body.at("keyword") : "";
     string chat_type = body.count("chat_type") ? body.at("chat_type") : "";  // "private" hoặc "group"
     string target = body.count("target") ? body.at("target") : "";  // username hoặc group_id
     
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["message"] = "Invalid token";
-        send_packet(client_socket, S_RESP_SEARCH_MESSAGES, STATUS_UNAUTHORIZED, JsonHelper::build(resp));
-        return;
-    }
-    pthread_mutex_unlock(&db_mutex);
+    int user_id = ctx.user_id;
     
     if (keyword.empty() || chat_type.empty() || target.empty()) {
         map<string, string> resp;
         resp["message"] = "Missing keyword, chat_type or target";
-        send_packet(client_socket, S_RESP_SEARCH_MESSAGES, STATUS_BAD_REQUEST, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_SEARCH_MESSAGES, STATUS_BAD_REQUEST, JsonHelper::build(resp));
         return;
     }
     
     vector<map<string, string>> results;
     
-    pthread_mutex_lock(&db_mutex);
+    db_acquire();
     if (chat_type == "private") {
         int target_user_id = db->getUserId(target);
         if (target_user_id != -1) {
@@ -1338,7 +1821,7 @@ void handle_search_messages(int client_socket, const map<string, string>& body)
             results = db->searchGroupMessages(group_id, keyword, 100);
         }
     }
-    pthread_mutex_unlock(&db_mutex);
+    db_release();
     
     // Build response JSON với array messages
     string json = "{\"count\":" + to_string(results.size()) + ",\"messages\":[";
@@ -1353,68 +1836,41 @@ void handle_search_messages(int client_socket, const map<string, string>& body)
     }
     json += "]}";
     
-    send_packet(client_socket, S_RESP_SEARCH_MESSAGES, STATUS_OK, json);
-    cout << "✓ Search for '" << keyword << "' returned " << results.size() << " results" << endl;
+    send_response(ctx, S_RESP_SEARCH_MESSAGES, STATUS_OK, json);
+    LOG_INFO("Message search", "keyword", keyword, "results", results.size());
 }
 
-void handle_file_upload(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
-    string fileName = body.count("file_name") ? body.at("file_name") : "";
-    string fileSizeStr = body.count("file_size") ? body.at("file_size") : "0";
-    string fileDataBase64 = body.count("file_data") ? body.at("file_data") : "";
-    string target_username = body.count("target_username") ? body.at("target_username") : "";
-    string group_id = body.count("group_id") ? body.at("group_id") : "";
-    
-    int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["message"] = "Invalid token";
-        send_packet(client_socket, S_RESP_FILE_OK, STATUS_UNAUTHORIZED, JsonHelper::build(resp));
-        return;
-    }
+// ===== FILE UPLOAD =====
+
+// Gửi tin nhắn [FILE:...] cho người nhận / nhóm và xác nhận cho người gửi.
+// Tin nhắn vẫn giữ dạng "[FILE:<tên lưu>]<tên gốc>" cho client cũ, kèm một
+// bản ghi attachments để liệt kê file theo cuộc chat (C_REQ_FILE_LIST).
+void deliver_file_message(RequestContext& ctx, const string& savedFileName, const string& fileName,
+                          uint64_t fileSize, const string& target_username, const string& group_id,
+                          bool deduplicated = false) {
+    int user_id = ctx.user_id;
+    db_acquire();
     string sender_username = db->getUsername(user_id);
-    pthread_mutex_unlock(&db_mutex);
-    
-    if (fileName.empty() || fileDataBase64.empty()) {
-        map<string, string> resp;
-        resp["message"] = "Missing file data";
-        send_packet(client_socket, S_RESP_FILE_OK, STATUS_BAD_REQUEST, JsonHelper::build(resp));
-        return;
-    }
-    
-    // Decode base64
-    string fileData = base64_decode(fileDataBase64);
-    
-    // Generate unique filename
-    time_t now = time(nullptr);
-    stringstream ss;
-    ss << now << "_" << fileName;
-    string savedFileName = ss.str();
-    string filePath = "uploads/" + savedFileName;
-    
-    // Save file
-    ofstream outFile(filePath, ios::binary);
-    if (!outFile) {
-        map<string, string> resp;
-        resp["message"] = "Failed to save file";
-        send_packet(client_socket, S_RESP_FILE_OK, STATUS_SERVER_ERROR, JsonHelper::build(resp));
-        return;
-    }
-    outFile.write(fileData.c_str(), fileData.size());
-    outFile.close();
-    
-    cout << "✓ Saved file: " << filePath << " (" << fileData.size() << " bytes)" << endl;
+    db_release();
     
     // Send file message
     string fileMessage = "[FILE:" + savedFileName + "]" + fileName;
+    string hash;
+    if (!parse_blob_name(savedFileName, hash)) hash = "";
+    string mimeType = guess_mime_type(fileName);
+    int attachment_id = -1;
+    bool saved;
     
     if (!group_id.empty()) {
         // Group file
-        pthread_mutex_lock(&db_mutex);
+        db_acquire();
         int group_int_id = stoi(group_id);
-        bool saved = db->saveGroupMessage(group_int_id, user_id, fileMessage);
+        int message_id = db->saveGroupMessage(group_int_id, user_id, fileMessage);
+        saved = message_id > 0;
+        if (saved) {
+            attachment_id = db->saveAttachment("group", message_id, group_int_id, user_id, 0, fileName, savedFileName,
+                                               fileSize, hash, mimeType, upload_storage_path(savedFileName));
+        }
         vector<int> member_ids = db->getGroupMembers(group_int_id);
         string groupName = db->getGroupName(group_int_id);
         
@@ -1424,11 +1880,11 @@ void handle_file_upload(int client_socket, const map<string, string>& body) {
             string member_name = db->getUsername(member_id);
             if (!member_name.empty()) members.push_back(member_name);
         }
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         
         if (saved) {
             // Broadcast to group members
-            pthread_mutex_lock(&clients_mutex);
+            clients_mutex.lock();
             for (const string &member : members) {
                 if (username_to_socket.count(member)) {
                     int mem_socket = username_to_socket[member];
@@ -1437,300 +1893,1773 @@ void handle_file_upload(int client_socket, const map<string, string>& body) {
                     notify["group_name"] = groupName;
                     notify["from_username"] = sender_username;
                     notify["message"] = fileMessage;
+                    if (attachment_id > 0) notify["attachment_id"] = to_string(attachment_id);
                     send_packet(mem_socket, S_NOTIFY_MSG_GROUP, STATUS_OK, JsonHelper::build(notify));
                 }
             }
-            pthread_mutex_unlock(&clients_mutex);
+            clients_mutex.unlock();
         }
     } else {
         // Private file
-        pthread_mutex_lock(&db_mutex);
+        db_acquire();
         int target_id = db->getUserId(target_username);
-        bool saved = db->savePrivateMessage(user_id, target_id, fileMessage);
-        pthread_mutex_unlock(&db_mutex);
+        int message_id = db->savePrivateMessage(user_id, target_id, fileMessage);
+        saved = message_id > 0;
+        if (saved) {
+            attachment_id = db->saveAttachment("private", message_id, 0, user_id, target_id, fileName, savedFileName,
+                                               fileSize, hash, mimeType, upload_storage_path(savedFileName));
+        }
+        db_release();
         
         if (saved) {
             // Send to target if online
-            pthread_mutex_lock(&clients_mutex);
+            clients_mutex.lock();
             if (username_to_socket.count(target_username)) {
                 int target_socket = username_to_socket[target_username];
-                pthread_mutex_unlock(&clients_mutex);
+                clients_mutex.unlock();
                 
                 map<string, string> notify;
                 notify["from_username"] = sender_username;
                 notify["message"] = fileMessage;
+                if (attachment_id > 0) notify["attachment_id"] = to_string(attachment_id);
                 send_packet(target_socket, S_NOTIFY_MSG_PRIVATE, STATUS_OK, JsonHelper::build(notify));
             } else {
-                pthread_mutex_unlock(&clients_mutex);
+                clients_mutex.unlock();
             }
         }
     }
     
+    // Không lưu được tin nhắn: trả lại tham chiếu blob đã lấy trước khi gọi hàm này
+    if (!saved) {
+        if (!hash.empty()) release_blob_ref(hash);
+        map<string, string> resp;
+        resp["message"] = "Failed to save file message";
+        send_response(ctx, S_RESP_FILE_OK, STATUS_SERVER_ERROR, JsonHelper::build(resp));
+        return;
+    }
+    
     // Confirm to sender
     map<string, string> resp;
     resp["message"] = "File uploaded successfully";
     resp["file_name"] = savedFileName;
-    send_packet(client_socket, S_RESP_FILE_OK, STATUS_OK, JsonHelper::build(resp));
+    if (attachment_id > 0) resp["attachment_id"] = to_string(attachment_id);
+    if (deduplicated) resp["deduplicated"] = "1";   // Nội dung đã có, client không cần gửi dữ liệu
+    send_response(ctx, S_RESP_FILE_OK, STATUS_OK, JsonHelper::build(resp));
 }
 
-void handle_file_download(int client_socket, const map<string, string>& body) {
-    string token = body.count("token") ? body.at("token") : "";
-    string fileName = body.count("file_name") ? body.at("file_name") : "";
-    
+LockProfile session_lock_profile("upload_session.lock");    // Chung cho mọi phiên upload
+
+// Phiên upload theo chunk: C_REQ_FILE_UPLOAD (không có file_data) mở phiên và
+// trả file_id, client stream C_DATA_FILE_CHUNK ghi thẳng xuống file .part,
+// C_DATA_FILE_END đổi tên file và gửi tin nhắn [FILE:...]
+// Khi kết nối rớt, phiên được giữ lại (tách khỏi socket) trong
+// UPLOAD_RESUME_TTL giây để client gửi "resume_file_id" và tiếp tục từ offset
+// server đã ghi.
+struct UploadSession {
+    uint32_t file_id;
     int user_id;
-    pthread_mutex_lock(&db_mutex);
-    if (!db->verifyToken(token, user_id)) {
-        pthread_mutex_unlock(&db_mutex);
-        map<string, string> resp;
-        resp["message"] = "Invalid token";
-        send_packet(client_socket, S_RESP_FILE_OK, STATUS_UNAUTHORIZED, JsonHelper::build(resp));
-        return;
+    ProfiledMutex lock;         // Giữ khi ghi chunk / đổi chủ phiên
+    int fd;                     // File .part đang ghi (-1 khi đang tạm dừng)
+    string part_path;           // Trong UPLOAD_TMP_DIR
+    string file_name;           // Tên gốc của client
+    string expected_hash;       // "file_hash" client gửi (có thể rỗng)
+    Sha256 hasher;              // Băm dần theo thứ tự chunk
+    bool checksum;              // Chunk kèm CRC32C ("checksum": "crc32c")
+    uint32_t file_crc;          // CRC32C cộng dồn của phần đã ghi
+    bool nack_pending;          // Đã báo chunk sai CRC, bỏ các chunk sau cho tới khi nhận lại
+    uint64_t file_size;
+    uint64_t received;
+    uint64_t written_back;      // Đã yêu cầu ghi xuống đĩa tới offset này (UPLOAD_WRITEBACK_BYTES)
+    string target_username;
+    string group_id;
+    int owner_socket;           // -1 khi kết nối đã rớt, chờ resume
+    time_t detached_at;
+    
+    UploadSession() : file_id(0), user_id(-1), lock(session_lock_profile), fd(-1), checksum(false), file_crc(0),
+                      nack_pending(false), file_size(0), received(0), written_back(0),
+                      owner_socket(-1), detached_at(0) {}
+    ~UploadSession() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+map<uint32_t, shared_ptr<UploadSession>> upload_sessions;   // file_id -> phiên
+ProfiledMutex upload_mutex("upload_mutex");
+uint32_t next_file_id = 1;
+
+shared_ptr<UploadSession> find_upload(uint32_t file_id, int user_id) {
+    upload_mutex.lock();
+    auto it = upload_sessions.find(file_id);
+    shared_ptr<UploadSession> session;
+    if (it != upload_sessions.end() && it->second->user_id == user_id) session = it->second;
+    upload_mutex.unlock();
+    return session;
+}
+
+// Gỡ phiên khỏi bảng; false nếu thread khác đã gỡ trước
+bool detach_upload(const shared_ptr<UploadSession>& session) {
+    upload_mutex.lock();
+    auto it = upload_sessions.find(session->file_id);
+    bool owned = it != upload_sessions.end() && it->second == session;
+    if (owned) upload_sessions.erase(it);
+    upload_mutex.unlock();
+    return owned;
+}
+
+// Hủy phiên: xóa file .part (fd đóng khi phiên được giải phóng)
+void abort_upload(const shared_ptr<UploadSession>& session) {
+    if (!detach_upload(session)) return;
+    unlink(session->part_path.c_str());
+}
+
+// Kết nối vừa đóng: tạm dừng các phiên upload dang dở để client resume sau
+void suspend_uploads_of(int client_socket) {
+    vector<shared_ptr<UploadSession>> orphans;
+    upload_mutex.lock();
+    for (auto& entry : upload_sessions) {
+        if (entry.second->owner_socket == client_socket) orphans.push_back(entry.second);
+    }
+    upload_mutex.unlock();
+    
+    for (auto& session : orphans) {
+        session->lock.lock();
+        if (session->owner_socket == client_socket) {
+            session->owner_socket = -1;
+            session->detached_at = time(nullptr);
+            if (session->fd >= 0) close(session->fd);
+            session->fd = -1;
+            LOG_WARN("Upload paused", "file", session->file_name, "received", session->received,
+                     "size", session->file_size, "file_id", session->file_id);
+        }
+        session->lock.unlock();
     }
-    pthread_mutex_unlock(&db_mutex);
+}
+
+// Xóa các phiên tạm dừng quá UPLOAD_RESUME_TTL (gọi khi mở phiên mới)
+void expire_uploads() {
+    time_t now = time(nullptr);
+    vector<shared_ptr<UploadSession>> expired;
+    upload_mutex.lock();
+    for (auto& entry : upload_sessions) {
+        const shared_ptr<UploadSession>& session = entry.second;
+        session->lock.lock();
+        if (session->owner_socket < 0 && now - session->detached_at > UPLOAD_RESUME_TTL) {
+            expired.push_back(session);
+        }
+        session->lock.unlock();
+    }
+    upload_mutex.unlock();
     
-    if (fileName.empty()) {
+    for (auto& session : expired) {
+        LOG_WARN("Upload expired", "file", session->file_name, "file_id", session->file_id);
+        abort_upload(session);
+    }
+}
+
+void send_upload_error(RequestContext& ctx, uint32_t file_id, int status, const string& message) {
+    map<string, string> resp;
+    resp["file_id"] = to_string(file_id);
+    resp["message"] = message;
+    send_response(ctx, S_RESP_FILE_OK, status, JsonHelper::build(resp));
+}
+
+// Mở phiên upload theo chunk
+void begin_chunked_upload(RequestContext& ctx, const string& fileName, uint64_t fileSize,
+                          const string& fileHash, bool checksum,
+                          const string& target_username, const string& group_id) {
+    if (fileSize > MAX_UPLOAD_SIZE) {
+        send_upload_error(ctx, 0, STATUS_BAD_REQUEST, "File too large");
+        return;
+    }
+    
+    // Nội dung đã có trong kho -> chỉ thêm tham chiếu, client bỏ qua việc truyền.
+    // Hash do client gửi không chứng minh client có nội dung (ai biết hash cũng
+    // lấy được file của người khác), nên chỉ áp dụng với file chính user này đã
+    // gửi; còn lại vẫn stream và kiểm tra hash khi xong (commit_blob gộp blob)
+    bool uploaded_before = false;
+    if (is_sha256_hex(fileHash)) {
+        db_acquire();
+        uploaded_before = db->hasUploadedBlob(ctx.user_id, fileHash);
+        db_release();
+    }
+    if (uploaded_before && ref_existing_blob(fileHash, fileSize)) {
+        LOG_INFO("Upload deduplicated", "file", fileName, "size", fileSize, "hash", fileHash);
+        deliver_file_message(ctx, fileHash + "_" + fileName, fileName, fileSize, target_username, group_id, true);
+        return;
+    }
+    
+    expire_uploads();
+    
+    auto session = make_shared<UploadSession>();
+    session->user_id = ctx.user_id;
+    session->owner_socket = ctx.client_socket;
+    session->file_name = fileName;
+    session->file_size = fileSize;
+    session->target_username = target_username;
+    session->group_id = group_id;
+    session->checksum = checksum;
+    if (is_sha256_hex(fileHash)) session->expected_hash = fileHash;
+    
+    upload_mutex.lock();
+    session->file_id = next_file_id++;
+    if (next_file_id == 0) next_file_id = 1;
+    upload_mutex.unlock();
+    
+    session->fd = create_upload_temp(to_string(session->file_id) + ".part", session->part_path);
+    if (session->fd < 0) {
+        send_upload_error(ctx, 0, STATUS_SERVER_ERROR, "Failed to save file");
+        return;
+    }
+    
+    upload_mutex.lock();
+    upload_sessions[session->file_id] = session;
+    upload_mutex.unlock();
+    
+    map<string, string> resp;
+    resp["message"] = "Upload ready";
+    resp["file_id"] = to_string(session->file_id);
+    resp["chunk_size"] = to_string(FILE_CHUNK_SIZE);
+    if (checksum) resp["checksum"] = FILE_CHECKSUM_CRC32C;
+    send_response(ctx, S_RESP_FILE_OK, STATUS_OK, JsonHelper::build(resp));
+    
+    LOG_INFO("Upload started", "file", fileName, "size", fileSize, "file_id", session->file_id);
+}
+
+// Tiếp tục phiên upload đã tạm dừng: gắn phiên vào kết nối hiện tại và trả
+// offset đã ghi, client gửi tiếp chunk từ offset đó
+void resume_chunked_upload(RequestContext& ctx, uint32_t file_id, uint64_t fileSize) {
+    shared_ptr<UploadSession> session = find_upload(file_id, ctx.user_id);
+    if (!session || session->file_size != fileSize) {
+        send_upload_error(ctx, file_id, STATUS_NOT_FOUND, "Unknown upload");
+        return;
+    }
+    
+    session->lock.lock();
+    // Kết nối cũ có thể chưa bị phát hiện là đã chết -> kết nối mới giành lại phiên
+    session->owner_socket = ctx.client_socket;
+    if (session->fd < 0) session->fd = open(session->part_path.c_str(), O_WRONLY);
+    bool ok = session->fd >= 0;
+    uint64_t offset = session->received;
+    bool checksum = session->checksum;
+    session->nack_pending = false;      // Client gửi lại từ offset trả về bên dưới
+    session->lock.unlock();
+    
+    if (!ok) {
+        abort_upload(session);
+        send_upload_error(ctx, file_id, STATUS_SERVER_ERROR, "Failed to save file");
+        return;
+    }
+    
+    map<string, string> resp;
+    resp["message"] = "Upload resumed";
+    resp["file_id"] = to_string(file_id);
+    resp["chunk_size"] = to_string(FILE_CHUNK_SIZE);
+    resp["offset"] = to_string(offset);
+    if (checksum) resp["checksum"] = FILE_CHECKSUM_CRC32C;
+    send_response(ctx, S_RESP_FILE_OK, STATUS_OK, JsonHelper::build(resp));
+    
+    LOG_INFO("Upload resumed", "file", session->file_name, "offset", offset, "size", session->file_size,
+             "file_id", file_id);
+}
+
+atomic<uint64_t> chunk_crc_errors(0);      // Chunk upload/download sai CRC32C
+
+// Báo client gửi lại upload từ offset (chunk tại offset sai CRC)
+void send_chunk_nack(int client_socket, uint32_t file_id, uint64_t offset) {
+    map<string, string> nack;
+    nack["file_id"] = to_string(file_id);
+    nack["offset"] = to_string(offset);
+    send_packet(client_socket, S_NOTIFY_FILE_NACK, STATUS_OK, JsonHelper::build(nack));
+}
+
+// C_DATA_FILE_CHUNK: [u32 file_id][u64 offset]([u32 crc32c])[dữ liệu] - không phản hồi khi thành công
+// Chunk sai CRC không được ghi: server gửi S_NOTIFY_FILE_NACK và bỏ qua các
+// chunk phía sau đang trên đường truyền cho tới khi client gửi lại đúng offset.
+void handle_file_chunk(RequestContext& ctx) {
+    const string& raw = ctx.raw_body;
+    if (raw.size() < FILE_CHUNK_HEADER_SIZE) return;
+    
+    const unsigned char* p = (const unsigned char*)raw.data();
+    uint32_t file_id = wire_get_u32(p);
+    uint64_t offset = wire_get_u64(p + 4);
+    
+    shared_ptr<UploadSession> session = find_upload(file_id, ctx.user_id);
+    if (!session) return;   // Phiên đã hủy - bỏ qua các chunk còn trên đường truyền
+    
+    session->lock.lock();
+    if (session->owner_socket != ctx.client_socket) {
+        // Phiên đã được resume trên kết nối khác
+        session->lock.unlock();
+        return;
+    }
+    
+    size_t head_size = FILE_CHUNK_HEADER_SIZE + (session->checksum ? FILE_CHUNK_CRC_SIZE : 0);
+    if (raw.size() < head_size) {
+        session->lock.unlock();
+        abort_upload(session);
+        send_upload_error(ctx, file_id, STATUS_BAD_REQUEST, "Invalid chunk");
+        return;
+    }
+    const char* data = raw.data() + head_size;
+    size_t len = raw.size() - head_size;
+    
+    if (session->nack_pending && offset != session->received) {
+        // Chunk gửi trước khi client nhận NACK - bỏ, client sẽ gửi lại
+        session->lock.unlock();
+        return;
+    }
+    if (offset != session->received || session->received + len > session->file_size) {
+        session->lock.unlock();
+        abort_upload(session);
+        send_upload_error(ctx, file_id, STATUS_BAD_REQUEST, "Invalid chunk offset");
+        return;
+    }
+    if (session->checksum && crc32c(data, len) != wire_get_u32(p + FILE_CHUNK_HEADER_SIZE)) {
+        session->nack_pending = true;
+        session->lock.unlock();
+        chunk_crc_errors++;
+        send_chunk_nack(ctx.client_socket, file_id, offset);
+        LOG_WARN("Upload chunk CRC mismatch, requested resend", "file", session->file_name, "offset", offset,
+                 "file_id", file_id);
+        return;
+    }
+    session->nack_pending = false;
+    
+    while (len > 0) {
+        ssize_t n = pwrite(session->fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            session->lock.unlock();
+            abort_upload(session);
+            send_upload_error(ctx, file_id, STATUS_SERVER_ERROR, "Failed to save file");
+            return;
+        }
+        session->hasher.update(data, n);
+        session->file_crc = crc32c_update(session->file_crc, data, n);
+        data += n;
+        offset += n;
+        len -= n;
+        session->received += n;
+    }
+    
+    // Bắt đầu ghi phần vừa nhận xuống đĩa (không chờ), dirty page không dồn
+    // lại tới lúc fdatasync ở C_DATA_FILE_END
+    if (session->received - session->written_back >= UPLOAD_WRITEBACK_BYTES) {
+        sync_file_range(session->fd, session->written_back, session->received - session->written_back,
+                        SYNC_FILE_RANGE_WRITE);
+        session->written_back = session->received;
+    }
+    session->lock.unlock();
+}
+
+// C_DATA_FILE_END: kiểm tra đủ dữ liệu, đổi tên file và gửi tin nhắn
+void handle_file_end(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
+    uint32_t file_id = body.count("file_id") ? strtoul(body.at("file_id").c_str(), nullptr, 10) : 0;
+    
+    shared_ptr<UploadSession> session = find_upload(file_id, ctx.user_id);
+    if (!session) {
+        send_upload_error(ctx, file_id, STATUS_NOT_FOUND, "Unknown upload");
+        return;
+    }
+    session->lock.lock();
+    bool complete = session->received == session->file_size;
+    bool resending = session->nack_pending;
+    session->lock.unlock();
+    if (resending) {
+        // END đi sau các chunk đã bị NACK - client gửi lại chunk rồi gửi END mới
+        return;
+    }
+    if (!complete) {
+        abort_upload(session);
+        send_upload_error(ctx, file_id, STATUS_BAD_REQUEST, "Incomplete upload");
+        return;
+    }
+    
+    if (!detach_upload(session)) {
+        send_upload_error(ctx, file_id, STATUS_NOT_FOUND, "Unknown upload");
+        return;
+    }
+    session->lock.lock();
+    // fd đóng khi kết nối cũ rớt trước lúc resume -> mở lại để fdatasync
+    if (session->fd < 0) session->fd = open(session->part_path.c_str(), O_WRONLY);
+    bool synced = session->fd >= 0 && fdatasync(session->fd) == 0;
+    if (session->fd >= 0) close(session->fd);
+    session->fd = -1;
+    string hash = session->hasher.final_hex();
+    uint32_t file_crc = session->file_crc;
+    session->lock.unlock();
+    
+    if (!session->expected_hash.empty() && session->expected_hash != hash) {
+        unlink(session->part_path.c_str());
+        send_upload_error(ctx, file_id, STATUS_BAD_REQUEST, "File hash mismatch");
+        return;
+    }
+    if (!synced) {
+        unlink(session->part_path.c_str());
+        send_upload_error(ctx, file_id, STATUS_SERVER_ERROR, "Failed to save file");
+        return;
+    }
+    if (!commit_blob(session->part_path, hash, session->file_size, file_crc)) {
+        send_upload_error(ctx, file_id, STATUS_SERVER_ERROR, "Failed to save file");
+        return;
+    }
+    
+    LOG_INFO("Saved file", "path", blob_path(hash), "size", session->file_size, "chunked", true);
+    
+    deliver_file_message(ctx, hash + "_" + session->file_name, session->file_name, session->file_size,
+                         session->target_username, session->group_id);
+}
+
+// C_REQ_FILE_UPLOAD: có file_data -> upload một gói base64 (client cũ),
+// có resume_file_id -> tiếp tục phiên cũ, không có -> mở phiên upload theo chunk
+void handle_file_upload(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
+    string fileName = body.count("file_name") ? body.at("file_name") : "";
+    string fileSizeStr = body.count("file_size") ? body.at("file_size") : "0";
+    string fileDataBase64 = body.count("file_data") ? body.at("file_data") : "";
+    string target_username = body.count("target_username") ? body.at("target_username") : "";
+    string group_id = body.count("group_id") ? body.at("group_id") : "";
+    string fileHash = body.count("file_hash") ? body.at("file_hash") : "";
+    bool checksum = body.count("checksum") && body.at("checksum") == FILE_CHECKSUM_CRC32C;
+    
+    if (body.count("resume_file_id")) {
+        resume_chunked_upload(ctx, strtoul(body.at("resume_file_id").c_str(), nullptr, 10),
+                              strtoull(fileSizeStr.c_str(), nullptr, 10));
+        return;
+    }
+    
+    if (!fileName.empty() && fileDataBase64.empty() && !body.count("file_data")) {
+        begin_chunked_upload(ctx, fileName, strtoull(fileSizeStr.c_str(), nullptr, 10),
+                             fileHash, checksum, target_username, group_id);
+        return;
+    }
+    
+    if (fileName.empty() || fileDataBase64.empty()) {
         map<string, string> resp;
-        resp["message"] = "Missing file name";
-        send_packet(client_socket, S_RESP_FILE_OK, STATUS_BAD_REQUEST, JsonHelper::build(resp));
+        resp["message"] = "Missing file data";
+        send_response(ctx, S_RESP_FILE_OK, STATUS_BAD_REQUEST, JsonHelper::build(resp));
         return;
     }
     
-    string filePath = "uploads/" + fileName;
+    // Decode base64
+    string fileData = base64_decode(fileDataBase64);
     
-    // Read file
-    ifstream inFile(filePath, ios::binary);
-    if (!inFile) {
+    Sha256 hasher;
+    hasher.update(fileData.data(), fileData.size());
+    string hash = hasher.final_hex();
+    
+    // Save file (ghi ra file tạm rồi đưa vào kho theo hash)
+    if (!ref_existing_blob(hash, fileData.size())) {
+        string tmpPath;
+        int fd = create_upload_temp("upload", tmpPath);
+        bool written = fd >= 0 && write_file_all(fd, fileData.data(), fileData.size()) && fdatasync(fd) == 0;
+        if (fd >= 0) close(fd);
+        uint32_t file_crc = crc32c(fileData.data(), fileData.size());
+        if (!written || !commit_blob(tmpPath, hash, fileData.size(), file_crc)) {
+            if (fd >= 0) unlink(tmpPath.c_str());
+            map<string, string> resp;
+            resp["message"] = "Failed to save file";
+            send_response(ctx, S_RESP_FILE_OK, STATUS_SERVER_ERROR, JsonHelper::build(resp));
+            return;
+        }
+    }
+    
+    LOG_INFO("Saved file", "path", blob_path(hash), "size", fileData.size());
+    
+    deliver_file_message(ctx, hash + "_" + fileName, fileName, fileData.size(), target_username, group_id);
+}
+
+// ===== FILE DOWNLOAD =====
+
+atomic<uint32_t> next_download_id(1);
+
+// Gửi một S_DATA_FILE_CHUNK: header + [u32 file_id][u64 offset] rồi sendfile
+// phần dữ liệu thẳng từ page cache xuống socket (không copy qua user space).
+// Giữ khóa ghi trong từng chunk nên phản hồi/thông báo khác vẫn chen được
+// vào giữa các chunk.
+bool send_file_chunk(int client_socket, uint32_t request_id, uint32_t file_id,
+                     int fd, uint64_t offset, size_t len) {
+    PhaseTimer timer(send_time_ns);
+    shared_ptr<Connection> conn = find_connection(client_socket);
+    if (!conn) return false;
+    
+    unsigned char head[WIRE_HEADER_SIZE + FILE_CHUNK_HEADER_SIZE];
+    WireHeader header(S_DATA_FILE_CHUNK, STATUS_OK, request_id);
+    header.body_length = FILE_CHUNK_HEADER_SIZE + len;
+    encode_wire_header(header, head);
+    wire_put_u32(head + WIRE_HEADER_SIZE, file_id);
+    wire_put_u64(head + WIRE_HEADER_SIZE + 4, offset);
+    
+    conn->write_mutex.lock();
+    struct iovec iov = { head, sizeof(head) };
+    bool ok = send_iov_all(client_socket, &iov, 1);
+    off_t off = offset;
+    while (ok && len > 0) {
+        ssize_t n = sendfile(client_socket, fd, &off, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // Frame đã gửi dở (file bị cắt ngắn / socket lỗi) -> luồng hỏng
+            shutdown(client_socket, SHUT_RDWR);
+            ok = false;
+            break;
+        }
+        len -= n;
+    }
+    conn->write_mutex.unlock();
+    return ok;
+}
+
+// Như send_file_chunk nhưng dữ liệu lấy từ buffer trong RAM (file đang cache
+// hoặc chunk vừa đọc để tính CRC). checksum -> chèn CRC32C của data sau offset.
+bool send_buffer_chunk(int client_socket, uint32_t request_id, uint32_t file_id,
+                       const char* data, uint64_t offset, size_t len, bool checksum) {
+    PhaseTimer timer(send_time_ns);
+    shared_ptr<Connection> conn = find_connection(client_socket);
+    if (!conn) return false;
+    
+    unsigned char head[WIRE_HEADER_SIZE + FILE_CHUNK_HEADER_SIZE + FILE_CHUNK_CRC_SIZE];
+    size_t chunk_head = FILE_CHUNK_HEADER_SIZE + (checksum ? FILE_CHUNK_CRC_SIZE : 0);
+    WireHeader header(S_DATA_FILE_CHUNK, STATUS_OK, request_id);
+    header.body_length = chunk_head + len;
+    encode_wire_header(header, head);
+    wire_put_u32(head + WIRE_HEADER_SIZE, file_id);
+    wire_put_u64(head + WIRE_HEADER_SIZE + 4, offset);
+    if (checksum) wire_put_u32(head + WIRE_HEADER_SIZE + FILE_CHUNK_HEADER_SIZE, crc32c(data, len));
+    
+    struct iovec iov[2] = { { head, WIRE_HEADER_SIZE + chunk_head }, { (void*)data, len } };
+    conn->write_mutex.lock();
+    bool ok = send_iov_all(client_socket, iov, 2);
+    conn->write_mutex.unlock();
+    if (!ok) shutdown(client_socket, SHUT_RDWR);
+    return ok;
+}
+
+bool read_file_range(int fd, char* buf, uint64_t offset, size_t len) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Gửi chunk [offset, offset+len): từ RAM nếu file đang cache, ngược lại
+// sendfile; khi cần CRC thì đọc chunk vào buffer để tính (sendfile không
+// cho xem dữ liệu).
+bool send_download_chunk(int client_socket, uint32_t request_id, uint32_t file_id, int fd,
+                         const shared_ptr<CachedFile>& cached, uint64_t offset, size_t len,
+                         bool checksum) {
+    if (cached) {
+        return send_buffer_chunk(client_socket, request_id, file_id, cached->data.data() + offset,
+                                 offset, len, checksum);
+    }
+    if (!checksum) return send_file_chunk(client_socket, request_id, file_id, fd, offset, len);
+    
+    static thread_local char buf[FILE_CHUNK_SIZE];
+    if (!read_file_range(fd, buf, offset, len)) {
+        shutdown(client_socket, SHUT_RDWR);     // File bị cắt ngắn giữa chừng
+        return false;
+    }
+    return send_buffer_chunk(client_socket, request_id, file_id, buf, offset, len, checksum);
+}
+
+// Tải file dạng stream (client v2 gửi "stream"): S_RESP_FILE_START ->
+// các S_DATA_FILE_CHUNK -> S_DATA_FILE_END, bộ nhớ dùng không phụ thuộc cỡ file.
+// start_offset > 0 khi client tải tiếp phần còn thiếu sau khi rớt kết nối.
+// checksum -> mỗi chunk kèm CRC32C, client xin lại chunk hỏng bằng C_REQ_FILE_RESEND.
+void stream_file_download(RequestContext& ctx, const string& fileName, string filePath,
+                          uint64_t start_offset, bool checksum) {
+    int fd = open_upload(fileName, filePath);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        map<string, string> resp;
+        resp["message"] = "File not found";
+        send_response(ctx, S_RESP_FILE_OK, STATUS_NOT_FOUND, JsonHelper::build(resp));
+        return;
+    }
+    
+    uint64_t fileSize = st.st_size;
+    if (start_offset > fileSize) {
+        close(fd);
+        map<string, string> resp;
+        resp["message"] = "Invalid offset";
+        send_response(ctx, S_RESP_FILE_OK, STATUS_BAD_REQUEST, JsonHelper::build(resp));
+        return;
+    }
+    
+    uint32_t file_id = next_download_id++;
+    // File nhỏ vừa được tải gần đây -> gửi từ RAM, file lớn -> sendfile từ page cache
+    shared_ptr<CachedFile> cached = file_cache.acquire(filePath, fd, st);
+    if (!cached) posix_fadvise(fd, start_offset, 0, POSIX_FADV_SEQUENTIAL);
+    
+    map<string, string> start;
+    start["file_id"] = to_string(file_id);
+    start["file_name"] = fileName;
+    start["file_size"] = to_string(fileSize);
+    start["chunk_size"] = to_string(FILE_CHUNK_SIZE);
+    start["offset"] = to_string(start_offset);
+    if (checksum) {
+        start["checksum"] = FILE_CHECKSUM_CRC32C;
+        long long file_crc = blob_crc32c(fileName);
+        if (file_crc >= 0) start["file_crc32c"] = to_string(file_crc);
+    }
+    send_response(ctx, S_RESP_FILE_START, STATUS_OK, JsonHelper::build(start));
+    
+    uint64_t offset = start_offset;
+    while (offset < fileSize) {
+        size_t len = min<uint64_t>(FILE_CHUNK_SIZE, fileSize - offset);
+        if (!send_download_chunk(ctx.client_socket, ctx.request_id, file_id, fd, cached, offset, len, checksum)) {
+            close(fd);
+            LOG_WARN("Download interrupted", "file", fileName, "offset", offset, "size", fileSize);
+            return;
+        }
+        offset += len;
+    }
+    close(fd);
+    
+    map<string, string> end;
+    end["file_id"] = to_string(file_id);
+    end["file_name"] = fileName;
+    end["message"] = "Download complete";
+    send_response(ctx, S_DATA_FILE_END, STATUS_OK, JsonHelper::build(end));
+    
+    LOG_INFO("Streamed file download", "file", fileName, "size", fileSize, "user_id", ctx.user_id);
+}
+
+// C_REQ_FILE_RESEND: gửi lại một chunk download bị sai CRC (không cần phiên
+// phía server - file_id chỉ để client ghép chunk vào lượt tải của nó)
+void handle_file_resend(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
+    string fileName = body.count("file_name") ? body.at("file_name") : "";
+    uint32_t file_id = body.count("file_id") ? strtoul(body.at("file_id").c_str(), nullptr, 10) : 0;
+    uint64_t offset = body.count("offset") ? strtoull(body.at("offset").c_str(), nullptr, 10) : 0;
+    
+    string filePath = resolve_upload_path(fileName);
+    shared_ptr<Connection> conn = find_connection(ctx.client_socket);
+    if (filePath.empty() || ctx.batch_out || !conn || conn->version != 2) {
+        map<string, string> resp;
+        resp["message"] = "Invalid resend request";
+        send_response(ctx, S_RESP_FILE_OK, STATUS_BAD_REQUEST, JsonHelper::build(resp));
+        return;
+    }
+    
+    int fd = open_upload(fileName, filePath);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || offset >= (uint64_t)st.st_size) {
+        if (fd >= 0) close(fd);
         map<string, string> resp;
         resp["message"] = "File not found";
-        send_packet(client_socket, S_RESP_FILE_OK, STATUS_NOT_FOUND, JsonHelper::build(resp));
+        send_response(ctx, S_RESP_FILE_OK, STATUS_NOT_FOUND, JsonHelper::build(resp));
         return;
     }
     
-    // Get file size
-    inFile.seekg(0, ios::end);
-    streamsize fileSize = inFile.tellg();
-    inFile.seekg(0, ios::beg);
+    chunk_crc_errors++;
+    size_t len = min<uint64_t>(FILE_CHUNK_SIZE, st.st_size - offset);
+    shared_ptr<CachedFile> cached = file_cache.acquire(filePath, fd, st);
+    send_download_chunk(ctx.client_socket, ctx.request_id, file_id, fd, cached, offset, len, true);
+    close(fd);
+    
+    LOG_WARN("Resent download chunk", "file", fileName, "offset", offset, "user_id", ctx.user_id);
+}
+
+void handle_file_download(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
+    string fileName = body.count("file_name") ? body.at("file_name") : "";
+    
+    int user_id = ctx.user_id;
+    
+    if (fileName.empty()) {
+        map<string, string> resp;
+        resp["message"] = "Missing file name";
+        send_response(ctx, S_RESP_FILE_OK, STATUS_BAD_REQUEST, JsonHelper::build(resp));
+        return;
+    }
     
-    // Read file content
-    vector<char> fileData(fileSize);
-    if (!inFile.read(fileData.data(), fileSize)) {
-        inFile.close();
+    string filePath = resolve_upload_path(fileName);
+    if (filePath.empty()) {
         map<string, string> resp;
-        resp["message"] = "Failed to read file";
-        send_packet(client_socket, S_RESP_FILE_OK, STATUS_SERVER_ERROR, JsonHelper::build(resp));
+        resp["message"] = "Invalid file name";
+        send_response(ctx, S_RESP_FILE_OK, STATUS_BAD_REQUEST, JsonHelper::build(resp));
         return;
     }
-    inFile.close();
     
-    // Encode to base64
-    string fileDataStr(fileData.begin(), fileData.end());
-    string fileDataBase64;
+    // Chunk nhị phân cần header v2; client v1 / batch vẫn nhận một gói base64
+    shared_ptr<Connection> conn = find_connection(ctx.client_socket);
+    if (body.count("stream") && !ctx.batch_out && conn && conn->version == 2) {
+        uint64_t offset = body.count("offset") ? strtoull(body.at("offset").c_str(), nullptr, 10) : 0;
+        bool checksum = body.count("checksum") && body.at("checksum") == FILE_CHECKSUM_CRC32C;
+        stream_file_download(ctx, fileName, filePath, offset, checksum);
+        return;
+    }
     
-    // Simple base64 encoding
-    const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    int val = 0, valb = -6;
-    for (unsigned char c : fileDataStr) {
-        val = (val << 8) + c;
-        valb += 8;
-        while (valb >= 0) {
-            fileDataBase64.push_back(chars[(val >> valb) & 0x3F]);
-            valb -= 6;
+    // Read file
+    int fd = open_upload(fileName, filePath);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        map<string, string> resp;
+        resp["message"] = "File not found";
+        send_response(ctx, S_RESP_FILE_OK, STATUS_NOT_FOUND, JsonHelper::build(resp));
+        return;
+    }
+    uint64_t fileSize = st.st_size;
+    
+    // Encode to base64 - file đang cache thì dùng lại bản base64 đã mã hóa
+    string encoded;
+    const string* fileDataBase64 = &encoded;
+    shared_ptr<CachedFile> cached = file_cache.acquire(filePath, fd, st);
+    if (cached) {
+        fileDataBase64 = &file_cache.base64(cached);
+    } else {
+        string fileData;
+        fileData.resize(fileSize);
+        uint64_t done = 0;
+        while (done < fileSize) {
+            ssize_t n = pread(fd, &fileData[done], fileSize - done, done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        if (done < fileSize) {
+            close(fd);
+            map<string, string> resp;
+            resp["message"] = "Failed to read file";
+            send_response(ctx, S_RESP_FILE_OK, STATUS_SERVER_ERROR, JsonHelper::build(resp));
+            return;
         }
+        encoded = base64_encode(fileData);
     }
-    if (valb > -6) fileDataBase64.push_back(chars[((val << 8) >> (valb + 8)) & 0x3F]);
-    while (fileDataBase64.size() % 4) fileDataBase64.push_back('=');
+    close(fd);
     
     // Send response
     map<string, string> resp;
     resp["message"] = "File download successful";
     resp["file_name"] = fileName;
     resp["file_size"] = to_string(fileSize);
-    resp["file_data"] = fileDataBase64;
     
-    send_packet(client_socket, S_RESP_FILE_OK, STATUS_OK, JsonHelper::build(resp));
+    // file_data nối thẳng vào body: base64 chỉ được chép một lần
+    string json = JsonHelper::build(resp);
+    json.pop_back();
+    json.reserve(json.size() + fileDataBase64->size() + 16);
+    json += ",\"file_data\":\"";
+    json += *fileDataBase64;
+    json += "\"}";
+    send_response(ctx, S_RESP_FILE_OK, STATUS_OK, json);
     
-    cout << "✓ Sent file download: " << fileName << " (" << fileSize << " bytes) to user_id " << user_id << endl;
+    LOG_INFO("Sent file download", "file", fileName, "size", fileSize, "user_id", user_id);
+}
+
+// ===== FILE LIST =====
+
+// C_REQ_FILE_LIST: một trang file của cuộc chat (mới nhất trước), đọc từ
+// bảng attachments theo index - không quét lịch sử tin nhắn
+void handle_file_list(RequestContext& ctx) {
+    const map<string, string>& body = ctx.body;
+    string chat_type = body.count("chat_type") ? body.at("chat_type") : "";
+    string target = body.count("target") ? body.at("target") : "";
+    int before_id = body.count("before_id") ? atoi(body.at("before_id").c_str()) : 0;
+    int limit = body.count("limit") ? atoi(body.at("limit").c_str()) : FILE_LIST_DEFAULT_LIMIT;
+    if (limit <= 0 || limit > FILE_LIST_MAX_LIMIT) limit = FILE_LIST_DEFAULT_LIMIT;
+    
+    int user_id = ctx.user_id;
+    int status = STATUS_OK;
+    string message;
+    vector<map<string, string>> files;
+    
+    // Lấy thừa một dòng để biết còn trang sau không
+    db_acquire();
+    if (chat_type == "group") {
+        int group_id = atoi(target.c_str());
+        if (group_id <= 0 || db->getGroupName(group_id).empty()) {
+            status = STATUS_NOT_FOUND;
+            message = "Group not found";
+        } else if (!db->isGroupMember(group_id, user_id)) {
+            status = STATUS_FORBIDDEN;
+            message = "Not a group member";
+        } else {
+            files = db->getGroupAttachments(group_id, before_id, limit + 1);
+        }
+    } else if (chat_type == "private") {
+        int other_id = db->getUserId(target);
+        if (other_id == -1) {
+            status = STATUS_NOT_FOUND;
+            message = "User not found";
+        } else {
+            files = db->getPrivateAttachments(user_id, other_id, before_id, limit + 1);
+        }
+    } else {
+        status = STATUS_BAD_REQUEST;
+        message = "Invalid chat type";
+    }
+    db_release();
+    
+    if (status != STATUS_OK) {
+        map<string, string> resp;
+        resp["message"] = message;
+        send_response(ctx, S_RESP_FILE_LIST, status, JsonHelper::build(resp));
+        return;
+    }
+    
+    bool has_more = (int)files.size() > limit;
+    if (has_more) files.resize(limit);
+    
+    string json = "{\"chat_type\":\"" + chat_type + "\",";
+    json += "\"target\":\"" + JsonHelper::escapeJson(target) + "\",";
+    json += "\"files\":[";
+    for (size_t i = 0; i < files.size(); i++) {
+        if (i > 0) json += ",";
+        json += "{\"attachment_id\":" + files[i]["attachment_id"] + ",";
+        json += "\"message_id\":" + files[i]["message_id"] + ",";
+        json += "\"from_username\":\"" + JsonHelper::escapeJson(files[i]["from_username"]) + "\",";
+        json += "\"file_name\":\"" + JsonHelper::escapeJson(files[i]["file_name"]) + "\",";
+        json += "\"stored_name\":\"" + JsonHelper::escapeJson(files[i]["stored_name"]) + "\",";
+        json += "\"file_size\":" + files[i]["file_size"] + ",";
+        json += "\"hash\":\"" + files[i]["hash"] + "\",";
+        json += "\"mime_type\":\"" + JsonHelper::escapeJson(files[i]["mime_type"]) + "\",";
+        json += "\"created_at\":\"" + files[i]["created_at"] + "\"}";
+    }
+    json += "],\"next_before_id\":\"" + (has_more ? files.back()["attachment_id"] : string()) + "\"}";
+    
+    send_response(ctx, S_RESP_FILE_LIST, STATUS_OK, json);
+    LOG_INFO("Sent file list", "chat_type", chat_type, "target", target, "files", files.size());
+}
+
+// ===== COMMAND TABLE =====
+
+void handle_batch(RequestContext& ctx);     // Định nghĩa ở phần BATCH (cần tra bảng lệnh)
+
+constexpr CommandInfo COMMAND_TABLE[] = {
+    // command                      name                      handler                       auth        body       max_body            priority          resp_command (lỗi)
+    { C_REQ_REGISTER,               "register",               handle_register,              AUTH_NONE,  BODY_JSON, MAX_BODY_SIZE,      PRIO_AUTH,        S_RESP_REGISTER },
+    { C_REQ_LOGIN,                  "login",                  handle_login,                 AUTH_NONE,  BODY_JSON, MAX_BODY_SIZE,      PRIO_AUTH,        S_RESP_LOGIN },
+    { C_REQ_CHANGE_PASS,            "change_pass",            handle_change_password,       AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_AUTH,        S_RESP_CHANGE_PASS },
+    { C_REQ_ATTACH_CHANNEL,         "attach_channel",         handle_attach_channel,        AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_AUTH,        S_RESP_ATTACH_CHANNEL },
+    { C_REQ_GROUP_CREATE,           "group_create",           handle_group_create,          AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, S_RESP_GROUP_CREATE },
+    { C_REQ_GROUP_JOIN,             "group_join",             handle_group_join,            AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, 0 },
+    { C_REQ_GROUP_LEAVE,            "group_leave",            handle_group_leave,           AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, 0 },
+    { C_REQ_GROUP_INVITE,           "group_invite",           handle_group_invite,          AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, S_RESP_GROUP_INVITE },
+    { C_REQ_GROUP_LIST,             "group_list",             handle_group_list,            AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       S_RESP_GROUP_LIST },
+    { C_REQ_ALL_GROUPS,             "all_groups",             handle_all_groups,            AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       S_RESP_ALL_GROUPS },
+    { C_REQ_GROUP_MEMBERS,          "group_members",          handle_group_members,         AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       S_RESP_GROUP_MEMBERS },
+    { C_REQ_FRIEND_ADD,             "friend_add",             handle_friend_add,            AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, 0 },
+    { C_RESP_FRIEND_REQ,            "friend_response",        handle_friend_response,       AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, 0 },
+    { C_REQ_FRIEND_LIST,            "friend_list",            handle_friend_list,           AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       0 },
+    { C_REQ_PENDING_REQUESTS,       "pending_requests",       handle_pending_requests,      AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       0 },
+    { C_REQ_UNFRIEND,               "unfriend",               handle_unfriend,              AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, S_RESP_UNFRIEND },
+    { C_REQ_MSG_PRIVATE,            "msg_private",            handle_msg_private,           AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, 0 },
+    { C_REQ_MSG_GROUP,              "msg_group",              handle_msg_group,             AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, 0 },
+    { C_REQ_CHAT_HISTORY_PRIVATE,   "history_private",        handle_chat_history_private,  AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       0 },
+    { C_REQ_CHAT_HISTORY_GROUP,     "history_group",          handle_chat_history_group,    AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       0 },
+    { C_REQ_MARK_MESSAGES_READ,     "mark_read",              handle_mark_messages_read,    AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, 0 },
+    { C_REQ_DELETE_MESSAGE,         "delete_message",         handle_delete_message,        AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_INTERACTIVE, S_RESP_DELETE_MESSAGE },
+    { C_REQ_SEARCH_MESSAGES,        "search_messages",        handle_search_messages,       AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       S_RESP_SEARCH_MESSAGES },
+    { C_REQ_FILE_UPLOAD,            "file_upload",            handle_file_upload,           AUTH_TOKEN, BODY_JSON, MAX_FILE_BODY_SIZE, PRIO_BULK,        S_RESP_FILE_OK },
+    { C_REQ_FILE_DOWNLOAD,          "file_download",          handle_file_download,         AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_BULK,        S_RESP_FILE_OK },
+    { C_REQ_FILE_LIST,              "file_list",              handle_file_list,             AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_QUERY,       S_RESP_FILE_LIST },
+    { C_REQ_FILE_RESEND,            "file_resend",            handle_file_resend,           AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_BULK,        S_RESP_FILE_OK },
+    { C_DATA_FILE_CHUNK,            "file_chunk",             handle_file_chunk,            AUTH_SESSION, BODY_BINARY, FILE_CHUNK_HEADER_SIZE + FILE_CHUNK_CRC_SIZE + FILE_CHUNK_SIZE, PRIO_BULK, 0 },
+    { C_DATA_FILE_END,              "file_end",               handle_file_end,              AUTH_TOKEN, BODY_JSON, MAX_BODY_SIZE,      PRIO_BULK,        S_RESP_FILE_OK },
+    { C_REQ_BATCH,                  "batch",                  handle_batch,                 AUTH_SESSION, BODY_BINARY, MAX_BODY_SIZE,  PRIO_INTERACTIVE, S_RESP_BATCH },
+};
+
+constexpr size_t COMMAND_COUNT = sizeof(COMMAND_TABLE) / sizeof(COMMAND_TABLE[0]);
+static_assert(command_table_valid(COMMAND_TABLE), "COMMAND_TABLE có command id trùng hoặc ngoài khoảng");
+constexpr CommandIndex COMMAND_INDEX = build_command_index(COMMAND_TABLE);
+
+CommandStats command_stats[COMMAND_COUNT];
+atomic<uint64_t> unknown_commands(0);
+atomic<uint64_t> offloaded_requests(0);     // Request chạy trên worker pool
+
+// Body lớn nhất mà bất kỳ lệnh nào chấp nhận - vượt quá thì coi như luồng hỏng
+constexpr int max_command_body() {
+    int max_body = 0;
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        if (COMMAND_TABLE[i].max_body > max_body) max_body = COMMAND_TABLE[i].max_body;
+    }
+    return max_body;
+}
+
+const CommandInfo* lookup_command(int command) {
+    if (command <= 0 || command >= MAX_COMMAND_ID) return nullptr;
+    int slot = COMMAND_INDEX.slot[command];
+    return slot < 0 ? nullptr : &COMMAND_TABLE[slot];
+}
+
+// ===== METRICS =====
+// Số liệu theo lệnh được đọc qua SIGUSR1 (in ra log) hoặc cổng quản trị
+// (JSON, xem ADMIN ENDPOINT). Tốc độ lệnh/giây tính theo khoảng giữa hai
+// lần lấy số liệu liên tiếp.
+
+chrono::steady_clock::time_point server_started = chrono::steady_clock::now();
+ProfiledMutex rate_mutex("rate_mutex");
+uint64_t rate_prev_calls[COMMAND_COUNT];
+chrono::steady_clock::time_point rate_prev_time = chrono::steady_clock::now();
+
+// Số lệnh/giây của từng lệnh kể từ lần gọi trước
+vector<double> sample_command_rates() {
+    vector<double> rates(COMMAND_COUNT, 0.0);
+    rate_mutex.lock();
+    auto now = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(now - rate_prev_time).count();
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        uint64_t calls = command_stats[i].calls.load();
+        if (seconds > 0) rates[i] = (calls - rate_prev_calls[i]) / seconds;
+        rate_prev_calls[i] = calls;
+    }
+    rate_prev_time = now;
+    rate_mutex.unlock();
+    return rates;
+}
+
+void print_command_stats() {
+    vector<double> rates = sample_command_rates();
+    log_flush();    // Các dòng log trước đó ra trước bảng thống kê
+    cout << "========== COMMAND STATS ==========" << endl;
+    cout << left << setw(18) << "command" << setw(12) << "priority" << right
+         << setw(9) << "calls" << setw(9) << "rate/s" << setw(9) << "p50_us" << setw(9) << "p99_us"
+         << setw(10) << "p999_us" << setw(10) << "max_us" << setw(10) << "db_p99" << setw(10) << "send_p99"
+         << setw(10) << "queue_p99" << setw(9) << "auth_err" << setw(9) << "rejected" << endl;
+    LatencySnapshot handler, db, send, queue;
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        const CommandStats& st = command_stats[i];
+        uint64_t calls = st.calls.load();
+        if (calls == 0 && st.auth_failures.load() == 0 && st.rejected.load() == 0) continue;
+        st.handler.snapshot(handler);
+        st.db.snapshot(db);
+        st.send.snapshot(send);
+        st.queue.snapshot(queue);
+        cout << left << setw(18) << COMMAND_TABLE[i].name
+             << setw(12) << priority_name(COMMAND_TABLE[i].priority) << right
+             << setw(9) << calls << setw(9) << fixed << setprecision(1) << rates[i]
+             << setw(9) << handler.percentile_ns(0.5) / 1000 << setw(9) << handler.percentile_ns(0.99) / 1000
+             << setw(10) << handler.percentile_ns(0.999) / 1000 << setw(10) << handler.max_ns / 1000
+             << setw(10) << db.percentile_ns(0.99) / 1000 << setw(10) << send.percentile_ns(0.99) / 1000
+             << setw(10) << queue.percentile_ns(0.99) / 1000
+             << setw(9) << st.auth_failures.load() << setw(9) << st.rejected.load() << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << "unknown commands: " << unknown_commands.load() << endl;
+    cout << "offloaded to workers: " << offloaded_requests.load() << endl;
+    uint64_t zin = compress_bytes_in.load(), zout = compress_bytes_out.load();
+    size_t cache_entries, cache_bytes;
+    file_cache.usage(cache_entries, cache_bytes);
+    uint64_t hits = file_cache.hits.load(), misses = file_cache.misses.load();
+    cout << "file cache: " << cache_entries << " files, " << cache_bytes << " bytes, hits " << hits
+         << ", misses " << misses << (hits + misses ? ", hit ratio " + to_string(hits * 100 / (hits + misses)) + "%" : string())
+         << ", bypassed " << file_cache.bypassed.load() << ", evictions " << file_cache.evictions.load()
+         << ", bytes saved " << file_cache.bytes_saved.load() << endl;
+    cout << "dir fsync: " << dir_syncer.requests.load() << " requests, " << dir_syncer.batches.load()
+         << " batches, " << dir_syncer.fsyncs.load() << " fsyncs, " << dir_syncer.failures.load() << " failed" << endl;
+    cout << "chunk CRC errors: " << chunk_crc_errors.load()
+         << (crc32c_hw_available() ? " (crc32c: sse4.2)" : " (crc32c: software)") << endl;
+    cout << "log: dropped " << log_dropped.load() << " lines, rate-limited " << log_suppressed.load() << " lines" << endl;
+    cout << "compressed frames: " << compressed_frames.load() << " (" << zin << " -> " << zout
+         << " bytes" << (zin ? ", " + to_string(zout * 100 / zin) + "%" : string()) << ")" << endl;
+    cout << "===================================" << endl;
+}
+
+#define LOCK_STATS_TOP_SITES 5      // Số call site in ra cho mỗi khóa
+
+// Các khóa đã từng được dùng, tổng thời gian chờ nhiều nhất trước (bằng
+// nhau thì theo tổng thời gian giữ)
+vector<LockProfile*> lock_profiles() {
+    vector<pair<pair<uint64_t, uint64_t>, LockProfile*>> order;
+    LatencySnapshot wait, hold;
+    for (LockProfile* profile = LockProfile::first(); profile; profile = profile->following()) {
+        profile->wait.snapshot(wait);
+        profile->hold.snapshot(hold);
+        if (wait.count > 0) order.push_back({ { wait.sum_ns, hold.sum_ns }, profile });
+    }
+    stable_sort(order.begin(), order.end(),
+                [](const pair<pair<uint64_t, uint64_t>, LockProfile*>& a,
+                   const pair<pair<uint64_t, uint64_t>, LockProfile*>& b) { return a.first > b.first; });
+    vector<LockProfile*> profiles;
+    for (auto& entry : order) profiles.push_back(entry.second);
+    return profiles;
+}
+
+// Các call site của một khóa, tổng thời gian chờ + giữ nhiều nhất trước
+vector<const LockSiteStats*> lock_sites(const LockProfile& profile) {
+    vector<const LockSiteStats*> sites;
+    const LockSiteStats* table = profile.site_table();
+    for (int i = 0; i < LOCK_SITES; i++) {
+        if (table[i].site.load() && table[i].acquires.load() > 0) sites.push_back(&table[i]);
+    }
+    stable_sort(sites.begin(), sites.end(), [](const LockSiteStats* a, const LockSiteStats* b) {
+        return a->wait_ns.load() + a->hold_ns.load() > b->wait_ns.load() + b->hold_ns.load();
+    });
+    return sites;
+}
+
+void print_lock_stats() {
+    cout << "========== LOCK STATS ==========" << endl;
+    cout << left << setw(22) << "lock" << right << setw(10) << "acquires" << setw(11) << "contended"
+         << setw(11) << "wait_ms" << setw(11) << "wait_p99" << setw(11) << "wait_max"
+         << setw(11) << "hold_ms" << setw(11) << "hold_p50" << setw(11) << "hold_p99" << setw(11) << "hold_max" << endl;
+    cout << fixed << setprecision(1);
+    LatencySnapshot wait, hold;
+    for (LockProfile* profile : lock_profiles()) {
+        profile->wait.snapshot(wait);
+        profile->hold.snapshot(hold);
+        cout << left << setw(22) << profile->name << right << setw(10) << wait.count
+             << setw(10) << (wait.count ? profile->contended.load() * 100.0 / wait.count : 0.0) << "%"
+             << setw(11) << wait.sum_ns / 1e6 << setw(11) << wait.percentile_ns(0.99) / 1e3 << setw(11) << wait.max_ns / 1e3
+             << setw(11) << hold.sum_ns / 1e6 << setw(11) << hold.percentile_ns(0.5) / 1e3
+             << setw(11) << hold.percentile_ns(0.99) / 1e3 << setw(11) << hold.max_ns / 1e3 << endl;
+        vector<const LockSiteStats*> sites = lock_sites(*profile);
+        for (size_t i = 0; i < sites.size() && i < LOCK_STATS_TOP_SITES; i++) {
+            const LockSiteStats& site = *sites[i];
+            cout << "  " << left << setw(20) << site.site.load() << right << setw(10) << site.acquires.load()
+                 << setw(11) << site.contended.load() << setw(11) << site.wait_ns.load() / 1e6
+                 << setw(22) << "" << setw(11) << site.hold_ns.load() / 1e6 << setw(11) << ""
+                 << setw(11) << site.hold_percentile_ns(0.99) / 1e3 << setw(11) << site.max_hold_ns.load() / 1e3 << endl;
+        }
+    }
+    cout.unsetf(ios::floatfield);
+    cout << "(thời gian theo µs, tổng theo ms; p99 theo call site làm tròn lên lũy thừa 2)" << endl;
+    cout << "================================" << endl;
+}
+
+// Mọi câu lệnh SQL của DBManager được báo về đây (DBManager::setQueryObserver)
+#define SLOW_QUERY_MS_DEFAULT 200
+QueryStatsTable query_stats;
+
+void record_query(const QueryEvent& event) {
+    trace_complete(event.op, "sql", trace_now_ns() - event.duration_ns, event.duration_ns, "rows", event.rows);
+    flight_db_query(event.op, event.duration_ns, event.rows);
+    QueryStats& stats = query_stats.get(event.op);
+    stats.queries.fetch_add(1, memory_order_relaxed);
+    stats.rows.fetch_add(event.rows, memory_order_relaxed);
+    stats.latency.record(event.duration_ns);
+    if (!event.ok) {
+        stats.errors.fetch_add(1, memory_order_relaxed);
+        LOG_ERROR("Query failed", "op", event.op, "errno", event.error_code, "error", event.error);
+    }
+    if (event.slow) {
+        stats.slow.fetch_add(1, memory_order_relaxed);
+        LOG_WARN("Slow query", "op", event.op, "ms", event.duration_ns / 1e6, "rows", event.rows,
+                 "sql", DBManager::queryShape(event.sql));
+        if (!event.explain.empty()) LOG_WARN("Slow query plan", "op", event.op, "plan", event.explain);
+    }
+}
+
+// Các thao tác đã chạy, tổng thời gian nhiều nhất trước
+vector<const QueryStats*> query_ops() {
+    vector<pair<uint64_t, const QueryStats*>> order;
+    LatencySnapshot latency;
+    for (size_t i = 0; i < QUERY_OPS; i++) {
+        const QueryStats* stats = query_stats.at(i);
+        if (!stats) continue;
+        stats->latency.snapshot(latency);
+        order.push_back({ latency.sum_ns, stats });
+    }
+    stable_sort(order.begin(), order.end(),
+                [](const pair<uint64_t, const QueryStats*>& a, const pair<uint64_t, const QueryStats*>& b) { return a.first > b.first; });
+    vector<const QueryStats*> ops;
+    for (auto& entry : order) ops.push_back(entry.second);
+    return ops;
+}
+
+void print_query_stats() {
+    cout << "========== DB QUERY STATS ==========" << endl;
+    cout << left << setw(26) << "operation" << right << setw(9) << "queries" << setw(10) << "rows"
+         << setw(8) << "errors" << setw(7) << "slow" << setw(10) << "p50_us" << setw(10) << "p99_us"
+         << setw(10) << "max_us" << setw(11) << "total_ms" << endl;
+    LatencySnapshot latency;
+    for (const QueryStats* stats : query_ops()) {
+        stats->latency.snapshot(latency);
+        cout << left << setw(26) << stats->op << right << setw(9) << stats->queries.load()
+             << setw(10) << stats->rows.load() << setw(8) << stats->errors.load() << setw(7) << stats->slow.load()
+             << setw(10) << latency.percentile_ns(0.5) / 1000 << setw(10) << latency.percentile_ns(0.99) / 1000
+             << setw(10) << latency.max_ns / 1000 << setw(11) << latency.sum_ns / 1000000 << endl;
+    }
+    cout << "====================================" << endl;
 }
 
 // ===== CLIENT HANDLER =====
 
-void* handle_client(void* arg) {
-    int client_socket = *(int*)arg;
-    delete (int*)arg;
+// Đọc đủ len bytes (recv có thể trả về từng phần)
+bool recv_all(int sock, void* buf, size_t len) {
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Xác thực token: token trùng với phiên đang gắn với socket thì dùng luôn
+// user_id trong cache, ngược lại mới hỏi database
+bool authenticate(int client_socket, const string& token, int& user_id) {
+    if (token.empty()) return false;
+    TraceSpan span("verifyToken", "auth");
+    
+    clients_mutex.lock();
+    if (socket_to_token.count(client_socket) && socket_to_token[client_socket] == token) {
+        user_id = socket_to_userid[client_socket];
+        clients_mutex.unlock();
+        return true;
+    }
+    clients_mutex.unlock();
+    
+    db_acquire();
+    bool ok = db->verifyToken(token, user_id);
+    db_release();
+    return ok;
+}
+
+// User đã đăng nhập trên kết nối này (dùng cho lệnh AUTH_SESSION)
+bool session_user(int client_socket, int& user_id) {
+    clients_mutex.lock();
+    auto it = socket_to_userid.find(client_socket);
+    bool ok = it != socket_to_userid.end();
+    if (ok) user_id = it->second;
+    clients_mutex.unlock();
+    return ok;
+}
+
+void reject_request(int client_socket, const WireHeader& header, const CommandInfo* info,
+                    int status, const string& message) {
+    if (info->resp_command == 0) return;
+    map<string, string> resp;
+    resp["error"] = message;
+    resp["message"] = message;
+    send_frame(client_socket, info->resp_command, status, header.request_id, JsonHelper::build(resp));
+}
+
+// Chạy handler và cập nhật thống kê thời gian của lệnh
+void run_handler(const CommandInfo* info, RequestContext& ctx) {
+    CommandStats& stats = command_stats[info - COMMAND_TABLE];
+    uint64_t db_before = db_time_ns, send_before = send_time_ns;
+    
+    auto start = chrono::steady_clock::now();
+    {
+        TraceSpan span(info->name, "handler");
+        info->handler(ctx);
+    }
+    uint64_t elapsed = ns_since(start);
+    
+    if (elapsed >= FLIGHT_SLOW_HANDLER_NS) flight_slow_handler(info->name, info->command, elapsed);
+    
+    stats.calls++;
+    stats.handler.record(elapsed);
+    stats.db.record(db_time_ns - db_before);
+    stats.send.record(send_time_ns - send_before);
+}
+
+// Pipeline chung cho mọi lệnh: kiểm tra body -> xác thực -> handler -> thống kê
+void dispatch_command(int client_socket, const WireHeader& header, const string& raw_body) {
+    const CommandInfo* info = lookup_command(header.command);
+    if (!info) {
+        unknown_commands++;
+        LOG_WARN("Unknown command", "command", header.command, "socket", client_socket);
+        return;
+    }
+    CommandStats& stats = command_stats[info - COMMAND_TABLE];
+    // Watchdog coi request chạy quá lâu là treo; truyền file (PRIO_BULK) lâu theo
+    // kích thước file / tốc độ client nên không canh
+    FlightBusy busy(info->command, info->priority != PRIO_BULK);
+    
+    if ((int)raw_body.size() > info->max_body ||
+        (info->body_type == BODY_NONE && !raw_body.empty())) {
+        stats.rejected++;
+        reject_request(client_socket, header, info, STATUS_BAD_REQUEST, "Invalid body");
+        return;
+    }
     
-    cout << "✓ New client connected: socket " << client_socket << endl;
+    map<string, string> body;
+    if (info->body_type == BODY_JSON) {
+        TraceSpan span("parse_json", "request");
+        body = JsonHelper::parse(raw_body);
+    }
+    
+    int user_id = -1;
+    bool authorized = true;
+    if (info->auth == AUTH_TOKEN) {
+        string token = body.count("token") ? body.at("token") : "";
+        authorized = authenticate(client_socket, token, user_id);
+    } else if (info->auth == AUTH_SESSION) {
+        authorized = session_user(client_socket, user_id);
+    }
+    if (!authorized) {
+        stats.auth_failures++;
+        reject_request(client_socket, header, info, STATUS_UNAUTHORIZED, "Invalid token");
+        return;
+    }
+    
+    RequestContext ctx = { client_socket, user_id, header.command, header.request_id, raw_body, body, nullptr };
+    run_handler(info, ctx);
+}
+
+// ===== BATCH =====
+
+// Lệnh con được phép nằm trong batch: truy vấn chỉ đọc (PRIO_QUERY) và
+// mark_read - đúng những gì client gom. Batch giữ một kết nối trong pool suốt
+// các lệnh con, nên không nhận lệnh gửi tới socket người khác (msg_group,
+// group_invite, ...): người nhận chậm sẽ giữ kết nối DB lâu
+bool batchable(const CommandInfo* info) {
+    return info->auth == AUTH_TOKEN && info->body_type == BODY_JSON &&
+           (info->priority == PRIO_QUERY || info->command == C_REQ_MARK_MESSAGES_READ);
+}
+
+// Chạy lần lượt các frame con với user của batch và một kết nối database
+// duy nhất; phản hồi của handler được gom lại thành một S_RESP_BATCH
+void handle_batch(RequestContext& ctx) {
+    const string& raw = ctx.raw_body;
+    string out;
+    size_t pos = 0;
+    int items = 0;
+    
+    db_acquire();
+    while (pos < raw.size()) {
+        WireHeader sub;
+        if (raw.size() - pos < WIRE_HEADER_SIZE ||
+            !decode_wire_header((const unsigned char*)raw.data() + pos, sub) ||
+            raw.size() - pos - WIRE_HEADER_SIZE < sub.body_length) {
+            LOG_WARN("Malformed batch", "socket", ctx.client_socket);
+            break;
+        }
+        string sub_raw = raw.substr(pos + WIRE_HEADER_SIZE, sub.body_length);
+        pos += WIRE_HEADER_SIZE + sub.body_length;
+        
+        const CommandInfo* info = lookup_command(sub.command);
+        if (!info) {
+            unknown_commands++;
+            continue;
+        }
+        if (++items > MAX_BATCH_ITEMS || !batchable(info) || (int)sub_raw.size() > info->max_body) {
+            command_stats[info - COMMAND_TABLE].rejected++;
+            if (info->resp_command) {
+                map<string, string> resp;
+                resp["error"] = "Command not allowed in batch";
+                resp["message"] = "Command not allowed in batch";
+                append_wire_frame(out, info->resp_command, STATUS_BAD_REQUEST, sub.request_id,
+                                  JsonHelper::build(resp));
+            }
+            continue;
+        }
+        
+        map<string, string> sub_body = JsonHelper::parse(sub_raw);
+        RequestContext sub_ctx = { ctx.client_socket, ctx.user_id, sub.command, sub.request_id,
+                                   sub_raw, sub_body, &out };
+        flight_progress();      // Watchdog canh từng lệnh con, không phải cả batch
+        run_handler(info, sub_ctx);
+    }
+    db_release();
     
+    send_response(ctx, S_RESP_BATCH, STATUS_OK, out);
+}
+
+// ===== WORKER POOL =====
+
+// Truy vấn chỉ đọc (PRIO_QUERY) của client v2 có request_id được chuyển sang
+// worker pool: chạy song song và trả lời không theo thứ tự, client ghép phản
+// hồi với request qua request_id. Các lệnh còn lại vẫn chạy tuần tự trên
+// thread của kết nối nên thứ tự gửi tin / kết bạn / đăng nhập giữ nguyên.
+#define WORKER_THREADS 4
+#define MAX_INFLIGHT_PER_CONN 32    // Vượt quá thì chạy tại chỗ (backpressure)
+
+struct Job {
+    shared_ptr<Connection> conn;
+    WireHeader header;
+    string raw_body;
+    chrono::steady_clock::time_point queued_at;
+    TraceContext trace;         // Trace của request (tiếp tục trên worker)
+};
+
+deque<Job*> job_queue;
+ProfiledMutex job_mutex("job_mutex");
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+void* worker_thread(void* arg) {
     while (true) {
-        PacketHeader header;
-        int bytes = recv(client_socket, &header, sizeof(PacketHeader), 0);
+        job_mutex.lock();
+        while (job_queue.empty()) {
+            job_mutex.wait(job_cond);
+        }
+        Job* job = job_queue.front();
+        job_queue.pop_front();
+        job_mutex.unlock();
         
-        if (bytes <= 0) {
-            break;
+        const CommandInfo* info = lookup_command(job->header.command);
+        uint64_t queued = ns_since(job->queued_at);
+        if (info) command_stats[info - COMMAND_TABLE].queue.record(queued);
+        {
+            TraceRequest trace(job->trace.id, job->trace.sampled);
+            trace_complete("queue_wait", "queue", trace_ns(job->queued_at), queued);
+            dispatch_command(job->conn->socket, job->header, job->raw_body);
         }
         
-        // Read JSON body
-        string json_body;
-        if (header.body_length > 0) {
-            char* buffer = new char[header.body_length + 1];
-            recv(client_socket, buffer, header.body_length, 0);
-            buffer[header.body_length] = '\0';
-            json_body = string(buffer);
-            delete[] buffer;
+        Connection& conn = *job->conn;
+        conn.inflight_mutex.lock();
+        if (--conn.inflight == 0) pthread_cond_broadcast(&conn.idle_cond);
+        conn.inflight_mutex.unlock();
+        delete job;
+    }
+    return NULL;
+}
+
+// Đẩy request sang worker pool nếu được; false = gọi dispatch_command tại chỗ
+bool submit_job(const shared_ptr<Connection>& conn, const WireHeader& header, string& raw_body) {
+    if (conn->version != 2 || header.request_id == 0) return false;
+    const CommandInfo* info = lookup_command(header.command);
+    if (!info || info->priority != PRIO_QUERY) return false;
+    
+    conn->inflight_mutex.lock();
+    if (conn->inflight >= MAX_INFLIGHT_PER_CONN) {
+        conn->inflight_mutex.unlock();
+        return false;
+    }
+    conn->inflight++;
+    conn->inflight_mutex.unlock();
+    
+    Job* job = new Job;
+    job->conn = conn;
+    job->header = header;
+    job->raw_body.swap(raw_body);
+    job->queued_at = chrono::steady_clock::now();
+    job->trace = trace_ctx;
+    
+    job_mutex.lock();
+    job_queue.push_back(job);
+    pthread_cond_signal(&job_cond);
+    job_mutex.unlock();
+    
+    offloaded_requests++;
+    return true;
+}
+
+// Chờ mọi request của kết nối trên worker pool chạy xong
+void wait_jobs_done(Connection& conn) {
+    conn.inflight_mutex.lock();
+    while (conn.inflight > 0) {
+        conn.inflight_mutex.wait(conn.idle_cond);
+    }
+    conn.inflight_mutex.unlock();
+}
+
+// Body quá cỡ mọi lệnh nhưng dưới mức này (vd. file base64 lớn của client cũ)
+// được đọc bỏ và trả lỗi; lớn hơn nữa coi như luồng hỏng
+#define MAX_DISCARD_BODY_SIZE (128 * 1024 * 1024)
+
+// Đọc bỏ len byte body
+bool discard_body(int sock, uint32_t len) {
+    char buf[65536];
+    while (len > 0) {
+        ssize_t n = recv(sock, buf, min<uint32_t>(len, sizeof(buf)), 0);
+        if (n <= 0) return false;
+        len -= n;
+    }
+    return true;
+}
+
+// Đọc một frame và chuẩn hóa về WireHeader. Định dạng header được chốt
+// theo byte đầu tiên của kết nối: WIRE_MAGIC -> v2, còn lại -> v1 (cũ).
+// header_at: lúc nhận xong header (thời gian trước đó là chờ request tới)
+bool read_frame(Connection& conn, WireHeader& header, string& body, uint64_t& header_at) {
+    if (conn.version == 0) {
+        unsigned char first;
+        if (recv(conn.socket, &first, 1, MSG_PEEK) <= 0) return false;
+        conn.version = (first == WIRE_MAGIC) ? 2 : 1;
+        LOG_INFO("Framing negotiated", "socket", conn.socket, "version", conn.version.load());
+    }
+    
+    while (true) {
+        if (conn.version == 2) {
+            unsigned char buf[WIRE_HEADER_SIZE];
+            if (!recv_all(conn.socket, buf, WIRE_HEADER_SIZE)) return false;
+            if (!decode_wire_header(buf, header)) {
+                LOG_WARN("Bad frame magic/version", "socket", conn.socket);
+                return false;
+            }
+        } else {
+            PacketHeader legacy;
+            if (!recv_all(conn.socket, &legacy, sizeof(PacketHeader))) return false;
+            if (legacy.body_length < 0) return false;
+            header = WireHeader(legacy.command >= 0 && legacy.command < MAX_COMMAND_ID ? legacy.command : 0,
+                                legacy.status);
+            header.timestamp = legacy.timestamp;
+            header.body_length = legacy.body_length;
         }
         
-        map<string, string> body = JsonHelper::parse(json_body);
+        header_at = trace_now_ns();
+        if (header.body_length <= (uint32_t)max_command_body()) break;
         
-        // Route command
-        switch (header.command) {
-            case C_REQ_REGISTER:
-                handle_register(client_socket, body);
-                break;
-            case C_REQ_LOGIN:
-                handle_login(client_socket, body);
-                break;
-            case C_REQ_CHANGE_PASS:
-                handle_change_password(client_socket, body);
-                break;
-            case C_REQ_GROUP_CREATE:
-                handle_group_create(client_socket, body);
-                break;
-            case C_REQ_GROUP_JOIN:
-                handle_group_join(client_socket, body);
-                break;
-            case C_REQ_GROUP_LEAVE:
-                handle_group_leave(client_socket, body);
-                break;
-            case C_REQ_GROUP_INVITE:
-                handle_group_invite(client_socket, body);
-                break;
-            case C_REQ_GROUP_LIST:
-                handle_group_list(client_socket, body);
-                break;
-            case C_REQ_ALL_GROUPS:
-                handle_all_groups(client_socket, body);
-                break;
-            case C_REQ_GROUP_MEMBERS:
-                handle_group_members(client_socket, body);
-                break;
-            case C_REQ_FRIEND_ADD:
-                handle_friend_add(client_socket, body);
-                break;
-            case C_RESP_FRIEND_REQ:
-                handle_friend_response(client_socket, body);
-                break;
-            case C_REQ_FRIEND_LIST:
-                handle_friend_list(client_socket, body);
-                break;
-            // case C_REQ_ALL_USERS:
-            //     handle_all_users(client_socket, body);
-            //     break;
-            case C_REQ_PENDING_REQUESTS:
-                handle_pending_requests(client_socket, body);
-                break;
-            case C_REQ_UNFRIEND:
-                handle_unfriend(client_socket, body);
-                break;
-            case C_REQ_MSG_PRIVATE:
-                handle_msg_private(client_socket, body);
-                break;
-            case C_REQ_MSG_GROUP:
-                handle_msg_group(client_socket, body);
-                break;
-            case C_REQ_CHAT_HISTORY_PRIVATE:
-                handle_chat_history_private(client_socket, body);
-                break;
-            case C_REQ_CHAT_HISTORY_GROUP:
-                handle_chat_history_group(client_socket, body);
-                break;
-            case C_REQ_MARK_MESSAGES_READ:
-                handle_mark_messages_read(client_socket, body);
-                break;
-            case C_REQ_DELETE_MESSAGE:
-                handle_delete_message(client_socket, body);
-                break;
-            case C_REQ_SEARCH_MESSAGES:
-                handle_search_messages(client_socket, body);
-                break;
-            case C_REQ_FILE_UPLOAD:
-                handle_file_upload(client_socket, body);
-                break;
-            case C_REQ_FILE_DOWNLOAD:
-                handle_file_download(client_socket, body);
-                break;
-            default:
-                cout << "⚠ Unknown command: " << header.command << endl;
+        // Body lớn hơn mọi lệnh cho phép: còn hợp lý thì đọc bỏ và trả lỗi để
+        // client biết, quá lớn -> luồng hỏng, ngắt kết nối
+        if (header.body_length > MAX_DISCARD_BODY_SIZE) {
+            LOG_WARN("Invalid body length", "length", header.body_length, "socket", conn.socket);
+            return false;
+        }
+        if (!discard_body(conn.socket, header.body_length)) return false;
+        LOG_WARN("Body too large", "command", header.command, "length", header.body_length,
+                 "socket", conn.socket);
+        const CommandInfo* info = lookup_command(header.command);
+        if (info) {
+            command_stats[info - COMMAND_TABLE].rejected++;
+            reject_request(conn.socket, header, info, STATUS_BAD_REQUEST, "Body too large");
+        }
+    }
+    
+    body.assign(header.body_length, '\0');
+    return header.body_length == 0 || recv_all(conn.socket, &body[0], header.body_length);
+}
+
+void* handle_client(void* arg) {
+    int client_socket = *(int*)arg;
+    delete (int*)arg;
+    
+    LOG_INFO("New client connected", "socket", client_socket);
+    
+    shared_ptr<Connection> conn = make_shared<Connection>(client_socket);
+    conn_mutex.lock();
+    connections[client_socket] = conn;
+    conn_mutex.unlock();
+    
+    WireHeader header;
+    string raw_body;
+    uint64_t header_at;
+    while (read_frame(*conn, header, raw_body, header_at)) {
+        flight_packet_in(header.command, raw_body.size(), client_socket);
+        TraceRequest trace;
+        trace_complete("recv_body", "net", header_at, trace_now_ns() - header_at, "bytes", raw_body.size());
+        TraceSpan span("request", "request");
+        span.arg("command", header.command);
+        if (!submit_job(conn, header, raw_body)) {
+            dispatch_command(client_socket, header, raw_body);
         }
     }
     
     // Cleanup on disconnect
-    pthread_mutex_lock(&clients_mutex);
+    clients_mutex.lock();
     int user_id = socket_to_userid.count(client_socket) ? socket_to_userid[client_socket] : -1;
     string username = socket_to_username.count(client_socket) ? socket_to_username[client_socket] : "";
-    pthread_mutex_unlock(&clients_mutex);
+    clients_mutex.unlock();
     
-    if (user_id != -1) {
+    if (conn->bulk) {
+        // Kênh truyền file đóng: user vẫn online trên kết nối chat
+        clients_mutex.lock();
+        socket_to_userid.erase(client_socket);
+        socket_to_token.erase(client_socket);
+        clients_mutex.unlock();
+        
+        LOG_INFO("Bulk channel closed", "socket", client_socket);
+    } else if (user_id != -1) {
         // Set user offline
-        pthread_mutex_lock(&db_mutex);
+        db_acquire();
         db->setUserOnline(user_id, false);
         vector<string> friends = db->getFriends(user_id);
-        pthread_mutex_unlock(&db_mutex);
+        db_release();
         
         // Notify friends
         for (const string& friend_name : friends) {
-            pthread_mutex_lock(&clients_mutex);
+            clients_mutex.lock();
             if (username_to_socket.count(friend_name)) {
                 int friend_socket = username_to_socket[friend_name];
-                pthread_mutex_unlock(&clients_mutex);
+                clients_mutex.unlock();
                 
                 map<string, string> notify;
                 notify["username"] = username;
                 send_packet(friend_socket, S_NOTIFY_FRIEND_OFFLINE, STATUS_OK, 
                            JsonHelper::build(notify));
             } else {
-                pthread_mutex_unlock(&clients_mutex);
+                clients_mutex.unlock();
             }
         }
         
         // Remove from cache
-        pthread_mutex_lock(&clients_mutex);
+        clients_mutex.lock();
         username_to_socket.erase(username);
         socket_to_username.erase(client_socket);
         socket_to_userid.erase(client_socket);
         socket_to_token.erase(client_socket);
-        pthread_mutex_unlock(&clients_mutex);
+        clients_mutex.unlock();
         
-        cout << "✓ User logged out: " << username << endl;
+        LOG_INFO("User logged out", "username", username);
     }
     
+    wait_jobs_done(*conn);
+    suspend_uploads_of(client_socket);
+    
+    conn_mutex.lock();
+    connections.erase(client_socket);
+    conn_mutex.unlock();
+    
     close(client_socket);
-    cout << "✓ Client disconnected: socket " << client_socket << endl;
+    LOG_INFO("Client disconnected", "socket", client_socket);
+    
+    return NULL;
+}
+
+// ===== ADMIN ENDPOINT =====
+// Cổng quản trị chỉ nghe trên 127.0.0.1: mỗi kết nối nhận một bản số liệu
+// JSON rồi bị đóng. Trả lời dạng HTTP nên đọc được bằng
+// curl http://127.0.0.1:<cổng>/ (nội dung request bị bỏ qua).
+
+// {"count":..,"mean_ns":..,"p50_ns":..,...} của một histogram
+string latency_json(const LatencyHistogram& histogram) {
+    LatencySnapshot snap;
+    histogram.snapshot(snap);
+    stringstream ss;
+    ss << "{\"count\":" << snap.count << ",\"mean_ns\":" << snap.mean_ns()
+       << ",\"p50_ns\":" << snap.percentile_ns(0.5) << ",\"p90_ns\":" << snap.percentile_ns(0.9)
+       << ",\"p99_ns\":" << snap.percentile_ns(0.99) << ",\"p999_ns\":" << snap.percentile_ns(0.999)
+       << ",\"max_ns\":" << snap.max_ns << "}";
+    return ss.str();
+}
+
+string metrics_json() {
+    vector<double> rates = sample_command_rates();
+    stringstream ss;
+    ss << "{\"uptime_s\":" << chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - server_started).count();
+    
+    conn_mutex.lock();
+    size_t connection_count = connections.size();
+    conn_mutex.unlock();
+    job_mutex.lock();
+    size_t queued_jobs = job_queue.size();
+    job_mutex.unlock();
+    db_pool_mutex.lock();
+    size_t idle_db = db_pool.size();
+    db_pool_mutex.unlock();
+    
+    ss << ",\"connections\":" << connection_count << ",\"queued_jobs\":" << queued_jobs
+       << ",\"db_pool_idle\":" << idle_db << ",\"unknown_commands\":" << unknown_commands.load()
+       << ",\"offloaded_requests\":" << offloaded_requests.load()
+       << ",\"file_cache_hits\":" << file_cache.hits.load() << ",\"file_cache_misses\":" << file_cache.misses.load()
+       << ",\"chunk_crc_errors\":" << chunk_crc_errors.load()
+       << ",\"compress_bytes_in\":" << compress_bytes_in.load() << ",\"compress_bytes_out\":" << compress_bytes_out.load();
+    
+    ss << ",\"commands\":[";
+    bool first = true;
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        const CommandStats& st = command_stats[i];
+        uint64_t calls = st.calls.load();
+        if (calls == 0 && st.auth_failures.load() == 0 && st.rejected.load() == 0) continue;
+        if (!first) ss << ",";
+        first = false;
+        ss << "{\"name\":\"" << COMMAND_TABLE[i].name << "\",\"command\":" << COMMAND_TABLE[i].command
+           << ",\"priority\":\"" << priority_name(COMMAND_TABLE[i].priority) << "\""
+           << ",\"calls\":" << calls << ",\"rate_per_s\":" << fixed << setprecision(2) << rates[i]
+           << ",\"auth_failures\":" << st.auth_failures.load() << ",\"rejected\":" << st.rejected.load()
+           << ",\"handler\":" << latency_json(st.handler) << ",\"queue\":" << latency_json(st.queue)
+           << ",\"db\":" << latency_json(st.db) << ",\"send\":" << latency_json(st.send) << "}";
+    }
+    ss << "]";
+    
+    ss << ",\"locks\":[";
+    first = true;
+    for (LockProfile* profile : lock_profiles()) {
+        if (!first) ss << ",";
+        first = false;
+        ss << "{\"name\":\"" << profile->name << "\",\"contended\":" << profile->contended.load()
+           << ",\"wait\":" << latency_json(profile->wait) << ",\"hold\":" << latency_json(profile->hold) << ",\"sites\":[";
+        bool first_site = true;
+        for (const LockSiteStats* site : lock_sites(*profile)) {
+            if (!first_site) ss << ",";
+            first_site = false;
+            ss << "{\"site\":\"" << site->site.load() << "\",\"acquires\":" << site->acquires.load()
+               << ",\"contended\":" << site->contended.load() << ",\"wait_ns\":" << site->wait_ns.load()
+               << ",\"hold_ns\":" << site->hold_ns.load() << ",\"hold_p99_ns\":" << site->hold_percentile_ns(0.99)
+               << ",\"max_hold_ns\":" << site->max_hold_ns.load() << "}";
+        }
+        ss << "]}";
+    }
+    ss << "]";
     
+    ss << ",\"queries\":[";
+    first = true;
+    for (const QueryStats* stats : query_ops()) {
+        if (!first) ss << ",";
+        first = false;
+        ss << "{\"op\":\"" << stats->op << "\",\"queries\":" << stats->queries.load()
+           << ",\"rows\":" << stats->rows.load() << ",\"errors\":" << stats->errors.load()
+           << ",\"slow\":" << stats->slow.load() << ",\"latency\":" << latency_json(stats->latency) << "}";
+    }
+    ss << "]}";
+    return ss.str();
+}
+
+void* admin_thread(void* arg) {
+    int admin_socket = (int)(intptr_t)arg;
+    while (true) {
+        int client = accept(admin_socket, NULL, NULL);
+        if (client < 0) continue;
+        
+        struct timeval timeout = { 1, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        recv(client, request, sizeof(request), 0);
+        
+        string body = metrics_json();
+        string head = "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+                      to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        struct iovec iov[2] = { { (void*)head.data(), head.size() }, { (void*)body.data(), body.size() } };
+        send_iov_all(client, iov, 2);
+        close(client);
+    }
+    return NULL;
+}
+
+// Mở cổng quản trị trên 127.0.0.1; false nếu không bind được
+bool start_admin_endpoint(int port) {
+    int admin_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (admin_socket < 0) return false;
+    int opt = 1;
+    setsockopt(admin_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(admin_socket, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(admin_socket, 4) < 0) {
+        close(admin_socket);
+        return false;
+    }
+    
+    pthread_t thread;
+    pthread_create(&thread, NULL, admin_thread, (void*)(intptr_t)admin_socket);
+    pthread_detach(thread);
+    return true;
+}
+
+// ===== SIGNAL THREAD =====
+
+// Các tín hiệu quản trị được xử lý trên một thread riêng bằng sigwait,
+// nên có thể in thống kê an toàn (không chạy trong signal handler)
+void* signal_thread(void* arg) {
+    sigset_t* set = (sigset_t*)arg;
+    while (true) {
+        int sig;
+        if (sigwait(set, &sig) != 0) continue;
+        if (sig == SIGUSR1) {
+            print_command_stats();
+            print_lock_stats();
+            print_query_stats();
+        } else if (sig == SIGUSR2) {
+            string path = flight_dump("SIGUSR2");
+            if (path.empty()) LOG_ERROR("Cannot write flight recorder dump");
+            else LOG_WARN("Flight recorder dumped", "file", path);
+        }
+    }
     return NULL;
 }
 
+// Watchdog của flight recorder vừa tự dump vì có request chạy quá lâu
+void on_stall_dump(const string& path, const string& reason) {
+    LOG_WARN("Stall detected, flight recorder dumped", "file", path, "reason", reason);
+}
+
 // ===== MAIN =====
 
 int main(int argc, char* argv[]) {
     int port = (argc > 1) ? atoi(argv[1]) : 8888;
+    int admin_port = (argc > 2) ? atoi(argv[2]) : port + 1;    // 0 = tắt cổng quản trị
     
     cout << "==================================" << endl;
     cout << "   CHAT SERVER - CHECKPOINT 1" << endl;
     cout << "   với MySQL Database" << endl;
     cout << "==================================" << endl;
     
+    // Đo mọi câu lệnh SQL; SLOW_QUERY_MS (0 = không log câu chậm),
+    // SLOW_QUERY_EXPLAIN=1 để log kèm EXPLAIN của câu SELECT chậm
+    const char* slow_ms = getenv("SLOW_QUERY_MS");
+    const char* explain = getenv("SLOW_QUERY_EXPLAIN");
+    DBManager::setQueryObserver(record_query, (uint64_t)(slow_ms ? atoi(slow_ms) : SLOW_QUERY_MS_DEFAULT) * 1000000,
+                                explain && strcmp(explain, "1") == 0);
+    
     // Connect to database
-    db = new DBManager("localhost", "chat_user", "chat_password", "chat_app", 3306);
-    if (!db->connect()) {
-        cerr << "❌ Cannot connect to database" << endl;
-        return 1;
+    for (int i = 0; i < DB_POOL_SIZE; i++) {
+        DBManager* conn = new DBManager("localhost", "chat_user", "chat_password", "chat_app", 3306);
+        if (!conn->connect()) {
+            cerr << "❌ Cannot connect to database" << endl;
+            return 1;
+        }
+        db_pool.push_back(conn);
     }
+    LOG_INFO("Database pool ready", "connections", DB_POOL_SIZE);
+    
+    db_acquire();
     
     // Clean expired sessions
     db->cleanExpiredSessions();
     
     // Reset all users to offline on server start
     db->resetAllUsersOffline();
-    cout << "✓ Reset all users to offline" << endl;
+    LOG_INFO("Reset all users to offline");
+    
+    db_release();
+    
+    // sendfile không có MSG_NOSIGNAL - client ngắt giữa chừng không được giết server
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Chặn SIGUSR1 / SIGUSR2 ở mọi thread (các thread con kế thừa mask), chỉ signal_thread nhận
+    static sigset_t admin_signals;
+    sigemptyset(&admin_signals);
+    sigaddset(&admin_signals, SIGUSR1);
+    sigaddset(&admin_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &admin_signals, NULL);
+    
+    // Các dòng log từ trước lúc này nằm chờ trong ring, thread ghi log ghi ra sau
+    log_start();
+    
+    // TRACE_SAMPLE=N: ghi trace của 1 trên N request vào TRACE_FILE (mặc định trace.json)
+    const char* trace_sample = getenv("TRACE_SAMPLE");
+    const char* trace_path = getenv("TRACE_FILE");
+    if (trace_sample && atoi(trace_sample) > 0) {
+        string path = trace_path ? trace_path : "trace.json";
+        if (trace_start(path, atoi(trace_sample))) {
+            LOG_INFO("Tracing enabled", "file", path, "sample_every", atoi(trace_sample));
+        } else {
+            LOG_WARN("Cannot open trace file", "file", path);
+        }
+    }
+    
+    pthread_t sig_thread;
+    pthread_create(&sig_thread, NULL, signal_thread, &admin_signals);
+    pthread_detach(sig_thread);
+    LOG_INFO("Send SIGUSR1 to dump command stats", "pid", getpid());
+    LOG_INFO("Send SIGUSR2 to dump the flight recorder", "pid", getpid());
+    
+    // FLIGHT_STALL_MS: request chạy lâu hơn thì tự dump flight recorder (0 = tắt)
+    const char* stall_ms = getenv("FLIGHT_STALL_MS");
+    if (stall_ms) flight_stall_ns = (uint64_t)atoi(stall_ms) * 1000000;
+    flight_start_watchdog(on_stall_dump);
+    
+    mkdir(UPLOAD_DIR, 0755);
+    mkdir(UPLOAD_BLOB_DIR, 0755);
+    mkdir(UPLOAD_FILE_DIR, 0755);
+    mkdir(UPLOAD_TMP_DIR, 0755);
+    clean_upload_temp();
+    dir_syncer.start();
+    
+    // Dời file từ layout phẳng cũ trong nền, server phục vụ ngay trong lúc đó
+    pthread_t migration_thread;
+    pthread_create(&migration_thread, NULL, upload_migration_thread, NULL);
+    pthread_detach(migration_thread);
+    
+    if (admin_port > 0) {
+        if (start_admin_endpoint(admin_port)) {
+            LOG_INFO("Metrics endpoint", "url", "http://127.0.0.1:" + to_string(admin_port) + "/");
+        } else {
+            LOG_WARN("Cannot open admin port", "port", admin_port);
+        }
+    }
+    
+    for (int i = 0; i < WORKER_THREADS; i++) {
+        pthread_t worker;
+        pthread_create(&worker, NULL, worker_thread, NULL);
+        pthread_detach(worker);
+    }
+    LOG_INFO("Worker pool ready", "threads", WORKER_THREADS);
     
     // Create server socket
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -1757,7 +3686,8 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    cout << "✓ Server listening on port " << port << endl;
+    LOG_INFO("Server listening", "port", port);
+    log_flush();
     cout << "==================================" << endl;
     
     // Accept connections
@@ -1778,7 +3708,7 @@ int main(int argc, char* argv[]) {
     }
     
     close(server_socket);
-    delete db;
+    for (DBManager* conn : db_pool) delete conn;
     
     return 0;
 }
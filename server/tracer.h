@@ -0,0 +1,204 @@
+/*
+ * TRACING THEO REQUEST (CHROME TRACE FORMAT)
+ *
+ * Mỗi request được lấy mẫu (1 trên TRACE_SAMPLE request) có một trace id;
+ * các span (đọc body, xác thực, từng câu lệnh SQL, fan-out, gửi frame, ...)
+ * được ghi kèm trace id đó rồi xuất ra file dạng JSON Array của Chrome
+ * trace event ("ph":"X"), mở bằng chrome://tracing hoặc ui.perfetto.dev.
+ * Lọc theo args.trace_id để xem một request, kể cả phần chạy trên worker.
+ *
+ * Request không được lấy mẫu chỉ tốn một lần đọc biến thread_local ở mỗi
+ * span. Span của request được lấy mẫu gom vào buffer của thread, đẩy sang
+ * hàng đợi chung khi request kết thúc; một thread nền ghi ra file.
+ */
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define TRACE_FLUSH_INTERVAL_US 200000
+#define TRACE_FILE_MAX_BYTES (512LL * 1024 * 1024)   // Ngừng ghi khi file đạt cỡ này
+
+struct TraceEvent {
+    const char* name;           // Chuỗi tĩnh (tên lệnh, tên hàm DBManager, ...)
+    const char* category;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t trace_id;
+    int tid;
+    const char* arg_key;        // Một tham số tùy chọn (nullptr nếu không có)
+    int64_t arg_value;
+};
+
+// Trace của request mà thread hiện tại đang xử lý
+struct TraceContext {
+    uint64_t id = 0;
+    bool sampled = false;
+};
+
+inline thread_local TraceContext trace_ctx;
+inline thread_local vector<TraceEvent> trace_buffer;
+
+inline atomic<uint32_t> trace_sample_every(0);     // 0 = tắt
+inline atomic<uint64_t> trace_requests(0);
+inline pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+inline vector<TraceEvent> trace_pending;            // Chờ thread nền ghi ra file
+inline FILE* trace_file = nullptr;
+
+inline uint64_t trace_now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t trace_ns(chrono::steady_clock::time_point t) {
+    return chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+inline int trace_tid() {
+    thread_local int tid = (int)syscall(SYS_gettid);
+    return tid;
+}
+
+inline bool trace_active() { return trace_ctx.sampled; }
+
+// Ghi một span đã biết thời điểm bắt đầu / độ dài (chỉ khi request được lấy mẫu)
+inline void trace_complete(const char* name, const char* category, uint64_t start_ns, uint64_t duration_ns,
+                           const char* arg_key = nullptr, int64_t arg_value = 0) {
+    if (!trace_ctx.sampled) return;
+    trace_buffer.push_back({ name, category, start_ns, duration_ns, trace_ctx.id, trace_tid(), arg_key, arg_value });
+}
+
+// Chuyển span của thread sang hàng đợi chung
+inline void trace_flush_thread() {
+    if (trace_buffer.empty()) return;
+    pthread_mutex_lock(&trace_mutex);
+    trace_pending.insert(trace_pending.end(), trace_buffer.begin(), trace_buffer.end());
+    pthread_mutex_unlock(&trace_mutex);
+    trace_buffer.clear();
+}
+
+// Phạm vi một request trên thread hiện tại. Constructor mặc định quyết định
+// lấy mẫu cho request mới; constructor (id, sampled) tiếp tục trace của
+// request đã bắt đầu ở thread khác (worker pool).
+class TraceRequest {
+public:
+    TraceRequest() : saved(trace_ctx) {
+        uint32_t every = trace_sample_every.load(memory_order_relaxed);
+        trace_ctx = TraceContext();
+        if (every == 0) return;
+        uint64_t n = trace_requests.fetch_add(1, memory_order_relaxed);
+        if (n % every == 0) {
+            static const uint64_t base = (uint64_t)time(nullptr) << 24;   // Khác nhau giữa các lần chạy
+            trace_ctx.id = base + n + 1;
+            trace_ctx.sampled = true;
+        }
+    }
+    TraceRequest(uint64_t id, bool sampled) : saved(trace_ctx) {
+        trace_ctx.id = id;
+        trace_ctx.sampled = sampled;
+    }
+    ~TraceRequest() {
+        trace_ctx = saved;
+        if (!trace_ctx.sampled) trace_flush_thread();   // Hết request ngoài cùng
+    }
+    TraceRequest(const TraceRequest&) = delete;
+    TraceRequest& operator=(const TraceRequest&) = delete;
+
+private:
+    TraceContext saved;
+};
+
+// Span từ lúc tạo tới lúc ra khỏi scope
+class TraceSpan {
+public:
+    TraceSpan(const char* span_name, const char* span_category)
+        : name(span_name), category(span_category), start(0), arg_key(nullptr), arg_value(0) {
+        if (trace_ctx.sampled) start = trace_now_ns();
+    }
+    ~TraceSpan() {
+        if (start) trace_complete(name, category, start, trace_now_ns() - start, arg_key, arg_value);
+    }
+    void arg(const char* key, int64_t value) {
+        arg_key = key;
+        arg_value = value;
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    const char* category;
+    uint64_t start;
+    const char* arg_key;
+    int64_t arg_value;
+};
+
+// ===== GHI FILE =====
+
+inline void trace_append_event(string& out, const TraceEvent& event, int pid) {
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf),
+                     "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                     "\"pid\":%d,\"tid\":%d,\"args\":{\"trace_id\":\"%016llx\"",
+                     event.name, event.category, event.start_ns / 1000.0, event.duration_ns / 1000.0,
+                     pid, event.tid, (unsigned long long)event.trace_id);
+    out.append(buf, n);
+    if (event.arg_key) {
+        n = snprintf(buf, sizeof(buf), ",\"%s\":%lld", event.arg_key, (long long)event.arg_value);
+        out.append(buf, n);
+    }
+    out += "}},\n";
+}
+
+inline void* trace_writer_thread(void*) {
+    vector<TraceEvent> batch;
+    string out;
+    long long written = 0;
+    int pid = getpid();
+    while (true) {
+        usleep(TRACE_FLUSH_INTERVAL_US);
+        pthread_mutex_lock(&trace_mutex);
+        batch.swap(trace_pending);
+        pthread_mutex_unlock(&trace_mutex);
+        if (batch.empty()) continue;
+
+        out.clear();
+        for (const TraceEvent& event : batch) trace_append_event(out, event, pid);
+        batch.clear();
+        if (written + (long long)out.size() > TRACE_FILE_MAX_BYTES) {
+            trace_sample_every = 0;     // File đã đủ lớn: tắt lấy mẫu
+            continue;
+        }
+        fwrite(out.data(), 1, out.size(), trace_file);
+        fflush(trace_file);
+        written += out.size();
+    }
+    return nullptr;
+}
+
+// Mở file trace (ghi đè) và bắt đầu lấy mẫu 1 trên sample_every request.
+// File là JSON Array Format; dấu ']' cuối có thể thiếu, trình xem vẫn đọc được
+inline bool trace_start(const string& path, uint32_t sample_every) {
+    if (sample_every == 0) return true;
+    trace_file = fopen(path.c_str(), "w");
+    if (!trace_file) return false;
+    fputs("[\n", trace_file);
+    pthread_t thread;
+    pthread_create(&thread, nullptr, trace_writer_thread, nullptr);
+    pthread_detach(thread);
+    trace_sample_every = sample_every;
+    return true;
+}
+
+#endif // TRACER_H